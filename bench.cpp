@@ -0,0 +1,540 @@
+#include <bits/stdc++.h>
+#include <malloc.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "include/AVLTree.h"
+#include "include/Dict.h"
+#include "include/Heap.h"
+#include "include/Helper.h"
+#include "include/Robj.h"
+#include "include/ZSet.h"
+#include "include/hashmap.h"
+using namespace std;
+
+// Microbenchmarks for the data structures on their own, without the
+// network stack. Each benchmark runs at every --sizes element count and
+// reports the best of --repeat runs as ns/op, LLC misses/op (when
+// perf_event_open is allowed) and heap bytes per element (for the ones
+// that build a structure). --save writes the results as a baseline;
+// --baseline compares against one and exits 1 on a regression.
+
+static const int KEY_LEN = 16;
+
+static uint64_t mono_ns(){
+    return chrono::duration_cast<chrono::nanoseconds>(
+               chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static size_t heap_in_use(){
+    return mallinfo2().uordblks;
+}
+
+// Last-level cache misses of this thread in user space.
+class PerfCounter {
+private:
+    int fd = -1;
+
+public:
+    bool open(){
+        perf_event_attr attr{};
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = PERF_COUNT_HW_CACHE_MISSES;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+        return fd >= 0;
+    }
+
+    bool ok() const{
+        return fd >= 0;
+    }
+
+    void start(){
+        if (fd < 0) return;
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+
+    uint64_t stop(){
+        if (fd < 0) return 0;
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        uint64_t v = 0;
+        if (read(fd, &v, sizeof(v)) != sizeof(v)) return 0;
+        return v;
+    }
+};
+
+static PerfCounter perf;
+
+// What one run measured. A benchmark brackets the timed part with
+// start()/stop() and sets bytes when it built something.
+struct Measure {
+    uint64_t ns = 0;
+    uint64_t misses = 0;
+    double bytes = -1;
+    uint64_t t0 = 0;
+
+    void start(){
+        perf.start();
+        t0 = mono_ns();
+    }
+
+    void stop(){
+        ns = mono_ns() - t0;
+        misses = perf.stop();
+    }
+};
+
+// Fixed-width keys "key:000000000042" packed in one buffer, and a random
+// permutation for access order; both built before anything is timed.
+struct Workload {
+    size_t n;
+    vector<char> keys;
+    vector<uint32_t> order;
+    vector<double> scores;
+
+    explicit Workload(size_t count) : n(count), keys(count * KEY_LEN), order(count), scores(count){
+        mt19937_64 rng(42);
+        char buf[32];
+        for (size_t i = 0; i < n; i++) {
+            snprintf(buf, sizeof(buf), "key:%012zu", i);
+            memcpy(&keys[i * KEY_LEN], buf, KEY_LEN);
+            order[i] = i;
+            scores[i] = (double)(rng() % 1000000);
+        }
+        shuffle(order.begin(), order.end(), rng);
+    }
+
+    const char* key(size_t i) const{
+        return &keys[i * KEY_LEN];
+    }
+};
+
+static volatile uint64_t sink;
+
+static vector<Robj*> make_objs(const Workload& w){
+    vector<Robj*> objs(w.n);
+    for (size_t i = 0; i < w.n; i++) objs[i] = create_obj(w.key(i), KEY_LEN, OBJ_STRING);
+    return objs;
+}
+
+static void drop_objs(vector<Robj*>& objs){
+    for (Robj* o : objs) decr_refcount(o);
+}
+
+// HashTable with one bucket per element, as Dict sizes it.
+static uint64_t hashtable_insert(const Workload& w, Measure& m){
+    vector<Robj*> objs = make_objs(w);
+    Robj* val = create_obj("v", 1, OBJ_STRING);
+    size_t before = heap_in_use();
+    HashTable* ht = new HashTable(w.n);
+    m.start();
+    for (size_t i = 0; i < w.n; i++) ht->insert(objs[w.order[i]], val);
+    m.stop();
+    m.bytes = (double)(heap_in_use() - before) / w.n;
+    delete ht;
+    drop_objs(objs);
+    decr_refcount(val);
+    return w.n;
+}
+
+static HashTable* build_table(const Workload& w){
+    HashTable* ht = new HashTable(w.n);
+    Robj* val = create_obj("v", 1, OBJ_STRING);
+    for (size_t i = 0; i < w.n; i++) {
+        Robj* k = create_obj(w.key(i), KEY_LEN, OBJ_STRING);
+        ht->insert(k, val);
+        decr_refcount(k);
+    }
+    decr_refcount(val);
+    return ht;
+}
+
+static uint64_t hashtable_find_hit(const Workload& w, Measure& m){
+    HashTable* ht = build_table(w);
+    Robj k{1, OBJ_STRING, nullptr, KEY_LEN};
+    uint64_t found = 0;
+    m.start();
+    for (size_t i = 0; i < w.n; i++) {
+        k.ptr = (void*)w.key(w.order[i]);
+        found += ht->find(&k) != nullptr;
+    }
+    m.stop();
+    sink = found;
+    delete ht;
+    return w.n;
+}
+
+static uint64_t hashtable_find_miss(const Workload& w, Measure& m){
+    HashTable* ht = build_table(w);
+    vector<char> miss(w.keys);
+    for (size_t i = 0; i < w.n; i++) miss[i * KEY_LEN] = 'x';
+    Robj k{1, OBJ_STRING, nullptr, KEY_LEN};
+    uint64_t found = 0;
+    m.start();
+    for (size_t i = 0; i < w.n; i++) {
+        k.ptr = &miss[w.order[i] * KEY_LEN];
+        found += ht->find(&k) != nullptr;
+    }
+    m.stop();
+    sink = found;
+    delete ht;
+    return w.n;
+}
+
+static uint64_t hashtable_erase(const Workload& w, Measure& m){
+    HashTable* ht = build_table(w);
+    Robj k{1, OBJ_STRING, nullptr, KEY_LEN};
+    m.start();
+    for (size_t i = 0; i < w.n; i++) {
+        k.ptr = (void*)w.key(w.order[i]);
+        ht->erase(&k);
+    }
+    m.stop();
+    delete ht;
+    return w.n;
+}
+
+// Dict from its initial 128 buckets, so inserts run through every
+// doubling with incremental rehash in progress.
+static uint64_t dict_insert_rehash(const Workload& w, Measure& m){
+    size_t before = heap_in_use();
+    Dict* d = new Dict(128);
+    m.start();
+    for (size_t i = 0; i < w.n; i++) {
+        const char* k = w.key(w.order[i]);
+        d->insert_into(k, KEY_LEN, "v", 1);
+    }
+    m.stop();
+    m.bytes = (double)(heap_in_use() - before) / w.n;
+    delete d;
+    return w.n;
+}
+
+// Lookups halfway through a rehash: the keys already moved miss in the old
+// table before they are found in the new one. Presizing keeps the inserts
+// from starting, and partly finishing, a rehash of their own.
+static uint64_t dict_find_rehashing(const Workload& w, Measure& m){
+    Dict* d = new Dict(128);
+    d->reserve(w.n);
+    for (size_t i = 0; i < w.n; i++) d->insert_into(w.key(i), KEY_LEN, "v", 1);
+    d->start_rehashing();
+    // A small table can finish in one step (progress drops back to -1).
+    double p;
+    while ((p = d->rehash_progress()) >= 0 && p < 0.5) d->rehash();
+    uint64_t found = 0;
+    m.start();
+    for (size_t i = 0; i < w.n; i++) found += d->find_from(w.key(w.order[i]), KEY_LEN) != nullptr;
+    m.stop();
+    sink = found;
+    delete d;
+    return w.n;
+}
+
+// Dict with a TTL on every key: the expiry heap grows along with it.
+static uint64_t dict_insert_ttl(const Workload& w, Measure& m){
+    uint64_t far = now_ns() + 3600ULL * 1000000000ULL;
+    size_t before = heap_in_use();
+    Dict* d = new Dict(128);
+    m.start();
+    for (size_t i = 0; i < w.n; i++) {
+        size_t j = w.order[i];
+        d->insert_into(w.key(j), KEY_LEN, "v", 1, far + (uint64_t)w.scores[j] * 1000);
+    }
+    m.stop();
+    m.bytes = (double)(heap_in_use() - before) / w.n;
+    delete d;
+    return w.n;
+}
+
+static uint64_t heap_push(const Workload& w, Measure& m){
+    vector<Robj*> objs = make_objs(w);
+    size_t before = heap_in_use();
+    Heap* h = new Heap();
+    m.start();
+    for (size_t i = 0; i < w.n; i++) h->push(objs[i], 1 + (uint64_t)w.scores[w.order[i]]);
+    m.stop();
+    m.bytes = (double)(heap_in_use() - before) / w.n;
+    delete h;
+    drop_objs(objs);
+    return w.n;
+}
+
+static uint64_t heap_pop(const Workload& w, Measure& m){
+    vector<Robj*> objs = make_objs(w);
+    Heap* h = new Heap();
+    for (size_t i = 0; i < w.n; i++) h->push(objs[i], 1 + (uint64_t)w.scores[w.order[i]]);
+    vector<HeapItem*> popped(w.n);
+    m.start();
+    for (size_t i = 0; i < w.n; i++) popped[i] = h->pop();
+    m.stop();
+    for (HeapItem* it : popped) {
+        decr_refcount(it->key);
+        free(it);
+    }
+    delete h;
+    drop_objs(objs);
+    return w.n;
+}
+
+// AVLTree::insert takes over a reference to the member.
+static AVLTree* build_tree(const Workload& w, const vector<Robj*>& objs){
+    AVLTree* t = new AVLTree();
+    for (size_t i = 0; i < w.n; i++) {
+        incr_refcount(objs[w.order[i]]);
+        t->insert(objs[w.order[i]], w.scores[w.order[i]]);
+    }
+    return t;
+}
+
+static uint64_t avl_insert(const Workload& w, Measure& m){
+    vector<Robj*> objs = make_objs(w);
+    size_t before = heap_in_use();
+    AVLTree* t = new AVLTree();
+    for (Robj* o : objs) incr_refcount(o);
+    m.start();
+    for (size_t i = 0; i < w.n; i++) t->insert(objs[w.order[i]], w.scores[w.order[i]]);
+    m.stop();
+    m.bytes = (double)(heap_in_use() - before) / w.n;
+    delete t;
+    drop_objs(objs);
+    return w.n;
+}
+
+static uint64_t avl_rank(const Workload& w, Measure& m){
+    vector<Robj*> objs = make_objs(w);
+    AVLTree* t = build_tree(w, objs);
+    uint64_t sum = 0;
+    m.start();
+    for (size_t i = 0; i < w.n; i++) sum += t->rank(objs[i], w.scores[i]);
+    m.stop();
+    sink = sum;
+    delete t;
+    drop_objs(objs);
+    return w.n;
+}
+
+// Ten elements from a random rank; range() seeks to the start by subtree
+// size, so every size runs a query per element.
+static uint64_t avl_range(const Workload& w, Measure& m){
+    vector<Robj*> objs = make_objs(w);
+    AVLTree* t = build_tree(w, objs);
+    uint64_t sum = 0;
+    m.start();
+    for (size_t i = 0; i < w.n; i++) {
+        int start = w.order[i] % w.n;
+        sum += t->range(start, start + 9).size();
+    }
+    m.stop();
+    sink = sum;
+    delete t;
+    drop_objs(objs);
+    return w.n;
+}
+
+static uint64_t zset_zadd(const Workload& w, Measure& m){
+    size_t before = heap_in_use();
+    ZSet* z = new ZSet();
+    m.start();
+    for (size_t i = 0; i < w.n; i++) {
+        size_t j = w.order[i];
+        z->zadd(w.key(j), KEY_LEN, w.scores[j]);
+    }
+    m.stop();
+    m.bytes = (double)(heap_in_use() - before) / w.n;
+    delete z;
+    return w.n;
+}
+
+static ZSet* build_zset(const Workload& w){
+    ZSet* z = new ZSet();
+    for (size_t i = 0; i < w.n; i++) z->zadd(w.key(i), KEY_LEN, w.scores[i]);
+    return z;
+}
+
+static uint64_t zset_zrank(const Workload& w, Measure& m){
+    ZSet* z = build_zset(w);
+    uint64_t sum = 0;
+    m.start();
+    for (size_t i = 0; i < w.n; i++) sum += z->zrank(w.key(w.order[i]), KEY_LEN);
+    m.stop();
+    sink = sum;
+    delete z;
+    return w.n;
+}
+
+static uint64_t zset_zrange(const Workload& w, Measure& m){
+    ZSet* z = build_zset(w);
+    uint64_t sum = 0;
+    m.start();
+    for (size_t i = 0; i < w.n; i++) {
+        int start = w.order[i] % w.n;
+        sum += z->zrange(start, start + 9).size();
+    }
+    m.stop();
+    sink = sum;
+    delete z;
+    return w.n;
+}
+
+static uint64_t zset_zrem(const Workload& w, Measure& m){
+    ZSet* z = build_zset(w);
+    m.start();
+    for (size_t i = 0; i < w.n; i++) z->zrem(w.key(w.order[i]), KEY_LEN);
+    m.stop();
+    delete z;
+    return w.n;
+}
+
+struct Bench {
+    const char* name;
+    uint64_t (*fn)(const Workload&, Measure&);
+};
+
+static const Bench benches[] = {
+    {"hashtable/insert", hashtable_insert},
+    {"hashtable/find-hit", hashtable_find_hit},
+    {"hashtable/find-miss", hashtable_find_miss},
+    {"hashtable/erase", hashtable_erase},
+    {"dict/insert-rehash", dict_insert_rehash},
+    {"dict/find-rehashing", dict_find_rehashing},
+    {"dict/insert-ttl", dict_insert_ttl},
+    {"heap/push", heap_push},
+    {"heap/pop", heap_pop},
+    {"avltree/insert", avl_insert},
+    {"avltree/rank", avl_rank},
+    {"avltree/range10", avl_range},
+    {"zset/zadd", zset_zadd},
+    {"zset/zrank", zset_zrank},
+    {"zset/zrange10", zset_zrange},
+    {"zset/zrem", zset_zrem},
+};
+
+struct Result {
+    string name;
+    size_t n;
+    double ns_per_op;
+    double misses_per_op;   // -1 when not measured
+    double bytes_per_elem;  // -1 when not measured
+};
+
+// "1K", "100M", "5000" -> count.
+static size_t parse_count(const string& s){
+    size_t mult = 1;
+    string digits = s;
+    char last = s.empty() ? 0 : toupper(s.back());
+    if (last == 'K') mult = 1000;
+    if (last == 'M') mult = 1000000;
+    if (mult > 1) digits.pop_back();
+    return stoull(digits) * mult;
+}
+
+static bool load_baseline(const string& path, map<pair<string, size_t>, Result>& out){
+    ifstream in(path);
+    if (!in) return false;
+    Result r;
+    while (in >> r.name >> r.n >> r.ns_per_op >> r.misses_per_op >> r.bytes_per_elem)
+        out[{r.name, r.n}] = r;
+    return true;
+}
+
+int main(int argc, char** argv){
+    vector<size_t> sizes = {1000, 100000, 1000000};
+    string filter, baseline, save;
+    int repeat = 3;
+    double threshold = 10;
+
+    for (int i = 1; i < argc; i++) {
+        string a = argv[i];
+        if (a.rfind("--sizes=", 0) == 0) {
+            sizes.clear();
+            stringstream ss(a.substr(8));
+            string item;
+            while (getline(ss, item, ',')) sizes.push_back(parse_count(item));
+        } else if (a.rfind("--filter=", 0) == 0) {
+            filter = a.substr(9);
+        } else if (a.rfind("--repeat=", 0) == 0) {
+            repeat = max(1, stoi(a.substr(9)));
+        } else if (a.rfind("--baseline=", 0) == 0) {
+            baseline = a.substr(11);
+        } else if (a.rfind("--threshold=", 0) == 0) {
+            threshold = stod(a.substr(12));
+        } else if (a.rfind("--save=", 0) == 0) {
+            save = a.substr(7);
+        } else {
+            fprintf(stderr, "unknown option %s\n", a.c_str());
+            return 1;
+        }
+    }
+
+    map<pair<string, size_t>, Result> base;
+    if (!baseline.empty() && !load_baseline(baseline, base)) {
+        fprintf(stderr, "cannot read baseline %s\n", baseline.c_str());
+        return 1;
+    }
+    if (!perf.open())
+        fprintf(stderr, "perf_event_open unavailable; cache misses not reported\n");
+
+    printf("%-22s %10s %10s %10s %11s", "benchmark", "n", "ns/op", "misses/op", "bytes/elem");
+    if (!base.empty()) printf(" %10s %8s", "base ns/op", "delta");
+    printf("\n");
+
+    vector<Result> results;
+    int regressions = 0;
+    for (size_t n : sizes) {
+        Workload w(n);
+        for (const Bench& b : benches) {
+            if (!filter.empty() && string(b.name).find(filter) == string::npos) continue;
+
+            // Best of repeat: noise only ever makes a run slower.
+            Result r{b.name, n, 0, -1, -1};
+            for (int rep = 0; rep < repeat; rep++) {
+                Measure m;
+                uint64_t ops = b.fn(w, m);
+                double ns = (double)m.ns / ops;
+                if (rep == 0 || ns < r.ns_per_op) {
+                    r.ns_per_op = ns;
+                    r.misses_per_op = perf.ok() ? (double)m.misses / ops : -1;
+                }
+                r.bytes_per_elem = m.bytes;
+            }
+            results.push_back(r);
+
+            printf("%-22s %10zu %10.1f", r.name.c_str(), n, r.ns_per_op);
+            if (r.misses_per_op >= 0) printf(" %10.2f", r.misses_per_op);
+            else printf(" %10s", "-");
+            if (r.bytes_per_elem >= 0) printf(" %11.1f", r.bytes_per_elem);
+            else printf(" %11s", "-");
+            auto it = base.find({r.name, n});
+            if (it != base.end()) {
+                double delta = (r.ns_per_op - it->second.ns_per_op) / it->second.ns_per_op * 100;
+                bool worse = delta > threshold;
+                regressions += worse;
+                printf(" %10.1f %+7.1f%%%s", it->second.ns_per_op, delta, worse ? "  REGRESSION" : "");
+            }
+            printf("\n");
+            fflush(stdout);
+        }
+    }
+
+    if (!save.empty()) {
+        ofstream out(save);
+        for (auto& r : results)
+            out << r.name << " " << r.n << " " << r.ns_per_op << " " << r.misses_per_op << " "
+                << r.bytes_per_elem << "\n";
+        if (!out) {
+            fprintf(stderr, "cannot write %s\n", save.c_str());
+            return 1;
+        }
+    }
+
+    if (!base.empty()) {
+        printf("%d regression(s) over %.0f%%\n", regressions, threshold);
+        return regressions ? 1 : 0;
+    }
+    return 0;
+}
@@ -12,6 +12,17 @@ private:
     int fd = -1;
     sockaddr_in addr{};
 
+    // Bytes read past the last complete frame.
+    string inbuf;
+
+    // Client-side cache of GET replies, kept valid by the server's
+    // "(push) invalidate" messages once CLIENT TRACKING is on.
+    bool caching = false;
+    unordered_map<string, string> cache;
+    size_t cache_max = 100000;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+
     bool write_full(const void* buf, size_t len) {
         const char* p = static_cast<const char*>(buf);
         while (len > 0) {
@@ -40,6 +51,55 @@ private:
         return true;
     }
 
+    // Takes the next frame out of inbuf, reading more if wait is set.
+    // Without wait, only what the socket already holds is read.
+    bool read_frame(string& out, bool wait) {
+        while (true) {
+            if (inbuf.size() >= 4) {
+                uint32_t len;
+                memcpy(&len, inbuf.data(), 4);
+                if (len > MAX_LEN) {
+                    cerr << "response too large\n";
+                    return false;
+                }
+                if (inbuf.size() >= 4 + len) {
+                    out.assign(inbuf, 4, len);
+                    inbuf.erase(0, 4 + len);
+                    return true;
+                }
+            }
+
+            char buf[MAX_LEN];
+            ssize_t n = recv(fd, buf, sizeof(buf), wait ? 0 : MSG_DONTWAIT);
+            if (n <= 0) {
+                if (wait) perror("read");
+                return false;
+            }
+            inbuf.append(buf, n);
+        }
+    }
+
+    // Pushes can arrive between any two replies.
+    static bool is_push(const string& frame) {
+        return frame.compare(0, 7, "(push) ") == 0;
+    }
+
+    void handle_push(const string& frame) {
+        static const string inv = "(push) invalidate ";
+        if (frame == "(push) invalidate-all")
+            cache.clear();
+        else if (frame.compare(0, inv.size(), inv) == 0)
+            cache.erase(frame.substr(inv.size()));
+    }
+
+    // Applies the invalidations that have already arrived.
+    void poll_pushes() {
+        string frame;
+        while (read_frame(frame, false)) {
+            if (is_push(frame)) handle_push(frame);
+        }
+    }
+
 public:
     bool connect_to_server(const char* ip, uint16_t port) {
         fd = socket(AF_INET, SOCK_STREAM, 0);
@@ -63,7 +123,8 @@ public:
         return true;
     }
 
-    bool send_message(const string& msg) {
+    // Sends msg and waits for its reply, applying any pushes on the way.
+    bool request(const string& msg, string& reply) {
         if (msg.size() > MAX_LEN) {
             cerr << "message too large\n";
             return false;
@@ -78,25 +139,58 @@ public:
         if (!write_full(wbuf, 4 + len))
             return false;
 
-        uint32_t rlen = 0;
-        if (!read_full(&rlen, 4))
-            return false;
+        while (read_frame(reply, true)) {
+            if (!is_push(reply)) return true;
+            handle_push(reply);
+        }
+        return false;
+    }
 
-        if (rlen > MAX_LEN) {
-            cerr << "response too large\n";
+    bool send_message(const string& msg) {
+        string payload;
+        if (!request(msg, payload))
             return false;
-        }
 
-        char rbuf[MAX_LEN + 1];
-if (!read_full(rbuf, rlen))
-    return false;
-string payload(rbuf, rlen);
+        cout << "Server says:\n" << payload << endl;
 
-cout << "Server says:\n" << payload << endl;
+        return true;
+    }
 
+    // Turns on CLIENT TRACKING; from then on cached_get serves repeated
+    // reads from memory until the server says the key changed.
+    bool enable_cache() {
+        string reply;
+        if (!request("CLIENT TRACKING ON", reply) || reply != "(str) OK")
+            return false;
+        caching = true;
         return true;
     }
 
+    // GET through the cache. reply is the server's reply, "(nil)" included.
+    bool cached_get(const string& key, string& reply) {
+        if (caching) {
+            poll_pushes();
+            auto it = cache.find(key);
+            if (it != cache.end()) {
+                hits++;
+                reply = it->second;
+                return true;
+            }
+        }
+
+        misses++;
+        if (!request("GET " + key, reply))
+            return false;
+        if (caching && reply.compare(0, 5, "(err)") != 0) {
+            if (cache.size() >= cache_max) cache.clear();
+            cache[key] = reply;
+        }
+        return true;
+    }
+
+    uint64_t cache_hits() const { return hits; }
+    uint64_t cache_misses() const { return misses; }
+
     void close_connection() {
         if (fd >= 0) {
             close(fd);
@@ -108,6 +202,7 @@ int main() {
     Client client;
     if (!client.connect_to_server("127.0.0.1", 1234))
         return 1;
+    bool failed = false;
 
     cout << "\n======= BASIC STRING COMMANDS =======\n";
     client.send_message("SET foo bar");
@@ -142,9 +237,48 @@ int main() {
     client.send_message("ZREM scores bob");
     client.send_message("ZRANGE scores 0 5");
 
+    cout << "\n======= HYPERLOGLOG =======\n";
+    client.send_message("PFADD visitors alice bob carol");
+    client.send_message("PFCOUNT visitors");
+
+    // A forged sparse HLL (stale cache, one triple for register 0xffff
+    // with value 200) must be refused as WRONGTYPE, never counted or merged.
+    string forged("HYLL\x01\x01\x01\x01", 8);
+    forged.append(7, '\x01');
+    forged += "\x80\xff\xff\xc8";
+    client.send_message("SET forged " + forged);
+    for (const char* cmd : {"PFCOUNT forged", "PFMERGE merged visitors forged"}) {
+        string reply;
+        if (!client.request(cmd, reply) || reply.rfind("(err) 2 WRONGTYPE", 0) != 0) {
+            cerr << "FAIL: " << cmd << " accepted a forged HLL: " << reply << "\n";
+            failed = true;
+        } else {
+            cout << cmd << ": refused as WRONGTYPE\n";
+        }
+    }
+
     cout << "\n======= INFO METRICS =======\n";
     client.send_message("INFO");
 
+    cout << "\n======= CLIENT-SIDE CACHING =======\n";
+    Client cached;
+    if (cached.connect_to_server("127.0.0.1", 1234) && cached.enable_cache()) {
+        string reply;
+        client.send_message("SET flag on");
+        for (int i = 0; i < 1000; i++)
+            cached.cached_get("flag", reply);
+        cout << "flag: " << reply << "\n";
+
+        // The write makes the server push an invalidation to `cached`.
+        client.send_message("SET flag off");
+        usleep(10000);
+        cached.cached_get("flag", reply);
+        cout << "flag after SET: " << reply << "\n";
+        cout << "cache hits: " << cached.cache_hits()
+             << ", misses: " << cached.cache_misses() << "\n";
+        cached.close_connection();
+    }
+
     cout << "\n======= PIPELINING TEST =======\n";
     client.send_message("SET a 1");
     client.send_message("SET b 2");
@@ -153,5 +287,5 @@ int main() {
 
 
     client.close_connection();
-    return 0;
+    return failed ? 1 : 0;
 }
@@ -1,5 +1,6 @@
 #include "AVLTree.h"
 #include "Robj.h"
+#include "Helper.h"
 #include <cstdlib>
 #include <cstring>
 #include <algorithm>
@@ -186,26 +187,97 @@ int AVLTree::rank(Robj* member, double score){
 }
 
 
+// Descends only into subtrees that overlap [start, end], using the subtree
+// sizes to know each node's rank: O(log n + k) rather than a walk over
+// every node before start.
 void AVLTree::range_by_rank_util(AVLNode* node, int start, int end,
-                                 vector<Robj*>& out, int& idx)
+                                 vector<Robj*>& out, int base)
 {
     if (!node) return;
 
-    range_by_rank_util(node->left, start, end, out, idx);
+    int r = base + get_size(node->left);
 
-    if (idx >= start && idx <= end){
+    if (start < r){
+        range_by_rank_util(node->left, start, end, out, base);
+    }
+    if (r >= start && r <= end){
         out.push_back(node->member);
     }
-    idx++;
-
-    if (idx > end) return;
-
-    range_by_rank_util(node->right, start, end, out, idx);
+    if (end > r){
+        range_by_rank_util(node->right, start, end, out, r + 1);
+    }
 }
 
 vector<Robj*> AVLTree::range(int start, int end){
     vector<Robj*> out;
-    int idx = 0;
-    range_by_rank_util(root, start, end, out, idx);
+    int lo = max(start, 0);
+    int hi = min(end, get_size(root) - 1);
+    if (lo <= hi){
+        out.reserve(hi - lo + 1);
+    }
+    range_by_rank_util(root, start, end, out, 0);
     return out;
 }
+
+
+int AVLTree::size(){
+    return get_size(root);
+}
+
+
+AVLNode* AVLTree::build_util(const vector<pair<Robj*, double>>& items,
+                             size_t lo, size_t hi)
+{
+    if (lo >= hi) return nullptr;
+
+    size_t mid = lo + (hi - lo) / 2;
+    AVLNode* n = (AVLNode*)malloc(sizeof(AVLNode));
+    n->member = items[mid].first;
+    n->score = items[mid].second;
+    n->left  = build_util(items, lo, mid);
+    n->right = build_util(items, mid + 1, hi);
+
+    update_node(n);
+    return n;
+}
+
+void AVLTree::build_sorted(const vector<pair<Robj*, double>>& items){
+    destroy_recursive(root);
+    root = build_util(items, 0, items.size());
+}
+
+
+void AVLTree::in_order_util(AVLNode* node, vector<pair<Robj*, double>>& out){
+    if (!node) return;
+    in_order_util(node->left, out);
+    out.emplace_back(node->member, node->score);
+    in_order_util(node->right, out);
+}
+
+void AVLTree::in_order(vector<pair<Robj*, double>>& out){
+    out.reserve(out.size() + get_size(root));
+    in_order_util(root, out);
+}
+
+void AVLTree::sample_util(AVLNode* root, size_t max, vector<AVLNode*>& out){
+    // Breadth first, so a small sample spans the score range.
+    if (root) out.push_back(root);
+    for (size_t i = 0; i < out.size(); i++) {
+        for (AVLNode* c : {out[i]->left, out[i]->right}) {
+            if (max && out.size() >= max) return;
+            if (c) out.push_back(c);
+        }
+    }
+}
+
+size_t AVLTree::memory_usage(size_t samples){
+    size_t bytes = alloc_size(this);
+    vector<AVLNode*> nodes;
+    sample_util(root, samples, nodes);
+    if (nodes.empty()) return bytes;
+
+    size_t sampled = 0;
+    for (AVLNode* n : nodes)
+        sampled += alloc_size(n) + alloc_size(n->member) + alloc_size(n->member->ptr);
+    return bytes + sampled * get_size(root) / nodes.size();
+}
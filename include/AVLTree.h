@@ -2,6 +2,7 @@
 #include <vector>
 #include <string>
 #include <cstdint>
+#include <utility>
 
 struct Robj;
 
@@ -36,8 +37,15 @@ private:
 
     int rank_util(AVLNode* root, Robj* member, double score);
 
+    // base is the rank of the leftmost node under root.
     void range_by_rank_util(AVLNode* root, int start, int end,
-                            std::vector<Robj*>& out, int& idx);
+                            std::vector<Robj*>& out, int base);
+
+    AVLNode* build_util(const std::vector<std::pair<Robj*, double>>& items,
+                        size_t lo, size_t hi);
+    void in_order_util(AVLNode* root,
+                       std::vector<std::pair<Robj*, double>>& out);
+    void sample_util(AVLNode* root, size_t max, std::vector<AVLNode*>& out);
 
 public:
     AVLTree();
@@ -49,4 +57,17 @@ public:
 
     int rank(Robj* member, double score);
     std::vector<Robj*> range(int start, int end);
+
+    int size();
+
+    // Replaces an empty tree with a perfectly balanced one built from items
+    // already sorted by (score, member). O(n), no rotations.
+    void build_sorted(const std::vector<std::pair<Robj*, double>>& items);
+
+    // Appends every (member, score) pair in (score, member) order.
+    void in_order(std::vector<std::pair<Robj*, double>>& out);
+
+    // Allocated bytes of the nodes and their member objects, measured on
+    // samples nodes near the root and extrapolated; samples 0 measures all.
+    size_t memory_usage(size_t samples);
 };
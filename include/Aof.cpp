@@ -0,0 +1,376 @@
+#include "Aof.h"
+#include "Crc32c.h"
+#include "Helper.h"
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <csignal>
+#include <sys/eventfd.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace std;
+
+bool parse_fsync_policy(const string& s, FsyncPolicy& out){
+    if (s == "always") out = FSYNC_ALWAYS;
+    else if (s == "everysec") out = FSYNC_EVERYSEC;
+    else if (s == "no") out = FSYNC_NO;
+    else return false;
+    return true;
+}
+
+const char* fsync_policy_name(FsyncPolicy p){
+    switch (p) {
+    case FSYNC_ALWAYS: return "always";
+    case FSYNC_EVERYSEC: return "everysec";
+    default: return "no";
+    }
+}
+
+string aof_record(const string& cmd){
+    char crc[10];
+    snprintf(crc, sizeof(crc), "%08x ", crc32c(cmd.data(), cmd.size()));
+    string rec;
+    rec.reserve(cmd.size() + 10);
+    rec.append(crc, 9);
+    rec += cmd;
+    rec += '\n';
+    return rec;
+}
+
+static bool is_hex8(const char* p){
+    for (int i = 0; i < 8; i++) {
+        if (!isdigit((unsigned char)p[i]) && (p[i] < 'a' || p[i] > 'f'))
+            return false;
+    }
+    return true;
+}
+
+bool aof_check_record(const char* line, size_t len, string& cmd){
+    // Commands are upper case, so a lower-case hex prefix is never the
+    // start of a legacy line.
+    if (len < 9 || line[8] != ' ' || !is_hex8(line)) {
+        cmd.assign(line, len);
+        return true;
+    }
+    uint32_t want = strtoul(string(line, 8).c_str(), nullptr, 16);
+    cmd.assign(line + 9, len - 9);
+    return crc32c(cmd.data(), cmd.size()) == want;
+}
+
+Aof::Aof()
+    : fd(-1), efd(-1), buf_records(0), policy(FSYNC_EVERYSEC), written(0), synced(0), sync_target(0),
+      stopping(false), syncing(false), last_sync_request_ns(0),
+      rewrite_pid(-1), rewrite_start_ns(0), file_size(0), base_size(0),
+      auto_pct(100), auto_min_size(64ULL << 20), rewrite_count(0),
+      last_rewrite_ms(0), fsync_count(0), last_fsync_us(0), max_fsync_us(0),
+      last_fsync_done_ns(0), fsync_spike_us(0), fsync_errno(0), last_flush_bytes(0) {}
+
+Aof::~Aof(){
+    close();
+}
+
+bool Aof::open(const string& path, FsyncPolicy p){
+    fd = ::open(path.c_str(), O_CREAT | O_WRONLY | O_APPEND, 0644);
+    if (fd < 0) return false;
+
+    efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (efd < 0) {
+        ::close(fd);
+        fd = -1;
+        return false;
+    }
+
+    file = path;
+    policy = p;
+    written = synced = lseek(fd, 0, SEEK_END);
+    file_size = base_size = written;
+    sync_target = written;
+    stopping = false;
+    fsync_thread = thread(&Aof::fsync_loop, this);
+    return true;
+}
+
+void Aof::close(){
+    if (fd < 0) return;
+
+    if (rewrite_pid > 0) abort_rewrite();
+    flush();
+    {
+        lock_guard<mutex> lk(mu);
+        stopping = true;
+    }
+    cv.notify_all();
+    fsync_thread.join();
+
+    // Whatever the policy, nothing acknowledged is left in the page cache.
+    if (fdatasync(fd) == 0)
+        synced = written;
+    else
+        perror("[AOF] fdatasync");
+    ::close(fd);
+    ::close(efd);
+    fd = efd = -1;
+}
+
+void Aof::drain_events(){
+    uint64_t n;
+    while (read(efd, &n, sizeof(n)) > 0) {}
+}
+
+void Aof::append_records(const char* p, size_t n, uint32_t count){
+    buf.append(p, n);
+    buf_records += count;
+}
+
+void Aof::flush(bool sync_now){
+    if (fd < 0) return;
+
+    if (buf_records) {
+        string frame;
+        aof_encode_frame(frame, buf, buf_records);
+        buf.clear();
+        buf_records = 0;
+        if (rewrite_pid > 0) rewrite_buf += frame;
+        pending += frame;
+    }
+
+    size_t off = 0;
+    while (off < pending.size()) {
+        ssize_t n = write(fd, pending.data() + off, pending.size() - off);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            // Keep the rest and retry on the next iteration.
+            perror("[AOF] write");
+            break;
+        }
+        off += n;
+    }
+    if (off) {
+        written += off;
+        file_size += off;
+        last_flush_bytes = off;
+        pending.erase(0, off);
+    }
+
+    if (written == synced.load()) return;
+
+    uint64_t now = now_ns();
+    if (sync_now || policy == FSYNC_ALWAYS ||
+        (policy == FSYNC_EVERYSEC && now - last_sync_request_ns >= 1000000000ULL)) {
+        last_sync_request_ns = now;
+        request_sync();
+    }
+}
+
+void Aof::request_sync(){
+    {
+        lock_guard<mutex> lk(mu);
+        sync_target = written;
+    }
+    cv.notify_all();
+}
+
+// Background fsync thread. Each pass syncs everything written up to the
+// requested offset, so requests that pile up during a slow fsync are served
+// by the next one.
+void Aof::fsync_loop(){
+    unique_lock<mutex> lk(mu);
+    while (true) {
+        cv.wait(lk, [&] {
+            return stopping || (!fsync_errno && sync_target > synced.load());
+        });
+        if (stopping) return;
+
+        uint64_t target = sync_target;
+        int f = fd;
+        syncing = true;
+        lk.unlock();
+
+        uint64_t t0 = now_ns();
+        int err = fdatasync(f) == 0 ? 0 : errno;
+        uint64_t t1 = now_ns();
+
+        uint64_t us = (t1 - t0) / 1000;
+        last_fsync_us = us;
+        if (us > max_fsync_us) max_fsync_us = us;
+        uint64_t spike = fsync_spike_us.load();
+        while (us > spike && !fsync_spike_us.compare_exchange_weak(spike, us)) {}
+        fsync_count++;
+        last_fsync_done_ns = t1;
+
+        lk.lock();
+        syncing = false;
+        if (err) {
+            // Leave synced where it is; the loop fails the waiting writes.
+            fprintf(stderr, "[AOF] fdatasync: %s\n", strerror(err));
+            if (f == fd) fsync_errno = err;
+        } else if (target > synced.load()) {
+            // A rewrite may have swapped files and moved synced past target.
+            synced = target;
+        }
+        cv.notify_all();
+
+        uint64_t one = 1;
+        if (write(efd, &one, sizeof(one)) < 0) perror("[AOF] eventfd");
+    }
+}
+
+bool Aof::start_rewrite(const function<bool(int)>& dump){
+    if (fd < 0 || rewrite_pid > 0) return false;
+
+    // The child sees everything logged up to here; later records go to
+    // rewrite_buf as well.
+    flush();
+    rewrite_tmp = file + ".rewrite";
+    rewrite_buf.clear();
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("[AOF] fork");
+        return false;
+    }
+    if (pid == 0) {
+        int f = ::open(rewrite_tmp.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0644);
+        bool ok = f >= 0 && dump(f) && fsync(f) == 0;
+        _exit(ok ? 0 : 1);
+    }
+
+    rewrite_pid = pid;
+    rewrite_start_ns = now_ns();
+    fprintf(stderr, "[AOF] background rewrite started by pid %d\n", pid);
+    return true;
+}
+
+bool Aof::should_auto_rewrite(){
+    if (fd < 0 || rewrite_pid > 0 || !auto_pct || file_size < auto_min_size)
+        return false;
+    uint64_t base = base_size ? base_size : 1;
+    return (file_size - base_size) * 100 / base >= auto_pct;
+}
+
+void Aof::poll_rewrite(){
+    if (rewrite_pid <= 0) return;
+
+    int status;
+    pid_t r = waitpid(rewrite_pid, &status, WNOHANG);
+    if (r == 0) return;
+
+    rewrite_pid = -1;
+    if (r < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "[AOF] background rewrite failed\n");
+        unlink(rewrite_tmp.c_str());
+        rewrite_buf.clear();
+        return;
+    }
+    finish_rewrite();
+}
+
+void Aof::finish_rewrite(){
+    flush();
+
+    int nfd = ::open(rewrite_tmp.c_str(), O_WRONLY | O_APPEND);
+    if (nfd < 0 || !write_all(nfd, rewrite_buf.data(), rewrite_buf.size()) ||
+        fdatasync(nfd) != 0 || rename(rewrite_tmp.c_str(), file.c_str()) != 0) {
+        perror("[AOF] rewrite switch");
+        if (nfd >= 0) ::close(nfd);
+        unlink(rewrite_tmp.c_str());
+        rewrite_buf.clear();
+        return;
+    }
+    rewrite_buf.clear();
+    rewrite_buf.shrink_to_fit();
+
+    // The new file already holds and has synced everything written so far.
+    int old;
+    {
+        unique_lock<mutex> lk(mu);
+        cv.wait(lk, [&] { return !syncing; });
+        old = fd;
+        fd = nfd;
+        synced = written;
+        sync_target = written;
+        fsync_errno = 0;
+    }
+    ::close(old);
+
+    file_size = base_size = lseek(nfd, 0, SEEK_END);
+    rewrite_count++;
+    last_rewrite_ms = (now_ns() - rewrite_start_ns) / 1000000;
+    fprintf(stderr, "[AOF] rewrite finished: %llu bytes in %llu ms\n",
+            (unsigned long long)file_size, (unsigned long long)last_rewrite_ms);
+
+    uint64_t one = 1;
+    if (write(efd, &one, sizeof(one)) < 0) perror("[AOF] eventfd");
+}
+
+void Aof::abort_rewrite(){
+    if (rewrite_pid <= 0) return;
+    kill(rewrite_pid, SIGKILL);
+    waitpid(rewrite_pid, nullptr, 0);
+    rewrite_pid = -1;
+    unlink(rewrite_tmp.c_str());
+    rewrite_buf.clear();
+}
+
+bool Aof::reset_to(const string& path){
+    if (fd < 0) return false;
+    abort_rewrite();
+
+    int nfd = ::open(path.c_str(), O_WRONLY | O_APPEND);
+    if (nfd < 0 || fdatasync(nfd) != 0 || rename(path.c_str(), file.c_str()) != 0) {
+        perror("[AOF] reset");
+        if (nfd >= 0) ::close(nfd);
+        return false;
+    }
+    buf.clear();
+    buf_records = 0;
+    pending.clear();
+
+    int old;
+    {
+        unique_lock<mutex> lk(mu);
+        cv.wait(lk, [&] { return !syncing; });
+        old = fd;
+        fd = nfd;
+        synced = written;
+        sync_target = written;
+        fsync_errno = 0;
+    }
+    ::close(old);
+
+    file_size = base_size = lseek(nfd, 0, SEEK_END);
+    fprintf(stderr, "[AOF] log reset to a %llu byte snapshot\n",
+            (unsigned long long)file_size);
+
+    uint64_t one = 1;
+    if (write(efd, &one, sizeof(one)) < 0) perror("[AOF] eventfd");
+    return true;
+}
+
+void Aof::info(string& out){
+    uint64_t now = now_ns();
+    uint64_t lag_bytes = written - synced.load();
+    uint64_t done = last_fsync_done_ns.load();
+
+    out += "# Persistence\n";
+    out += "aof_fsync_policy:" + string(fsync_policy_name(policy)) + "\n";
+    out += "aof_buffer_length:" + to_string(buf.size() + pending.size()) + "\n";
+    out += "aof_last_write_bytes:" + to_string(last_flush_bytes) + "\n";
+    out += "aof_current_size:" + to_string(file_size) + "\n";
+    out += "aof_base_size:" + to_string(base_size) + "\n";
+    out += "aof_rewrite_in_progress:" + to_string(rewrite_pid > 0 ? 1 : 0) + "\n";
+    out += "aof_rewrite_buffer_length:" + to_string(rewrite_buf.size()) + "\n";
+    out += "aof_rewrites:" + to_string(rewrite_count) + "\n";
+    out += "aof_last_rewrite_ms:" + to_string(last_rewrite_ms) + "\n";
+    out += "aof_fsyncs:" + to_string(fsync_count.load()) + "\n";
+    out += "aof_last_fsync_status:" + string(fsync_errno.load() ? "err" : "ok") + "\n";
+    out += "aof_last_fsync_us:" + to_string(last_fsync_us.load()) + "\n";
+    out += "aof_max_fsync_us:" + to_string(max_fsync_us.load()) + "\n";
+    out += "aof_fsync_lag_bytes:" + to_string(lag_bytes) + "\n";
+    out += "aof_fsync_lag_ms:" +
+           to_string(lag_bytes && done ? (now - done) / 1000000 : 0) + "\n";
+}
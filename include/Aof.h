@@ -0,0 +1,185 @@
+#pragma once
+#include "AofFormat.h"
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#define AOF_FILE "appendonly.aof"
+
+enum FsyncPolicy {
+    FSYNC_ALWAYS,    // fsync after every event-loop flush
+    FSYNC_EVERYSEC,  // fsync at most once a second
+    FSYNC_NO         // leave it to the kernel
+};
+
+bool parse_fsync_policy(const std::string& s, FsyncPolicy& out);
+const char* fsync_policy_name(FsyncPolicy p);
+
+// A text log record: "<crc32c of cmd as 8 hex digits> <cmd>\n", as
+// written by plain-command rewrites.
+std::string aof_record(const std::string& cmd);
+
+// Validates one record (line without its '\n') and extracts the command.
+// Lines without a checksum, as written before records had one, are
+// accepted unchecked.
+bool aof_check_record(const char* line, size_t len, std::string& cmd);
+
+// Append-only file writer. Records are collected in memory and written as
+// one frame with a single write() per event-loop iteration (flush);
+// fdatasync runs on a background thread so the loop never waits for the
+// disk.
+//
+// Offsets are byte positions in the log. Every completed fsync bumps
+// synced_offset() and signals event_fd(), which lets the loop release
+// replies that were held until their writes were durable (group commit:
+// one fsync acknowledges every write batched since the previous one).
+class Aof {
+private:
+    int fd;
+    int efd;
+    std::string file;
+    std::string buf;           // encoded records of the next frame
+    uint32_t buf_records;
+    std::string pending;       // framed bytes write() has not taken yet
+    FsyncPolicy policy;
+
+    // Bytes handed to write() so far, and bytes known to be on disk.
+    uint64_t written;
+    std::atomic<uint64_t> synced;
+
+    std::thread fsync_thread;
+    std::mutex mu;
+    std::condition_variable cv;
+    uint64_t sync_target;      // guarded by mu
+    bool stopping;             // guarded by mu
+    bool syncing;              // guarded by mu; fd is in use by the thread
+    uint64_t last_sync_request_ns;
+
+    // Background rewrite: the forked child dumps the dataset to rewrite_tmp
+    // while records logged meanwhile are also kept in rewrite_buf, to be
+    // appended to the new file before it replaces the old one.
+    pid_t rewrite_pid;
+    std::string rewrite_tmp;
+    std::string rewrite_buf;
+    uint64_t rewrite_start_ns;
+    uint64_t file_size;
+    uint64_t base_size;        // file size right after the last rewrite
+    uint32_t auto_pct;
+    uint64_t auto_min_size;
+    uint64_t rewrite_count;
+    uint64_t last_rewrite_ms;
+
+    std::atomic<uint64_t> fsync_count;
+    std::atomic<uint64_t> last_fsync_us;
+    std::atomic<uint64_t> max_fsync_us;
+    std::atomic<uint64_t> last_fsync_done_ns;
+    std::atomic<uint64_t> fsync_spike_us;   // slowest fsync not yet taken
+    // errno of a failed fsync. Once one fails, the kernel may have dropped
+    // the dirty pages and a retry can succeed without them being on disk,
+    // so nothing more is synced until a rewrite or reset replaces the file.
+    std::atomic<int> fsync_errno;
+    uint64_t last_flush_bytes;
+
+    void fsync_loop();
+    void request_sync();
+    void finish_rewrite();
+
+public:
+    Aof();
+    ~Aof();
+
+    bool open(const std::string& path, FsyncPolicy p);
+    void close();
+
+    bool enabled(){
+        return fd >= 0;
+    }
+
+    const std::string& path(){
+        return file;
+    }
+
+    FsyncPolicy fsync_policy(){
+        return policy;
+    }
+
+    // Logs count records already encoded with aof_encode_command, or taken
+    // verbatim from a replication frame.
+    void append_records(const char* p, size_t n, uint32_t count);
+
+    // End of the log, including records not yet written.
+    uint64_t offset(){
+        return written + pending.size() +
+               (buf_records ? AOF_FRAME_HEADER + buf.size() : 0);
+    }
+
+    uint64_t synced_offset(){
+        return synced.load();
+    }
+
+    // Nonzero (an errno) once an fsync has failed: synced_offset() stops
+    // moving and writes waiting on it will never be durable.
+    int fsync_error(){
+        return fsync_errno.load();
+    }
+
+    int event_fd(){
+        return efd;
+    }
+
+    // Clears event_fd() after it polls readable.
+    void drain_events();
+
+    // Writes the buffered records and schedules an fsync per the policy, or
+    // unconditionally when sync_now (someone is waiting on durability).
+    void flush(bool sync_now = false);
+
+    // Forks a child that writes dump(fd) to a temporary file. False when a
+    // rewrite is already running or fork failed.
+    bool start_rewrite(const std::function<bool(int)>& dump);
+
+    bool rewrite_in_progress(){
+        return rewrite_pid > 0;
+    }
+
+    // Kills the child and drops its temporary file.
+    void abort_rewrite();
+
+    // Makes the file at path the whole log, as when the dataset has been
+    // replaced by a snapshot: syncs it, renames it over the log and appends
+    // there from now on. Records not yet written and a running rewrite are
+    // dropped, as they describe the dataset being replaced.
+    bool reset_to(const std::string& path);
+
+    // Reaps a finished child and, on success, appends the writes logged in
+    // the meantime and atomically renames the new file over the old one.
+    void poll_rewrite();
+
+    // Rewrite automatically once the file has grown pct percent past its
+    // size after the last rewrite and is at least min_size bytes.
+    void set_auto_rewrite(uint32_t pct, uint64_t min_size){
+        auto_pct = pct;
+        auto_min_size = min_size;
+    }
+
+    bool should_auto_rewrite();
+
+    // The slowest fsync since the last call, 0 if none; for the LATENCY
+    // monitor, which runs on the loop thread.
+    uint64_t take_fsync_spike_us(){
+        return fsync_spike_us.exchange(0);
+    }
+
+    // Bytes buffered in memory: records not yet written, and those kept
+    // for a running rewrite.
+    size_t memory_usage(){
+        return buf.capacity() + pending.capacity() + rewrite_buf.capacity();
+    }
+
+    // Appends an INFO "# Persistence" section.
+    void info(std::string& out);
+};
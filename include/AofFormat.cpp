@@ -0,0 +1,249 @@
+#include "AofFormat.h"
+#include "AofRewrite.h"
+#include "Crc32c.h"
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+using namespace std;
+
+static void put_u32(string& out, uint32_t v){
+    out.append((const char*)&v, 4);
+}
+
+static void put_varint(string& out, uint64_t v){
+    while (v >= 0x80) {
+        out.push_back((char)(v | 0x80));
+        v >>= 7;
+    }
+    out.push_back((char)v);
+}
+
+static void put_arg(string& out, const string& s){
+    put_varint(out, s.size());
+    out += s;
+}
+
+static vector<string> split_spaces(const string& cmd){
+    vector<string> t;
+    size_t i = 0;
+    while (i < cmd.size()) {
+        size_t j = cmd.find(' ', i);
+        if (j == string::npos) j = cmd.size();
+        if (j > i) t.push_back(cmd.substr(i, j - i));
+        i = j + 1;
+    }
+    return t;
+}
+
+static bool parse_u64(const string& s, uint64_t& out){
+    if (s.empty() || !isdigit((unsigned char)s[0])) return false;
+    char* end;
+    errno = 0;
+    out = strtoull(s.c_str(), &end, 10);
+    return !*end && errno == 0;
+}
+
+static bool parse_f64(const string& s, double& out){
+    if (s.empty()) return false;
+    char* end;
+    out = strtod(s.c_str(), &end);
+    return !*end;
+}
+
+// Body for one command; falls back to AOF_OP_CMD for anything without a
+// dedicated opcode or with fields that do not parse.
+static void encode_body(string& b, const vector<string>& t){
+    const string& c = t[0];
+    size_t n = t.size();
+
+    if (c == "SET" && n == 3) {
+        b.push_back(AOF_OP_SET);
+        put_arg(b, t[1]);
+        put_arg(b, t[2]);
+        return;
+    }
+    if (c == "SETHEX" && n == 3) {
+        string v;
+        if (hex_decode(t[2], v)) {
+            b.push_back(AOF_OP_SET);
+            put_arg(b, t[1]);
+            put_arg(b, v);
+            return;
+        }
+    }
+    if (c == "DELETE" && n == 2) {
+        b.push_back(AOF_OP_DEL);
+        put_arg(b, t[1]);
+        return;
+    }
+    uint64_t at;
+    if (c == "PEXPIREAT" && n == 3 && parse_u64(t[2], at)) {
+        b.push_back(AOF_OP_PEXPIREAT);
+        put_arg(b, t[1]);
+        b.append((const char*)&at, 8);
+        return;
+    }
+    double score;
+    if (c == "ZADD" && n == 4 && parse_f64(t[2], score)) {
+        b.push_back(AOF_OP_ZADD);
+        put_arg(b, t[1]);
+        b.append((const char*)&score, 8);
+        put_arg(b, t[3]);
+        return;
+    }
+
+    AofOp op = AOF_OP_CMD;
+    if (c == "HSET" && n >= 4 && n % 2 == 0) op = AOF_OP_HSET;
+    else if (c == "SADD" && n >= 3) op = AOF_OP_SADD;
+    else if (c == "RPUSH" && n >= 3) op = AOF_OP_RPUSH;
+    else if (c == "LPUSH" && n >= 3) op = AOF_OP_LPUSH;
+
+    b.push_back(op);
+    if (op == AOF_OP_CMD) {
+        put_varint(b, n);
+        for (auto& s : t) put_arg(b, s);
+        return;
+    }
+    put_arg(b, t[1]);
+    put_varint(b, n - 2);
+    for (size_t i = 2; i < n; i++) put_arg(b, t[i]);
+}
+
+void aof_encode_command(string& out, const string& cmd){
+    vector<string> t = split_spaces(cmd);
+    if (t.empty()) return;
+
+    string body;
+    encode_body(body, t);
+    put_u32(out, crc32c(body.data(), body.size()));
+    put_varint(out, body.size());
+    out += body;
+}
+
+void aof_encode_frame(string& out, const string& records, uint32_t count){
+    size_t at = out.size();
+    out.push_back((char)AOF_FRAME_MAGIC);
+    put_u32(out, records.size());
+    put_u32(out, count);
+    put_u32(out, crc32c(out.data() + at, 9));
+    out += records;
+}
+
+bool aof_is_frame(const char* data, size_t len){
+    return len > 0 && (uint8_t)data[0] == AOF_FRAME_MAGIC;
+}
+
+// Bounds-checked cursor over a record body.
+struct Cursor {
+    const uint8_t* p;
+    const uint8_t* end;
+    bool ok = true;
+
+    uint64_t varint(){
+        uint64_t v = 0;
+        for (int shift = 0; shift < 64 && p < end; shift += 7) {
+            uint8_t b = *p++;
+            v |= (uint64_t)(b & 0x7f) << shift;
+            if (!(b & 0x80)) return v;
+        }
+        ok = false;
+        return 0;
+    }
+
+    void fixed(void* dst, size_t n){
+        if ((size_t)(end - p) < n) {
+            ok = false;
+            return;
+        }
+        memcpy(dst, p, n);
+        p += n;
+    }
+
+    AofArg arg(){
+        uint64_t n = varint();
+        if (!ok || n > (uint64_t)(end - p)) {
+            ok = false;
+            return {nullptr, 0};
+        }
+        AofArg a{(const char*)p, (uint32_t)n};
+        p += n;
+        return a;
+    }
+};
+
+static bool decode_body(Cursor& c, AofRecord& r){
+    uint8_t op;
+    c.fixed(&op, 1);
+    if (!c.ok || op > AOF_OP_LPUSH) return false;
+    r.op = (AofOp)op;
+    r.args.clear();
+
+    if (r.op == AOF_OP_CMD) {
+        uint64_t argc = c.varint();
+        if (!c.ok || argc == 0 || argc > (uint64_t)(c.end - c.p)) return false;
+        for (uint64_t i = 0; i < argc && c.ok; i++) r.args.push_back(c.arg());
+        return c.ok;
+    }
+
+    r.key = c.arg();
+    switch (r.op) {
+    case AOF_OP_SET:
+        r.args.push_back(c.arg());
+        break;
+    case AOF_OP_PEXPIREAT:
+        c.fixed(&r.u64, 8);
+        break;
+    case AOF_OP_ZADD:
+        c.fixed(&r.f64, 8);
+        r.args.push_back(c.arg());
+        break;
+    case AOF_OP_HSET:
+    case AOF_OP_SADD:
+    case AOF_OP_RPUSH:
+    case AOF_OP_LPUSH: {
+        uint64_t n = c.varint();
+        if (!c.ok || n == 0 || n > (uint64_t)(c.end - c.p)) return false;
+        if (r.op == AOF_OP_HSET && n % 2) return false;
+        for (uint64_t i = 0; i < n && c.ok; i++) r.args.push_back(c.arg());
+        break;
+    }
+    default:
+        break;
+    }
+    return c.ok;
+}
+
+AofFrameStatus aof_decode_frame(const char* data, size_t len, size_t* frame_len,
+                                vector<AofRecord>& out){
+    if (len < AOF_FRAME_HEADER) return AOF_FRAME_TRUNCATED;
+
+    uint32_t bytes, count, hcrc;
+    memcpy(&bytes, data + 1, 4);
+    memcpy(&count, data + 5, 4);
+    memcpy(&hcrc, data + 9, 4);
+    if (crc32c(data, 9) != hcrc) return AOF_FRAME_CORRUPT;
+    if (len - AOF_FRAME_HEADER < bytes) return AOF_FRAME_TRUNCATED;
+    if (count > bytes) return AOF_FRAME_CORRUPT;
+
+    Cursor frame{(const uint8_t*)data + AOF_FRAME_HEADER,
+                 (const uint8_t*)data + AOF_FRAME_HEADER + bytes};
+    out.resize(count);
+
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t crc = 0;
+        frame.fixed(&crc, 4);
+        uint64_t n = frame.varint();
+        if (!frame.ok || n > (uint64_t)(frame.end - frame.p)) return AOF_FRAME_CORRUPT;
+        if (crc32c(frame.p, n) != crc) return AOF_FRAME_CORRUPT;
+
+        Cursor body{frame.p, frame.p + n};
+        if (!decode_body(body, out[i]) || body.p != body.end) return AOF_FRAME_CORRUPT;
+        frame.p += n;
+    }
+    if (frame.p != frame.end) return AOF_FRAME_CORRUPT;
+
+    *frame_len = AOF_FRAME_HEADER + bytes;
+    return AOF_FRAME_OK;
+}
@@ -0,0 +1,69 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Binary AOF encoding. Each event-loop flush is written as one frame:
+//
+//   frame:  u8 AOF_FRAME_MAGIC | u32 payload bytes | u32 records
+//           | u32 crc32c of the preceding 9 bytes | payload
+//   record: u32 crc32c(body) | varint body bytes | body
+//   body:   u8 opcode | fields
+//
+// Hot write commands get their own opcode with numbers pre-parsed (an
+// expiry is a u64, a zset score an f64) so replay can call Dict and the
+// value types directly. Everything else is AOF_OP_CMD: the command's
+// arguments, replayed through the normal dispatcher. Arguments are
+// length-prefixed, so values may hold any bytes.
+
+#define AOF_FRAME_MAGIC 0xA0
+#define AOF_FRAME_HEADER 13
+
+enum AofOp : uint8_t {
+    AOF_OP_CMD = 0,        // varint argc | args
+    AOF_OP_SET = 1,        // key | value
+    AOF_OP_DEL = 2,        // key
+    AOF_OP_PEXPIREAT = 3,  // key | u64 ns
+    AOF_OP_ZADD = 4,       // key | f64 score | member
+    AOF_OP_HSET = 5,       // key | varint n | n args (field, value, ...)
+    AOF_OP_SADD = 6,       // key | varint n | n members
+    AOF_OP_RPUSH = 7,      // key | varint n | n elements
+    AOF_OP_LPUSH = 8       // key | varint n | n elements
+};
+
+struct AofArg {
+    const char* p;
+    uint32_t len;
+};
+
+// A decoded record. Arguments point into the frame being decoded.
+struct AofRecord {
+    AofOp op;
+    AofArg key;
+    std::vector<AofArg> args;  // values, members, fields; argv for CMD
+    uint64_t u64;              // PEXPIREAT
+    double f64;                // ZADD
+};
+
+// Appends the record for a space-separated command line, as passed to
+// Server::aof_append.
+void aof_encode_command(std::string& out, const std::string& cmd);
+
+// Wraps records into a frame.
+void aof_encode_frame(std::string& out, const std::string& records, uint32_t count);
+
+// True when data starts with a frame marker.
+bool aof_is_frame(const char* data, size_t len);
+
+enum AofFrameStatus {
+    AOF_FRAME_OK,
+    AOF_FRAME_TRUNCATED,  // the frame runs past the end of the data
+    AOF_FRAME_CORRUPT     // bad header or record checksum / encoding
+};
+
+// Checks and decodes the frame at data into out, whose storage is reused
+// between calls. Only on AOF_FRAME_OK are out and *frame_len (the frame's
+// total size) meaningful, so a frame is replayed all or nothing.
+AofFrameStatus aof_decode_frame(const char* data, size_t len, size_t* frame_len,
+                                std::vector<AofRecord>& out);
@@ -0,0 +1,125 @@
+#include "AofRewrite.h"
+#include "Aof.h"
+#include "Dict.h"
+#include "Hash.h"
+#include "Helper.h"
+#include "List.h"
+#include "Set.h"
+#include "ZSet.h"
+#include <cstdio>
+
+using namespace std;
+
+// Elements per RPUSH / SADD / HSET line.
+#define REWRITE_BATCH 64
+#define REWRITE_FLUSH_BYTES (1 << 20)
+
+bool aof_token_safe(const char* s, uint32_t len){
+    if (len == 0) return false;
+    for (uint32_t i = 0; i < len; i++) {
+        unsigned char c = s[i];
+        if (c <= ' ' || c >= 0x7f) return false;
+    }
+    return true;
+}
+
+string hex_encode(const char* s, uint32_t len){
+    static const char digits[] = "0123456789abcdef";
+    string out(len * 2, '0');
+    for (uint32_t i = 0; i < len; i++) {
+        out[i * 2] = digits[(unsigned char)s[i] >> 4];
+        out[i * 2 + 1] = digits[(unsigned char)s[i] & 15];
+    }
+    return out;
+}
+
+static int hex_val(char c){
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+bool hex_decode(const string& hex, string& out){
+    if (hex.size() % 2) return false;
+    out.resize(hex.size() / 2);
+    for (size_t i = 0; i < out.size(); i++) {
+        int hi = hex_val(hex[i * 2]), lo = hex_val(hex[i * 2 + 1]);
+        if (hi < 0 || lo < 0) return false;
+        out[i] = (char)(hi << 4 | lo);
+    }
+    return true;
+}
+
+// "<cmd> <key> a b c ..." lines of at most REWRITE_BATCH items.
+static void emit_batched(const function<void(const string&)>& emit,
+                         const string& head, const vector<string>& items,
+                         size_t per_item){
+    for (size_t i = 0; i < items.size(); i += REWRITE_BATCH * per_item) {
+        string cmd = head;
+        size_t end = min(items.size(), i + REWRITE_BATCH * per_item);
+        for (size_t j = i; j < end; j++) {
+            cmd += ' ';
+            cmd += items[j];
+        }
+        emit(cmd);
+    }
+}
+
+void aof_entry_commands(HashEntry* e, const function<void(const string&)>& emit){
+    string key((const char*)e->key->ptr, e->key->len);
+    Robj* v = e->val;
+    vector<string> items;
+
+    switch (v->type) {
+    case OBJ_ZSET: {
+        vector<pair<string, double>> zitems;
+        ((ZSet*)v->ptr)->items(zitems);
+        char score[32];
+        for (auto& it : zitems) {
+            snprintf(score, sizeof(score), "%.17g", it.second);
+            emit("ZADD " + key + " " + score + " " + it.first);
+        }
+        break;
+    }
+    case OBJ_HASH:
+        ((Hash*)v->ptr)->hgetall(items);
+        emit_batched(emit, "HSET " + key, items, 2);
+        break;
+    case OBJ_LIST:
+        ((List*)v->ptr)->lrange(0, -1, items);
+        emit_batched(emit, "RPUSH " + key, items, 1);
+        break;
+    case OBJ_SET:
+        ((Set*)v->ptr)->smembers(items);
+        emit_batched(emit, "SADD " + key, items, 1);
+        break;
+    default: {
+        const char* s = (const char*)v->ptr;
+        if (aof_token_safe(s, v->len))
+            emit("SET " + key + " " + string(s, v->len));
+        else
+            emit("SETHEX " + key + " " + hex_encode(s, v->len));
+    }
+    }
+
+    if (e->expires_at)
+        emit("PEXPIREAT " + key + " " + to_string(e->expires_at));
+}
+
+bool aof_rewrite_dataset(Dict* dict, int fd){
+    uint64_t now = now_ns();
+    string out;
+    bool ok = true;
+
+    dict->for_each([&](HashEntry* e) {
+        if (!ok || (e->expires_at && e->expires_at <= now)) return;
+        aof_entry_commands(e, [&](const string& cmd) { out += aof_record(cmd); });
+        if (out.size() >= REWRITE_FLUSH_BYTES) {
+            ok = write_all(fd, out.data(), out.size());
+            out.clear();
+        }
+    });
+
+    return ok && write_all(fd, out.data(), out.size());
+}
@@ -0,0 +1,21 @@
+#pragma once
+#include <functional>
+#include <string>
+
+class Dict;
+struct HashEntry;
+
+// Writes the smallest AOF that rebuilds dict: one command per string, batched
+// variadic pushes for collections, and a PEXPIREAT for each volatile key.
+// Already-expired keys are skipped. Returns false on a write error.
+bool aof_rewrite_dataset(Dict* dict, int fd);
+
+// The commands aof_rewrite_dataset writes for one entry, passed to emit.
+void aof_entry_commands(HashEntry* e,
+                        const std::function<void(const std::string&)>& emit);
+
+// Strings that survive the space-separated text protocol can be logged as
+// is; anything else (bitmaps, HLLs) is logged hex-encoded via SETHEX.
+bool aof_token_safe(const char* s, uint32_t len);
+std::string hex_encode(const char* s, uint32_t len);
+bool hex_decode(const std::string& hex, std::string& out);
@@ -0,0 +1,167 @@
+#include "Bitops.h"
+#include "Helper.h"
+#include <algorithm>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BITOPS_X86 1
+#endif
+
+using namespace std;
+
+// BITOP walks the destination in blocks this size, applying every source to
+// a block while it is still in L2.
+#define BITOP_BLOCK (64 * 1024)
+
+static uint64_t count_words(const uint8_t* p, size_t n){
+    uint64_t total = 0;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t w;
+        memcpy(&w, p + i, 8);
+        total += __builtin_popcountll(w);
+    }
+    for (; i < n; i++) total += __builtin_popcount(p[i]);
+    return total;
+}
+
+#ifdef BITOPS_X86
+// Same loop, compiled so __builtin_popcountll becomes one POPCNT.
+__attribute__((target("popcnt")))
+static uint64_t count_words_popcnt(const uint8_t* p, size_t n){
+    uint64_t total = 0;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t w;
+        memcpy(&w, p + i, 8);
+        total += __builtin_popcountll(w);
+    }
+    for (; i < n; i++) total += __builtin_popcount(p[i]);
+    return total;
+}
+
+// Mula's nibble lookup: pshufb maps each nibble to its bit count, byte
+// counts are summed for up to 8 rounds (max 64 < 256) and then folded into
+// 64-bit lanes with SAD.
+__attribute__((target("avx2")))
+static uint64_t count_avx2(const uint8_t* p, size_t n){
+    const __m256i lookup = _mm256_setr_epi8(
+        0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+        0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low = _mm256_set1_epi8(0x0f);
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i acc = zero;
+
+    size_t i = 0;
+    while (i + 32 <= n) {
+        __m256i local = zero;
+        for (int k = 0; k < 8 && i + 32 <= n; k++, i += 32) {
+            __m256i v = _mm256_loadu_si256((const __m256i*)(p + i));
+            __m256i lo = _mm256_and_si256(v, low);
+            __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low);
+            local = _mm256_add_epi8(local, _mm256_add_epi8(_mm256_shuffle_epi8(lookup, lo),
+                                                           _mm256_shuffle_epi8(lookup, hi)));
+        }
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(local, zero));
+    }
+
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i*)lanes, acc);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + count_words_popcnt(p + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void apply_avx2(BitOp op, uint8_t* dst, const uint8_t* src, size_t n){
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i d = _mm256_loadu_si256((const __m256i*)(dst + i));
+        __m256i s = _mm256_loadu_si256((const __m256i*)(src + i));
+        if (op == BITOP_AND) d = _mm256_and_si256(d, s);
+        else if (op == BITOP_OR) d = _mm256_or_si256(d, s);
+        else d = _mm256_xor_si256(d, s);
+        _mm256_storeu_si256((__m256i*)(dst + i), d);
+    }
+    for (; i < n; i++) {
+        if (op == BITOP_AND) dst[i] &= src[i];
+        else if (op == BITOP_OR) dst[i] |= src[i];
+        else dst[i] ^= src[i];
+    }
+}
+#endif
+
+uint64_t bit_count(const uint8_t* p, size_t n){
+#ifdef BITOPS_X86
+    if (n >= 256 && cpu_has_avx2()) return count_avx2(p, n);
+    if (cpu_has_popcnt()) return count_words_popcnt(p, n);
+#endif
+    return count_words(p, n);
+}
+
+// dst[0..n) op= src[0..n), eight bytes at a time when there is no AVX2.
+static void apply(BitOp op, uint8_t* dst, const uint8_t* src, size_t n){
+#ifdef BITOPS_X86
+    if (cpu_has_avx2()) {
+        apply_avx2(op, dst, src, n);
+        return;
+    }
+#endif
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t d, s;
+        memcpy(&d, dst + i, 8);
+        memcpy(&s, src + i, 8);
+        if (op == BITOP_AND) d &= s;
+        else if (op == BITOP_OR) d |= s;
+        else d ^= s;
+        memcpy(dst + i, &d, 8);
+    }
+    for (; i < n; i++) {
+        if (op == BITOP_AND) dst[i] &= src[i];
+        else if (op == BITOP_OR) dst[i] |= src[i];
+        else dst[i] ^= src[i];
+    }
+}
+
+void bit_op(BitOp op, uint8_t* dst, size_t n,
+            const vector<const uint8_t*>& srcs, const vector<size_t>& lens){
+    for (size_t block = 0; block < n; block += BITOP_BLOCK) {
+        size_t bn = min((size_t)BITOP_BLOCK, n - block);
+
+        // Seed the block from the first source (zero padded).
+        size_t have = lens[0] > block ? min(bn, lens[0] - block) : 0;
+        memcpy(dst + block, srcs[0] + block, have);
+        memset(dst + block + have, 0, bn - have);
+
+        if (op == BITOP_NOT) {
+            for (size_t i = 0; i < bn; i++) dst[block + i] = ~dst[block + i];
+            continue;
+        }
+
+        for (size_t s = 1; s < srcs.size(); s++) {
+            have = lens[s] > block ? min(bn, lens[s] - block) : 0;
+            apply(op, dst + block, srcs[s] + block, have);
+            // Past the end of a source its bytes are 0: AND clears the
+            // rest of the block, OR/XOR leave it alone.
+            if (op == BITOP_AND) memset(dst + block + have, 0, bn - have);
+        }
+    }
+}
+
+int64_t bit_pos(const uint8_t* p, size_t n, int bit){
+    uint8_t skip = bit ? 0x00 : 0xFF;
+    uint64_t skip_word = bit ? 0 : UINT64_MAX;
+
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t w;
+        memcpy(&w, p + i, 8);
+        if (w != skip_word) break;
+    }
+    for (; i < n; i++) {
+        if (p[i] == skip) continue;
+        uint8_t b = bit ? p[i] : (uint8_t)~p[i];
+        return (int64_t)i * 8 + __builtin_clz((unsigned)b << 24);
+    }
+    return -1;
+}
@@ -0,0 +1,22 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Bit-level kernels over string values. Bit 0 is the most significant bit
+// of byte 0, as in Redis.
+
+enum BitOp { BITOP_AND, BITOP_OR, BITOP_XOR, BITOP_NOT };
+
+// Number of set bits in p[0..n). AVX2 nibble-lookup kernel on large inputs,
+// hardware POPCNT otherwise, picked at runtime.
+uint64_t bit_count(const uint8_t* p, size_t n);
+
+// dst (n bytes, the longest source) = op over every source; shorter sources
+// count as zero-padded. NOT takes exactly one source.
+void bit_op(BitOp op, uint8_t* dst, size_t n,
+            const std::vector<const uint8_t*>& srcs,
+            const std::vector<size_t>& lens);
+
+// Position of the first bit equal to bit in p[0..n), or -1.
+int64_t bit_pos(const uint8_t* p, size_t n, int bit);
@@ -0,0 +1,229 @@
+#include "Cluster.h"
+#include <cstdio>
+#include <fcntl.h>
+#include <fstream>
+#include <sstream>
+#include <sys/file.h>
+#include <unistd.h>
+
+using namespace std;
+
+static uint16_t crc16_table[256];
+
+static bool init_crc16(){
+    for (int i = 0; i < 256; i++) {
+        uint16_t c = i << 8;
+        for (int k = 0; k < 8; k++) c = c & 0x8000 ? (c << 1) ^ 0x1021 : c << 1;
+        crc16_table[i] = c;
+    }
+    return true;
+}
+
+static uint16_t crc16(const char* p, size_t n){
+    static bool ready = init_crc16();
+    (void)ready;
+    uint16_t crc = 0;
+    for (size_t i = 0; i < n; i++)
+        crc = (crc << 8) ^ crc16_table[((crc >> 8) ^ (uint8_t)p[i]) & 0xff];
+    return crc;
+}
+
+uint16_t key_hash_slot(const char* key, size_t len){
+    size_t open = 0;
+    while (open < len && key[open] != '{') open++;
+    if (open < len) {
+        size_t close = open + 1;
+        while (close < len && key[close] != '}') close++;
+        if (close < len && close > open + 1)
+            return crc16(key + open + 1, close - open - 1) & (CLUSTER_SLOTS - 1);
+    }
+    return crc16(key, len) & (CLUSTER_SLOTS - 1);
+}
+
+Cluster::Cluster() : owner(CLUSTER_SLOTS, -1), importing(CLUSTER_SLOTS, false), self(-1) {}
+
+static bool parse_range(const string& tok, uint16_t& lo, uint16_t& hi){
+    size_t dash = tok.find('-');
+    try {
+        size_t used;
+        unsigned long a = stoul(tok.substr(0, dash), &used);
+        if (used != (dash == string::npos ? tok.size() : dash)) return false;
+        unsigned long b = a;
+        if (dash != string::npos) {
+            b = stoul(tok.substr(dash + 1), &used);
+            if (used != tok.size() - dash - 1) return false;
+        }
+        if (a > b || b >= CLUSTER_SLOTS) return false;
+        lo = a;
+        hi = b;
+        return true;
+    } catch (...) {
+        return false;
+    }
+}
+
+// Reads the nodes and slot owners of the config file at path.
+static bool parse_config(const string& path, vector<ClusterNode>& parsed,
+                         vector<int16_t>& own, string& err){
+    ifstream in(path);
+    if (!in) {
+        err = "cannot open " + path;
+        return false;
+    }
+
+    parsed.clear();
+    own.assign(CLUSTER_SLOTS, -1);
+    string line;
+    for (int lineno = 1; getline(in, line); lineno++) {
+        size_t hash = line.find('#');
+        if (hash != string::npos) line.erase(hash);
+        istringstream iss(line);
+        ClusterNode n;
+        unsigned long p;
+        if (!(iss >> n.host)) continue;
+        if (!(iss >> p) || p == 0 || p > 65535) {
+            err = path + ":" + to_string(lineno) + ": bad port";
+            return false;
+        }
+        n.port = p;
+
+        int idx = parsed.size();
+        string tok;
+        while (iss >> tok) {
+            uint16_t lo, hi;
+            if (!parse_range(tok, lo, hi)) {
+                err = path + ":" + to_string(lineno) + ": bad slot range " + tok;
+                return false;
+            }
+            for (uint32_t s = lo; s <= hi; s++) {
+                if (own[s] >= 0) {
+                    err = path + ":" + to_string(lineno) + ": slot " +
+                          to_string(s) + " is assigned twice";
+                    return false;
+                }
+                own[s] = idx;
+            }
+            n.ranges.push_back({lo, hi});
+        }
+        parsed.push_back(n);
+    }
+    return true;
+}
+
+bool Cluster::load(const string& path, const string& host, uint16_t port, string& err){
+    vector<ClusterNode> parsed;
+    vector<int16_t> own;
+    if (!parse_config(path, parsed, own, err)) return false;
+
+    int me = -1;
+    for (size_t i = 0; i < parsed.size(); i++) {
+        if (parsed[i].port != port || (!host.empty() && parsed[i].host != host))
+            continue;
+        if (me >= 0) {
+            err = host.empty()
+                      ? "more than one node listens on port " + to_string(port) +
+                            "; set --cluster-announce-host"
+                      : host + ":" + to_string(port) + " is listed twice";
+            return false;
+        }
+        me = i;
+    }
+    if (me < 0) {
+        err = "no node in " + path + " is " +
+              (host.empty() ? "on port " + to_string(port)
+                            : host + ":" + to_string(port));
+        return false;
+    }
+
+    nodes.swap(parsed);
+    owner.swap(own);
+    self = me;
+    config_path = path;
+    return true;
+}
+
+string Cluster::address(int i) const{
+    return nodes[i].host + ":" + to_string(nodes[i].port);
+}
+
+int Cluster::find_node(const string& host, uint16_t port) const{
+    for (size_t i = 0; i < nodes.size(); i++) {
+        if (nodes[i].host == host && nodes[i].port == port) return i;
+    }
+    return -1;
+}
+
+static void build_ranges(vector<ClusterNode>& nodes, const vector<int16_t>& own){
+    for (auto& n : nodes) n.ranges.clear();
+    for (uint32_t s = 0; s < CLUSTER_SLOTS; s++) {
+        int o = own[s];
+        if (o < 0) continue;
+        auto& r = nodes[o].ranges;
+        if (!r.empty() && r.back().second + 1u == s) r.back().second = s;
+        else r.push_back({(uint16_t)s, (uint16_t)s});
+    }
+}
+
+void Cluster::rebuild_ranges(){
+    build_ranges(nodes, owner);
+}
+
+bool Cluster::set_owner(uint16_t slot, int node){
+    owner[slot] = node;
+    importing[slot] = false;
+
+    // All nodes rewrite this one file, each for its own migrations, and our
+    // map of the other slots may be behind. So the rewrite starts from the
+    // file as it is now and changes only this slot, under a lock that keeps
+    // two nodes from interleaving their read and rename.
+    int lock = ::open((config_path + ".lock").c_str(), O_CREAT | O_RDWR | O_CLOEXEC, 0644);
+    if (lock >= 0) flock(lock, LOCK_EX);
+    bool ok = rewrite_config(slot, node);
+    if (lock >= 0) ::close(lock);
+
+    rebuild_ranges();
+    return ok;
+}
+
+bool Cluster::rewrite_config(uint16_t slot, int node){
+    vector<ClusterNode> disk;
+    vector<int16_t> own;
+    string err;
+    if (!parse_config(config_path, disk, own, err)) return false;
+
+    // Our index of each node in the file.
+    vector<int> ours(disk.size());
+    int target = -1;
+    for (size_t i = 0; i < disk.size(); i++) {
+        ours[i] = find_node(disk[i].host, disk[i].port);
+        if (ours[i] == node) target = i;
+    }
+    if (target < 0) return false;
+    own[slot] = target;
+
+    // Take in the handoffs other nodes wrote since we last looked.
+    for (uint32_t s = 0; s < CLUSTER_SLOTS; s++) {
+        if (own[s] >= 0 && ours[own[s]] >= 0) owner[s] = ours[own[s]];
+    }
+
+    build_ranges(disk, own);
+    string tmp = config_path + ".tmp";
+    ofstream out(tmp, ios::trunc);
+    out << "# host port slot ranges\n";
+    for (auto& n : disk) {
+        out << n.host << " " << n.port;
+        for (auto& r : n.ranges) {
+            out << " " << r.first;
+            if (r.second != r.first) out << "-" << r.second;
+        }
+        out << "\n";
+    }
+    out.close();
+    return out && rename(tmp.c_str(), config_path.c_str()) == 0;
+}
+
+uint32_t Cluster::slots_owned() const{
+    uint32_t n = 0;
+    for (int16_t o : owner) n += o == self;
+    return n;
+}
@@ -0,0 +1,95 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Hash-slot sharding. Every key maps to one of CLUSTER_SLOTS slots:
+// CRC16 (XMODEM) of the key, or of the part between the first '{' and the
+// next '}' when that part is non-empty, so "{user1}.name" and
+// "{user1}.mail" land together.
+//
+// Slot ownership comes from a static config file shared by all nodes, one
+// node per line:
+//
+//   # host port slot ranges
+//   127.0.0.1 7001 0-5460
+//   127.0.0.1 7002 5461-10922
+//   127.0.0.1 7003 10923-16383
+//
+// A node finds itself by host and listening port, or by the port alone
+// when it is not told its host; that needs every port in the file to be
+// unique, as when all nodes run on one machine. Ownership changes made by
+// slot migration are written back to the file.
+
+#define CLUSTER_SLOTS 16384
+
+uint16_t key_hash_slot(const char* key, size_t len);
+
+struct ClusterNode {
+    std::string host;
+    uint16_t port;
+    std::vector<std::pair<uint16_t, uint16_t>> ranges;  // inclusive
+};
+
+class Cluster {
+private:
+    std::vector<ClusterNode> nodes;
+    std::vector<int16_t> owner;  // node index per slot, -1 when unassigned
+    std::vector<bool> importing; // slots being migrated to this node
+    int self;
+    std::string config_path;
+
+    void rebuild_ranges();
+    bool rewrite_config(uint16_t slot, int node);
+
+public:
+    Cluster();
+
+    // Parses path and picks the node at host:port, or the only one on port
+    // when host is empty. On failure err says why and the cluster stays
+    // disabled.
+    bool load(const std::string& path, const std::string& host, uint16_t port,
+              std::string& err);
+
+    bool enabled() const{
+        return self >= 0;
+    }
+
+    int slot_owner(uint16_t slot) const{
+        return owner[slot];
+    }
+
+    bool owns(uint16_t slot) const{
+        return owner[slot] == self;
+    }
+
+    const std::vector<ClusterNode>& all_nodes() const{
+        return nodes;
+    }
+
+    int self_index() const{
+        return self;
+    }
+
+    // "host:port" of node i, as used in redirects.
+    std::string address(int i) const;
+
+    // Index of the node at host:port, or -1.
+    int find_node(const std::string& host, uint16_t port) const;
+
+    uint32_t slots_owned() const;
+
+    // Hands slot to node and records that in the config file: reread under
+    // a lock, with only this slot changed, then temp file + rename. Other
+    // slots' owners are refreshed from the file on the way.
+    bool set_owner(uint16_t slot, int node);
+
+    bool is_importing(uint16_t slot) const{
+        return importing[slot];
+    }
+
+    void set_importing(uint16_t slot, bool on){
+        importing[slot] = on;
+    }
+};
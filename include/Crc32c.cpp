@@ -0,0 +1,73 @@
+#include "Crc32c.h"
+#include "Helper.h"
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CRC_X86 1
+#endif
+
+#define CRC32C_POLY 0x82F63B78u
+
+static uint32_t table[8][256];
+
+static bool init_table(){
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+        table[0][i] = c;
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+        for (int t = 1; t < 8; t++)
+            table[t][i] = (table[t - 1][i] >> 8) ^ table[0][table[t - 1][i] & 0xff];
+    }
+    return true;
+}
+
+static uint32_t crc_sw(const uint8_t* p, size_t n, uint32_t c){
+    static const bool ready = init_table();
+    (void)ready;
+
+    for (; n >= 8; n -= 8, p += 8) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        w ^= c;
+        c = table[7][w & 0xff] ^ table[6][(w >> 8) & 0xff] ^
+            table[5][(w >> 16) & 0xff] ^ table[4][(w >> 24) & 0xff] ^
+            table[3][(w >> 32) & 0xff] ^ table[2][(w >> 40) & 0xff] ^
+            table[1][(w >> 48) & 0xff] ^ table[0][w >> 56];
+    }
+    while (n--) c = (c >> 8) ^ table[0][(c ^ *p++) & 0xff];
+    return c;
+}
+
+#ifdef CRC_X86
+__attribute__((target("sse4.2")))
+static uint32_t crc_hw(const uint8_t* p, size_t n, uint32_t c){
+#if defined(__x86_64__)
+    uint64_t c64 = c;
+    for (; n >= 8; n -= 8, p += 8) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        c64 = _mm_crc32_u64(c64, w);
+    }
+    c = (uint32_t)c64;
+#endif
+    for (; n >= 4; n -= 4, p += 4) {
+        uint32_t w;
+        memcpy(&w, p, 4);
+        c = _mm_crc32_u32(c, w);
+    }
+    while (n--) c = _mm_crc32_u8(c, *p++);
+    return c;
+}
+#endif
+
+uint32_t crc32c(const void* buf, size_t n, uint32_t crc){
+    const uint8_t* p = (const uint8_t*)buf;
+    uint32_t c = ~crc;
+#ifdef CRC_X86
+    if (cpu_has_sse42()) return ~crc_hw(p, n, c);
+#endif
+    return ~crc_sw(p, n, c);
+}
@@ -0,0 +1,8 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+// CRC-32C (Castagnoli). Uses the SSE4.2 crc32 instruction when the CPU has
+// it, otherwise a slicing-by-8 table. Pass the previous result as crc to
+// checksum a buffer in pieces.
+uint32_t crc32c(const void* buf, size_t n, uint32_t crc = 0);
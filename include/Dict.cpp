@@ -3,6 +3,11 @@
 #include "Dict.h"
 #include "hashmap.h"
 #include "Helper.h"
+#include "Latency.h"
+#include <algorithm>
+#include <cstring>
+#include <random>
+#include <unordered_set>
 #include <sys/types.h>
 
 
@@ -11,12 +16,17 @@ Dict::Dict(uint32_t init_buckets){
     ht[1] = nullptr;
     heap = new Heap();
     rehash_idx = -1;
+    slots = nullptr;
+    on_expire = nullptr;
+    on_latency = nullptr;
 }
 
 void Dict::start_rehashing(){
     if (rehash_idx != -1) return;
-    ht[1] = new HashTable(ht[0]->get_bucket_count()*2);
+    uint64_t start = ticks_now();
+    ht[1] = new HashTable(ht[0]->get_bucket_count()*2, slots);
     rehash_idx = 0;
+    if (on_latency) on_latency("rehash", ticks_now() - start);
 }
 
 
@@ -29,6 +39,7 @@ HashEntry* Dict::find_from(const char* key, uint32_t key_len){
 
     if(found && found->expires_at != 0 && found->expires_at <= now_ns()) {
         erase_from(key, key_len);
+        if (on_expire) on_expire(key, key_len);
         return nullptr;
     }
 
@@ -36,6 +47,57 @@ HashEntry* Dict::find_from(const char* key, uint32_t key_len){
 }
 
 
+void Dict::prefetch(const char* key, uint32_t key_len, bool deep){
+    // New keys land in ht[1] while rehashing.
+    ht[rehash_idx != -1 ? 1 : 0]->prefetch(key, key_len, deep);
+}
+
+void Dict::prefetch_hashed(const vector<uint64_t>& hashes){
+    for (int stage = 0; stage < 4; stage++) {
+        for (uint64_t h : hashes) {
+            ht[0]->prefetch_stage(h, stage);
+            if (ht[1]) ht[1]->prefetch_stage(h, stage);
+        }
+    }
+}
+
+void Dict::prefetch_many(const vector<string>& keys){
+    vector<uint64_t> hashes(keys.size());
+    for (size_t i = 0; i < keys.size(); i++)
+        hashes[i] = hash_bytes(keys[i].data(), keys[i].size());
+    prefetch_hashed(hashes);
+}
+
+void Dict::prefetch_many(const vector<const char*>& keys){
+    vector<uint64_t> hashes(keys.size());
+    for (size_t i = 0; i < keys.size(); i++)
+        hashes[i] = hash_bytes(keys[i], strlen(keys[i]));
+    prefetch_hashed(hashes);
+}
+
+void Dict::find_many(const vector<string>& keys, vector<HashEntry*>& out){
+    vector<uint64_t> hashes(keys.size());
+    for (size_t i = 0; i < keys.size(); i++)
+        hashes[i] = hash_bytes(keys[i].data(), keys[i].size());
+    prefetch_hashed(hashes);
+
+    // One clock for the batch, so a key repeated in it cannot expire
+    // between two of its lookups.
+    uint64_t now = now_ns();
+    out.assign(keys.size(), nullptr);
+    for (size_t i = 0; i < keys.size(); i++) {
+        const string& k = keys[i];
+        HashEntry* e = ht[0]->find_hashed(k.data(), k.size(), hashes[i]);
+        if (!e && ht[1]) e = ht[1]->find_hashed(k.data(), k.size(), hashes[i]);
+        if (e && e->expires_at != 0 && e->expires_at <= now) {
+            erase_from(k.data(), k.size());
+            if (on_expire) on_expire(k.data(), k.size());
+            e = nullptr;
+        }
+        out[i] = e;
+    }
+}
+
 bool Dict::insert_into(const char* key, uint32_t key_len, const char* val, uint32_t val_len, uint64_t expiry) {
 
     Robj* key_obj = create_obj(key, key_len, RobjType::OBJ_STRING);
@@ -63,8 +125,15 @@ bool Dict::insert_into(const char* key, uint32_t key_len, const char* val, uint3
 }
 
 bool Dict::insert_into(const char* key, uint32_t key_len, uint64_t expiry){
-    Robj* key_obj = create_obj(key, key_len, RobjType::OBJ_STRING);
     Robj* val_obj = create_zset_obj();
+    bool success = insert_obj(key, key_len, val_obj, expiry);
+    decr_refcount(val_obj);
+    return success;
+}
+
+// The table takes its own reference to val; the caller keeps theirs.
+bool Dict::insert_obj(const char* key, uint32_t key_len, Robj* val_obj, uint64_t expiry){
+    Robj* key_obj = create_obj(key, key_len, RobjType::OBJ_STRING);
 
     if (rehash_idx != -1) rehash();
  
@@ -81,7 +150,6 @@ bool Dict::insert_into(const char* key, uint32_t key_len, uint64_t expiry){
     }
 
     decr_refcount(key_obj);
-    decr_refcount(val_obj);
     
     if (should_start_rehashing()) start_rehashing();
     return success;
@@ -130,6 +198,18 @@ int Dict::count_keys() {
     return keys.size();
 }
 
+uint64_t Dict::size() {
+    return ht[0]->count() + (ht[1] ? ht[1]->count() : 0);
+}
+
+void Dict::reserve(uint64_t n) {
+    if (size() != 0 || rehash_idx != -1 || n < ht[0]->get_bucket_count()) return;
+    uint64_t buckets = ht[0]->get_bucket_count();
+    while (buckets <= n) buckets *= 2;
+    delete ht[0];
+    ht[0] = new HashTable(buckets, slots);
+}
+
 void Dict::rehash() {
     if (rehash_idx == -1) return;
     int steps = 10;
@@ -152,10 +232,12 @@ void Dict::rehash() {
     }
 
     if ((uint32_t)rehash_idx == ht[0]->get_bucket_count()) {
+        uint64_t start = ticks_now();
         delete ht[0];
         ht[0] = ht[1];
         ht[1] = nullptr;
         rehash_idx = -1;
+        if (on_latency) on_latency("rehash", ticks_now() - start);
     }
 }
 
@@ -163,6 +245,11 @@ bool Dict::should_start_rehashing(){
     return ht[0]->count() >= ht[0]->get_bucket_count();
 }
 
+double Dict::rehash_progress(){
+    if (rehash_idx == -1) return -1;
+    return (double)rehash_idx / ht[0]->get_bucket_count();
+}
+
 void Dict::get_all_keys(vector<string>& out) {
     if (rehash_idx != -1) {
         for (size_t i = rehash_idx; i < ht[0]->get_bucket_count(); i++) {
@@ -193,6 +280,17 @@ void Dict::get_all_keys(vector<string>& out) {
     }
 }
 
+void Dict::for_each(const function<void(HashEntry*)>& fn) {
+    for (int t = 0; t < 2; t++) {
+        if (!ht[t]) continue;
+        // Buckets below rehash_idx have already moved to ht[1].
+        size_t start = (t == 0 && rehash_idx != -1) ? rehash_idx : 0;
+        for (size_t i = start; i < ht[t]->get_bucket_count(); i++) {
+            for (HashEntry* e = ht[t]->bucket_at_idx(i); e; e = e->next) fn(e);
+        }
+    }
+}
+
 int Dict::active_expire() {
     int n_expired = 0;
     uint64_t now = now_ns();
@@ -211,6 +309,7 @@ int Dict::active_expire() {
         if (e) {
             if (e->expires_at != 0 && e->expires_at <= now) {
                 erase_from((const char*)item->key->ptr, item->key->len);
+                if (on_expire) on_expire((const char*)item->key->ptr, item->key->len);
                 n_expired++;
             }
         }
@@ -223,9 +322,81 @@ int Dict::active_expire() {
 }
 
 
+void Dict::enable_slot_index() {
+    if (slots || size() != 0 || rehash_idx != -1) return;
+    slots = new SlotIndex();
+    uint32_t buckets = ht[0]->get_bucket_count();
+    delete ht[0];
+    ht[0] = new HashTable(buckets, slots);
+}
+
+uint32_t Dict::count_keys_in_slot(uint16_t slot) {
+    return slots ? slots->count(slot) : 0;
+}
+
+void Dict::keys_in_slot(uint16_t slot, size_t max, vector<string>& out) {
+    if (!slots) return;
+    for (HashEntry* e = slots->first(slot); e && max; e = e->slot_next, max--)
+        out.emplace_back((const char*)e->key->ptr, e->key->len);
+}
+
 Dict::~Dict(){
     delete ht[0];
     delete ht[1];
     delete heap;
+    delete slots;
 }
 
+void Dict::sample(size_t count, vector<HashEntry*>& out) {
+    uint64_t total = size();
+    if (count == 0 || total == 0) return;
+    if (count >= total) {
+        for_each([&](HashEntry* e) { out.push_back(e); });
+        return;
+    }
+
+    // Buckets are drawn without replacement, uniformly over both tables,
+    // and all of a drawn bucket's chain is taken, so every entry has the
+    // same chance of being reached whatever its table or chain position.
+    // The overshoot of the last chain is then dropped at random rather
+    // than from its tail. A sparse table may need many draws, and gives up
+    // after 16 per requested entry.
+    static mt19937_64 rng(now_ns());
+    uint64_t b0 = ht[0]->get_bucket_count();
+    uint64_t buckets = b0 + (ht[1] ? ht[1]->get_bucket_count() : 0);
+    size_t first = out.size();
+    size_t want = first + count;
+    unordered_set<uint64_t> seen;
+    for (size_t tries = 0; out.size() < want && tries < count * 16; tries++) {
+        uint64_t b = rng() % buckets;
+        if (!seen.insert(b).second) continue;
+        HashEntry* e = b < b0 ? ht[0]->bucket_at_idx(b) : ht[1]->bucket_at_idx(b - b0);
+        for (; e; e = e->next) out.push_back(e);
+    }
+    if (out.size() > want) {
+        shuffle(out.begin() + first, out.end(), rng);
+        out.resize(want);
+    }
+}
+
+size_t Dict::table_bytes() {
+    size_t bytes = alloc_size(this) + alloc_size(slots);
+    for (int t = 0; t < 2; t++)
+        if (ht[t]) bytes += ht[t]->bucket_bytes();
+    return bytes;
+}
+
+size_t Dict::expiry_bytes() {
+    return heap->memory_usage();
+}
+
+size_t Dict::expiry_item_bytes() {
+    return heap->item_bytes();
+}
+
+size_t Dict::memory_usage(size_t samples) {
+    size_t bytes = alloc_size(this) + alloc_size(slots) + expiry_bytes();
+    for (int t = 0; t < 2; t++)
+        if (ht[t]) bytes += ht[t]->memory_usage(samples);
+    return bytes;
+}
@@ -1,9 +1,11 @@
 #pragma once
+#include <functional>
 #include <vector>
 #include <string>
 #include "Robj.h"
 #include "hashmap.h"
 #include "Heap.h"
+#include "SlotIndex.h"
 using namespace std;
 
 class Dict{
@@ -11,7 +13,11 @@ class Dict{
         HashTable* ht[2];
         Heap* heap;
         int rehash_idx;
+        SlotIndex* slots;
+        void (*on_expire)(const char* key, uint32_t key_len);
+        void (*on_latency)(const char* event, uint64_t ticks);
 
+        void prefetch_hashed(const vector<uint64_t>& hashes);
 
     public:
         Dict(uint32_t init_buckets);
@@ -19,14 +25,68 @@ class Dict{
         void start_rehashing();
         void rehash();
         void get_all_keys(vector<string>& out);
+        // Visits every entry in both tables; fn must not insert or erase.
+        void for_each(const function<void(HashEntry*)>& fn);
         bool insert_into(const char* key, uint32_t key_len, const char* val, uint32_t val_len, uint64_t expiry=0);
         bool insert_into(const char* key, uint32_t key_len, uint64_t expiry=0);
+        bool insert_obj(const char* key, uint32_t key_len, Robj* val, uint64_t expiry=0);
         bool erase_from(const char* key, uint32_t key_len);
         HashEntry* find_from(const char* key, uint32_t key_len);
+        // Cache warm-up for an upcoming access to key; see HashTable::prefetch.
+        void prefetch(const char* key, uint32_t key_len, bool deep);
+        // Looks up a batch of keys: hashes them all, runs every key through
+        // each prefetch stage before the next, then probes, so the cache
+        // misses of different keys overlap. out[i] is find_from(keys[i]).
+        void find_many(const vector<string>& keys, vector<HashEntry*>& out);
+        // The prefetch half of find_many, ahead of inserting or erasing keys.
+        void prefetch_many(const vector<string>& keys);
+        void prefetch_many(const vector<const char*>& keys);
         bool should_start_rehashing();
+        // Share of the old table's buckets moved so far, or -1 when no
+        // rehash is under way.
+        double rehash_progress();
         void set_expiry(const char* key, uint32_t key_len, uint64_t expiry_at_ns);
         int active_expire();  
         int count_keys();
+        // Entries in both tables, expired ones included.
+        uint64_t size();
+        // Presizes an empty dict for n keys so loading it never rehashes.
+        void reserve(uint64_t n);
         uint64_t get_next_expiry();
+        // Appends up to count entries from random buckets, for estimates
+        // over a keyspace too large to walk. Expired entries may be among
+        // them; with count >= size() every entry is appended.
+        void sample(size_t count, vector<HashEntry*>& out);
+        // Allocated bytes of the tables, bucket arrays and slot index,
+        // without the entries.
+        size_t table_bytes();
+        // Allocated bytes of the expiry heap, and what one key with a TTL
+        // adds to it.
+        size_t expiry_bytes();
+        size_t expiry_item_bytes();
+        // All of the above plus the entries, measured as in
+        // HashTable::memory_usage; for dicts holding string values.
+        size_t memory_usage(size_t samples);
+        // Called with each key dropped because it expired, whether found
+        // expired on access or reclaimed by active_expire.
+        void set_expire_hook(void (*fn)(const char* key, uint32_t key_len)){
+            on_expire = fn;
+        }
+
+        // Called with the duration in ticks (Latency.h) of the rehash steps
+        // that can stall: allocating the new table and freeing the old.
+        void set_latency_hook(void (*fn)(const char* event, uint64_t ticks)){
+            on_latency = fn;
+        }
+
+        // Cluster mode: index keys by hash slot. Only on an empty dict.
+        void enable_slot_index();
+        bool has_slot_index(){
+            return slots != nullptr;
+        }
+        // Keys of slot, expired ones not yet reclaimed included.
+        uint32_t count_keys_in_slot(uint16_t slot);
+        // Appends up to max keys of slot.
+        void keys_in_slot(uint16_t slot, size_t max, vector<string>& out);
 };
 
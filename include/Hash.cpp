@@ -0,0 +1,183 @@
+#include "Hash.h"
+#include "Helper.h"
+#include "OpenTable.h"
+#include <cstdlib>
+#include <cstring>
+
+using namespace std;
+
+static uint32_t read_u32(const char* p){
+    uint32_t n;
+    memcpy(&n, p, 4);
+    return n;
+}
+
+static uint64_t rev64(uint64_t v){
+    v = ((v >> 1) & 0x5555555555555555ULL) | ((v & 0x5555555555555555ULL) << 1);
+    v = ((v >> 2) & 0x3333333333333333ULL) | ((v & 0x3333333333333333ULL) << 2);
+    v = ((v >> 4) & 0x0F0F0F0F0F0F0F0FULL) | ((v & 0x0F0F0F0F0F0F0F0FULL) << 4);
+    return __builtin_bswap64(v);
+}
+
+Hash::Hash(){
+    enc = HASH_PACKED;
+    buf = nullptr;
+    buf_len = 0;
+    n_entries = 0;
+    table = nullptr;
+}
+
+Hash::~Hash(){
+    free(buf);
+    delete table;
+}
+
+int64_t Hash::packed_find(const char* field, uint32_t flen){
+    uint32_t off = 0;
+    while (off < buf_len) {
+        uint32_t fl = read_u32(buf + off);
+        uint32_t vl = read_u32(buf + off + 4 + fl);
+        if (fl == flen && memcmp(buf + off + 4, field, flen) == 0) return off;
+        off += 8 + fl + vl;
+    }
+    return -1;
+}
+
+void Hash::convert_to_table(){
+    table = new OpenTable(n_entries * 2);
+
+    uint32_t off = 0;
+    while (off < buf_len) {
+        uint32_t fl = read_u32(buf + off);
+        uint32_t vl = read_u32(buf + off + 4 + fl);
+        table->set(buf + off + 4, fl, buf + off + 8 + fl, vl);
+        off += 8 + fl + vl;
+    }
+
+    free(buf);
+    buf = nullptr;
+    buf_len = 0;
+    enc = HASH_TABLE;
+}
+
+bool Hash::hset(const char* field, uint32_t flen, const char* val, uint32_t vlen){
+    if (enc == HASH_PACKED) {
+        int64_t at = packed_find(field, flen);
+        bool grows = at < 0 && n_entries + 1 > HASH_MAX_PACKED_ENTRIES;
+        if (grows || flen > HASH_MAX_PACKED_VALUE || vlen > HASH_MAX_PACKED_VALUE) {
+            convert_to_table();
+        }
+    }
+
+    if (enc == HASH_TABLE) {
+        return table->set(field, flen, val, vlen);
+    }
+
+    int64_t at = packed_find(field, flen);
+    if (at >= 0) {
+        // Splice the new value in place of the old one.
+        uint32_t voff = at + 4 + flen;
+        uint32_t old_vlen = read_u32(buf + voff);
+        uint32_t tail = buf_len - (voff + 4 + old_vlen);
+
+        if (vlen > old_vlen) buf = (char*)realloc(buf, buf_len + vlen - old_vlen);
+        memmove(buf + voff + 4 + vlen, buf + voff + 4 + old_vlen, tail);
+        memcpy(buf + voff, &vlen, 4);
+        memcpy(buf + voff + 4, val, vlen);
+        buf_len = buf_len + vlen - old_vlen;
+        return false;
+    }
+
+    buf = (char*)realloc(buf, buf_len + 8 + flen + vlen);
+    char* p = buf + buf_len;
+    memcpy(p, &flen, 4);
+    memcpy(p + 4, field, flen);
+    memcpy(p + 4 + flen, &vlen, 4);
+    memcpy(p + 8 + flen, val, vlen);
+    buf_len += 8 + flen + vlen;
+    n_entries++;
+    return true;
+}
+
+bool Hash::hget(const char* field, uint32_t flen, const char** val, uint32_t* vlen){
+    if (enc == HASH_TABLE) return table->get(field, flen, val, vlen);
+
+    int64_t at = packed_find(field, flen);
+    if (at < 0) return false;
+    *vlen = read_u32(buf + at + 4 + flen);
+    *val = buf + at + 8 + flen;
+    return true;
+}
+
+bool Hash::hdel(const char* field, uint32_t flen){
+    if (enc == HASH_TABLE) return table->erase(field, flen);
+
+    int64_t at = packed_find(field, flen);
+    if (at < 0) return false;
+
+    uint32_t sz = 8 + flen + read_u32(buf + at + 4 + flen);
+    memmove(buf + at, buf + at + sz, buf_len - (at + sz));
+    buf_len -= sz;
+    n_entries--;
+    return true;
+}
+
+uint32_t Hash::hlen(){
+    return enc == HASH_TABLE ? table->size() : n_entries;
+}
+
+void Hash::hgetall(vector<string>& out){
+    hscan(0, UINT32_MAX, out);
+}
+
+uint64_t Hash::hscan(uint64_t cursor, uint32_t count, vector<string>& out){
+    if (enc == HASH_PACKED) {
+        uint32_t off = 0;
+        while (off < buf_len) {
+            uint32_t fl = read_u32(buf + off);
+            uint32_t vl = read_u32(buf + off + 4 + fl);
+            out.emplace_back(buf + off + 4, fl);
+            out.emplace_back(buf + off + 8 + fl, vl);
+            off += 8 + fl + vl;
+        }
+        return 0;
+    }
+
+    // The cursor is a home bucket counted in reverse-binary order, as in
+    // Redis' dictScan: the buckets visited at one capacity cover the same
+    // hash prefixes at any other, so growing, shrinking or compacting the
+    // table between calls never skips a field. Visit at most 10x count
+    // buckets so a sparse table still returns promptly.
+    uint64_t mask = table->capacity() - 1;
+    uint64_t v = cursor;
+    uint64_t visited = 0;
+    size_t found = 0;
+    vector<uint32_t> idx;
+    do {
+        idx.clear();
+        table->bucket_slots(v & mask, idx);
+        for (uint32_t i : idx) {
+            const char *f, *val;
+            uint32_t fl, vl;
+            table->slot_at(i, &f, &fl, &val, &vl);
+            out.emplace_back(f, fl);
+            out.emplace_back(val, vl);
+        }
+        found += idx.size();
+        visited++;
+
+        // Add one to the masked bits counting from their top bit; the high
+        // bits are set first so the carry runs out of them.
+        v |= ~mask;
+        v = rev64(v);
+        v++;
+        v = rev64(v);
+    } while (v != 0 && found < count && visited < (uint64_t)count * 10);
+    return v;
+}
+
+size_t Hash::memory_usage(size_t samples){
+    size_t bytes = alloc_size(this);
+    if (enc == HASH_PACKED) return bytes + alloc_size(buf);
+    return bytes + table->memory_usage(samples);
+}
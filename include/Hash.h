@@ -0,0 +1,55 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+class OpenTable;
+
+enum HashEncoding {
+    HASH_PACKED,  // flat [flen][field][vlen][value]... buffer, linear scan
+    HASH_TABLE    // OpenTable
+};
+
+// Small hashes stay packed until either limit is crossed; the conversion is
+// one way.
+#define HASH_MAX_PACKED_ENTRIES 128
+#define HASH_MAX_PACKED_VALUE   64
+
+class Hash {
+private:
+    HashEncoding enc;
+    char* buf;
+    uint32_t buf_len;
+    uint32_t n_entries;
+    OpenTable* table;
+
+    // Offset of the entry holding field in buf, or -1.
+    int64_t packed_find(const char* field, uint32_t flen);
+    void convert_to_table();
+
+public:
+    Hash();
+    ~Hash();
+
+    // Returns true when field was added rather than overwritten.
+    bool hset(const char* field, uint32_t flen, const char* val, uint32_t vlen);
+    bool hget(const char* field, uint32_t flen, const char** val, uint32_t* vlen);
+    bool hdel(const char* field, uint32_t flen);
+    uint32_t hlen();
+
+    // Appends field, value, field, value, ...
+    void hgetall(std::vector<std::string>& out);
+
+    // Returns roughly count field/value pairs starting at cursor plus the
+    // cursor to continue from (0 when done). Packed hashes are returned in
+    // one call. A field present for the whole scan is returned at least
+    // once, however the table is resized between calls; one may repeat.
+    uint64_t hscan(uint64_t cursor, uint32_t count, std::vector<std::string>& out);
+
+    HashEncoding encoding(){
+        return enc;
+    }
+
+    // Estimated allocated bytes; see OpenTable::memory_usage.
+    size_t memory_usage(size_t samples);
+};
@@ -1,5 +1,6 @@
 #include "Heap.h"
 #include "Robj.h"
+#include "Helper.h"
 #include <cstdlib>
 
 void Heap::swap_items(int i, int j) {
@@ -70,4 +71,14 @@ Heap::~Heap(){
         decr_refcount(item->key);
         free(item);
     }
-}
\ No newline at end of file
+}
+
+size_t Heap::item_bytes(){
+    // Every item is the same size.
+    return sizeof(HeapItem*) + (arr.empty() ? sizeof(HeapItem) : alloc_size(arr[0]));
+}
+
+size_t Heap::memory_usage(){
+    size_t item = arr.empty() ? 0 : alloc_size(arr[0]);
+    return alloc_size(this) + arr.capacity() * sizeof(HeapItem*) + arr.size() * item;
+}
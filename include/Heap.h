@@ -18,5 +18,9 @@ class Heap{
         bool push(Robj* key, uint64_t expires_at);       
         HeapItem* top();               
         HeapItem* pop(); 
+        // Allocated bytes of the array and every item.
+        size_t memory_usage();
+        // Bytes one more item costs: its allocation and its array slot.
+        size_t item_bytes();
         ~Heap();
 };
\ No newline at end of file
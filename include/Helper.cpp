@@ -1,8 +1,65 @@
+#include <cerrno>
 #include <cstdint>
 #include <chrono>
+#include <malloc.h>
+#include <unistd.h>
 
 uint64_t now_ns() {
     auto now = std::chrono::system_clock::now();
     auto nanoseconds_since_epoch = std::chrono::duration_cast<std::chrono::nanoseconds>(now.time_since_epoch()).count();
     return static_cast<uint64_t>(nanoseconds_since_epoch);
-}
\ No newline at end of file
+}
+
+size_t alloc_size(const void* p) {
+    return p ? malloc_usable_size(const_cast<void*>(p)) + sizeof(size_t) : 0;
+}
+
+bool cpu_has_sse41() {
+#if defined(__x86_64__) || defined(__i386__)
+    static const bool has = __builtin_cpu_supports("sse4.1");
+    return has;
+#else
+    return false;
+#endif
+}
+
+bool cpu_has_sse42() {
+#if defined(__x86_64__) || defined(__i386__)
+    static const bool has = __builtin_cpu_supports("sse4.2");
+    return has;
+#else
+    return false;
+#endif
+}
+
+bool cpu_has_popcnt() {
+#if defined(__x86_64__) || defined(__i386__)
+    static const bool has = __builtin_cpu_supports("popcnt");
+    return has;
+#else
+    return false;
+#endif
+}
+
+bool cpu_has_avx2() {
+#if defined(__x86_64__) || defined(__i386__)
+    static const bool has = __builtin_cpu_supports("avx2");
+    return has;
+#else
+    return false;
+#endif
+}
+
+bool write_all(int fd, const void* buf, size_t n) {
+    const char* p = (const char*)buf;
+    while (n > 0) {
+        ssize_t w = write(fd, p, n);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        p += w;
+        n -= w;
+    }
+    return true;
+}
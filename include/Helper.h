@@ -1,3 +1,19 @@
+#pragma once
 #include <chrono>
+#include <cstddef>
+#include <cstdint>
 
-uint64_t now_ns();
\ No newline at end of file
+uint64_t now_ns();
+
+// write() until all n bytes are out, retrying on EINTR.
+bool write_all(int fd, const void* buf, size_t n);
+
+// Bytes p costs the heap, 0 for null: what malloc reserved for it plus
+// glibc's one-word chunk header. What MEMORY counts.
+size_t alloc_size(const void* p);
+
+// Runtime CPU feature checks for the SIMD kernels; false off x86.
+bool cpu_has_sse41();
+bool cpu_has_sse42();
+bool cpu_has_popcnt();
+bool cpu_has_avx2();
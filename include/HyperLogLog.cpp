@@ -0,0 +1,322 @@
+#include "HyperLogLog.h"
+#include "Helper.h"
+#include "Robj.h"
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HLL_X86 1
+#endif
+
+using namespace std;
+
+#define HLL_HDR 16
+#define HLL_DENSE 0
+#define HLL_SPARSE 1
+#define HLL_DENSE_BYTES ((HLL_REGISTERS * 6 + 7) / 8 + 1)
+#define HLL_Q (64 - HLL_P)
+#define HLL_CACHE_STALE (1ULL << 63)
+#define HLL_REG_MAX 63
+
+// MurmurHash2, 64-bit version by Austin Appleby.
+static uint64_t murmur64(const void* key, int len, uint64_t seed){
+    const uint64_t m = 0xc6a4a7935bd1e995ULL;
+    const int r = 47;
+    uint64_t h = seed ^ (len * m);
+    const uint8_t* data = (const uint8_t*)key;
+    const uint8_t* end = data + (len - (len & 7));
+
+    while (data != end) {
+        uint64_t k;
+        memcpy(&k, data, 8);
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+        h ^= k;
+        h *= m;
+        data += 8;
+    }
+
+    switch (len & 7) {
+    case 7: h ^= (uint64_t)data[6] << 48; /* fallthrough */
+    case 6: h ^= (uint64_t)data[5] << 40; /* fallthrough */
+    case 5: h ^= (uint64_t)data[4] << 32; /* fallthrough */
+    case 4: h ^= (uint64_t)data[3] << 24; /* fallthrough */
+    case 3: h ^= (uint64_t)data[2] << 16; /* fallthrough */
+    case 2: h ^= (uint64_t)data[1] << 8;  /* fallthrough */
+    case 1: h ^= (uint64_t)data[0];
+            h *= m;
+    }
+
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+    return h;
+}
+
+// Register index from the low P bits, value = 1 + trailing zeros of the rest.
+static void hash_element(const char* ele, uint32_t len, uint32_t* idx, uint8_t* val){
+    uint64_t h = murmur64(ele, len, 0xadc83b19ULL);
+    *idx = h & (HLL_REGISTERS - 1);
+    h >>= HLL_P;
+    h |= 1ULL << HLL_Q;
+    *val = __builtin_ctzll(h) + 1;
+}
+
+static uint8_t* body(Robj* o){
+    return (uint8_t*)o->ptr + HLL_HDR;
+}
+
+static uint8_t encoding(Robj* o){
+    return ((uint8_t*)o->ptr)[4];
+}
+
+static void invalidate(Robj* o){
+    uint64_t c = HLL_CACHE_STALE;
+    memcpy((uint8_t*)o->ptr + 8, &c, 8);
+}
+
+static uint8_t dense_get(const uint8_t* regs, uint32_t i){
+    uint32_t byte = i * 6 / 8, fb = i * 6 & 7;
+    return ((regs[byte] >> fb) | (regs[byte + 1] << (8 - fb))) & HLL_REG_MAX;
+}
+
+static void dense_set(uint8_t* regs, uint32_t i, uint8_t v){
+    uint32_t byte = i * 6 / 8, fb = i * 6 & 7;
+    regs[byte] &= ~(HLL_REG_MAX << fb);
+    regs[byte] |= v << fb;
+    regs[byte + 1] &= ~(HLL_REG_MAX >> (8 - fb));
+    regs[byte + 1] |= v >> (8 - fb);
+}
+
+static string header(uint8_t enc){
+    string h("HYLL", 4);
+    h.push_back((char)enc);
+    h.append(3, '\0');
+    uint64_t c = HLL_CACHE_STALE;
+    h.append((const char*)&c, 8);
+    return h;
+}
+
+string hll_create(){
+    return header(HLL_SPARSE);
+}
+
+bool hll_valid(Robj* o){
+    if (o->type != RobjType::OBJ_STRING || o->len < HLL_HDR) return false;
+    const uint8_t* p = (const uint8_t*)o->ptr;
+    if (memcmp(p, "HYLL", 4) != 0) return false;
+    // Counting and merging trust what they read, so a crafted value must
+    // not get past here: every register value one hash_element can produce
+    // and, for sparse, registers in range and strictly ascending.
+    if (p[4] == HLL_DENSE) {
+        if (o->len != HLL_HDR + HLL_DENSE_BYTES) return false;
+        for (uint32_t i = 0; i < HLL_REGISTERS; i++)
+            if (dense_get(p + HLL_HDR, i) > HLL_Q + 1) return false;
+        return true;
+    }
+    if (p[4] != HLL_SPARSE || (o->len - HLL_HDR) % 3 != 0) return false;
+
+    const uint8_t* s = p + HLL_HDR;
+    uint32_t n = (o->len - HLL_HDR) / 3;
+    int64_t prev = -1;
+    for (uint32_t k = 0; k < n; k++) {
+        uint16_t idx;
+        memcpy(&idx, s + k * 3, 2);
+        uint8_t val = s[k * 3 + 2];
+        if (idx >= HLL_REGISTERS || idx <= prev || val < 1 || val > HLL_Q + 1)
+            return false;
+        prev = idx;
+    }
+    return true;
+}
+
+static void sparse_to_dense(Robj* o){
+    uint8_t* d = (uint8_t*)calloc(HLL_HDR + HLL_DENSE_BYTES, 1);
+    memcpy(d, o->ptr, HLL_HDR);
+    d[4] = HLL_DENSE;
+
+    const uint8_t* s = body(o);
+    uint32_t n = (o->len - HLL_HDR) / 3;
+    for (uint32_t k = 0; k < n; k++) {
+        uint16_t idx;
+        memcpy(&idx, s + k * 3, 2);
+        dense_set(d + HLL_HDR, idx, s[k * 3 + 2]);
+    }
+
+    free(o->ptr);
+    o->ptr = d;
+    o->len = HLL_HDR + HLL_DENSE_BYTES;
+}
+
+bool hll_add(Robj* o, const char* ele, uint32_t len){
+    uint32_t idx;
+    uint8_t val;
+    hash_element(ele, len, &idx, &val);
+
+    if (encoding(o) == HLL_SPARSE) {
+        uint8_t* s = body(o);
+        int64_t lo = 0, hi = (int64_t)(o->len - HLL_HDR) / 3 - 1;
+        while (lo <= hi) {
+            int64_t mid = (lo + hi) / 2;
+            uint16_t cur;
+            memcpy(&cur, s + mid * 3, 2);
+            if (cur == idx) {
+                if (s[mid * 3 + 2] >= val) return false;
+                s[mid * 3 + 2] = val;
+                invalidate(o);
+                return true;
+            }
+            if (cur < idx) lo = mid + 1;
+            else hi = mid - 1;
+        }
+
+        if (o->len - HLL_HDR + 3 <= HLL_SPARSE_MAX_BYTES) {
+            uint32_t at = HLL_HDR + lo * 3;
+            o->ptr = realloc(o->ptr, o->len + 3);
+            uint8_t* p = (uint8_t*)o->ptr;
+            memmove(p + at + 3, p + at, o->len - at);
+            uint16_t i16 = idx;
+            memcpy(p + at, &i16, 2);
+            p[at + 2] = val;
+            o->len += 3;
+            invalidate(o);
+            return true;
+        }
+        sparse_to_dense(o);
+    }
+
+    uint8_t* regs = body(o);
+    if (dense_get(regs, idx) >= val) return false;
+    dense_set(regs, idx, val);
+    invalidate(o);
+    return true;
+}
+
+static double hll_sigma(double x){
+    if (x == 1.0) return INFINITY;
+    double y = 1, z = x, z_prev;
+    do {
+        x *= x;
+        z_prev = z;
+        z += x * y;
+        y += y;
+    } while (z_prev != z);
+    return z;
+}
+
+static double hll_tau(double x){
+    if (x == 0.0 || x == 1.0) return 0.0;
+    double y = 1.0, z = 1 - x, z_prev;
+    do {
+        x = sqrt(x);
+        z_prev = z;
+        y *= 0.5;
+        z -= pow(1 - x, 2) * y;
+    } while (z_prev != z);
+    return z / 3;
+}
+
+// Ertl's improved raw estimator over the register value histogram; needs no
+// empirical bias tables and stays accurate from 0 to billions.
+static uint64_t estimate(const uint32_t* histo){
+    double m = HLL_REGISTERS;
+    double z = m * hll_tau((m - histo[HLL_Q + 1]) / m);
+    for (int j = HLL_Q; j >= 1; j--) {
+        z += histo[j];
+        z *= 0.5;
+    }
+    z += m * hll_sigma(histo[0] / m);
+    return (uint64_t)llroundl(0.5 / log(2) * m * m / z);
+}
+
+uint64_t hll_count(Robj* o){
+    uint64_t cached;
+    memcpy(&cached, (uint8_t*)o->ptr + 8, 8);
+    if (!(cached & HLL_CACHE_STALE)) return cached;
+
+    uint32_t histo[64] = {0};
+    const uint8_t* b = body(o);
+    if (encoding(o) == HLL_SPARSE) {
+        uint32_t n = (o->len - HLL_HDR) / 3;
+        histo[0] = HLL_REGISTERS - n;
+        for (uint32_t k = 0; k < n; k++) histo[b[k * 3 + 2]]++;
+    } else {
+        for (uint32_t i = 0; i < HLL_REGISTERS; i++) histo[dense_get(b, i)]++;
+    }
+
+    uint64_t card = estimate(histo);
+    memcpy((uint8_t*)o->ptr + 8, &card, 8);
+    return card;
+}
+
+uint64_t hll_count_raw(const uint8_t* raw){
+    uint32_t histo[64] = {0};
+    for (uint32_t i = 0; i < HLL_REGISTERS; i++) histo[raw[i]]++;
+    return estimate(histo);
+}
+
+#ifdef HLL_X86
+__attribute__((target("avx2")))
+static void max_avx2(uint8_t* dst, const uint8_t* src){
+    for (uint32_t i = 0; i < HLL_REGISTERS; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(dst + i));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(src + i));
+        _mm256_storeu_si256((__m256i*)(dst + i), _mm256_max_epu8(a, b));
+    }
+}
+
+static void max_sse2(uint8_t* dst, const uint8_t* src){
+    for (uint32_t i = 0; i < HLL_REGISTERS; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(dst + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(src + i));
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_max_epu8(a, b));
+    }
+}
+#endif
+
+static void max_registers(uint8_t* dst, const uint8_t* src){
+#ifdef HLL_X86
+    if (cpu_has_avx2()) max_avx2(dst, src);
+    else max_sse2(dst, src);
+#else
+    for (uint32_t i = 0; i < HLL_REGISTERS; i++) {
+        if (src[i] > dst[i]) dst[i] = src[i];
+    }
+#endif
+}
+
+void hll_merge_into(uint8_t* raw, Robj* o){
+    const uint8_t* b = body(o);
+    if (encoding(o) == HLL_SPARSE) {
+        uint32_t n = (o->len - HLL_HDR) / 3;
+        for (uint32_t k = 0; k < n; k++) {
+            uint16_t idx;
+            memcpy(&idx, b + k * 3, 2);
+            if (b[k * 3 + 2] > raw[idx]) raw[idx] = b[k * 3 + 2];
+        }
+        return;
+    }
+
+    // Unpack four 6-bit registers from every 3 bytes, then take the max a
+    // vector at a time.
+    uint8_t regs[HLL_REGISTERS];
+    for (uint32_t i = 0, byte = 0; i < HLL_REGISTERS; i += 4, byte += 3) {
+        uint32_t w = b[byte] | (b[byte + 1] << 8) | (b[byte + 2] << 16);
+        regs[i] = w & HLL_REG_MAX;
+        regs[i + 1] = (w >> 6) & HLL_REG_MAX;
+        regs[i + 2] = (w >> 12) & HLL_REG_MAX;
+        regs[i + 3] = (w >> 18) & HLL_REG_MAX;
+    }
+    max_registers(raw, regs);
+}
+
+string hll_from_raw(const uint8_t* raw){
+    string out = header(HLL_DENSE);
+    out.resize(HLL_HDR + HLL_DENSE_BYTES, '\0');
+    uint8_t* regs = (uint8_t*)&out[HLL_HDR];
+    for (uint32_t i = 0; i < HLL_REGISTERS; i++) dense_set(regs, i, raw[i]);
+    return out;
+}
@@ -0,0 +1,39 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+struct Robj;
+
+// HyperLogLogs are plain string values with a 16-byte header:
+//   "HYLL" | encoding | 3 unused | cached cardinality (u64, top bit = stale)
+// followed by either
+//   dense:  16384 6-bit registers packed little-endian (12 KB + 1 pad byte)
+//   sparse: sorted [u16 register][u8 value] triples for non-zero registers,
+//           converted to dense once they pass HLL_SPARSE_MAX_BYTES.
+// Standard error is 1.04 / sqrt(16384) ~ 0.81%.
+
+#define HLL_P 14
+#define HLL_REGISTERS (1 << HLL_P)
+#define HLL_SPARSE_MAX_BYTES 3000
+
+// An empty (sparse) HLL value.
+std::string hll_create();
+
+// True when o is a string holding an HLL written by this module.
+bool hll_valid(Robj* o);
+
+// Adds an element; true when a register changed. May reallocate o->ptr.
+bool hll_add(Robj* o, const char* ele, uint32_t len);
+
+// Cardinality estimate, served from the header cache when it is fresh.
+uint64_t hll_count(Robj* o);
+
+// raw (HLL_REGISTERS bytes, one register per byte) = max(raw, o) per
+// register, vectorized for dense HLLs.
+void hll_merge_into(uint8_t* raw, Robj* o);
+
+uint64_t hll_count_raw(const uint8_t* raw);
+
+// A dense HLL value holding the given registers.
+std::string hll_from_raw(const uint8_t* raw);
@@ -0,0 +1,329 @@
+#include "IntSet.h"
+#include "Helper.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define INTSET_X86 1
+#endif
+
+using namespace std;
+
+// Below this size ratio a linear/SIMD merge wins, above it binary-searching
+// each member of the small set into the large one does.
+#define GALLOP_RATIO 32
+
+static uint8_t width_for(int64_t v){
+    if (v >= INT16_MIN && v <= INT16_MAX) return 2;
+    if (v >= INT32_MIN && v <= INT32_MAX) return 4;
+    return 8;
+}
+
+IntSet::IntSet() : width(2), length(0), contents(nullptr) {}
+
+IntSet::~IntSet(){
+    free(contents);
+}
+
+int64_t IntSet::get_at(uint32_t pos, uint8_t w){
+    if (w == 2) {
+        int16_t v;
+        memcpy(&v, contents + pos * 2, 2);
+        return v;
+    }
+    if (w == 4) {
+        int32_t v;
+        memcpy(&v, contents + pos * 4, 4);
+        return v;
+    }
+    int64_t v;
+    memcpy(&v, contents + pos * 8, 8);
+    return v;
+}
+
+void IntSet::set_at(uint32_t pos, int64_t v){
+    if (width == 2) {
+        int16_t x = v;
+        memcpy(contents + pos * 2, &x, 2);
+    } else if (width == 4) {
+        int32_t x = v;
+        memcpy(contents + pos * 4, &x, 4);
+    } else {
+        memcpy(contents + pos * 8, &v, 8);
+    }
+}
+
+bool IntSet::search(int64_t v, uint32_t* pos){
+    int64_t lo = 0, hi = (int64_t)length - 1;
+    while (lo <= hi) {
+        int64_t mid = (lo + hi) / 2;
+        int64_t cur = get_at(mid, width);
+        if (cur == v) {
+            *pos = mid;
+            return true;
+        }
+        if (cur < v) lo = mid + 1;
+        else hi = mid - 1;
+    }
+    *pos = lo;
+    return false;
+}
+
+// v needs a wider encoding than any member, so it sorts before or after all
+// of them. Members are re-encoded back to front to reuse the buffer.
+void IntSet::upgrade_and_add(int64_t v){
+    uint8_t old_width = width;
+    width = width_for(v);
+    contents = (char*)realloc(contents, (size_t)(length + 1) * width);
+
+    bool prepend = v < 0;
+    for (int64_t i = (int64_t)length - 1; i >= 0; i--) {
+        set_at(i + prepend, get_at(i, old_width));
+    }
+    set_at(prepend ? 0 : length, v);
+    length++;
+}
+
+bool IntSet::add(int64_t v){
+    if (width_for(v) > width) {
+        upgrade_and_add(v);
+        return true;
+    }
+
+    uint32_t pos;
+    if (search(v, &pos)) return false;
+
+    contents = (char*)realloc(contents, (size_t)(length + 1) * width);
+    memmove(contents + (size_t)(pos + 1) * width, contents + (size_t)pos * width,
+            (size_t)(length - pos) * width);
+    set_at(pos, v);
+    length++;
+    return true;
+}
+
+bool IntSet::remove(int64_t v){
+    uint32_t pos;
+    if (width_for(v) > width || !search(v, &pos)) return false;
+
+    memmove(contents + (size_t)pos * width, contents + (size_t)(pos + 1) * width,
+            (size_t)(length - pos - 1) * width);
+    length--;
+    return true;
+}
+
+bool IntSet::contains(int64_t v){
+    uint32_t pos;
+    return width_for(v) <= width && search(v, &pos);
+}
+
+bool parse_int64_strict(const char* s, uint32_t len, int64_t* out){
+    if (len == 0 || len > 20) return false;
+
+    bool neg = s[0] == '-';
+    uint32_t i = neg;
+    if (i == len) return false;
+    if (s[i] == '0' && (len > i + 1 || neg)) return false;
+
+    uint64_t v = 0;
+    for (; i < len; i++) {
+        if (s[i] < '0' || s[i] > '9') return false;
+        uint64_t d = s[i] - '0';
+        if (v > (UINT64_MAX - d) / 10) return false;
+        v = v * 10 + d;
+    }
+
+    if (neg) {
+        if (v > (uint64_t)INT64_MAX + 1) return false;
+        *out = (int64_t)(0 - v);
+    } else {
+        if (v > (uint64_t)INT64_MAX) return false;
+        *out = (int64_t)v;
+    }
+    return true;
+}
+
+
+template <typename T>
+static size_t intersect_merge(const T* a, size_t na, const T* b, size_t nb, T* out){
+    size_t i = 0, j = 0, k = 0;
+    while (i < na && j < nb) {
+        if (a[i] < b[j]) i++;
+        else if (b[j] < a[i]) j++;
+        else {
+            out[k++] = a[i];
+            i++;
+            j++;
+        }
+    }
+    return k;
+}
+
+// a is the much smaller side; each lookup resumes where the last one ended.
+template <typename T>
+static size_t intersect_gallop(const T* a, size_t na, const T* b, size_t nb, T* out){
+    size_t k = 0;
+    const T* lo = b;
+    const T* end = b + nb;
+    for (size_t i = 0; i < na && lo < end; i++) {
+        lo = lower_bound(lo, end, a[i]);
+        if (lo < end && *lo == a[i]) out[k++] = a[i];
+    }
+    return k;
+}
+
+#ifdef INTSET_X86
+// Compares a 4-wide block of a against every rotation of a 4-wide block of
+// b, then advances whichever block ends lower (both when they tie).
+static size_t intersect_sse2_i32(const int32_t* a, size_t na, const int32_t* b,
+                                 size_t nb, int32_t* out){
+    size_t i = 0, j = 0, k = 0;
+    while (i + 4 <= na && j + 4 <= nb) {
+        __m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i*)(b + j));
+        __m128i m0 = _mm_cmpeq_epi32(va, vb);
+        __m128i m1 = _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(0, 3, 2, 1)));
+        __m128i m2 = _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(1, 0, 3, 2)));
+        __m128i m3 = _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(2, 1, 0, 3)));
+        __m128i m = _mm_or_si128(_mm_or_si128(m0, m1), _mm_or_si128(m2, m3));
+
+        int mask = _mm_movemask_ps(_mm_castsi128_ps(m));
+        while (mask) {
+            out[k++] = a[i + __builtin_ctz(mask)];
+            mask &= mask - 1;
+        }
+
+        int32_t amax = a[i + 3], bmax = b[j + 3];
+        if (amax <= bmax) i += 4;
+        if (bmax <= amax) j += 4;
+    }
+    return k + intersect_merge(a + i, na - i, b + j, nb - j, out + k);
+}
+
+__attribute__((target("avx2")))
+static size_t intersect_avx2_i32(const int32_t* a, size_t na, const int32_t* b,
+                                 size_t nb, int32_t* out){
+    const __m256i rot = _mm256_set_epi32(0, 7, 6, 5, 4, 3, 2, 1);
+    size_t i = 0, j = 0, k = 0;
+    while (i + 8 <= na && j + 8 <= nb) {
+        __m256i va = _mm256_loadu_si256((const __m256i*)(a + i));
+        __m256i vb = _mm256_loadu_si256((const __m256i*)(b + j));
+        __m256i m = _mm256_cmpeq_epi32(va, vb);
+        for (int r = 1; r < 8; r++) {
+            vb = _mm256_permutevar8x32_epi32(vb, rot);
+            m = _mm256_or_si256(m, _mm256_cmpeq_epi32(va, vb));
+        }
+
+        int mask = _mm256_movemask_ps(_mm256_castsi256_ps(m));
+        while (mask) {
+            out[k++] = a[i + __builtin_ctz(mask)];
+            mask &= mask - 1;
+        }
+
+        int32_t amax = a[i + 7], bmax = b[j + 7];
+        if (amax <= bmax) i += 8;
+        if (bmax <= amax) j += 8;
+    }
+    return k + intersect_sse2_i32(a + i, na - i, b + j, nb - j, out + k);
+}
+
+__attribute__((target("sse4.1")))
+static size_t intersect_sse41_i64(const int64_t* a, size_t na, const int64_t* b,
+                                  size_t nb, int64_t* out){
+    size_t i = 0, j = 0, k = 0;
+    while (i + 2 <= na && j + 2 <= nb) {
+        __m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i*)(b + j));
+        __m128i m = _mm_or_si128(_mm_cmpeq_epi64(va, vb),
+                                 _mm_cmpeq_epi64(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(1, 0, 3, 2))));
+
+        int mask = _mm_movemask_pd(_mm_castsi128_pd(m));
+        while (mask) {
+            out[k++] = a[i + __builtin_ctz(mask)];
+            mask &= mask - 1;
+        }
+
+        int64_t amax = a[i + 1], bmax = b[j + 1];
+        if (amax <= bmax) i += 2;
+        if (bmax <= amax) j += 2;
+    }
+    return k + intersect_merge(a + i, na - i, b + j, nb - j, out + k);
+}
+#endif
+
+static size_t intersect_i32(const int32_t* a, size_t na, const int32_t* b,
+                            size_t nb, int32_t* out){
+    if (na > nb) {
+        swap(a, b);
+        swap(na, nb);
+    }
+    if (na * GALLOP_RATIO < nb) return intersect_gallop(a, na, b, nb, out);
+#ifdef INTSET_X86
+    if (cpu_has_avx2()) return intersect_avx2_i32(a, na, b, nb, out);
+    return intersect_sse2_i32(a, na, b, nb, out);
+#else
+    return intersect_merge(a, na, b, nb, out);
+#endif
+}
+
+static size_t intersect_i64(const int64_t* a, size_t na, const int64_t* b,
+                            size_t nb, int64_t* out){
+    if (na > nb) {
+        swap(a, b);
+        swap(na, nb);
+    }
+    if (na * GALLOP_RATIO < nb) return intersect_gallop(a, na, b, nb, out);
+#ifdef INTSET_X86
+    if (cpu_has_sse41()) return intersect_sse41_i64(a, na, b, nb, out);
+#endif
+    return intersect_merge(a, na, b, nb, out);
+}
+
+// Members of s at element type T, copied only when s is stored narrower.
+template <typename T>
+static const T* members_as(IntSet* s, vector<T>& scratch){
+    if (s->get_width() == sizeof(T)) return (const T*)s->data();
+    scratch.resize(s->size());
+    for (uint32_t i = 0; i < s->size(); i++) scratch[i] = (T)s->at(i);
+    return scratch.data();
+}
+
+template <typename T>
+static size_t intersect_all(vector<IntSet*>& sets, vector<int64_t>* out, size_t limit,
+                            size_t (*kernel)(const T*, size_t, const T*, size_t, T*)){
+    vector<T> cur, next, scratch;
+    const T* first = members_as<T>(sets[0], scratch);
+    cur.assign(first, first + sets[0]->size());
+
+    for (size_t s = 1; s < sets.size() && !cur.empty(); s++) {
+        const T* b = members_as<T>(sets[s], scratch);
+        next.resize(cur.size());
+        next.resize(kernel(cur.data(), cur.size(), b, sets[s]->size(), next.data()));
+        cur.swap(next);
+    }
+
+    size_t n = cur.size();
+    if (limit && n > limit) n = limit;
+    if (out) out->assign(cur.begin(), cur.begin() + n);
+    return n;
+}
+
+size_t intset_intersect(vector<IntSet*> sets, vector<int64_t>* out, size_t limit){
+    if (sets.empty()) return 0;
+
+    sort(sets.begin(), sets.end(),
+         [](IntSet* x, IntSet* y) { return x->size() < y->size(); });
+
+    uint8_t w = 2;
+    for (IntSet* s : sets) w = max(w, s->get_width());
+
+    // 16-bit sets are widened to 32 bits: the 32-bit kernels already do 8
+    // compares per instruction and keep the code to two element types.
+    if (w <= 4) return intersect_all<int32_t>(sets, out, limit, intersect_i32);
+    return intersect_all<int64_t>(sets, out, limit, intersect_i64);
+}
+
+size_t IntSet::memory_usage(){
+    return alloc_size(this) + alloc_size(contents);
+}
@@ -0,0 +1,55 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Sorted array of unique integers packed at the narrowest width (2, 4 or 8
+// bytes) that fits every member. Adding a wider value upgrades the whole
+// array in place; it never narrows again.
+class IntSet {
+private:
+    uint8_t width;
+    uint32_t length;
+    char* contents;
+
+    int64_t get_at(uint32_t pos, uint8_t w);
+    void set_at(uint32_t pos, int64_t v);
+    bool search(int64_t v, uint32_t* pos);
+    void upgrade_and_add(int64_t v);
+
+public:
+    IntSet();
+    ~IntSet();
+
+    bool add(int64_t v);
+    bool remove(int64_t v);
+    bool contains(int64_t v);
+
+    uint32_t size(){
+        return length;
+    }
+
+    size_t memory_usage();
+
+    uint8_t get_width(){
+        return width;
+    }
+
+    int64_t at(uint32_t pos){
+        return get_at(pos, width);
+    }
+
+    const char* data(){
+        return contents;
+    }
+};
+
+// Parses a canonical base-10 int64 (no sign on zero, no leading zeros), so
+// that storing the number loses nothing of the original string.
+bool parse_int64_strict(const char* s, uint32_t len, int64_t* out);
+
+// Intersects every set (smallest first) into out, if non-null, in ascending
+// order. Returns the result size, capped at limit when limit > 0. Sets of
+// width <= 4 go through SSE4.1/AVX2 kernels when the CPU has them.
+size_t intset_intersect(std::vector<IntSet*> sets, std::vector<int64_t>* out,
+                        size_t limit = 0);
@@ -0,0 +1,108 @@
+#include "IoThreads.h"
+
+using namespace std;
+
+static inline void cpu_relax(){
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+IoThreads::~IoThreads(){
+    stop();
+}
+
+void IoThreads::start(int n){
+    stopping = false;
+    for (int i = 1; i < n; i++) {
+        workers.emplace_back(new Worker());
+        Worker* w = workers.back().get();
+        w->th = thread(&IoThreads::loop, this, w);
+    }
+}
+
+void IoThreads::stop(){
+    if (workers.empty()) return;
+    stopping = true;
+    for (auto& w : workers) {
+        {
+            lock_guard<mutex> lk(w->mu);
+        }
+        w->cv.notify_one();
+        w->th.join();
+    }
+    workers.clear();
+}
+
+// Polls for a while after each job, since the next batch usually follows
+// within one loop iteration, then sleeps until run() wakes it.
+void IoThreads::loop(Worker* w){
+    IoJob job;
+    int idle = 0;
+    while (true) {
+        if (w->in.pop(job)) {
+            job.fn(job.arg);
+            while (!w->done.push(job.arg)) this_thread::yield();
+            idle = 0;
+            continue;
+        }
+        if (++idle < IO_SPIN_POLLS) {
+            cpu_relax();
+            continue;
+        }
+
+        unique_lock<mutex> lk(w->mu);
+        w->sleeping = true;
+        atomic_thread_fence(memory_order_seq_cst);
+        w->cv.wait(lk, [&] { return !w->in.empty() || stopping.load(); });
+        w->sleeping = false;
+        if (stopping && w->in.empty()) return;
+        idle = 0;
+    }
+}
+
+void IoThreads::run(const vector<void*>& items, void (*fn)(void*)){
+    // Waking helpers costs more than a couple of syscalls saves.
+    if (workers.empty() || items.size() < 2 * (size_t)count()) {
+        for (void* it : items) fn(it);
+        return;
+    }
+    batches++;
+    jobs += items.size();
+
+    vector<void*> mine;
+    size_t pending = 0;
+    for (size_t i = 0; i < items.size(); i++) {
+        size_t t = i % count();
+        if (t == 0 || !workers[t - 1]->in.push({fn, items[i]}))
+            mine.push_back(items[i]);
+        else
+            pending++;
+    }
+
+    // Pairs with the fence in loop(): either the helper sees its queue
+    // non-empty or this sees it sleeping.
+    atomic_thread_fence(memory_order_seq_cst);
+    for (auto& w : workers) {
+        if (w->sleeping) {
+            {
+                lock_guard<mutex> lk(w->mu);
+            }
+            w->cv.notify_one();
+        }
+    }
+
+    for (void* it : mine) fn(it);
+
+    void* done;
+    while (pending) {
+        bool got = false;
+        for (auto& w : workers) {
+            while (w->done.pop(done)) {
+                pending--;
+                got = true;
+            }
+        }
+        if (!got) this_thread::yield();
+    }
+}
@@ -0,0 +1,104 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// I/O threads. The event loop hands socket reads, frame parsing and reply
+// writes for a batch of connections to helper threads and waits for them,
+// while commands still run on the loop's thread only. A connection belongs
+// to exactly one thread at a time, so nothing it holds needs a lock.
+
+#define IO_QUEUE_SIZE 1024
+// Empty polls before an idle thread sleeps on its condition variable.
+#define IO_SPIN_POLLS 20000
+
+// Bounded lock-free queue for one producer thread and one consumer thread.
+template <typename T, size_t N>
+class SpscQueue {
+    static_assert((N & (N - 1)) == 0, "size must be a power of two");
+
+private:
+    alignas(64) std::atomic<size_t> head{0};  // next slot to pop
+    alignas(64) std::atomic<size_t> tail{0};  // next slot to push
+    alignas(64) T items[N];
+
+public:
+    bool push(const T& v){
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) == N) return false;
+        items[t & (N - 1)] = v;
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(T& v){
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire)) return false;
+        v = items[h & (N - 1)];
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool empty() const{
+        return head.load(std::memory_order_acquire) ==
+               tail.load(std::memory_order_acquire);
+    }
+};
+
+struct IoJob {
+    void (*fn)(void*);
+    void* arg;
+};
+
+class IoThreads {
+private:
+    // Jobs go in through `in` and come back through `done`; the loop
+    // thread is the only producer of one and consumer of the other.
+    struct Worker {
+        SpscQueue<IoJob, IO_QUEUE_SIZE> in;
+        SpscQueue<void*, IO_QUEUE_SIZE> done;
+        std::mutex mu;
+        std::condition_variable cv;
+        std::atomic<bool> sleeping{false};
+        std::thread th;
+    };
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::atomic<bool> stopping{false};
+    uint64_t batches = 0;
+    uint64_t jobs = 0;
+
+    void loop(Worker* w);
+
+public:
+    ~IoThreads();
+
+    // n threads in all: the caller plus n - 1 helpers. n <= 1 keeps
+    // everything on the caller.
+    void start(int n);
+    void stop();
+
+    bool active() const{
+        return !workers.empty();
+    }
+
+    int count() const{
+        return workers.size() + 1;
+    }
+
+    // Calls fn on every item, spread over the helpers and the caller, and
+    // returns once all calls are done. Small batches run on the caller.
+    void run(const std::vector<void*>& items, void (*fn)(void*));
+
+    uint64_t batches_run() const{
+        return batches;
+    }
+
+    uint64_t jobs_run() const{
+        return jobs;
+    }
+};
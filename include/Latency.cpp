@@ -0,0 +1,147 @@
+#include "Latency.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+using namespace std;
+
+static uint64_t steady_ns(){
+    return chrono::duration_cast<chrono::nanoseconds>(
+               chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+uint64_t ticks_now(){
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return steady_ns();
+#endif
+}
+
+static const uint64_t start_ticks = ticks_now();
+static const uint64_t start_ns = steady_ns();
+
+double ticks_per_ns(){
+#if defined(__x86_64__) || defined(__i386__)
+    static double settled = 0;
+    if (settled) return settled;
+
+    // Too short a window gives a noisy rate; only INFO right after start
+    // ever waits here.
+    uint64_t ns;
+    while ((ns = steady_ns() - start_ns) < 10000000ULL) {}
+    double rate = (double)(ticks_now() - start_ticks) / ns;
+    if (ns >= 1000000000ULL) settled = rate;
+    return rate;
+#else
+    return 1.0;
+#endif
+}
+
+uint64_t ticks_to_us(uint64_t ticks){
+    return (uint64_t)(ticks / ticks_per_ns() / 1000.0);
+}
+
+LatencyHistogram::LatencyHistogram(){
+    reset();
+}
+
+size_t LatencyHistogram::bucket_of(uint64_t v){
+    if (v < (1u << HIST_SUB_BITS)) return v;
+    int e = 63 - __builtin_clzll(v);
+    if (e >= HIST_MAX_BITS) return HIST_BUCKETS - 1;
+    return ((size_t)(e - HIST_SUB_BITS + 1) << HIST_SUB_BITS) |
+           ((v >> (e - HIST_SUB_BITS)) & ((1u << HIST_SUB_BITS) - 1));
+}
+
+uint64_t LatencyHistogram::bucket_high(size_t b){
+    if (b < (1u << HIST_SUB_BITS)) return b;
+    int shift = (b >> HIST_SUB_BITS) - 1;
+    uint64_t low = (uint64_t)((1u << HIST_SUB_BITS) | (b & ((1u << HIST_SUB_BITS) - 1)))
+                   << shift;
+    return low + (1ULL << shift) - 1;
+}
+
+uint64_t LatencyHistogram::percentile(double pct) const{
+    if (!total) return 0;
+    uint64_t want = (uint64_t)(pct / 100.0 * total + 0.5);
+    if (want < 1) want = 1;
+    uint64_t seen = 0;
+    for (size_t b = 0; b < HIST_BUCKETS; b++) {
+        seen += counts[b];
+        if (seen >= want) return std::min(bucket_high(b), max_value);
+    }
+    return max_value;
+}
+
+void LatencyHistogram::reset(){
+    memset(counts, 0, sizeof(counts));
+    total = 0;
+    max_value = 0;
+}
+
+void LatencyHistogram::merge(const LatencyHistogram& o){
+    for (size_t b = 0; b < HIST_BUCKETS; b++) counts[b] += o.counts[b];
+    total += o.total;
+    if (o.max_value > max_value) max_value = o.max_value;
+}
+
+string LatencyHistogram::percentiles_usec(double tpn) const{
+    static const double pcts[] = {50, 99, 99.9};
+    static const char* names[] = {"p50", "p99", "p99.9"};
+    string out;
+    char buf[48];
+    for (int i = 0; i < 3; i++) {
+        snprintf(buf, sizeof(buf), "%s%s=%.3f", i ? "," : "", names[i],
+                 percentile(pcts[i]) / tpn / 1000.0);
+        out += buf;
+    }
+    return out;
+}
+
+LatencyMonitor::LatencyMonitor() : threshold_us(0) {}
+
+void LatencyMonitor::record(const char* event, uint64_t usec){
+    LatencyEvent& ev = events[event];
+    uint64_t now = time(nullptr);
+    if (usec > ev.max_usec) ev.max_usec = usec;
+
+    // Samples of the same second collapse into the worst one.
+    if (ev.len) {
+        LatencySample& last = ev.history[(ev.next + LATENCY_HISTORY_LEN - 1) %
+                                         LATENCY_HISTORY_LEN];
+        if (last.time == now) {
+            if (usec > last.usec) last.usec = usec;
+            return;
+        }
+    }
+    ev.history[ev.next] = {now, usec};
+    ev.next = (ev.next + 1) % LATENCY_HISTORY_LEN;
+    if (ev.len < LATENCY_HISTORY_LEN) ev.len++;
+}
+
+bool LatencyMonitor::history(const string& event, vector<LatencySample>& out) const{
+    auto it = events.find(event);
+    if (it == events.end()) return false;
+    const LatencyEvent& ev = it->second;
+    size_t first = (ev.next + LATENCY_HISTORY_LEN - ev.len) % LATENCY_HISTORY_LEN;
+    for (size_t i = 0; i < ev.len; i++)
+        out.push_back(ev.history[(first + i) % LATENCY_HISTORY_LEN]);
+    return true;
+}
+
+size_t LatencyMonitor::reset(const vector<string>& names){
+    if (names.empty()) {
+        size_t n = events.size();
+        events.clear();
+        return n;
+    }
+    size_t n = 0;
+    for (auto& name : names) n += events.erase(name);
+    return n;
+}
@@ -0,0 +1,138 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+// Timestamps cheap enough to take around every command: the TSC where
+// there is one (rdtsc, a few ns), steady-clock nanoseconds elsewhere.
+uint64_t ticks_now();
+
+// Ticks per nanosecond, measured against the steady clock since the
+// process started; settles after the first second.
+double ticks_per_ns();
+
+uint64_t ticks_to_us(uint64_t ticks);
+
+// Log-linear histogram in the style of HdrHistogram. Values below 16 get a
+// bucket each; every power of two above that is split into 16 buckets, so a
+// reported value is within 1/16 of the recorded one. The size is fixed no
+// matter how many values are recorded; values past 2^44 share the top
+// bucket.
+#define HIST_SUB_BITS 4
+#define HIST_MAX_BITS 44
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+class LatencyHistogram {
+private:
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t max_value;
+
+public:
+    LatencyHistogram();
+
+    static size_t bucket_of(uint64_t v);
+    // Largest value that lands in bucket b.
+    static uint64_t bucket_high(size_t b);
+
+    void record(uint64_t v){
+        counts[bucket_of(v)]++;
+        total++;
+        if (v > max_value) max_value = v;
+    }
+
+    uint64_t count() const{
+        return total;
+    }
+
+    uint64_t max() const{
+        return max_value;
+    }
+
+    // Smallest bucket bound at or above pct percent of the values; 0 when
+    // nothing was recorded.
+    uint64_t percentile(double pct) const;
+
+    void reset();
+
+    // Adds o's values, as if they had been recorded here.
+    void merge(const LatencyHistogram& o);
+
+    // "p50=1.234,p99=5.678,p99.9=9.012" in microseconds, for values
+    // recorded in ticks.
+    std::string percentiles_usec(double tpn) const;
+};
+
+// Per-command counters for INFO commandstats / latencystats.
+struct CommandStats {
+    uint64_t calls = 0;
+    uint64_t failed = 0;
+    uint64_t ticks = 0;
+    LatencyHistogram hist;
+
+    void record(uint64_t t, bool fail){
+        calls++;
+        failed += fail;
+        ticks += t;
+        hist.record(t);
+    }
+};
+
+// LATENCY monitor. Internal events (an fsync, an active-expire cycle, a
+// rehash table allocation, ...) report their duration; those at or over
+// the threshold are kept per event name, as the worst sample of each
+// second for the last LATENCY_HISTORY_LEN such seconds, plus the all-time
+// worst. A threshold of 0 turns the monitor off.
+#define LATENCY_HISTORY_LEN 160
+
+struct LatencySample {
+    uint64_t time;   // unix seconds
+    uint64_t usec;
+};
+
+struct LatencyEvent {
+    LatencySample history[LATENCY_HISTORY_LEN];
+    size_t next = 0;     // slot the next new second goes to
+    size_t len = 0;
+    uint64_t max_usec = 0;
+
+    const LatencySample& latest() const{
+        return history[(next + LATENCY_HISTORY_LEN - 1) % LATENCY_HISTORY_LEN];
+    }
+};
+
+class LatencyMonitor {
+private:
+    std::map<std::string, LatencyEvent> events;
+    uint64_t threshold_us;
+
+public:
+    LatencyMonitor();
+
+    void set_threshold(uint64_t us){
+        threshold_us = us;
+    }
+
+    uint64_t threshold() const{
+        return threshold_us;
+    }
+
+    void add_sample(const char* event, uint64_t usec){
+        if (threshold_us && usec >= threshold_us) record(event, usec);
+    }
+
+    void record(const char* event, uint64_t usec);
+
+    const std::map<std::string, LatencyEvent>& all() const{
+        return events;
+    }
+
+    // Oldest first; false for an event with no samples.
+    bool history(const std::string& event, std::vector<LatencySample>& out) const;
+
+    // Forgets the named events, or every event when names is empty.
+    // Returns how many were dropped.
+    size_t reset(const std::vector<std::string>& names);
+};
@@ -0,0 +1,253 @@
+#include "List.h"
+#include "Helper.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+using namespace std;
+
+static uint32_t hdr_size(uint32_t len){
+    return len < 255 ? 1 : 5;
+}
+
+static uint32_t entry_size(uint32_t len){
+    return 2 * hdr_size(len) + len;
+}
+
+static void write_entry(char* p, const char* val, uint32_t len){
+    if (len < 255) {
+        p[0] = (char)len;
+        memcpy(p + 1, val, len);
+        p[1 + len] = (char)len;
+    } else {
+        p[0] = (char)0xFF;
+        memcpy(p + 1, &len, 4);
+        memcpy(p + 5, val, len);
+        memcpy(p + 5 + len, &len, 4);
+        p[9 + len] = (char)0xFF;
+    }
+}
+
+// Decodes the entry starting at p; returns its encoded size.
+static uint32_t read_forward(const char* p, const char** data, uint32_t* len){
+    uint8_t b = p[0];
+    if (b != 0xFF) {
+        *len = b;
+        *data = p + 1;
+        return 2 + b;
+    }
+    memcpy(len, p + 1, 4);
+    *data = p + 5;
+    return 10 + *len;
+}
+
+// Decodes the entry that ends right before end; returns its encoded size.
+static uint32_t read_backward(const char* end, const char** data, uint32_t* len){
+    uint8_t b = end[-1];
+    if (b != 0xFF) {
+        *len = b;
+        *data = end - 1 - b;
+        return 2 + b;
+    }
+    memcpy(len, end - 5, 4);
+    *data = end - 5 - *len;
+    return 10 + *len;
+}
+
+List::List() : head(nullptr), tail(nullptr), length(0) {}
+
+List::~List(){
+    while (head) unlink_chunk(head);
+}
+
+ListChunk* List::new_chunk(uint32_t cap, bool at_head){
+    ListChunk* c = (ListChunk*)malloc(sizeof(ListChunk));
+    c->buf = (char*)malloc(cap);
+    c->cap = cap;
+    // Head chunks fill right to left, tail chunks left to right.
+    c->begin = c->end = at_head ? cap : 0;
+    c->count = 0;
+
+    if (at_head) {
+        c->prev = nullptr;
+        c->next = head;
+        if (head) head->prev = c;
+        head = c;
+        if (!tail) tail = c;
+    } else {
+        c->next = nullptr;
+        c->prev = tail;
+        if (tail) tail->next = c;
+        tail = c;
+        if (!head) head = c;
+    }
+    return c;
+}
+
+void List::unlink_chunk(ListChunk* c){
+    if (c->prev) c->prev->next = c->next;
+    else head = c->next;
+    if (c->next) c->next->prev = c->prev;
+    else tail = c->prev;
+
+    free(c->buf);
+    free(c);
+}
+
+// Ensures need free bytes on the requested side of c, sliding the live bytes
+// over when the space exists but is on the other side.
+bool List::make_room(ListChunk* c, uint32_t need, bool front){
+    uint32_t live = c->end - c->begin;
+    if (c->cap - live < need) return false;
+
+    if (front && c->begin < need) {
+        uint32_t nb = c->cap - live;
+        memmove(c->buf + nb, c->buf + c->begin, live);
+        c->begin = nb;
+        c->end = c->cap;
+    } else if (!front && c->cap - c->end < need) {
+        memmove(c->buf, c->buf + c->begin, live);
+        c->begin = 0;
+        c->end = live;
+    }
+    return true;
+}
+
+void List::lpush(const char* val, uint32_t len){
+    uint32_t need = entry_size(len);
+    if (!head || !make_room(head, need, true))
+        new_chunk(max<uint32_t>(need, LIST_CHUNK_BYTES), true);
+
+    head->begin -= need;
+    write_entry(head->buf + head->begin, val, len);
+    head->count++;
+    length++;
+}
+
+void List::rpush(const char* val, uint32_t len){
+    uint32_t need = entry_size(len);
+    if (!tail || !make_room(tail, need, false))
+        new_chunk(max<uint32_t>(need, LIST_CHUNK_BYTES), false);
+
+    write_entry(tail->buf + tail->end, val, len);
+    tail->end += need;
+    tail->count++;
+    length++;
+}
+
+bool List::lpop(string& out){
+    if (!head) return false;
+
+    const char* d;
+    uint32_t l;
+    head->begin += read_forward(head->buf + head->begin, &d, &l);
+    out.assign(d, l);
+    head->count--;
+    length--;
+
+    if (head->count == 0) unlink_chunk(head);
+    return true;
+}
+
+bool List::rpop(string& out){
+    if (!tail) return false;
+
+    const char* d;
+    uint32_t l;
+    tail->end -= read_backward(tail->buf + tail->end, &d, &l);
+    out.assign(d, l);
+    tail->count--;
+    length--;
+
+    if (tail->count == 0) unlink_chunk(tail);
+    return true;
+}
+
+uint64_t List::llen(){
+    return length;
+}
+
+bool List::normalize(int64_t& start, int64_t& stop){
+    int64_t n = length;
+    if (start < 0) start += n;
+    if (stop < 0) stop += n;
+    if (start < 0) start = 0;
+    if (start > stop || start >= n) return false;
+    if (stop >= n) stop = n - 1;
+    return true;
+}
+
+void List::lrange(int64_t start, int64_t stop, vector<string>& out){
+    if (!normalize(start, stop)) return;
+
+    // Whole chunks before start are skipped by their counts.
+    int64_t idx = 0;
+    ListChunk* c = head;
+    while (c && idx + c->count <= start) {
+        idx += c->count;
+        c = c->next;
+    }
+
+    for (; c && idx <= stop; c = c->next) {
+        uint32_t off = c->begin;
+        while (off < c->end && idx <= stop) {
+            const char* d;
+            uint32_t l;
+            off += read_forward(c->buf + off, &d, &l);
+            if (idx >= start) out.emplace_back(d, l);
+            idx++;
+        }
+    }
+}
+
+void List::drop_front(uint64_t n){
+    while (n && head) {
+        if (head->count <= n) {
+            n -= head->count;
+            length -= head->count;
+            unlink_chunk(head);
+            continue;
+        }
+        const char* d;
+        uint32_t l;
+        head->begin += read_forward(head->buf + head->begin, &d, &l);
+        head->count--;
+        length--;
+        n--;
+    }
+}
+
+void List::drop_back(uint64_t n){
+    while (n && tail) {
+        if (tail->count <= n) {
+            n -= tail->count;
+            length -= tail->count;
+            unlink_chunk(tail);
+            continue;
+        }
+        const char* d;
+        uint32_t l;
+        tail->end -= read_backward(tail->buf + tail->end, &d, &l);
+        tail->count--;
+        length--;
+        n--;
+    }
+}
+
+void List::ltrim(int64_t start, int64_t stop){
+    if (!normalize(start, stop)) {
+        drop_front(length);
+        return;
+    }
+    drop_back(length - 1 - stop);
+    drop_front(start);
+}
+
+size_t List::memory_usage(){
+    // Chunks hold LIST_CHUNK_BYTES or more each, so walking them is cheap
+    // next to walking the elements.
+    size_t bytes = alloc_size(this);
+    for (ListChunk* c = head; c; c = c->next)
+        bytes += alloc_size(c) + alloc_size(c->buf);
+    return bytes;
+}
@@ -0,0 +1,52 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Target size of one packed chunk. Larger elements get a chunk of their own.
+#define LIST_CHUNK_BYTES 8192
+
+// A run of packed entries, each stored as [len][bytes][len] so the chunk can
+// be walked from either end. len is one byte below 255, else 0xFF + u32
+// (mirrored as u32 + 0xFF at the tail). Live bytes sit in [begin, end) so
+// pushes and pops at both ends avoid moving the rest of the chunk.
+struct ListChunk {
+    ListChunk* prev;
+    ListChunk* next;
+    char* buf;
+    uint32_t cap;
+    uint32_t begin;
+    uint32_t end;
+    uint32_t count;
+};
+
+class List {
+private:
+    ListChunk* head;
+    ListChunk* tail;
+    uint64_t length;
+
+    ListChunk* new_chunk(uint32_t cap, bool at_head);
+    void unlink_chunk(ListChunk* c);
+    bool make_room(ListChunk* c, uint32_t need, bool front);
+    void drop_front(uint64_t n);
+    void drop_back(uint64_t n);
+
+    // Clamps Redis-style (possibly negative) bounds; false when empty.
+    bool normalize(int64_t& start, int64_t& stop);
+
+public:
+    List();
+    ~List();
+
+    void lpush(const char* val, uint32_t len);
+    void rpush(const char* val, uint32_t len);
+    bool lpop(std::string& out);
+    bool rpop(std::string& out);
+    uint64_t llen();
+    void lrange(int64_t start, int64_t stop, std::vector<std::string>& out);
+    void ltrim(int64_t start, int64_t stop);
+
+    // Allocated bytes of the list and all its chunks.
+    size_t memory_usage();
+};
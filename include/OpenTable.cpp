@@ -0,0 +1,187 @@
+#include "OpenTable.h"
+#include "hashmap.h"
+#include "Helper.h"
+#include <cstdlib>
+#include <cstring>
+#include <random>
+
+#define SLOT_EMPTY   0
+#define SLOT_DELETED 1
+
+static char* make_entry(const char* field, uint32_t flen,
+                        const char* val, uint32_t vlen){
+    char* e = (char*)malloc(8 + flen + vlen);
+    memcpy(e, &flen, 4);
+    memcpy(e + 4, &vlen, 4);
+    memcpy(e + 8, field, flen);
+    memcpy(e + 8 + flen, val, vlen);
+    return e;
+}
+
+static uint32_t entry_flen(const char* e){
+    uint32_t n;
+    memcpy(&n, e, 4);
+    return n;
+}
+
+static uint32_t entry_vlen(const char* e){
+    uint32_t n;
+    memcpy(&n, e + 4, 4);
+    return n;
+}
+
+uint64_t OpenTable::hash_of(const char* field, uint32_t len){
+    uint64_t h = hash_bytes(field, len);
+    return h <= SLOT_DELETED ? h + 2 : h;
+}
+
+OpenTable::OpenTable(uint32_t init_cap){
+    cap = 16;
+    while (cap < init_cap) cap *= 2;
+    used = 0;
+    deleted = 0;
+    slots = (OpenSlot*)calloc(cap, sizeof(OpenSlot));
+}
+
+OpenTable::~OpenTable(){
+    for (uint32_t i = 0; i < cap; i++) {
+        if (slots[i].hash > SLOT_DELETED) free(slots[i].entry);
+    }
+    free(slots);
+}
+
+// Index of the slot holding field, or of the first reusable slot on its
+// probe path when it is absent.
+uint32_t OpenTable::probe(const char* field, uint32_t len, uint64_t h){
+    uint32_t mask = cap - 1;
+    uint32_t idx = h & mask;
+    int64_t first_free = -1;
+
+    while (true) {
+        OpenSlot& s = slots[idx];
+        if (s.hash == SLOT_EMPTY) {
+            return first_free >= 0 ? (uint32_t)first_free : idx;
+        }
+        if (s.hash == SLOT_DELETED) {
+            if (first_free < 0) first_free = idx;
+        } else if (s.hash == h && entry_flen(s.entry) == len &&
+                   memcmp(s.entry + 8, field, len) == 0) {
+            return idx;
+        }
+        idx = (idx + 1) & mask;
+    }
+}
+
+void OpenTable::resize(uint32_t new_cap){
+    OpenSlot* old = slots;
+    uint32_t old_cap = cap;
+
+    cap = new_cap;
+    slots = (OpenSlot*)calloc(cap, sizeof(OpenSlot));
+    deleted = 0;
+
+    uint32_t mask = cap - 1;
+    for (uint32_t i = 0; i < old_cap; i++) {
+        if (old[i].hash <= SLOT_DELETED) continue;
+        uint32_t idx = old[i].hash & mask;
+        while (slots[idx].hash != SLOT_EMPTY) idx = (idx + 1) & mask;
+        slots[idx] = old[i];
+    }
+    free(old);
+}
+
+bool OpenTable::set(const char* field, uint32_t flen, const char* val, uint32_t vlen){
+    // Keep the load (live + tombstones) under 3/4 so probe runs stay short.
+    if ((used + deleted + 1) * 4 > cap * 3) {
+        resize((used + 1) * 2 > cap ? cap * 2 : cap);
+    }
+
+    uint64_t h = hash_of(field, flen);
+    uint32_t idx = probe(field, flen, h);
+    OpenSlot& s = slots[idx];
+
+    if (s.hash > SLOT_DELETED) {
+        if (entry_vlen(s.entry) != vlen) {
+            s.entry = (char*)realloc(s.entry, 8 + flen + vlen);
+            memcpy(s.entry + 4, &vlen, 4);
+        }
+        memcpy(s.entry + 8 + flen, val, vlen);
+        return false;
+    }
+
+    if (s.hash == SLOT_DELETED) deleted--;
+    s.hash = h;
+    s.entry = make_entry(field, flen, val, vlen);
+    used++;
+    return true;
+}
+
+bool OpenTable::get(const char* field, uint32_t flen, const char** val, uint32_t* vlen){
+    uint32_t idx = probe(field, flen, hash_of(field, flen));
+    OpenSlot& s = slots[idx];
+    if (s.hash <= SLOT_DELETED) return false;
+
+    if (val) *val = s.entry + 8 + flen;
+    if (vlen) *vlen = entry_vlen(s.entry);
+    return true;
+}
+
+bool OpenTable::erase(const char* field, uint32_t flen){
+    uint32_t idx = probe(field, flen, hash_of(field, flen));
+    OpenSlot& s = slots[idx];
+    if (s.hash <= SLOT_DELETED) return false;
+
+    free(s.entry);
+    s.entry = nullptr;
+    s.hash = SLOT_DELETED;
+    used--;
+    deleted++;
+    return true;
+}
+
+bool OpenTable::slot_at(uint32_t idx, const char** field, uint32_t* flen,
+                        const char** val, uint32_t* vlen){
+    if (idx >= cap || slots[idx].hash <= SLOT_DELETED) return false;
+
+    const char* e = slots[idx].entry;
+    *flen = entry_flen(e);
+    *field = e + 8;
+    if (val) *val = e + 8 + *flen;
+    if (vlen) *vlen = entry_vlen(e);
+    return true;
+}
+
+// Linear probing keeps every entry between its home slot and the next
+// empty slot, so the run starting at bucket holds all of them.
+void OpenTable::bucket_slots(uint32_t bucket, std::vector<uint32_t>& out){
+    uint32_t mask = cap - 1;
+    for (uint32_t idx = bucket & mask; slots[idx].hash != SLOT_EMPTY;
+         idx = (idx + 1) & mask) {
+        if (slots[idx].hash > SLOT_DELETED && (slots[idx].hash & mask) == bucket)
+            out.push_back(idx);
+    }
+}
+
+size_t OpenTable::memory_usage(size_t samples){
+    size_t bytes = alloc_size(this) + alloc_size(slots);
+    size_t seen = 0, entry_bytes = 0;
+    if (!samples) {
+        for (uint32_t i = 0; i < cap; i++) {
+            if (slots[i].hash <= SLOT_DELETED) continue;
+            entry_bytes += alloc_size(slots[i].entry);
+            seen++;
+        }
+    } else {
+        // Random slots, so the sample is not the start of the array; the
+        // load stays between 1/4 and 3/4, so few probes miss.
+        static std::mt19937_64 rng(now_ns());
+        for (size_t probes = 0; used && seen < samples && probes < samples * 16; probes++) {
+            OpenSlot& s = slots[rng() % cap];
+            if (s.hash <= SLOT_DELETED) continue;
+            entry_bytes += alloc_size(s.entry);
+            seen++;
+        }
+    }
+    if (seen) bytes += entry_bytes * used / seen;
+    return bytes;
+}
@@ -0,0 +1,54 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+// Open-addressing (linear probing) table of field -> value byte strings.
+// Each entry is one malloc'd block [flen][vlen][field][value]; the slot keeps
+// the full hash next to it so probes rarely touch the entry itself.
+struct OpenSlot {
+    uint64_t hash;   // 0 = empty, 1 = deleted
+    char* entry;
+};
+
+class OpenTable {
+private:
+    OpenSlot* slots;
+    uint32_t cap;
+    uint32_t used;
+    uint32_t deleted;
+
+    static uint64_t hash_of(const char* field, uint32_t len);
+    uint32_t probe(const char* field, uint32_t len, uint64_t h);
+    void resize(uint32_t new_cap);
+
+public:
+    OpenTable(uint32_t init_cap = 16);
+    ~OpenTable();
+
+    // Returns true when the field was not present before.
+    bool set(const char* field, uint32_t flen, const char* val, uint32_t vlen);
+    bool get(const char* field, uint32_t flen, const char** val, uint32_t* vlen);
+    bool erase(const char* field, uint32_t flen);
+
+    uint32_t size(){
+        return used;
+    }
+
+    uint32_t capacity(){
+        return cap;
+    }
+
+    // Slot-level access for iteration; returns false for empty slots.
+    bool slot_at(uint32_t idx, const char** field, uint32_t* flen,
+                 const char** val, uint32_t* vlen);
+
+    // Appends the slots of the entries whose home slot (hash & (capacity-1))
+    // is bucket. Which entries share a home depends only on their hash
+    // bits, not on where probing put them, so this survives any resize.
+    void bucket_slots(uint32_t bucket, std::vector<uint32_t>& out);
+
+    // Allocated bytes, the slot array included. Entries are measured on
+    // about samples random slots and extrapolated; samples 0 measures all.
+    size_t memory_usage(size_t samples);
+};
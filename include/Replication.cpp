@@ -0,0 +1,58 @@
+#include "Replication.h"
+#include <algorithm>
+#include <cstring>
+#include <random>
+
+using namespace std;
+
+string repl_new_id(){
+    static const char hex[] = "0123456789abcdef";
+    random_device rd;
+    mt19937_64 rng(((uint64_t)rd() << 32) ^ rd());
+    string id(40, '0');
+    for (char& c : id) c = hex[rng() & 15];
+    return id;
+}
+
+ReplBacklog::ReplBacklog() : head(0), len(0), end(0) {}
+
+void ReplBacklog::create(size_t cap, uint64_t offset){
+    ring.assign(cap, 0);
+    head = len = 0;
+    end = offset;
+}
+
+void ReplBacklog::release(){
+    vector<char>().swap(ring);
+    head = len = 0;
+}
+
+void ReplBacklog::append(const char* p, size_t n){
+    if (ring.empty()) return;
+    end += n;
+
+    // Only the newest capacity() bytes can survive.
+    if (n > ring.size()) {
+        p += n - ring.size();
+        n = ring.size();
+    }
+    while (n) {
+        size_t chunk = min(n, ring.size() - head);
+        memcpy(ring.data() + head, p, chunk);
+        head = (head + chunk) % ring.size();
+        len = min(len + chunk, ring.size());
+        p += chunk;
+        n -= chunk;
+    }
+}
+
+bool ReplBacklog::copy_from(uint64_t offset, string& out) const{
+    if (ring.empty() || offset < start_offset() || offset > end) return false;
+
+    size_t n = end - offset;
+    size_t pos = (head + ring.size() - n) % ring.size();
+    size_t first = min(n, ring.size() - pos);
+    out.assign(ring.data() + pos, first);
+    out.append(ring.data(), n - first);
+    return true;
+}
@@ -0,0 +1,85 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Leader/follower replication.
+//
+// The replication stream is the binary AOF encoding (AofFormat.h): every
+// command the leader logs is also framed once per event-loop iteration and
+// sent to each follower. A stream offset counts frame bytes since the
+// leader started, so a follower that applied whole frames always sits on a
+// frame boundary.
+//
+// Handshake, on a normal client connection:
+//   follower: PSYNC <replid> <offset>      ("?" and 0 on first contact)
+//   leader:   (str) CONTINUE <replid>       then the backlog from offset
+//         or: (str) FULLRESYNC <replid> <offset>
+//             then u64 snapshot bytes | snapshot (Snapshot.h)
+//   after either, frames as they are logged.
+// Writing the snapshot can take far longer than REPL_TIMEOUT_NS, so the
+// leader keeps a waiting follower's link alive once a second: with an
+// empty reply (u32 0) before FULLRESYNC, and after it with a u64
+// REPL_SYNC_KEEPALIVE where the snapshot length goes. The snapshot is sent
+// from its file REPL_SYNC_CHUNK bytes at a time as the socket drains, and
+// the follower writes it to REPL_RECV_FILE before loading it.
+// The follower reports progress with REPLCONF ACK <offset> once a second;
+// the leader does not reply to it. An idle leader sends an empty frame once
+// a second, and either side drops a link silent for REPL_TIMEOUT_NS.
+
+#define REPL_BACKLOG_SIZE (1 << 20)
+#define REPL_SYNC_FILE "repl-sync.snap"
+#define REPL_RECV_FILE "repl-recv.snap"
+#define REPL_SYNC_CHUNK (64 * 1024)
+#define REPL_SYNC_KEEPALIVE UINT64_MAX
+#define REPL_PING_NS 1000000000ULL
+#define REPL_TIMEOUT_NS 10000000000ULL
+
+// Random 40 hex digit replication id; a new one each time a process starts
+// leading, so a follower never resumes across unrelated histories.
+std::string repl_new_id();
+
+// Ring buffer holding the last capacity() bytes of the stream, which lets a
+// follower that was briefly disconnected resume where it left off instead
+// of transferring a full snapshot again.
+class ReplBacklog {
+private:
+    std::vector<char> ring;
+    size_t head;       // next write position
+    size_t len;        // valid bytes, at most ring.size()
+    uint64_t end;      // stream offset just past the newest byte
+
+public:
+    ReplBacklog();
+
+    // Allocates cap bytes with the stream currently at offset.
+    void create(size_t cap, uint64_t offset);
+    void release();
+
+    bool active() const{
+        return !ring.empty();
+    }
+
+    size_t capacity() const{
+        return ring.size();
+    }
+
+    size_t size() const{
+        return len;
+    }
+
+    uint64_t start_offset() const{
+        return end - len;
+    }
+
+    uint64_t end_offset() const{
+        return end;
+    }
+
+    void append(const char* p, size_t n);
+
+    // Copies the stream from offset to the end. False when offset is no
+    // longer (or not yet) in the buffer.
+    bool copy_from(uint64_t offset, std::string& out) const;
+};
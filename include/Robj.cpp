@@ -1,5 +1,8 @@
 #include "Robj.h"
 #include "ZSet.h"
+#include "Hash.h"
+#include "List.h"
+#include "Set.h"
 #include <cstring>
 #include <stdlib.h>
 
@@ -23,13 +26,44 @@ Robj* create_zset_obj(){
     return o;
 }
 
+Robj* create_hash_obj(){
+    Robj* o = (Robj*)malloc(sizeof(Robj));
+    o->refcount = 1;
+    o->type = RobjType::OBJ_HASH;
+    o->ptr = new Hash();
+    o->len = 0;
+    return o;
+}
+
+Robj* create_list_obj(){
+    Robj* o = (Robj*)malloc(sizeof(Robj));
+    o->refcount = 1;
+    o->type = RobjType::OBJ_LIST;
+    o->ptr = new List();
+    o->len = 0;
+    return o;
+}
+
+Robj* create_set_obj(){
+    Robj* o = (Robj*)malloc(sizeof(Robj));
+    o->refcount = 1;
+    o->type = RobjType::OBJ_SET;
+    o->ptr = new Set();
+    o->len = 0;
+    return o;
+}
+
 void incr_refcount(Robj* o){
     o->refcount++;
 }
 
 void decr_refcount(Robj* o){
     if(--o->refcount==0){
-        free(o->ptr);
+        if(o->type == RobjType::OBJ_ZSET) delete (ZSet*)o->ptr;
+        else if(o->type == RobjType::OBJ_HASH) delete (Hash*)o->ptr;
+        else if(o->type == RobjType::OBJ_LIST) delete (List*)o->ptr;
+        else if(o->type == RobjType::OBJ_SET) delete (Set*)o->ptr;
+        else free(o->ptr);
         free(o);
     }
 }
\ No newline at end of file
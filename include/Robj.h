@@ -5,7 +5,10 @@
 enum RobjType{
     OBJ_STRING,
     OBJ_INTEGER,
-    OBJ_ZSET
+    OBJ_ZSET,
+    OBJ_HASH,
+    OBJ_LIST,
+    OBJ_SET
 };
 
 struct Robj{
@@ -17,5 +20,8 @@ struct Robj{
 
 Robj* create_obj(const char* data, uint32_t len, RobjType type);
 Robj* create_zset_obj();
+Robj* create_hash_obj();
+Robj* create_list_obj();
+Robj* create_set_obj();
 void incr_refcount(Robj* o);
 void decr_refcount(Robj* o);
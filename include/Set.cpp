@@ -0,0 +1,168 @@
+#include "Set.h"
+#include "Helper.h"
+#include "IntSet.h"
+#include "OpenTable.h"
+#include <algorithm>
+#include <string>
+#include <unordered_set>
+
+using namespace std;
+
+Set::Set(){
+    enc = SET_INTSET;
+    ints = new IntSet();
+    table = nullptr;
+}
+
+Set::~Set(){
+    delete ints;
+    delete table;
+}
+
+void Set::convert_to_table(){
+    table = new OpenTable(ints->size() * 2);
+    for (uint32_t i = 0; i < ints->size(); i++) {
+        string m = to_string(ints->at(i));
+        table->set(m.data(), m.size(), "", 0);
+    }
+    delete ints;
+    ints = nullptr;
+    enc = SET_TABLE;
+}
+
+bool Set::sadd(const char* member, uint32_t len){
+    if (enc == SET_INTSET) {
+        int64_t v;
+        if (parse_int64_strict(member, len, &v)) {
+            if (ints->contains(v)) return false;
+            if (ints->size() < SET_MAX_INTSET_ENTRIES) return ints->add(v);
+        }
+        convert_to_table();
+    }
+    return table->set(member, len, "", 0);
+}
+
+bool Set::srem(const char* member, uint32_t len){
+    if (enc == SET_TABLE) return table->erase(member, len);
+
+    int64_t v;
+    return parse_int64_strict(member, len, &v) && ints->remove(v);
+}
+
+bool Set::sismember(const char* member, uint32_t len){
+    if (enc == SET_TABLE) return table->get(member, len, nullptr, nullptr);
+
+    int64_t v;
+    return parse_int64_strict(member, len, &v) && ints->contains(v);
+}
+
+uint32_t Set::scard(){
+    return enc == SET_INTSET ? ints->size() : table->size();
+}
+
+void Set::smembers(vector<string>& out){
+    out.reserve(out.size() + scard());
+    if (enc == SET_INTSET) {
+        for (uint32_t i = 0; i < ints->size(); i++) out.push_back(to_string(ints->at(i)));
+        return;
+    }
+    for (uint32_t i = 0; i < table->capacity(); i++) {
+        const char* m;
+        uint32_t len;
+        if (table->slot_at(i, &m, &len, nullptr, nullptr)) out.emplace_back(m, len);
+    }
+}
+
+size_t set_inter(const vector<Set*>& sets, vector<string>* out, size_t limit){
+    if (sets.empty()) return 0;
+
+    bool all_ints = true;
+    for (Set* s : sets) {
+        if (!s) return 0;
+        all_ints = all_ints && s->encoding() == SET_INTSET;
+    }
+
+    if (all_ints) {
+        vector<IntSet*> ints;
+        for (Set* s : sets) ints.push_back(s->intset());
+        vector<int64_t> res;
+        size_t n = intset_intersect(ints, out ? &res : nullptr, limit);
+        if (out) {
+            for (int64_t v : res) out->push_back(to_string(v));
+        }
+        return n;
+    }
+
+    // Walk the smallest set and probe the rest.
+    Set* smallest = sets[0];
+    for (Set* s : sets) {
+        if (s->scard() < smallest->scard()) smallest = s;
+    }
+
+    vector<string> members;
+    smallest->smembers(members);
+    size_t n = 0;
+    for (auto& m : members) {
+        bool in_all = true;
+        for (Set* s : sets) {
+            if (s != smallest && !s->sismember(m.data(), m.size())) {
+                in_all = false;
+                break;
+            }
+        }
+        if (!in_all) continue;
+        if (out) out->push_back(m);
+        if (++n == limit) break;
+    }
+    return n;
+}
+
+void set_union(const vector<Set*>& sets, vector<string>& out){
+    bool all_ints = true;
+    for (Set* s : sets) {
+        if (s && s->encoding() != SET_INTSET) all_ints = false;
+    }
+
+    if (all_ints) {
+        vector<int64_t> vals;
+        for (Set* s : sets) {
+            if (!s) continue;
+            IntSet* is = s->intset();
+            for (uint32_t i = 0; i < is->size(); i++) vals.push_back(is->at(i));
+        }
+        sort(vals.begin(), vals.end());
+        vals.erase(unique(vals.begin(), vals.end()), vals.end());
+        for (int64_t v : vals) out.push_back(to_string(v));
+        return;
+    }
+
+    unordered_set<string> seen;
+    for (Set* s : sets) {
+        if (!s) continue;
+        vector<string> members;
+        s->smembers(members);
+        for (auto& m : members) {
+            if (seen.insert(m).second) out.push_back(m);
+        }
+    }
+}
+
+void set_diff(const vector<Set*>& sets, vector<string>& out){
+    if (sets.empty() || !sets[0]) return;
+
+    vector<string> members;
+    sets[0]->smembers(members);
+    for (auto& m : members) {
+        bool found = false;
+        for (size_t i = 1; i < sets.size() && !found; i++) {
+            found = sets[i] && sets[i]->sismember(m.data(), m.size());
+        }
+        if (!found) out.push_back(m);
+    }
+}
+
+size_t Set::memory_usage(size_t samples){
+    size_t bytes = alloc_size(this);
+    if (enc == SET_INTSET) return bytes + ints->memory_usage();
+    return bytes + table->memory_usage(samples);
+}
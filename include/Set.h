@@ -0,0 +1,55 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+class IntSet;
+class OpenTable;
+
+enum SetEncoding {
+    SET_INTSET,  // every member is an integer: sorted packed array
+    SET_TABLE    // OpenTable of members with empty values
+};
+
+// Integer sets stay packed up to this many members. It is set high so large
+// ID sets keep the SIMD intersection path; past it inserts would memmove
+// too much per call.
+#define SET_MAX_INTSET_ENTRIES 131072
+
+class Set {
+private:
+    SetEncoding enc;
+    IntSet* ints;
+    OpenTable* table;
+
+    void convert_to_table();
+
+public:
+    Set();
+    ~Set();
+
+    bool sadd(const char* member, uint32_t len);
+    bool srem(const char* member, uint32_t len);
+    bool sismember(const char* member, uint32_t len);
+    uint32_t scard();
+    void smembers(std::vector<std::string>& out);
+
+    SetEncoding encoding(){
+        return enc;
+    }
+
+    IntSet* intset(){
+        return ints;
+    }
+
+    // Estimated allocated bytes; see OpenTable::memory_usage.
+    size_t memory_usage(size_t samples);
+};
+
+// Multi-set operations; a missing key is passed as a null set.
+// set_inter returns the result size, capped at limit when limit > 0, and
+// only fills out when it is non-null.
+size_t set_inter(const std::vector<Set*>& sets, std::vector<std::string>* out,
+                 size_t limit = 0);
+void set_union(const std::vector<Set*>& sets, std::vector<std::string>& out);
+void set_diff(const std::vector<Set*>& sets, std::vector<std::string>& out);
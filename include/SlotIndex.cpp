@@ -0,0 +1,25 @@
+#include "SlotIndex.h"
+#include "hashmap.h"
+#include <cstring>
+
+SlotIndex::SlotIndex(){
+    memset(heads, 0, sizeof(heads));
+    memset(counts, 0, sizeof(counts));
+}
+
+void SlotIndex::add(HashEntry* e){
+    uint16_t slot = key_hash_slot((const char*)e->key->ptr, e->key->len);
+    e->slot_prev = nullptr;
+    e->slot_next = heads[slot];
+    if (heads[slot]) heads[slot]->slot_prev = e;
+    heads[slot] = e;
+    counts[slot]++;
+}
+
+void SlotIndex::remove(HashEntry* e){
+    uint16_t slot = key_hash_slot((const char*)e->key->ptr, e->key->len);
+    if (e->slot_prev) e->slot_prev->slot_next = e->slot_next;
+    else heads[slot] = e->slot_next;
+    if (e->slot_next) e->slot_next->slot_prev = e->slot_prev;
+    counts[slot]--;
+}
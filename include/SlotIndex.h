@@ -0,0 +1,29 @@
+#pragma once
+#include "Cluster.h"
+#include <cstdint>
+
+struct HashEntry;
+
+// Keys grouped by hash slot, for cluster mode. Each slot is an intrusive
+// doubly-linked list through HashEntry::slot_prev / slot_next, so counting
+// or walking one slot never scans the rest of the keyspace. Entries keep
+// their address when the table rehashes, so the lists survive it.
+class SlotIndex {
+private:
+    HashEntry* heads[CLUSTER_SLOTS];
+    uint32_t counts[CLUSTER_SLOTS];
+
+public:
+    SlotIndex();
+
+    void add(HashEntry* e);
+    void remove(HashEntry* e);
+
+    uint32_t count(uint16_t slot) const{
+        return counts[slot];
+    }
+
+    HashEntry* first(uint16_t slot) const{
+        return heads[slot];
+    }
+};
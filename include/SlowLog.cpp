@@ -0,0 +1,36 @@
+#include "SlowLog.h"
+#include <ctime>
+
+using namespace std;
+
+SlowLog::SlowLog() : next_id(0), max_len(128), threshold_us(10000) {}
+
+void SlowLog::configure(int64_t threshold, size_t len){
+    threshold_us = threshold;
+    max_len = len;
+    while (entries.size() > max_len) entries.pop_back();
+}
+
+void SlowLog::add(vector<string> argv, uint64_t usec, const string& client){
+    if (argv.size() > SLOWLOG_MAX_ARGC) {
+        size_t more = argv.size() - (SLOWLOG_MAX_ARGC - 1);
+        argv.resize(SLOWLOG_MAX_ARGC - 1);
+        argv.push_back("... (" + to_string(more) + " more arguments)");
+    }
+    for (string& a : argv) {
+        if (a.size() > SLOWLOG_MAX_ARGLEN) {
+            size_t more = a.size() - SLOWLOG_MAX_ARGLEN;
+            a.resize(SLOWLOG_MAX_ARGLEN);
+            a += "... (" + to_string(more) + " more bytes)";
+        }
+    }
+
+    entries.push_front({next_id++, (uint64_t)time(nullptr), usec, move(argv), client});
+    while (entries.size() > max_len) entries.pop_back();
+}
+
+vector<const SlowLogEntry*> SlowLog::get(size_t n) const{
+    vector<const SlowLogEntry*> out;
+    for (size_t i = 0; i < n && i < entries.size(); i++) out.push_back(&entries[i]);
+    return out;
+}
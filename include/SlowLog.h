@@ -0,0 +1,50 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <vector>
+
+// SLOWLOG: the most recent commands that ran for at least the threshold,
+// newest first. Arguments are truncated so one huge command cannot pin
+// much memory.
+#define SLOWLOG_MAX_ARGC 32
+#define SLOWLOG_MAX_ARGLEN 128
+
+struct SlowLogEntry {
+    uint64_t id;
+    uint64_t time;   // unix seconds
+    uint64_t usec;
+    std::vector<std::string> argv;
+    std::string client;
+};
+
+class SlowLog {
+private:
+    std::deque<SlowLogEntry> entries;
+    uint64_t next_id;
+    size_t max_len;
+    int64_t threshold_us;   // < 0: off, 0: every command
+
+public:
+    SlowLog();
+
+    void configure(int64_t threshold, size_t len);
+
+    bool wants(uint64_t usec) const{
+        return threshold_us >= 0 && (int64_t)usec >= threshold_us && max_len;
+    }
+
+    void add(std::vector<std::string> argv, uint64_t usec, const std::string& client);
+
+    size_t len() const{
+        return entries.size();
+    }
+
+    // Up to n entries, newest first.
+    std::vector<const SlowLogEntry*> get(size_t n) const;
+
+    void reset(){
+        entries.clear();
+    }
+};
@@ -0,0 +1,446 @@
+#include "Snapshot.h"
+#include "Crc32c.h"
+#include "Dict.h"
+#include "Hash.h"
+#include "Helper.h"
+#include "IntSet.h"
+#include "List.h"
+#include "Robj.h"
+#include "Set.h"
+#include "ZSet.h"
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+
+using namespace std;
+
+#define SNAP_MAGIC "KVSNAP"
+#define SNAP_VERSION 1
+#define SNAP_HEADER_BYTES 32
+#define SNAP_BLOCK_HEADER SNAPSHOT_BLOCK_HEADER
+#define SNAP_BLOCK_BYTES (1 << 20)
+
+enum SnapType : uint8_t {
+    SNAP_STRING = 0,
+    SNAP_INT = 1,
+    SNAP_ZSET = 2,
+    SNAP_HASH = 3,
+    SNAP_LIST = 4,
+    SNAP_SET = 5,
+    SNAP_EXPIRES = 0x80
+};
+
+static void put_u32(string& out, uint32_t v){
+    out.append((const char*)&v, 4);
+}
+
+static void put_u64(string& out, uint64_t v){
+    out.append((const char*)&v, 8);
+}
+
+static void put_varint(string& out, uint64_t v){
+    while (v >= 0x80) {
+        out.push_back((char)(v | 0x80));
+        v >>= 7;
+    }
+    out.push_back((char)v);
+}
+
+static void put_bytes(string& out, const char* p, size_t n){
+    put_varint(out, n);
+    out.append(p, n);
+}
+
+static void put_bytes(string& out, const string& s){
+    put_bytes(out, s.data(), s.size());
+}
+
+// Bounds-checked cursor over a block payload.
+struct Reader {
+    const uint8_t* p;
+    const uint8_t* end;
+    bool ok = true;
+
+    bool need(size_t n){
+        if ((size_t)(end - p) < n) ok = false;
+        return ok;
+    }
+
+    uint8_t u8(){
+        if (!need(1)) return 0;
+        return *p++;
+    }
+
+    uint64_t u64(){
+        uint64_t v = 0;
+        if (!need(8)) return 0;
+        memcpy(&v, p, 8);
+        p += 8;
+        return v;
+    }
+
+    uint64_t varint(){
+        uint64_t v = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            if (!need(1)) return 0;
+            uint8_t b = *p++;
+            v |= (uint64_t)(b & 0x7f) << shift;
+            if (!(b & 0x80)) return v;
+        }
+        ok = false;
+        return 0;
+    }
+
+    bool bytes(const char** s, uint32_t* n){
+        uint64_t len = varint();
+        if (!ok || len > UINT32_MAX || !need(len)) return false;
+        *s = (const char*)p;
+        *n = (uint32_t)len;
+        p += len;
+        return true;
+    }
+};
+
+static string header(uint64_t keys, uint64_t created){
+    string h(SNAP_MAGIC, 6);
+    uint16_t ver = SNAP_VERSION;
+    h.append((const char*)&ver, 2);
+    put_u64(h, keys);
+    put_u64(h, created);
+    put_u32(h, 0);
+    put_u32(h, crc32c(h.data(), h.size()));
+    return h;
+}
+
+bool snapshot_is_snapshot(const char* data, size_t len){
+    return len >= SNAP_HEADER_BYTES && memcmp(data, SNAP_MAGIC, 6) == 0;
+}
+
+static void encode_entry(string& out, HashEntry* e){
+    Robj* v = e->val;
+    size_t type_at = out.size();
+    out.push_back(0);
+    if (e->expires_at) {
+        out[type_at] = (char)SNAP_EXPIRES;
+        put_u64(out, e->expires_at);
+    }
+    put_bytes(out, (const char*)e->key->ptr, e->key->len);
+
+    uint8_t type;
+    vector<string> items;
+    switch (v->type) {
+    case OBJ_ZSET: {
+        type = SNAP_ZSET;
+        vector<pair<string, double>> zitems;
+        ((ZSet*)v->ptr)->items(zitems);
+        put_varint(out, zitems.size());
+        for (auto& it : zitems) {
+            put_bytes(out, it.first);
+            out.append((const char*)&it.second, 8);
+        }
+        break;
+    }
+    case OBJ_HASH:
+    case OBJ_LIST:
+    case OBJ_SET:
+        if (v->type == OBJ_HASH) {
+            type = SNAP_HASH;
+            ((Hash*)v->ptr)->hgetall(items);
+        } else if (v->type == OBJ_LIST) {
+            type = SNAP_LIST;
+            ((List*)v->ptr)->lrange(0, -1, items);
+        } else {
+            type = SNAP_SET;
+            ((Set*)v->ptr)->smembers(items);
+        }
+        put_varint(out, items.size());
+        for (auto& s : items) put_bytes(out, s);
+        break;
+    default: {
+        int64_t n;
+        const char* s = (const char*)v->ptr;
+        if (v->len <= 20 && parse_int64_strict(s, v->len, &n) &&
+            to_string(n) == string(s, v->len)) {
+            type = SNAP_INT;
+            put_varint(out, ((uint64_t)n << 1) ^ (uint64_t)(n >> 63));
+        } else {
+            type = SNAP_STRING;
+            put_bytes(out, s, v->len);
+        }
+    }
+    }
+    out[type_at] = (char)((uint8_t)out[type_at] | type);
+}
+
+void snapshot_encode_entry(string& payload, HashEntry* e){
+    encode_entry(payload, e);
+}
+
+string snapshot_block(const string& payload, uint32_t entries){
+    string b;
+    put_u32(b, payload.size());
+    put_u32(b, entries);
+    put_u32(b, crc32c(payload.data(), payload.size()));
+    return b + payload;
+}
+
+bool snapshot_write(Dict* dict, int fd){
+    uint64_t now = now_ns();
+    string h = header(dict->size(), now);
+    if (!write_all(fd, h.data(), h.size())) return false;
+
+    string block;
+    uint32_t entries = 0;
+    bool ok = true;
+
+    auto flush_block = [&]() {
+        string bh;
+        put_u32(bh, block.size());
+        put_u32(bh, entries);
+        put_u32(bh, crc32c(block.data(), block.size()));
+        ok = write_all(fd, bh.data(), bh.size()) &&
+             write_all(fd, block.data(), block.size());
+        block.clear();
+        entries = 0;
+    };
+
+    dict->for_each([&](HashEntry* e) {
+        if (!ok || (e->expires_at && e->expires_at <= now)) return;
+        encode_entry(block, e);
+        entries++;
+        if (block.size() >= SNAP_BLOCK_BYTES) flush_block();
+    });
+    if (ok && entries) flush_block();
+    if (!ok) return false;
+
+    string end;
+    put_u32(end, 0);
+    put_u32(end, 0);
+    put_u32(end, 0);
+    return write_all(fd, end.data(), end.size());
+}
+
+bool snapshot_save(Dict* dict, const string& path){
+    string tmp = path + ".tmp";
+    int fd = open(tmp.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0644);
+    if (fd < 0) return false;
+
+    bool ok = snapshot_write(dict, fd) && fsync(fd) == 0;
+    close(fd);
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+struct Decoded {
+    string key;
+    Robj* val;
+    uint64_t expires_at;
+};
+
+static Robj* decode_value(Reader& r, uint8_t type){
+    const char* s;
+    uint32_t n;
+
+    switch (type) {
+    case SNAP_STRING:
+        if (!r.bytes(&s, &n)) return nullptr;
+        return create_obj(s, n, RobjType::OBJ_STRING);
+
+    case SNAP_INT: {
+        uint64_t z = r.varint();
+        if (!r.ok) return nullptr;
+        string v = to_string((int64_t)((z >> 1) ^ -(z & 1)));
+        return create_obj(v.data(), v.size(), RobjType::OBJ_STRING);
+    }
+
+    case SNAP_ZSET: {
+        uint64_t count = r.varint();
+        if (!r.ok || count > (uint64_t)(r.end - r.p)) return nullptr;
+        vector<pair<string, double>> items;
+        items.reserve(count);
+        for (uint64_t i = 0; i < count; i++) {
+            if (!r.bytes(&s, &n) || !r.need(8)) return nullptr;
+            double score;
+            memcpy(&score, r.p, 8);
+            r.p += 8;
+            items.emplace_back(string(s, n), score);
+        }
+        Robj* o = create_zset_obj();
+        ((ZSet*)o->ptr)->bulk_load(items);
+        return o;
+    }
+
+    case SNAP_HASH:
+    case SNAP_LIST:
+    case SNAP_SET: {
+        uint64_t count = r.varint();
+        if (!r.ok || count > (uint64_t)(r.end - r.p)) return nullptr;
+        Robj* o = type == SNAP_HASH ? create_hash_obj()
+                : type == SNAP_LIST ? create_list_obj()
+                : create_set_obj();
+        for (uint64_t i = 0; i < count; i++) {
+            if (!r.bytes(&s, &n)) {
+                decr_refcount(o);
+                return nullptr;
+            }
+            if (type == SNAP_LIST) {
+                ((List*)o->ptr)->rpush(s, n);
+            } else if (type == SNAP_SET) {
+                ((Set*)o->ptr)->sadd(s, n);
+            } else {
+                const char* v;
+                uint32_t vn;
+                if (++i >= count || !r.bytes(&v, &vn)) {
+                    decr_refcount(o);
+                    return nullptr;
+                }
+                ((Hash*)o->ptr)->hset(s, n, v, vn);
+            }
+        }
+        return o;
+    }
+    }
+    return nullptr;
+}
+
+static bool decode_block(const uint8_t* p, uint32_t len, uint32_t entries,
+                         vector<Decoded>& out){
+    Reader r{p, p + len};
+    out.reserve(entries);
+    for (uint32_t i = 0; i < entries; i++) {
+        uint8_t t = r.u8();
+        uint64_t exp = t & SNAP_EXPIRES ? r.u64() : 0;
+        const char* k;
+        uint32_t kn;
+        if (!r.bytes(&k, &kn)) return false;
+        Robj* v = decode_value(r, t & ~SNAP_EXPIRES);
+        if (!v) return false;
+        out.push_back({string(k, kn), v, exp});
+    }
+    return r.ok && r.p == r.end;
+}
+
+struct BlockRef {
+    const uint8_t* p;
+    uint32_t len;
+    uint32_t entries;
+    uint32_t crc;
+};
+
+bool snapshot_load(Dict* dict, const char* data, size_t len,
+                   SnapshotLoadStats& st, size_t* consumed){
+    if (!snapshot_is_snapshot(data, len)) return false;
+
+    uint16_t ver;
+    uint32_t hcrc;
+    uint64_t keys;
+    memcpy(&ver, data + 6, 2);
+    memcpy(&keys, data + 8, 8);
+    memcpy(&hcrc, data + 28, 4);
+    if (ver != SNAP_VERSION || crc32c(data, 28) != hcrc) return false;
+
+    // Index the blocks; each one is then checked and decoded independently.
+    vector<BlockRef> blocks;
+    size_t off = SNAP_HEADER_BYTES;
+    while (true) {
+        if (len - off < SNAP_BLOCK_HEADER) return false;
+        BlockRef b;
+        memcpy(&b.len, data + off, 4);
+        memcpy(&b.entries, data + off + 4, 4);
+        memcpy(&b.crc, data + off + 8, 4);
+        off += SNAP_BLOCK_HEADER;
+        if (b.len == 0 && b.entries == 0) break;
+        if (len - off < b.len) return false;
+        b.p = (const uint8_t*)data + off;
+        off += b.len;
+        blocks.push_back(b);
+    }
+
+    vector<vector<Decoded>> decoded(blocks.size());
+    atomic<size_t> next(0);
+    atomic<bool> failed(false);
+    auto worker = [&]() {
+        size_t i;
+        while (!failed && (i = next++) < blocks.size()) {
+            const BlockRef& b = blocks[i];
+            if (crc32c(b.p, b.len) != b.crc ||
+                !decode_block(b.p, b.len, b.entries, decoded[i]))
+                failed = true;
+        }
+    };
+
+    unsigned nthreads = max(1u, thread::hardware_concurrency());
+    nthreads = max<size_t>(1, min<size_t>(nthreads, blocks.size()));
+    vector<thread> pool;
+    for (unsigned t = 1; t < nthreads; t++) pool.emplace_back(worker);
+    worker();
+    for (auto& t : pool) t.join();
+
+    if (failed) {
+        for (auto& v : decoded) {
+            for (auto& d : v) decr_refcount(d.val);
+        }
+        return false;
+    }
+
+    dict->reserve(keys);
+    uint64_t now = now_ns();
+    for (auto& v : decoded) {
+        for (auto& d : v) {
+            if (!d.expires_at || d.expires_at > now) {
+                dict->insert_obj(d.key.data(), d.key.size(), d.val, d.expires_at);
+                st.keys++;
+            }
+            decr_refcount(d.val);
+        }
+    }
+
+    st.blocks = blocks.size();
+    st.threads = nthreads;
+    if (consumed) *consumed = off;
+    return true;
+}
+
+bool snapshot_load_block(Dict* dict, const char* payload, uint32_t len,
+                         uint32_t entries, uint32_t crc, vector<string>& keys){
+    vector<Decoded> decoded;
+    if (crc32c(payload, len) != crc ||
+        !decode_block((const uint8_t*)payload, len, entries, decoded)) {
+        for (auto& d : decoded) decr_refcount(d.val);
+        return false;
+    }
+    for (auto& d : decoded) {
+        dict->insert_obj(d.key.data(), d.key.size(), d.val, d.expires_at);
+        decr_refcount(d.val);
+        keys.push_back(move(d.key));
+    }
+    return true;
+}
+
+bool snapshot_load_file(Dict* dict, const string& path, SnapshotLoadStats& st){
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat sb;
+    if (fstat(fd, &sb) != 0 || sb.st_size == 0) {
+        close(fd);
+        return false;
+    }
+
+    void* m = mmap(nullptr, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (m == MAP_FAILED) return false;
+    madvise(m, sb.st_size, MADV_WILLNEED);
+
+    bool ok = snapshot_load(dict, (const char*)m, sb.st_size, st);
+    munmap(m, sb.st_size);
+    return ok;
+}
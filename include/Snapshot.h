@@ -0,0 +1,67 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+class Dict;
+struct HashEntry;
+
+// Binary point-in-time snapshot.
+//
+//   header: "KVSNAP" | u16 version | u64 key count | u64 created (ns)
+//           | u32 reserved | u32 crc32c of the preceding 28 bytes
+//   blocks: u32 payload bytes | u32 entries | u32 crc32c(payload) | payload
+//   end:    a block header with 0 bytes and 0 entries
+//
+// A payload is a run of entries:
+//   u8 type (| SNAP_EXPIRES) | [u64 expires_at ns] | varint key len | key
+//   | value
+// Strings holding a canonical int64 are stored as a zigzag varint; zsets are
+// written in (score, member) order so loading builds the tree in O(n).
+// Blocks are ~1 MB and self-contained, which lets the loader verify and
+// decode them on all cores.
+
+#define SNAPSHOT_FILE "dump.snap"
+
+// Writes a snapshot of dict to fd. Keys already expired are skipped.
+bool snapshot_write(Dict* dict, int fd);
+
+// Writes to path + ".tmp", fsyncs and renames over path.
+bool snapshot_save(Dict* dict, const std::string& path);
+
+struct SnapshotLoadStats {
+    uint64_t keys = 0;
+    uint32_t blocks = 0;
+    uint32_t threads = 0;
+};
+
+// Loads a snapshot from memory into an empty dict. *consumed is set to the
+// snapshot's length so callers can find what follows it. Returns false on a
+// malformed or corrupt snapshot, leaving dict untouched.
+bool snapshot_load(Dict* dict, const char* data, size_t len,
+                   SnapshotLoadStats& st, size_t* consumed = nullptr);
+
+// mmaps path and loads it. False when it is missing or corrupt.
+bool snapshot_load_file(Dict* dict, const std::string& path,
+                        SnapshotLoadStats& st);
+
+// True when data starts with a snapshot header.
+bool snapshot_is_snapshot(const char* data, size_t len);
+
+// Single blocks, as slot migration ships them: SNAPSHOT_BLOCK_HEADER bytes
+// (payload bytes, entries, crc32c) then the payload.
+#define SNAPSHOT_BLOCK_HEADER 12
+
+// Appends e to a block payload.
+void snapshot_encode_entry(std::string& payload, HashEntry* e);
+
+// Prepends the block header to payload.
+std::string snapshot_block(const std::string& payload, uint32_t entries);
+
+// Verifies and decodes a block payload, then inserts its entries into dict,
+// replacing existing keys; keys gets every key decoded. Nothing is inserted
+// unless the whole block is valid.
+bool snapshot_load_block(Dict* dict, const char* payload, uint32_t len,
+                         uint32_t entries, uint32_t crc,
+                         std::vector<std::string>& keys);
@@ -1,13 +1,21 @@
 #include "ZSet.h"
 #include "AVLTree.h"
 #include "Dict.h"
+#include "Helper.h"
 #include "Robj.h"
 #include "hashmap.h"
+#include <cstdio>
 #include <string>
 #include <vector>
 
 using namespace std;
 
+static string format_score(double score){
+    char buf[32];
+    int n = snprintf(buf, sizeof(buf), "%.17g", score);
+    return string(buf, n);
+}
+
 ZSet::ZSet(){
     tree = new AVLTree();
     dict = new Dict(128);
@@ -21,12 +29,17 @@ ZSet::~ZSet(){
 bool ZSet::zadd(const char* member, uint32_t member_len,
                 const char* score,  uint32_t score_len)
 {
-    double new_score = stod(string(score, score_len));
+    return zadd(member, member_len, stod(string(score, score_len)));
+}
+
+bool ZSet::zadd(const char* member, uint32_t member_len, double new_score)
+{
+    string score = format_score(new_score);
     HashEntry* existing = dict->find_from(member, member_len);
 
     if (existing) {
         double old_score = stod(string((char*)existing->val->ptr, existing->val->len));
-        bool success = dict->insert_into(member, member_len, score, score_len);
+        bool success = dict->insert_into(member, member_len, score.data(), score.size());
 
         Robj* mem_obj = create_obj(member, member_len, RobjType::OBJ_STRING);
         tree->update(mem_obj, old_score, new_score);
@@ -34,7 +47,7 @@ bool ZSet::zadd(const char* member, uint32_t member_len,
         return success;
     }
 
-    bool success = dict->insert_into(member, member_len, score, score_len);
+    bool success = dict->insert_into(member, member_len, score.data(), score.size());
 
     Robj* mem_obj = create_obj(member, member_len, RobjType::OBJ_STRING);
     tree->insert(mem_obj, new_score);
@@ -73,3 +86,44 @@ vector<string> ZSet::zrange(int start, int end){
     }
     return out;
 }
+
+size_t ZSet::zcard(){
+    return tree->size();
+}
+
+bool ZSet::zscore(const char* member, uint32_t member_len, double& out){
+    HashEntry* e = dict->find_from(member, member_len);
+    if (!e) return false;
+    out = stod(string((char*)e->val->ptr, e->val->len));
+    return true;
+}
+
+void ZSet::items(vector<pair<string, double>>& out){
+    vector<pair<Robj*, double>> nodes;
+    tree->in_order(nodes);
+    out.reserve(out.size() + nodes.size());
+    for (auto& n : nodes){
+        out.emplace_back(string((char*)n.first->ptr, n.first->len), n.second);
+    }
+}
+
+void ZSet::bulk_load(const vector<pair<string, double>>& sorted){
+    uint32_t buckets = 128;
+    while (buckets <= sorted.size()) buckets *= 2;
+    delete dict;
+    dict = new Dict(buckets);
+
+    vector<pair<Robj*, double>> nodes;
+    nodes.reserve(sorted.size());
+    for (auto& it : sorted){
+        string sc = format_score(it.second);
+        dict->insert_into(it.first.data(), it.first.size(), sc.data(), sc.size());
+        nodes.emplace_back(create_obj(it.first.data(), it.first.size(),
+                                      RobjType::OBJ_STRING), it.second);
+    }
+    tree->build_sorted(nodes);
+}
+
+size_t ZSet::memory_usage(size_t samples){
+    return alloc_size(this) + dict->memory_usage(samples) + tree->memory_usage(samples);
+}
@@ -2,6 +2,7 @@
 #include <cstdint>
 #include <vector>
 #include <string>
+#include <utility>
 
 struct Robj;
 class Dict;
@@ -18,10 +19,27 @@ public:
 
     bool zadd(const char* member, uint32_t member_len,
               const char* score, uint32_t score_len);
+    bool zadd(const char* member, uint32_t member_len, double score);
 
     bool zrem(const char* member, uint32_t member_len);
 
     int zrank(const char* member, uint32_t member_len);
 
     std::vector<std::string> zrange(int start, int end);
+
+    size_t zcard();
+
+    bool zscore(const char* member, uint32_t member_len, double& out);
+
+    // Appends every (member, score) pair in (score, member) order.
+    void items(std::vector<std::pair<std::string, double>>& out);
+
+    // Fills an empty zset from items already sorted by (score, member) with
+    // unique members. The member dict is presized and the tree is built
+    // directly, so nothing is rebalanced or rehashed along the way.
+    void bulk_load(const std::vector<std::pair<std::string, double>>& sorted);
+
+    // Estimated allocated bytes of the member dict and the tree, each
+    // measured on samples elements; 0 measures all.
+    size_t memory_usage(size_t samples);
 };
@@ -0,0 +1,244 @@
+#include "ZSetOps.h"
+#include "ZSet.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <functional>
+#include <queue>
+#include <thread>
+
+using namespace std;
+
+// Runs fn(0..n_tasks-1) on up to hardware_concurrency threads, the calling
+// thread included. Tasks only read the source zsets and write their own slot.
+static void run_parallel(size_t n_tasks, const function<void(size_t)>& fn){
+    size_t hw = max(1u, thread::hardware_concurrency());
+    size_t n_threads = min(n_tasks, hw);
+    if (n_threads <= 1) {
+        for (size_t i = 0; i < n_tasks; i++) fn(i);
+        return;
+    }
+
+    atomic<size_t> next{0};
+    auto worker = [&]() {
+        for (size_t i; (i = next.fetch_add(1)) < n_tasks; ) fn(i);
+    };
+
+    vector<thread> threads;
+    for (size_t t = 1; t < n_threads; t++) threads.emplace_back(worker);
+    worker();
+    for (auto& t : threads) t.join();
+}
+
+static size_t partition_count(size_t n){
+    if (n < ZSETOPS_PARALLEL_THRESHOLD) return 1;
+    size_t hw = max(1u, thread::hardware_concurrency());
+    return min(hw * 4, n / (ZSETOPS_PARALLEL_THRESHOLD / 4));
+}
+
+static bool by_score(const pair<string, double>& a, const pair<string, double>& b){
+    if (a.second != b.second) return a.second < b.second;
+    return a.first < b.first;
+}
+
+static bool by_member(const pair<string, double>& a, const pair<string, double>& b){
+    return a.first < b.first;
+}
+
+// inf * 0 is NaN; treat it as 0 like Redis does.
+static double weigh(double score, double weight){
+    double r = score * weight;
+    return isnan(r) ? 0.0 : r;
+}
+
+static void aggregate(double& acc, double v, ZAggregate agg){
+    switch (agg) {
+    case ZAggregate::SUM:
+        acc += v;
+        if (isnan(acc)) acc = 0.0;
+        break;
+    case ZAggregate::MIN:
+        acc = min(acc, v);
+        break;
+    case ZAggregate::MAX:
+        acc = max(acc, v);
+        break;
+    }
+}
+
+// Joins per-partition results that are each sorted by (score, member).
+static ZSetItems merge_parts(vector<ZSetItems>& parts){
+    ZSetItems out;
+    size_t total = 0;
+    for (auto& p : parts) total += p.size();
+    out.reserve(total);
+
+    for (auto& p : parts) {
+        size_t mid = out.size();
+        out.insert(out.end(), make_move_iterator(p.begin()),
+                   make_move_iterator(p.end()));
+        if (mid > 0)
+            inplace_merge(out.begin(), out.begin() + mid, out.end(), by_score);
+        ZSetItems().swap(p);
+    }
+    return out;
+}
+
+
+struct MergeCursor {
+    const ZSetItems* items;
+    size_t pos;
+    size_t end;
+    double weight;
+};
+
+// k-way merge over member-sorted runs; equal members are aggregated.
+static void merge_runs(vector<MergeCursor>& cursors, ZAggregate agg,
+                       ZSetItems& out)
+{
+    auto greater = [](const MergeCursor* a, const MergeCursor* b) {
+        return (*a->items)[a->pos].first > (*b->items)[b->pos].first;
+    };
+    priority_queue<MergeCursor*, vector<MergeCursor*>, decltype(greater)> heap(greater);
+    for (auto& c : cursors)
+        if (c.pos < c.end) heap.push(&c);
+
+    while (!heap.empty()) {
+        MergeCursor* c = heap.top();
+        heap.pop();
+
+        const pair<string, double>& it = (*c->items)[c->pos];
+        double v = weigh(it.second, c->weight);
+        if (!out.empty() && out.back().first == it.first)
+            aggregate(out.back().second, v, agg);
+        else
+            out.emplace_back(it.first, v);
+
+        if (++c->pos < c->end) heap.push(c);
+    }
+}
+
+ZSetItems zset_union(const vector<ZSetOpInput>& inputs, ZAggregate agg){
+    size_t total = 0;
+    size_t largest = 0;
+    for (size_t i = 0; i < inputs.size(); i++) {
+        if (!inputs[i].zset) continue;
+        size_t n = inputs[i].zset->zcard();
+        total += n;
+        if (!inputs[largest].zset || n > inputs[largest].zset->zcard())
+            largest = i;
+    }
+    if (total == 0) return {};
+
+    vector<ZSetItems> runs(inputs.size());
+    auto load = [&](size_t i) {
+        if (!inputs[i].zset) return;
+        inputs[i].zset->items(runs[i]);
+        sort(runs[i].begin(), runs[i].end(), by_member);
+    };
+    if (total >= ZSETOPS_PARALLEL_THRESHOLD) run_parallel(inputs.size(), load);
+    else for (size_t i = 0; i < inputs.size(); i++) load(i);
+
+    // Split the member space at quantiles of the largest run so every
+    // partition can be merged independently.
+    size_t n_parts = partition_count(total);
+    const ZSetItems& pivot = runs[largest];
+    vector<const string*> splitters;
+    for (size_t p = 1; p < n_parts; p++)
+        splitters.push_back(&pivot[p * pivot.size() / n_parts].first);
+
+    vector<ZSetItems> parts(n_parts);
+    auto merge_part = [&](size_t p) {
+        vector<MergeCursor> cursors;
+        for (size_t i = 0; i < runs.size(); i++) {
+            const ZSetItems& r = runs[i];
+            auto lower = [&](const string* m) -> size_t {
+                return lower_bound(r.begin(), r.end(), make_pair(*m, 0.0),
+                                   by_member) - r.begin();
+            };
+            size_t lo = p == 0 ? 0 : lower(splitters[p - 1]);
+            size_t hi = p + 1 == n_parts ? r.size() : lower(splitters[p]);
+            cursors.push_back({&r, lo, hi, inputs[i].weight});
+        }
+        merge_runs(cursors, agg, parts[p]);
+        sort(parts[p].begin(), parts[p].end(), by_score);
+    };
+    run_parallel(n_parts, merge_part);
+
+    return merge_parts(parts);
+}
+
+ZSetItems zset_inter(const vector<ZSetOpInput>& inputs, ZAggregate agg){
+    if (inputs.empty()) return {};
+
+    size_t smallest = 0;
+    for (size_t i = 0; i < inputs.size(); i++) {
+        if (!inputs[i].zset) return {};
+        if (inputs[i].zset->zcard() < inputs[smallest].zset->zcard())
+            smallest = i;
+    }
+
+    ZSetItems base;
+    inputs[smallest].zset->items(base);
+
+    size_t n_parts = partition_count(base.size());
+    vector<ZSetItems> parts(n_parts);
+    auto probe_part = [&](size_t p) {
+        size_t lo = p * base.size() / n_parts;
+        size_t hi = (p + 1) * base.size() / n_parts;
+        ZSetItems& out = parts[p];
+
+        for (size_t k = lo; k < hi; k++) {
+            const string& m = base[k].first;
+            double acc = weigh(base[k].second, inputs[smallest].weight);
+            bool in_all = true;
+
+            for (size_t i = 0; i < inputs.size() && in_all; i++) {
+                if (i == smallest) continue;
+                double sc;
+                if (!inputs[i].zset->zscore(m.data(), m.size(), sc))
+                    in_all = false;
+                else
+                    aggregate(acc, weigh(sc, inputs[i].weight), agg);
+            }
+            if (in_all) out.emplace_back(m, acc);
+        }
+        sort(out.begin(), out.end(), by_score);
+    };
+    run_parallel(n_parts, probe_part);
+
+    return merge_parts(parts);
+}
+
+ZSetItems zset_diff(const vector<ZSet*>& inputs){
+    if (inputs.empty() || !inputs[0]) return {};
+
+    ZSetItems base;
+    inputs[0]->items(base);
+
+    // Filtering keeps the (score, member) order of the first set, so the
+    // partitions only need concatenating.
+    size_t n_parts = partition_count(base.size());
+    vector<ZSetItems> parts(n_parts);
+    auto probe_part = [&](size_t p) {
+        size_t lo = p * base.size() / n_parts;
+        size_t hi = (p + 1) * base.size() / n_parts;
+
+        for (size_t k = lo; k < hi; k++) {
+            const string& m = base[k].first;
+            bool found = false;
+            for (size_t i = 1; i < inputs.size() && !found; i++) {
+                double sc;
+                found = inputs[i] && inputs[i]->zscore(m.data(), m.size(), sc);
+            }
+            if (!found) parts[p].push_back(base[k]);
+        }
+    };
+    run_parallel(n_parts, probe_part);
+
+    ZSetItems out;
+    for (auto& p : parts)
+        out.insert(out.end(), make_move_iterator(p.begin()),
+                   make_move_iterator(p.end()));
+    return out;
+}
@@ -0,0 +1,33 @@
+#pragma once
+#include <cstddef>
+#include <string>
+#include <utility>
+#include <vector>
+
+class ZSet;
+
+enum class ZAggregate { SUM, MIN, MAX };
+
+// One source of a ZUNIONSTORE / ZINTERSTORE. A missing key is passed as a
+// null zset and behaves like an empty set.
+struct ZSetOpInput {
+    ZSet* zset;
+    double weight;
+};
+
+typedef std::vector<std::pair<std::string, double>> ZSetItems;
+
+// Inputs above this many members are merged/probed on worker threads.
+const size_t ZSETOPS_PARALLEL_THRESHOLD = 1 << 16;
+
+// All three return (member, score) pairs sorted by (score, member), ready to
+// be handed to ZSet::bulk_load.
+
+// k-way merge of every input, each snapshotted and sorted by member.
+ZSetItems zset_union(const std::vector<ZSetOpInput>& inputs, ZAggregate agg);
+
+// Walks the smallest input and hash-probes the rest.
+ZSetItems zset_inter(const std::vector<ZSetOpInput>& inputs, ZAggregate agg);
+
+// Members of the first input that are in none of the others, scores kept.
+ZSetItems zset_diff(const std::vector<ZSet*>& inputs);
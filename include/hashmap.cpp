@@ -1,11 +1,13 @@
 #include "Robj.h"
 #include "hashmap.h"
 #include "Helper.h"
+#include "SlotIndex.h"
 #include <cstdint>
 #include <cstring>
+#include <random>
 using namespace std;
 
-static uint64_t hash_helper(const char* key , uint32_t key_len){
+uint64_t hash_bytes(const char* key , uint32_t key_len){
     uint64_t h = 1469598103934665603ULL;
 
     for(uint32_t i = 0; i<key_len; i++){
@@ -17,12 +19,13 @@ static uint64_t hash_helper(const char* key , uint32_t key_len){
 }
 
 uint64_t HashTable::hash(const char* key, uint32_t key_len){
-    return hash_helper(key, key_len)%bucket_count;
+    return hash_bytes(key, key_len)%bucket_count;
 }
 
-HashTable::HashTable(uint32_t init_buckets){
+HashTable::HashTable(uint32_t init_buckets, SlotIndex* index){
     bucket_count = init_buckets;
     size = 0;
+    slot_index = index;
     table = (HashEntry**)calloc(init_buckets, sizeof(HashEntry*));
 }
 
@@ -91,6 +94,7 @@ bool HashTable::insert(Robj* key, Robj* val, uint64_t expires_at){
         ptr->next = nullptr;
         ptr->expires_at = expires_at;
         table[table_key] = ptr;
+        if (slot_index) slot_index->add(ptr);
         return true;
     }
 
@@ -108,6 +112,7 @@ bool HashTable::insert(Robj* key, Robj* val, uint64_t expires_at){
     newEntry->expires_at = expires_at;
     table[table_key] = newEntry;
     size++;
+    if (slot_index) slot_index->add(newEntry);
     return true;
 }
 
@@ -120,6 +125,7 @@ bool HashTable::erase(Robj* key){
         if (ptr->key->len == key->len && memcmp(ptr->key->ptr, key->ptr, key->len) == 0){
             if(prev) prev->next = ptr->next; 
             else table[table_key] = ptr->next;
+            if (slot_index) slot_index->remove(ptr);
             
             decr_refcount(ptr->val);
             decr_refcount(ptr->key);
@@ -136,6 +142,48 @@ bool HashTable::erase(Robj* key){
     return false;
 }
 
+void HashTable::prefetch(const char* key, uint32_t len, bool deep){
+    HashEntry** slot = &table[hash(key, len)];
+    if (!deep) {
+        __builtin_prefetch(slot);
+        return;
+    }
+    HashEntry* e = *slot;
+    if (e) {
+        __builtin_prefetch(e);
+        __builtin_prefetch(e->key);
+    }
+}
+
+void HashTable::prefetch_stage(uint64_t h, int stage){
+    HashEntry** slot = &table[h % bucket_count];
+    if (stage == 0) {
+        __builtin_prefetch(slot);
+        return;
+    }
+    HashEntry* e = *slot;
+    if (!e) return;
+    if (stage == 1) {
+        __builtin_prefetch(e);
+    } else if (stage == 2) {
+        __builtin_prefetch(e->key);
+        __builtin_prefetch(e->val);
+    } else {
+        __builtin_prefetch(e->key->ptr);
+        __builtin_prefetch(e->val->ptr);
+    }
+}
+
+HashEntry* HashTable::find_hashed(const char* key, uint32_t len, uint64_t h){
+    HashEntry* curr = table[h % bucket_count];
+    while (curr) {
+        if (curr->key->len == len && memcmp(curr->key->ptr, key, len) == 0)
+            return curr;
+        curr = curr->next;
+    }
+    return nullptr;
+}
+
 HashEntry* HashTable::bucket_at_idx(uint64_t idx){
     if(idx>=bucket_count) return nullptr;
     return table[idx];
@@ -159,4 +207,32 @@ uint32_t HashTable::get_size(){
 
 void HashTable::set_null(uint64_t idx){
     table[idx] = nullptr;
-}
\ No newline at end of file
+}
+
+size_t HashTable::bucket_bytes(){
+    return alloc_size(this) + alloc_size(table);
+}
+
+size_t HashTable::memory_usage(size_t samples){
+    size_t bytes = bucket_bytes();
+    size_t seen = 0, entry_bytes = 0;
+    auto measure = [&](HashEntry* e) {
+        entry_bytes += alloc_size(e) + alloc_size(e->key) + alloc_size(e->key->ptr) +
+                       alloc_size(e->val) + alloc_size(e->val->ptr);
+        seen++;
+    };
+    if (!samples) {
+        for (uint32_t i = 0; i < bucket_count; i++)
+            for (HashEntry* e = table[i]; e; e = e->next) measure(e);
+    } else {
+        // Whole chains of random buckets, as in Dict::sample. Scanning from
+        // bucket 0 would favour the low buckets and, on a sparse table or
+        // the old table of a rehash (empty below rehash_idx), could walk
+        // millions of empty ones; the probes are capped instead.
+        static mt19937_64 rng(now_ns());
+        for (size_t probes = 0; size && seen < samples && probes < samples * 16; probes++)
+            for (HashEntry* e = table[rng() % bucket_count]; e; e = e->next) measure(e);
+    }
+    if (seen) bytes += entry_bytes * size / seen;
+    return bytes;
+}
@@ -4,12 +4,19 @@
 #include <cstddef>
 #include <string>
 
+// FNV-1a over raw bytes; shared by every table in the store.
+uint64_t hash_bytes(const char* key, uint32_t key_len);
+
+class SlotIndex;
 
 struct HashEntry{
     Robj* key;
     Robj* val;
     struct HashEntry* next;
     uint64_t expires_at;
+    // Neighbours in the key's hash slot; see SlotIndex.h.
+    struct HashEntry* slot_prev;
+    struct HashEntry* slot_next;
 };
 
 class HashTable{
@@ -17,12 +24,13 @@ class HashTable{
     HashEntry** table;
     uint32_t size;
     uint32_t bucket_count;
+    SlotIndex* slot_index;
 
     uint64_t hash(const char* key, uint32_t len);
 
     public:
     
-    HashTable(uint32_t init_buckets);
+    HashTable(uint32_t init_buckets, SlotIndex* index = nullptr);
 
     ~HashTable();
 
@@ -45,7 +53,31 @@ class HashTable{
     }
 
     HashEntry* bucket_at_idx(uint64_t idx);
+
+    // Pulls key's bucket slot (deep=false) or, once that is cached, the
+    // first entry of its chain and that entry's key into cache ahead of a
+    // lookup.
+    void prefetch(const char* key, uint32_t len, bool deep);
+
+    // One stage of a batched prefetch for the key whose hash_bytes() is h:
+    // 0 the bucket slot, 1 the chain's first entry, 2 its key and value
+    // objects, 3 their bytes. Each stage reads only what the one before
+    // brought in, so running all keys through a stage before the next
+    // overlaps their misses.
+    void prefetch_stage(uint64_t h, int stage);
+
+    // find() for a key whose hash_bytes() is already known.
+    HashEntry* find_hashed(const char* key, uint32_t len, uint64_t h);
     
     uint32_t get_size();
     void decrement_size();
+
+    // Allocated bytes of the table and its bucket array, without entries.
+    size_t bucket_bytes();
+
+    // bucket_bytes() plus the entries with their key and value objects,
+    // measured on about samples entries from random buckets and
+    // extrapolated (samples 0 measures all). Values count as strings, so this fits tables whose
+    // values are, like a zset's member dict.
+    size_t memory_usage(size_t samples);
 };
\ No newline at end of file
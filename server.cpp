@@ -1,22 +1,47 @@
+#include "include/Aof.h"
+#include "include/AofFormat.h"
+#include "include/AofRewrite.h"
+#include "include/Bitops.h"
+#include "include/Cluster.h"
 #include "include/Dict.h"
+#include "include/Hash.h"
 #include "include/Helper.h"
+#include "include/HyperLogLog.h"
+#include "include/IoThreads.h"
+#include "include/Latency.h"
+#include "include/List.h"
+#include "include/Replication.h"
 #include "include/Robj.h"
+#include "include/Set.h"
+#include "include/SlowLog.h"
+#include "include/Snapshot.h"
 #include "include/ZSet.h"
+#include "include/ZSetOps.h"
 #include "include/hashmap.h"
 #include <arpa/inet.h>
 #include <bits/stdc++.h>
 #include <cstring>
 #include <fcntl.h>
+#include <malloc.h>
+#include <netdb.h>
+#include <netinet/tcp.h>
 #include <stdlib.h>
 #include <string>
 #include <sys/epoll.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <unistd.h>
 #include <unordered_map>
 
-#define MAX_EVENTS 10
+#define MAX_EVENTS 256
 #define MAX_LEN 4096
+// MEMORY: elements measured per aggregate value, and keys sampled by
+// MEMORY STATS and BIGKEYS, unless SAMPLES says otherwise.
+#define MEMORY_ELEMENT_SAMPLES 5
+#define MEMORY_KEY_SAMPLES 10000
 
 using namespace std;
 
@@ -26,12 +51,56 @@ uint64_t g_last_ops_time_ns = 0;
 uint64_t g_last_ops_count = 0;
 uint64_t g_ops_per_sec = 0;
 
-int aof_fd = -1;
+// Commands run in the last whole second, refreshed by the event loop.
+void update_ops_per_sec() {
+  uint64_t now = now_ns();
+  if (now - g_last_ops_time_ns >= 1000000000ULL) {
+    g_ops_per_sec = g_total_commands - g_last_ops_count;
+    g_last_ops_count = g_total_commands;
+    g_last_ops_time_ns = now;
+  }
+}
+
+Aof aof;
 
 bool aof_loading = false;
 
 Dict *dict = new Dict(128);
 
+// Snapshot state: the BGSAVE child, if any, and the last save / load.
+pid_t bgsave_pid = -1;
+uint64_t bgsave_start_ns = 0;
+// BGREWRITEAOF asked for while the BGSAVE child runs; starts when it exits.
+bool aof_rewrite_scheduled = false;
+bool last_save_ok = true;
+uint64_t last_save_ms = 0;
+uint64_t last_load_ms = 0;
+SnapshotLoadStats last_load;
+
+// What the last AOF load replayed after the preamble, and cut off.
+uint64_t aof_load_records = 0;
+uint64_t aof_load_truncated = 0;
+bool aof_use_preamble = true;
+
+// Replication. A leader encodes every logged command into repl_buf as well;
+// the loop frames it once per iteration into the backlog and onto each
+// follower's link. A follower pulls its leader's stream and rejects writes
+// from clients.
+string repl_id = repl_new_id();
+ReplBacklog repl_backlog;
+size_t repl_backlog_size = REPL_BACKLOG_SIZE;
+string repl_buf;
+uint32_t repl_buf_records = 0;
+bool replica_mode = false;
+
+// Cluster mode: the slots this node serves; keys of other slots are
+// redirected to their owner. While a slot migrates away, migrating_keys
+// holds the keys of the batch the target has not acknowledged yet.
+Cluster cluster;
+int migrating_slot = -1;
+int migrating_to = -1;
+unordered_set<string> migrating_keys;
+
 enum ConnectionState { READING, WRITING, CLOSED };
 
 enum RequestType {
@@ -49,12 +118,129 @@ enum RequestType {
   TTL,
   INFO,
   UNKNOWN,
-  PEXPIREAT
+  PEXPIREAT,
+  ZUNIONSTORE,
+  ZINTERSTORE,
+  ZDIFFSTORE,
+  HSET,
+  HGET,
+  HMGET,
+  HDEL,
+  HGETALL,
+  HINCRBY,
+  HLEN,
+  HSCAN,
+  LPUSH,
+  RPUSH,
+  LPOP,
+  RPOP,
+  LRANGE,
+  LLEN,
+  LTRIM,
+  BLPOP,
+  BRPOP,
+  SADD,
+  SREM,
+  SISMEMBER,
+  SMEMBERS,
+  SCARD,
+  SINTER,
+  SINTERCARD,
+  SUNION,
+  SDIFF,
+  SETBIT,
+  GETBIT,
+  BITCOUNT,
+  BITOP,
+  BITPOS,
+  PFADD,
+  PFCOUNT,
+  PFMERGE,
+  CLIENT_DURABLE,
+  CLIENT_TRACKING,
+  WAITAOF,
+  BGREWRITEAOF,
+  SETHEX,
+  SAVE,
+  BGSAVE,
+  PSYNC,
+  REPLCONF_ACK,
+  REPLICAOF,
+  CLUSTER,
+  ASKING,
+  MGET,
+  MSET,
+  MSETNX,
+  MULTI,
+  EXEC,
+  DISCARD,
+  WATCH,
+  UNWATCH,
+  SLOWLOG,
+  LATENCY,
+  MEMORY,
+  NUM_REQUEST_TYPES
 };
 
-volatile sig_atomic_t g_running = 1;
+// Names for INFO commandstats / latencystats, in RequestType order.
+static const char *const request_names[] = {
+    "get",          "set",          "delete",      "exists",
+    "keys",         "zadd",         "zrem",        "zrank",
+    "zrange",       "expire",       "persist",     "ttl",
+    "info",         "unknown",      "pexpireat",   "zunionstore",
+    "zinterstore",  "zdiffstore",   "hset",        "hget",
+    "hmget",        "hdel",         "hgetall",     "hincrby",
+    "hlen",         "hscan",        "lpush",       "rpush",
+    "lpop",         "rpop",         "lrange",      "llen",
+    "ltrim",        "blpop",        "brpop",       "sadd",
+    "srem",         "sismember",    "smembers",    "scard",
+    "sinter",       "sintercard",   "sunion",      "sdiff",
+    "setbit",       "getbit",       "bitcount",    "bitop",
+    "bitpos",       "pfadd",        "pfcount",     "pfmerge",
+    "client_durable", "client_tracking", "waitaof", "bgrewriteaof",
+    "sethex",       "save",         "bgsave",      "psync",
+    "replconf_ack", "replicaof",    "cluster",     "asking",
+    "mget",         "mset",         "msetnx",      "multi",
+    "exec",         "discard",      "watch",       "unwatch",
+    "slowlog",      "latency",      "memory"};
+static_assert(sizeof(request_names) / sizeof(request_names[0]) ==
+                  NUM_REQUEST_TYPES,
+              "request_names out of sync with RequestType");
+
+// Timings in ticks (Latency.h), converted to microseconds only for INFO.
+// Replay is not counted.
+CommandStats command_stats[NUM_REQUEST_TYPES];
+// Busy time of whole event-loop iterations, epoll_wait excluded.
+LatencyHistogram loop_latency;
+
+// SLOWLOG and the LATENCY monitor. current_client_fd is the connection
+// whose command is running, -1 for internal work.
+SlowLog slowlog;
+LatencyMonitor latency_monitor;
+int current_client_fd = -1;
+
+// Adds a LATENCY sample for event, timed from start (ticks).
+void latency_since(const char *event, uint64_t start) {
+  latency_monitor.add_sample(event, ticks_to_us(ticks_now() - start));
+}
+
+void on_dict_latency(const char *event, uint64_t ticks) {
+  latency_monitor.add_sample(event, ticks_to_us(ticks));
+}
+
+// "ip:port" of the peer on fd, empty when there is none.
+string client_addr(int fd) {
+  sockaddr_in sa{};
+  socklen_t len = sizeof(sa);
+  if (fd < 0 || getpeername(fd, (sockaddr *)&sa, &len) < 0 ||
+      sa.sin_family != AF_INET)
+    return "";
+  char ip[INET_ADDRSTRLEN];
+  inet_ntop(AF_INET, &sa.sin_addr, ip, sizeof(ip));
+  return string(ip) + ":" + to_string(ntohs(sa.sin_port));
+}
 
-uint64_t last_fsync = 0;
+volatile sig_atomic_t g_running = 1;
 
 void signal_handler(int signum) {
   (void)signum;
@@ -66,12 +252,97 @@ struct parsed_request {
   char *key;
   char *arg1;
   char *arg2;
+  vector<string> args; // trailing tokens of variadic commands
+  bool asking = false; // preceded by ASKING on the same connection
 };
 
 struct Response {
   string payload;
+
+  // Set by BLPOP/BRPOP when every list was empty: the connection parks on
+  // these keys instead of sending payload.
+  vector<string> block_keys;
+  bool block_left = true;
+  uint64_t block_deadline = 0; // absolute ns, 0 = wait forever
+
+  // CLIENT DURABLE: 1 / 0 switches the connection's reply mode.
+  int durable = -1;
+  // WAITAOF: hold payload until everything logged so far is on disk.
+  bool wait_aof = false;
+
+  // PSYNC: the connection becomes a follower's replication link, resuming
+  // at repl_offset of history psync_id when possible.
+  bool psync = false;
+  string psync_id;
+  // REPLCONF ACK: the follower has applied up to repl_offset. No reply.
+  bool repl_ack = false;
+  uint64_t repl_offset = 0;
+
+  // ASKING: the next command may use a slot being imported.
+  bool asking = false;
+  // CLUSTER IMPORT: the connection now carries migration blocks for slot.
+  int import_slot = -1;
+
+  // WATCH: keys the connection now watches.
+  vector<string> watch_keys;
+
+  // CLIENT TRACKING: 1 / 0 turns tracking on or off; BCAST with prefixes.
+  int tracking = -1;
+  bool tracking_bcast = false;
+  vector<string> tracking_prefixes;
 };
 
+class Connection;
+
+// Clients parked in BLPOP/BRPOP per key in arrival order, their deadlines,
+// and the keys pushed to since the parked clients were last served.
+unordered_map<string, deque<Connection *>> blocked_clients;
+set<pair<uint64_t, Connection *>> block_deadlines;
+unordered_set<string> ready_keys;
+
+// Connections with replies held until the AOF is synced past their writes.
+unordered_set<Connection *> held_clients;
+
+// WATCHed keys and the connections watching each.
+unordered_map<string, vector<Connection *>> watched_keys;
+
+// CLIENT TRACKING: tracking connections by id, and the keys they read
+// mapped to the ids that read them. The table holds at most
+// tracking_max_keys keys; BCAST connections are notified of every key under
+// one of their prefixes instead.
+unordered_map<uint64_t, Connection *> tracking_clients;
+unordered_map<string, vector<uint64_t>> tracking_table;
+vector<pair<string, uint64_t>> tracking_prefixes;
+size_t tracking_max_keys = 1000000;
+uint64_t tracking_invalidations = 0;
+uint64_t next_client_id = 1;
+
+// Every change to a key goes through signal_modified_key (defined after
+// Connection), which fails watching transactions and invalidates tracking
+// clients. Callers skip it while nobody is observing keys.
+inline bool keys_observed() {
+  return !watched_keys.empty() || !tracking_clients.empty();
+}
+void signal_modified_key(const string &key);
+void signal_all_keys_modified();
+void tracking_invalidate(const string &key);
+
+// --io-threads: socket reads, framing and reply writes run on these, and
+// connections with replies queued since the last write-out wait here.
+IoThreads io_threads;
+vector<int> pending_writes;
+
+// Replication links of attached followers, and the replication entry points
+// defined after Connection.
+unordered_set<Connection *> replicas;
+void repl_attach(Connection *c, const string &id, uint64_t offset);
+void replicaof(const string &host, uint16_t port);
+void replication_info(string &out);
+bool start_slot_migration(uint16_t slot, int node, string &err);
+void migration_info(string &out);
+// Allocated bytes of all client connections and their buffers.
+size_t clients_memory();
+
 class Server {
 private:
   int epoll_fd = -1;
@@ -131,6 +402,10 @@ public:
       }
 
       set_non_blocking(cfd);
+      // An invalidation push is a lone small write; with Nagle it would
+      // wait for the client's delayed ACK of the previous reply.
+      int one = 1;
+      setsockopt(cfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
       ev.events = EPOLLIN | EPOLLET;
       ev.data.fd = cfd;
       epoll_ctl(epoll_fd, EPOLL_CTL_ADD, cfd, &ev);
@@ -169,12 +444,21 @@ public:
       p.type = SET;
       p.key = alloc_copy(tokens[1]);
       p.arg1 = alloc_copy(tokens[2]);
-    } else if (cmd == "DELETE" && tokens.size() == 2) {
+    } else if (cmd == "DELETE" && tokens.size() >= 2) {
       p.type = DELETE;
       p.key = alloc_copy(tokens[1]);
-    } else if (cmd == "EXISTS" && tokens.size() == 2) {
+      p.args.assign(tokens.begin() + 2, tokens.end());
+    } else if (cmd == "EXISTS" && tokens.size() >= 2) {
       p.type = EXISTS;
       p.key = alloc_copy(tokens[1]);
+      p.args.assign(tokens.begin() + 2, tokens.end());
+    } else if (cmd == "MGET" && tokens.size() >= 2) {
+      p.type = MGET;
+      p.args.assign(tokens.begin() + 1, tokens.end());
+    } else if ((cmd == "MSET" || cmd == "MSETNX") && tokens.size() >= 3 &&
+               tokens.size() % 2 == 1) {
+      p.type = cmd == "MSET" ? MSET : MSETNX;
+      p.args.assign(tokens.begin() + 1, tokens.end());
     } else if (cmd == "KEYS" && tokens.size() == 1) {
       p.type = KEYS;
     } else if (cmd == "EXPIRE" && tokens.size() == 3) {
@@ -184,8 +468,10 @@ public:
     } else if (cmd == "TTL" && tokens.size() == 2) {
       p.type = TTL;
       p.key = alloc_copy(tokens[1]);
-    } else if (cmd == "INFO" && tokens.size() == 1) {
+    } else if (cmd == "INFO" && tokens.size() <= 2) {
       p.type = INFO;
+      if (tokens.size() == 2)
+        p.arg1 = alloc_copy(tokens[1]);
     } else if (cmd == "PERSIST" && tokens.size() == 2) {
       p.type = PERSIST;
       p.key = alloc_copy(tokens[1]);
@@ -211,14 +497,476 @@ public:
       p.key = alloc_copy(tokens[1]);
       p.arg1 = alloc_copy(tokens[2]);
       p.arg2 = alloc_copy(tokens[3]);
+    } else if ((cmd == "ZUNIONSTORE" || cmd == "ZINTERSTORE" ||
+                cmd == "ZDIFFSTORE") &&
+               tokens.size() >= 4) {
+      p.type = cmd == "ZUNIONSTORE"   ? ZUNIONSTORE
+               : cmd == "ZINTERSTORE" ? ZINTERSTORE
+                                      : ZDIFFSTORE;
+      p.key = alloc_copy(tokens[1]);
+      p.args.assign(tokens.begin() + 2, tokens.end());
+    } else if (cmd == "HSET" && tokens.size() >= 4 && tokens.size() % 2 == 0) {
+      p.type = HSET;
+      p.key = alloc_copy(tokens[1]);
+      p.args.assign(tokens.begin() + 2, tokens.end());
+    } else if (cmd == "HGET" && tokens.size() == 3) {
+      p.type = HGET;
+      p.key = alloc_copy(tokens[1]);
+      p.arg1 = alloc_copy(tokens[2]);
+    } else if ((cmd == "HMGET" || cmd == "HDEL") && tokens.size() >= 3) {
+      p.type = cmd == "HMGET" ? HMGET : HDEL;
+      p.key = alloc_copy(tokens[1]);
+      p.args.assign(tokens.begin() + 2, tokens.end());
+    } else if ((cmd == "HGETALL" || cmd == "HLEN") && tokens.size() == 2) {
+      p.type = cmd == "HGETALL" ? HGETALL : HLEN;
+      p.key = alloc_copy(tokens[1]);
+    } else if (cmd == "HINCRBY" && tokens.size() == 4) {
+      p.type = HINCRBY;
+      p.key = alloc_copy(tokens[1]);
+      p.arg1 = alloc_copy(tokens[2]);
+      p.arg2 = alloc_copy(tokens[3]);
+    } else if (cmd == "HSCAN" && (tokens.size() == 3 || tokens.size() == 5)) {
+      p.type = HSCAN;
+      p.key = alloc_copy(tokens[1]);
+      p.args.assign(tokens.begin() + 2, tokens.end());
+    } else if ((cmd == "LPUSH" || cmd == "RPUSH") && tokens.size() >= 3) {
+      p.type = cmd == "LPUSH" ? LPUSH : RPUSH;
+      p.key = alloc_copy(tokens[1]);
+      p.args.assign(tokens.begin() + 2, tokens.end());
+    } else if ((cmd == "LPOP" || cmd == "RPOP" || cmd == "LLEN") &&
+               tokens.size() == 2) {
+      p.type = cmd == "LPOP" ? LPOP : cmd == "RPOP" ? RPOP : LLEN;
+      p.key = alloc_copy(tokens[1]);
+    } else if ((cmd == "LRANGE" || cmd == "LTRIM") && tokens.size() == 4) {
+      p.type = cmd == "LRANGE" ? LRANGE : LTRIM;
+      p.key = alloc_copy(tokens[1]);
+      p.arg1 = alloc_copy(tokens[2]);
+      p.arg2 = alloc_copy(tokens[3]);
+    } else if ((cmd == "BLPOP" || cmd == "BRPOP") && tokens.size() >= 3) {
+      p.type = cmd == "BLPOP" ? BLPOP : BRPOP;
+      p.args.assign(tokens.begin() + 1, tokens.end());
+    } else if ((cmd == "SADD" || cmd == "SREM") && tokens.size() >= 3) {
+      p.type = cmd == "SADD" ? SADD : SREM;
+      p.key = alloc_copy(tokens[1]);
+      p.args.assign(tokens.begin() + 2, tokens.end());
+    } else if (cmd == "SISMEMBER" && tokens.size() == 3) {
+      p.type = SISMEMBER;
+      p.key = alloc_copy(tokens[1]);
+      p.arg1 = alloc_copy(tokens[2]);
+    } else if ((cmd == "SMEMBERS" || cmd == "SCARD") && tokens.size() == 2) {
+      p.type = cmd == "SMEMBERS" ? SMEMBERS : SCARD;
+      p.key = alloc_copy(tokens[1]);
+    } else if ((cmd == "SINTER" || cmd == "SUNION" || cmd == "SDIFF") &&
+               tokens.size() >= 2) {
+      p.type = cmd == "SINTER" ? SINTER : cmd == "SUNION" ? SUNION : SDIFF;
+      p.args.assign(tokens.begin() + 1, tokens.end());
+    } else if (cmd == "SINTERCARD" && tokens.size() >= 3) {
+      p.type = SINTERCARD;
+      p.args.assign(tokens.begin() + 1, tokens.end());
+    } else if (cmd == "SETBIT" && tokens.size() == 4) {
+      p.type = SETBIT;
+      p.key = alloc_copy(tokens[1]);
+      p.arg1 = alloc_copy(tokens[2]);
+      p.arg2 = alloc_copy(tokens[3]);
+    } else if (cmd == "GETBIT" && tokens.size() == 3) {
+      p.type = GETBIT;
+      p.key = alloc_copy(tokens[1]);
+      p.arg1 = alloc_copy(tokens[2]);
+    } else if ((cmd == "BITCOUNT" && (tokens.size() == 2 || tokens.size() == 4)) ||
+               (cmd == "BITPOS" && tokens.size() >= 3 && tokens.size() <= 5)) {
+      p.type = cmd == "BITCOUNT" ? BITCOUNT : BITPOS;
+      p.key = alloc_copy(tokens[1]);
+      p.args.assign(tokens.begin() + 2, tokens.end());
+    } else if (cmd == "PFADD" && tokens.size() >= 2) {
+      p.type = PFADD;
+      p.key = alloc_copy(tokens[1]);
+      p.args.assign(tokens.begin() + 2, tokens.end());
+    } else if ((cmd == "PFCOUNT" || cmd == "PFMERGE") && tokens.size() >= 2) {
+      p.type = cmd == "PFCOUNT" ? PFCOUNT : PFMERGE;
+      p.args.assign(tokens.begin() + 1, tokens.end());
+    } else if (cmd == "CLIENT" && tokens.size() == 3 &&
+               tokens[1] == "DURABLE") {
+      p.type = CLIENT_DURABLE;
+      p.arg1 = alloc_copy(tokens[2]);
+    } else if (cmd == "CLIENT" && tokens.size() >= 3 &&
+               tokens[1] == "TRACKING") {
+      p.type = CLIENT_TRACKING;
+      p.arg1 = alloc_copy(tokens[2]);
+      p.args.assign(tokens.begin() + 3, tokens.end());
+    } else if (cmd == "WAITAOF" && tokens.size() == 1) {
+      p.type = WAITAOF;
+    } else if (cmd == "SAVE" && tokens.size() == 1) {
+      p.type = SAVE;
+    } else if (cmd == "BGSAVE" && tokens.size() == 1) {
+      p.type = BGSAVE;
+    } else if (cmd == "BGREWRITEAOF" && tokens.size() == 1) {
+      p.type = BGREWRITEAOF;
+    } else if (cmd == "SETHEX" && tokens.size() == 3) {
+      // Written by AOF rewrites for values that are not protocol-safe;
+      // only accepted while replaying.
+      p.type = SETHEX;
+      p.key = alloc_copy(tokens[1]);
+      p.arg1 = alloc_copy(tokens[2]);
+    } else if (cmd == "ASKING" && tokens.size() == 1) {
+      p.type = ASKING;
+    } else if ((cmd == "MULTI" || cmd == "EXEC" || cmd == "DISCARD" ||
+                cmd == "UNWATCH") &&
+               tokens.size() == 1) {
+      p.type = cmd == "MULTI"     ? MULTI
+               : cmd == "EXEC"    ? EXEC
+               : cmd == "DISCARD" ? DISCARD
+                                  : UNWATCH;
+    } else if (cmd == "WATCH" && tokens.size() >= 2) {
+      p.type = WATCH;
+      p.args.assign(tokens.begin() + 1, tokens.end());
+    } else if (cmd == "SLOWLOG" && (tokens.size() == 2 || tokens.size() == 3)) {
+      p.type = SLOWLOG;
+      p.arg1 = alloc_copy(tokens[1]);
+      if (tokens.size() == 3)
+        p.arg2 = alloc_copy(tokens[2]);
+    } else if (cmd == "LATENCY" && tokens.size() >= 2) {
+      p.type = LATENCY;
+      p.arg1 = alloc_copy(tokens[1]);
+      p.args.assign(tokens.begin() + 2, tokens.end());
+    } else if (cmd == "MEMORY" && tokens.size() >= 2) {
+      // MEMORY USAGE names a key, which cluster mode routes on.
+      p.type = MEMORY;
+      p.arg1 = alloc_copy(tokens[1]);
+      size_t rest = 2;
+      if (strcasecmp(tokens[1].c_str(), "USAGE") == 0 && tokens.size() >= 3)
+        p.key = alloc_copy(tokens[rest++]);
+      p.args.assign(tokens.begin() + rest, tokens.end());
+    } else if (cmd == "CLUSTER" && tokens.size() >= 2) {
+      p.type = CLUSTER;
+      p.arg1 = alloc_copy(tokens[1]);
+      p.args.assign(tokens.begin() + 2, tokens.end());
+    } else if (cmd == "PSYNC" && tokens.size() == 3) {
+      p.type = PSYNC;
+      p.arg1 = alloc_copy(tokens[1]);
+      p.arg2 = alloc_copy(tokens[2]);
+    } else if (cmd == "REPLCONF" && tokens.size() == 3 && tokens[1] == "ACK") {
+      p.type = REPLCONF_ACK;
+      p.arg1 = alloc_copy(tokens[2]);
+    } else if (cmd == "REPLICAOF" && tokens.size() == 3) {
+      p.type = REPLICAOF;
+      p.arg1 = alloc_copy(tokens[1]);
+      p.arg2 = alloc_copy(tokens[2]);
+    } else if (cmd == "BITOP" && tokens.size() >= 4) {
+      p.type = BITOP;
+      p.arg1 = alloc_copy(tokens[1]);
+      p.key = alloc_copy(tokens[2]);
+      p.args.assign(tokens.begin() + 3, tokens.end());
     }
 
     return p;
   }
 
+  // INFO with no section: server, stats, persistence, replication and
+  // cluster state.
+  static void default_info(string &info) {
+    uint64_t now = now_ns();
+    int key_count = dict->count_keys();
+
+    std::ostringstream out;
+    out << "# Server\n";
+    out << "uptime_sec:" << ((now - g_start_time_ns) / 1000000000ULL) << "\n";
+    out << "aof_enabled:" << (aof.enabled() ? 1 : 0) << "\n";
+    out << "io_threads:" << io_threads.count() << "\n";
+    out << "io_threaded_batches:" << io_threads.batches_run() << "\n";
+    out << "io_threaded_jobs:" << io_threads.jobs_run() << "\n";
+
+    out << "# Stats\n";
+    out << "total_commands_processed:" << g_total_commands << "\n";
+    out << "ops_per_sec:" << g_ops_per_sec << "\n";
+    out << "key_count:" << key_count << "\n";
+    out << "tracking_clients:" << tracking_clients.size() << "\n";
+    out << "tracking_total_keys:" << tracking_table.size() << "\n";
+    out << "tracking_invalidations:" << tracking_invalidations << "\n";
+
+    out << "# Snapshot\n";
+    out << "snapshot_bgsave_in_progress:" << (bgsave_pid > 0 ? 1 : 0) << "\n";
+    out << "snapshot_last_save_status:" << (last_save_ok ? "ok" : "err")
+        << "\n";
+    out << "snapshot_last_save_ms:" << last_save_ms << "\n";
+    out << "snapshot_last_load_ms:" << last_load_ms << "\n";
+    out << "snapshot_last_load_keys:" << last_load.keys << "\n";
+
+    info += out.str();
+    if (aof.enabled()) {
+      aof.info(info);
+      info += "aof_load_tail_records:" + to_string(aof_load_records) + "\n";
+      info += "aof_load_truncated_bytes:" + to_string(aof_load_truncated) +
+              "\n";
+    }
+    memory_info(info);
+    replication_info(info);
+    info += "# Cluster\n";
+    info += "cluster_enabled:" + to_string(cluster.enabled() ? 1 : 0) + "\n";
+    if (cluster.enabled()) {
+      info += "cluster_slots_owned:" + to_string(cluster.slots_owned()) + "\n";
+      info += "cluster_known_nodes:" +
+              to_string(cluster.all_nodes().size()) + "\n";
+      migration_info(info);
+    }
+  }
+
+  // One line per command type that has run:
+  //   cmdstat_get:calls=N,usec=N,usec_per_call=N.NN,failed_calls=N
+  static void commandstats_info(string &info) {
+    double tpn = ticks_per_ns();
+    info += "# Commandstats\n";
+    char buf[160];
+    for (int t = 0; t < NUM_REQUEST_TYPES; t++) {
+      const CommandStats &s = command_stats[t];
+      if (!s.calls)
+        continue;
+      double usec = s.ticks / tpn / 1000.0;
+      snprintf(buf, sizeof(buf),
+               "cmdstat_%s:calls=%llu,usec=%llu,usec_per_call=%.2f,"
+               "failed_calls=%llu\n",
+               request_names[t], (unsigned long long)s.calls,
+               (unsigned long long)usec, usec / s.calls,
+               (unsigned long long)s.failed);
+      info += buf;
+    }
+  }
+
+  // p50 / p99 / p99.9 in microseconds per command type, and for whole
+  // event-loop iterations.
+  static void latencystats_info(string &info) {
+    double tpn = ticks_per_ns();
+    info += "# Latencystats\n";
+    for (int t = 0; t < NUM_REQUEST_TYPES; t++) {
+      const LatencyHistogram &h = command_stats[t].hist;
+      if (h.count())
+        info += "latency_percentiles_usec_" + string(request_names[t]) + ":" +
+                h.percentiles_usec(tpn) + "\n";
+    }
+    if (loop_latency.count())
+      info += "latency_percentiles_usec_event_loop:" +
+              loop_latency.percentiles_usec(tpn) + "\n";
+  }
+
+  // Resident set size from /proc/self/statm, 0 when unreadable.
+  static size_t process_rss() {
+    unsigned long pages = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f) {
+      if (fscanf(f, "%*s %lu", &pages) != 1)
+        pages = 0;
+      fclose(f);
+    }
+    return pages * sysconf(_SC_PAGESIZE);
+  }
+
+  // Allocator totals and the overheads outside the dataset: the main
+  // table's bucket arrays, the expiry heap, client connections, the AOF
+  // buffers and replication. All cheap to compute; no key is visited.
+  static void memory_info(string &info) {
+    struct mallinfo2 mi = mallinfo2();
+    size_t used = mi.uordblks + mi.hblkhd;
+    size_t rss = process_rss();
+    size_t tables = dict->table_bytes();
+    size_t expires = dict->expiry_bytes();
+    size_t clients = clients_memory();
+    size_t aof_buf = aof.memory_usage();
+    size_t repl = repl_backlog.capacity() + repl_buf.capacity();
+
+    char ratio[32];
+    snprintf(ratio, sizeof(ratio), "%.2f", used ? (double)rss / used : 0.0);
+    info += "# Memory\n";
+    info += "used_memory:" + to_string(used) + "\n";
+    info += "used_memory_rss:" + to_string(rss) + "\n";
+    info += "mem_fragmentation_ratio:" + string(ratio) + "\n";
+    info += "mem_overhead_hashtable_main:" + to_string(tables) + "\n";
+    info += "mem_overhead_expires:" + to_string(expires) + "\n";
+    info += "mem_overhead_clients:" + to_string(clients) + "\n";
+    info += "mem_overhead_aof_buffer:" + to_string(aof_buf) + "\n";
+    info += "mem_overhead_repl:" + to_string(repl) + "\n";
+    info += "mem_overhead_total:" +
+            to_string(tables + expires + clients + aof_buf + repl) + "\n";
+  }
+
+  static const char *type_name(RobjType t) {
+    switch (t) {
+    case OBJ_ZSET:
+      return "zset";
+    case OBJ_HASH:
+      return "hash";
+    case OBJ_LIST:
+      return "list";
+    case OBJ_SET:
+      return "set";
+    default:
+      return "string";
+    }
+  }
+
+  // Elements in a value; bytes for a string.
+  static uint64_t value_length(Robj *o) {
+    switch (o->type) {
+    case OBJ_ZSET:
+      return ((ZSet *)o->ptr)->zcard();
+    case OBJ_HASH:
+      return ((Hash *)o->ptr)->hlen();
+    case OBJ_LIST:
+      return ((List *)o->ptr)->llen();
+    case OBJ_SET:
+      return ((Set *)o->ptr)->scard();
+    default:
+      return o->len;
+    }
+  }
+
+  // Allocated bytes of one key: its entry, the key and value objects and
+  // the value's structure, aggregates measured on samples elements (0:
+  // all). The expiry heap item of a key with a TTL is not included.
+  static size_t entry_memory(HashEntry *e, size_t samples) {
+    size_t bytes = alloc_size(e) + alloc_size(e->key) +
+                   alloc_size(e->key->ptr) + alloc_size(e->val);
+    void *v = e->val->ptr;
+    switch (e->val->type) {
+    case OBJ_ZSET:
+      return bytes + ((ZSet *)v)->memory_usage(samples);
+    case OBJ_HASH:
+      return bytes + ((Hash *)v)->memory_usage(samples);
+    case OBJ_LIST:
+      return bytes + ((List *)v)->memory_usage();
+    case OBJ_SET:
+      return bytes + ((Set *)v)->memory_usage(samples);
+    default:
+      return bytes + alloc_size(v);
+    }
+  }
+
+  // Per-type totals over sampled keys, with the biggest key by memory.
+  struct TypeMemory {
+    uint64_t keys = 0;
+    uint64_t bytes = 0;
+    string biggest;
+    uint64_t biggest_bytes = 0;
+    uint64_t biggest_length = 0;
+  };
+
+  // Measures up to samples random keys (every key when samples is 0) into
+  // out by type name. Returns how many keys were drawn, expired ones
+  // included, so totals scale by dict->size() / drawn.
+  static size_t sample_memory(uint64_t samples,
+                              map<string, TypeMemory> &out) {
+    vector<HashEntry *> entries;
+    dict->sample(samples ? samples : dict->size(), entries);
+    uint64_t now = now_ns();
+    for (HashEntry *e : entries) {
+      if (e->expires_at && e->expires_at <= now)
+        continue;
+      size_t bytes = entry_memory(e, MEMORY_ELEMENT_SAMPLES);
+      TypeMemory &t = out[type_name(e->val->type)];
+      t.keys++;
+      t.bytes += bytes;
+      if (bytes > t.biggest_bytes) {
+        t.biggest.assign((char *)e->key->ptr, e->key->len);
+        t.biggest_bytes = bytes;
+        t.biggest_length = value_length(e->val);
+      }
+    }
+    return entries.size();
+  }
+
+  // MEMORY STATS: memory_info plus the dataset by type, estimated from
+  // sampled keys.
+  static void memory_stats(uint64_t samples, string &info) {
+    map<string, TypeMemory> types;
+    size_t drawn = sample_memory(samples, types);
+    double scale = drawn ? (double)dict->size() / drawn : 0;
+    uint64_t total = 0;
+    for (auto &t : types)
+      total += t.second.bytes;
+
+    memory_info(info);
+    info += "# Dataset\n";
+    info += "dataset_keys:" + to_string(dict->size()) + "\n";
+    info += "dataset_keys_sampled:" + to_string(drawn) + "\n";
+    info += "dataset_bytes:" + to_string((uint64_t)(total * scale)) + "\n";
+    for (auto &t : types) {
+      info += "dataset_" + t.first +
+              ":keys=" + to_string((uint64_t)(t.second.keys * scale)) +
+              ",bytes=" + to_string((uint64_t)(t.second.bytes * scale)) +
+              ",avg_bytes=" + to_string(t.second.bytes / t.second.keys) +
+              "\n";
+    }
+  }
+
+  // [SAMPLES n] after a MEMORY subcommand.
+  static bool parse_samples(const vector<string> &args, uint64_t &n) {
+    if (args.empty())
+      return true;
+    string opt = args[0];
+    for (char &c : opt)
+      c = toupper((unsigned char)c);
+    return args.size() == 2 && opt == "SAMPLES" && parse_u64(args[1].c_str(), n);
+  }
+
+  // Runs p and charges its time to command_stats, the LATENCY monitor and
+  // SLOWLOG.
   static Response process_request(parsed_request p) {
+    uint64_t start = ticks_now();
+    Response r = run_request(p);
+    if (!aof_loading)
+      record_command(p, start, r);
+    free_request(p);
+    return r;
+  }
+
+  static void record_command(const parsed_request &p, uint64_t start,
+                             const Response &r) {
+    uint64_t ticks = ticks_now() - start;
+    command_stats[p.type].record(ticks, r.payload.compare(0, 5, "(err)") == 0);
+
+    uint64_t usec = ticks_to_us(ticks);
+    latency_monitor.add_sample("command", usec);
+    if (slowlog.wants(usec))
+      slowlog.add(request_argv(p), usec, client_addr(current_client_fd));
+  }
+
+  // The command line p was parsed from, near enough for SLOWLOG: the name
+  // and then the fields in the order the parser fills them.
+  static vector<string> request_argv(const parsed_request &p) {
+    string name = request_names[p.type];
+    for (char &c : name)
+      c = c == '_' ? ' ' : toupper((unsigned char)c);
+    vector<string> argv{name};
+    // These take a subcommand or operation before the key.
+    bool arg1_first = p.type == BITOP || p.type == CLUSTER ||
+                      p.type == SLOWLOG || p.type == LATENCY ||
+                      p.type == MEMORY;
+    if (arg1_first && p.arg1)
+      argv.push_back(p.arg1);
+    if (p.key)
+      argv.push_back(p.key);
+    if (!arg1_first && p.arg1)
+      argv.push_back(p.arg1);
+    if (p.arg2)
+      argv.push_back(p.arg2);
+    argv.insert(argv.end(), p.args.begin(), p.args.end());
+    return argv;
+  }
+
+  // Does not free p; process_request does, after timing it.
+  static Response run_request(parsed_request &p) {
     Response r;
 
+    // Replay and replication apply whatever they are given.
+    if (cluster.enabled() && !aof_loading && !cluster_route(p, r.payload)) {
+      return r;
+    }
+
+    // A follower's dataset only changes through its leader's stream.
+    if (replica_mode && !aof_loading && is_write_command(p.type)) {
+      r.payload = ser_err(3, "READONLY You can't write against a read only "
+                             "replica");
+      return r;
+    }
+
     auto is_zset = [](HashEntry *e) {
       return e && e->val->type == RobjType::OBJ_ZSET;
     };
@@ -229,6 +977,8 @@ public:
       HashEntry *e = dict->find_from(p.key, strlen(p.key));
       if (!e) {
         r.payload = ser_nil();
+      } else if (e->val->type != RobjType::OBJ_STRING) {
+        r.payload = ser_wrongtype();
       } else {
         r.payload = ser_str((const char *)e->val->ptr, e->val->len);
       }
@@ -243,6 +993,10 @@ public:
     }
 
     case DELETE: {
+      if (!p.args.empty()) {
+        r.payload = ser_int(delete_keys(p));
+        break;
+      }
       bool ok = dict->erase_from(p.key, strlen(p.key));
       if (ok)
         aof_append("DELETE " + string(p.key));
@@ -250,6 +1004,52 @@ public:
       break;
     }
 
+    case MGET: {
+      vector<HashEntry *> found;
+      dict->find_many(p.args, found);
+      vector<string> elems;
+      elems.reserve(found.size());
+      for (HashEntry *e : found) {
+        if (e && e->val->type == RobjType::OBJ_STRING)
+          elems.push_back(ser_str((const char *)e->val->ptr, e->val->len));
+        else
+          elems.push_back(ser_nil());
+      }
+      r.payload = ser_arr_of(elems);
+      break;
+    }
+
+    case MSET:
+    case MSETNX: {
+      vector<string> keys;
+      for (size_t i = 0; i < p.args.size(); i += 2)
+        keys.push_back(p.args[i]);
+      if (p.type == MSETNX) {
+        vector<HashEntry *> found;
+        dict->find_many(keys, found);
+        bool any = false;
+        for (HashEntry *e : found)
+          any = any || e;
+        if (any) {
+          r.payload = ser_int(0);
+          break;
+        }
+      } else {
+        dict->prefetch_many(keys);
+      }
+
+      string cmd = "MSET";
+      for (size_t i = 0; i < p.args.size(); i += 2) {
+        const string &k = p.args[i];
+        const string &v = p.args[i + 1];
+        dict->insert_into(k.data(), k.size(), v.data(), v.size());
+        cmd += " " + k + " " + v;
+      }
+      aof_append(cmd);
+      r.payload = p.type == MSET ? ser_nil() : ser_int(1);
+      break;
+    }
+
     case EXPIRE: {
       try {
         uint64_t sec = stoull(p.arg1);
@@ -311,6 +1111,17 @@ public:
     }
 
     case EXISTS: {
+      if (!p.args.empty()) {
+        vector<string> keys{p.key};
+        keys.insert(keys.end(), p.args.begin(), p.args.end());
+        vector<HashEntry *> found;
+        dict->find_many(keys, found);
+        long long n = 0;
+        for (HashEntry *e : found)
+          n += e != nullptr;
+        r.payload = ser_int(n);
+        break;
+      }
       bool ok = dict->find_from(p.key, strlen(p.key)) != nullptr;
       r.payload = ser_int(ok ? 1 : 0);
       break;
@@ -390,261 +1201,3591 @@ public:
     }
 
     case INFO: {
-      uint64_t now = now_ns();
+      string section = p.arg1 ? p.arg1 : "default";
+      for (char &c : section)
+        c = tolower((unsigned char)c);
+      bool all = section == "all" || section == "everything";
+      string info;
+      if (all || section == "default")
+        default_info(info);
+      else if (section == "memory")
+        memory_info(info);
+      if (all || section == "commandstats")
+        commandstats_info(info);
+      if (all || section == "latencystats")
+        latencystats_info(info);
+      r.payload = "(info)\n" + info;
+      break;
+    }
 
-      // calculate ops/sec approx every second
-      if (now - g_last_ops_time_ns >= 1000000000ULL) {
-        uint64_t diff = g_total_commands - g_last_ops_count;
-        g_ops_per_sec = diff;
-        g_last_ops_count = g_total_commands;
-        g_last_ops_time_ns = now;
+    case ZUNIONSTORE:
+    case ZINTERSTORE:
+    case ZDIFFSTORE: {
+      vector<ZSetOpInput> inputs;
+      ZAggregate agg = ZAggregate::SUM;
+      string err;
+      if (!parse_zsetop_args(p.args, p.type != ZDIFFSTORE, inputs, agg, err)) {
+        r.payload = ser_err(3, err);
+        break;
+      }
+      bool wrongtype = false;
+      for (size_t i = 0; i < inputs.size() && !wrongtype; i++) {
+        const string &k = p.args[i + 1];
+        HashEntry *e = dict->find_from(k.data(), k.size());
+        wrongtype = e && e->val->type != RobjType::OBJ_ZSET;
+        inputs[i].zset = e && !wrongtype ? (ZSet *)e->val->ptr : nullptr;
+      }
+      if (wrongtype) {
+        r.payload = ser_wrongtype();
+        break;
       }
 
-      int key_count = dict->count_keys(); // we write this next
+      ZSetItems result;
+      if (p.type == ZUNIONSTORE) {
+        result = zset_union(inputs, agg);
+      } else if (p.type == ZINTERSTORE) {
+        result = zset_inter(inputs, agg);
+      } else {
+        vector<ZSet *> sets;
+        for (auto &in : inputs)
+          sets.push_back(in.zset);
+        result = zset_diff(sets);
+      }
 
-      std::ostringstream out;
-      out << "# Server\n";
-      out << "uptime_sec:" << ((now - g_start_time_ns) / 1000000000ULL) << "\n";
-      out << "aof_enabled:" << (aof_fd >= 0 ? 1 : 0) << "\n";
+      // The destination is replaced wholesale (and loses any TTL), even
+      // when it was one of the sources.
+      uint32_t klen = strlen(p.key);
+      dict->erase_from(p.key, klen);
+      if (!result.empty()) {
+        dict->insert_into(p.key, klen);
+        HashEntry *e = dict->find_from(p.key, klen);
+        ((ZSet *)e->val->ptr)->bulk_load(result);
+      }
 
-      out << "# Stats\n";
-      out << "total_commands_processed:" << g_total_commands << "\n";
-      out << "ops_per_sec:" << g_ops_per_sec << "\n";
-      out << "key_count:" << key_count << "\n";
+      string cmd = p.type == ZUNIONSTORE   ? "ZUNIONSTORE "
+                   : p.type == ZINTERSTORE ? "ZINTERSTORE "
+                                           : "ZDIFFSTORE ";
+      aof_append(join_args(cmd + p.key, p.args));
 
-      r.payload = "(info)\n" + out.str();
+      r.payload = ser_int(result.size());
       break;
     }
 
-    default:
-      r.payload = ser_err(1, "Unknown cmd");
+    case HSET: {
+      HashEntry *e = find_or_create(p.key, create_hash_obj);
+      if (e->val->type != RobjType::OBJ_HASH) {
+        r.payload = ser_wrongtype();
+        break;
+      }
+      Hash *h = (Hash *)e->val->ptr;
+      int added = 0;
+      string line = "HSET " + string(p.key);
+      for (size_t i = 0; i + 1 < p.args.size(); i += 2) {
+        const string &f = p.args[i], &v = p.args[i + 1];
+        added += h->hset(f.data(), f.size(), v.data(), v.size());
+        line += " " + f + " " + v;
+      }
+      aof_append(line);
+      r.payload = ser_int(added);
+      break;
     }
 
-    if (p.key)
-      free(p.key);
-    if (p.arg1)
-      free(p.arg1);
-    if (p.arg2)
-      free(p.arg2);
-
-    g_total_commands++;
-
-    return r;
-  }
-
-  static string ser_err(int code, const string &msg) {
-    return "(err) " + to_string(code) + " " + msg;
-  }
-
-  static string ser_nil() { return "(nil)"; }
-
-  static string ser_str(const char *buf, uint32_t len) {
-    string out = "(str) ";
-    out.append(buf, len);
-    return out;
-  }
-
-  static string ser_int(int v) { return "(int) " + to_string(v); }
+    case HGET: {
+      HashEntry *e = dict->find_from(p.key, strlen(p.key));
+      const char *v;
+      uint32_t vlen;
+      if (!e) {
+        r.payload = ser_nil();
+      } else if (e->val->type != RobjType::OBJ_HASH) {
+        r.payload = ser_wrongtype();
+      } else if (!((Hash *)e->val->ptr)->hget(p.arg1, strlen(p.arg1), &v, &vlen)) {
+        r.payload = ser_nil();
+      } else {
+        r.payload = ser_str(v, vlen);
+      }
+      break;
+    }
 
-  static string ser_arr(const vector<string> &elems) {
-    string out = "(arr) len=" + to_string(elems.size()) + "\n";
-    for (auto &e : elems) {
-      out += ser_str(e.data(), e.size()) + "\n";
+    case HMGET: {
+      HashEntry *e = dict->find_from(p.key, strlen(p.key));
+      if (e && e->val->type != RobjType::OBJ_HASH) {
+        r.payload = ser_wrongtype();
+        break;
+      }
+      vector<string> elems;
+      for (auto &f : p.args) {
+        const char *v;
+        uint32_t vlen;
+        if (e && ((Hash *)e->val->ptr)->hget(f.data(), f.size(), &v, &vlen))
+          elems.push_back(ser_str(v, vlen));
+        else
+          elems.push_back(ser_nil());
+      }
+      r.payload = ser_arr_of(elems);
+      break;
     }
-    out += "(arr) end";
-    return out;
-  }
 
-  static void aof_append(const string &raw_cmd) {
-    if (aof_loading)
-      return;
-    if (aof_fd < 0)
-      return;
-    string line = raw_cmd + "\n";
-    write(aof_fd, line.data(), line.size());
-  }
+    case HDEL: {
+      uint32_t klen = strlen(p.key);
+      HashEntry *e = dict->find_from(p.key, klen);
+      if (!e) {
+        r.payload = ser_int(0);
+        break;
+      } else if (e->val->type != RobjType::OBJ_HASH) {
+        r.payload = ser_wrongtype();
+        break;
+      }
+      Hash *h = (Hash *)e->val->ptr;
+      int removed = 0;
+      string line = "HDEL " + string(p.key);
+      for (auto &f : p.args) {
+        if (h->hdel(f.data(), f.size())) {
+          removed++;
+          line += " " + f;
+        }
+      }
+      if (h->hlen() == 0)
+        dict->erase_from(p.key, klen);
+      if (removed)
+        aof_append(line);
+      r.payload = ser_int(removed);
+      break;
+    }
 
-  static void aof_replay() {
-    aof_loading = true;
-    ifstream in("appendonly.aof");
-    if (!in.is_open()) {
-      cerr << "[AOF] no file found, skipping replay\n";
-      return;
+    case HGETALL: {
+      HashEntry *e = dict->find_from(p.key, strlen(p.key));
+      vector<string> out;
+      if (e && e->val->type != RobjType::OBJ_HASH) {
+        r.payload = ser_wrongtype();
+        break;
+      }
+      if (e)
+        ((Hash *)e->val->ptr)->hgetall(out);
+      r.payload = ser_arr(out);
+      break;
     }
 
-    string line;
-    while (getline(in, line)) {
-      if (line.empty())
-        continue;
+    case HINCRBY: {
+      long long by;
+      try {
+        by = stoll(p.arg2);
+      } catch (...) {
+        r.payload = ser_err(3, "ERR value is not an integer or out of range");
+        break;
+      }
+      HashEntry *e = find_or_create(p.key, create_hash_obj);
+      if (e->val->type != RobjType::OBJ_HASH) {
+        r.payload = ser_wrongtype();
+        break;
+      }
+      Hash *h = (Hash *)e->val->ptr;
+      uint32_t flen = strlen(p.arg1);
+      long long cur = 0;
+      const char *v;
+      uint32_t vlen;
+      if (h->hget(p.arg1, flen, &v, &vlen)) {
+        try {
+          size_t used;
+          string s(v, vlen);
+          cur = stoll(s, &used);
+          if (used != s.size())
+            throw invalid_argument("trailing");
+        } catch (...) {
+          r.payload = ser_err(3, "ERR hash value is not an integer");
+          break;
+        }
+      }
+      long long next;
+      if (__builtin_add_overflow(cur, by, &next)) {
+        r.payload = ser_err(3, "ERR increment or decrement would overflow");
+        break;
+      }
+      string sv = to_string(next);
+      h->hset(p.arg1, flen, sv.data(), sv.size());
+      // Logged as the resulting value so replay does not depend on order.
+      aof_append("HSET " + string(p.key) + " " + p.arg1 + " " + sv);
+      r.payload = ser_int(next);
+      break;
+    }
 
-      parsed_request p = Server::parse_request(line);
+    case HLEN: {
+      HashEntry *e = dict->find_from(p.key, strlen(p.key));
+      if (!e)
+        r.payload = ser_int(0);
+      else if (e->val->type != RobjType::OBJ_HASH)
+        r.payload = ser_wrongtype();
+      else
+        r.payload = ser_int(((Hash *)e->val->ptr)->hlen());
+      break;
+    }
 
-      if (p.type == UNKNOWN) {
-        cerr << "[AOF] ignoring unknown command: " << line << "\n";
-        continue;
+    case HSCAN: {
+      uint64_t cursor, count = 10;
+      if (!parse_u64(p.args[0].c_str(), cursor) ||
+          (p.args.size() == 3 &&
+           (p.args[1] != "COUNT" || !parse_u64(p.args[2].c_str(), count) ||
+            count == 0))) {
+        r.payload = ser_err(3, "ERR syntax error");
+        break;
       }
-
-      Response r = Server::process_request(p);
+      // Any count past the table size means the same thing.
+      count = min<uint64_t>(count, UINT32_MAX);
+      HashEntry *e = dict->find_from(p.key, strlen(p.key));
+      if (e && e->val->type != RobjType::OBJ_HASH) {
+        r.payload = ser_wrongtype();
+        break;
+      }
+      // First element is the next cursor, then field/value pairs.
+      vector<string> out{"0"};
+      if (e)
+        out[0] = to_string(((Hash *)e->val->ptr)->hscan(cursor, count, out));
+      r.payload = ser_arr(out);
+      break;
     }
 
-    cerr << "[AOF] replay finished\n";
-    aof_loading = false;
-  }
+    case LPUSH:
+    case RPUSH: {
+      HashEntry *e = find_or_create(p.key, create_list_obj);
+      if (e->val->type != RobjType::OBJ_LIST) {
+        r.payload = ser_wrongtype();
+        break;
+      }
+      List *l = (List *)e->val->ptr;
+      for (auto &v : p.args) {
+        if (p.type == LPUSH)
+          l->lpush(v.data(), v.size());
+        else
+          l->rpush(v.data(), v.size());
+      }
+      aof_append(join_args(string(p.type == LPUSH ? "LPUSH " : "RPUSH ") + p.key,
+                           p.args));
+      if (blocked_clients.count(p.key))
+        ready_keys.insert(p.key);
+      r.payload = ser_int(l->llen());
+      break;
+    }
+
+    case LPOP:
+    case RPOP: {
+      uint32_t klen = strlen(p.key);
+      HashEntry *e = dict->find_from(p.key, klen);
+      if (!e) {
+        r.payload = ser_nil();
+      } else if (e->val->type != RobjType::OBJ_LIST) {
+        r.payload = ser_wrongtype();
+      } else {
+        string v;
+        pop_logged(p.key, (List *)e->val->ptr, p.type == LPOP, v);
+        r.payload = ser_str(v.data(), v.size());
+      }
+      break;
+    }
+
+    case LLEN: {
+      HashEntry *e = dict->find_from(p.key, strlen(p.key));
+      if (!e)
+        r.payload = ser_int(0);
+      else if (e->val->type != RobjType::OBJ_LIST)
+        r.payload = ser_wrongtype();
+      else
+        r.payload = ser_int(((List *)e->val->ptr)->llen());
+      break;
+    }
+
+    case LRANGE:
+    case LTRIM: {
+      int64_t start, stop;
+      try {
+        start = stoll(p.arg1);
+        stop = stoll(p.arg2);
+      } catch (...) {
+        r.payload = ser_err(3, "ERR value is not an integer or out of range");
+        break;
+      }
+      uint32_t klen = strlen(p.key);
+      HashEntry *e = dict->find_from(p.key, klen);
+      if (e && e->val->type != RobjType::OBJ_LIST) {
+        r.payload = ser_wrongtype();
+        break;
+      }
+      List *l = e ? (List *)e->val->ptr : nullptr;
+      if (p.type == LRANGE) {
+        vector<string> out;
+        if (l)
+          l->lrange(start, stop, out);
+        r.payload = ser_arr(out);
+        break;
+      }
+      if (l) {
+        l->ltrim(start, stop);
+        if (l->llen() == 0)
+          dict->erase_from(p.key, klen);
+        aof_append("LTRIM " + string(p.key) + " " + p.arg1 + " " + p.arg2);
+      }
+      r.payload = ser_int(1);
+      break;
+    }
+
+    case BLPOP:
+    case BRPOP: {
+      double timeout;
+      try {
+        timeout = stod(p.args.back());
+      } catch (...) {
+        timeout = -1;
+      }
+      if (timeout < 0) {
+        r.payload = ser_err(3, "ERR timeout is not a float or out of range");
+        break;
+      }
+
+      bool left = p.type == BLPOP;
+      vector<string> keys(p.args.begin(), p.args.end() - 1);
+      bool done = false;
+      for (auto &k : keys) {
+        HashEntry *e = dict->find_from(k.data(), k.size());
+        if (!e)
+          continue;
+        if (e->val->type != RobjType::OBJ_LIST) {
+          r.payload = ser_wrongtype();
+        } else {
+          string v;
+          pop_logged(k, (List *)e->val->ptr, left, v);
+          r.payload = ser_arr({k, v});
+        }
+        done = true;
+        break;
+      }
+      if (!done) {
+        r.block_keys = keys;
+        r.block_left = left;
+        if (timeout > 0)
+          r.block_deadline = now_ns() + (uint64_t)(timeout * 1e9);
+      }
+      break;
+    }
+
+    case SADD: {
+      HashEntry *e = find_or_create(p.key, create_set_obj);
+      if (e->val->type != RobjType::OBJ_SET) {
+        r.payload = ser_wrongtype();
+        break;
+      }
+      Set *set = (Set *)e->val->ptr;
+      int added = 0;
+      for (auto &m : p.args)
+        added += set->sadd(m.data(), m.size());
+      if (added)
+        aof_append(join_args("SADD " + string(p.key), p.args));
+      r.payload = ser_int(added);
+      break;
+    }
+
+    case SREM: {
+      uint32_t klen = strlen(p.key);
+      HashEntry *e = dict->find_from(p.key, klen);
+      if (!e) {
+        r.payload = ser_int(0);
+        break;
+      } else if (e->val->type != RobjType::OBJ_SET) {
+        r.payload = ser_wrongtype();
+        break;
+      }
+      Set *set = (Set *)e->val->ptr;
+      vector<string> removed;
+      for (auto &m : p.args) {
+        if (set->srem(m.data(), m.size()))
+          removed.push_back(m);
+      }
+      if (set->scard() == 0)
+        dict->erase_from(p.key, klen);
+      if (!removed.empty())
+        aof_append(join_args("SREM " + string(p.key), removed));
+      r.payload = ser_int(removed.size());
+      break;
+    }
+
+    case SISMEMBER:
+    case SMEMBERS:
+    case SCARD: {
+      HashEntry *e = dict->find_from(p.key, strlen(p.key));
+      if (e && e->val->type != RobjType::OBJ_SET) {
+        r.payload = ser_wrongtype();
+        break;
+      }
+      Set *set = e ? (Set *)e->val->ptr : nullptr;
+      if (p.type == SISMEMBER) {
+        r.payload = ser_int(set && set->sismember(p.arg1, strlen(p.arg1)));
+      } else if (p.type == SCARD) {
+        r.payload = ser_int(set ? set->scard() : 0);
+      } else {
+        vector<string> out;
+        if (set)
+          set->smembers(out);
+        r.payload = ser_arr(out);
+      }
+      break;
+    }
+
+    case SINTER:
+    case SUNION:
+    case SDIFF: {
+      vector<Set *> sets;
+      if (!lookup_sets(p.args.begin(), p.args.end(), sets)) {
+        r.payload = ser_wrongtype();
+        break;
+      }
+      vector<string> out;
+      if (p.type == SINTER)
+        set_inter(sets, &out);
+      else if (p.type == SUNION)
+        set_union(sets, out);
+      else
+        set_diff(sets, out);
+      r.payload = ser_arr(out);
+      break;
+    }
+
+    case SINTERCARD: {
+      // numkeys key [key ...] [LIMIT n]
+      long long numkeys, limit = 0;
+      try {
+        numkeys = stoll(p.args[0]);
+        if (numkeys < 1 || (size_t)numkeys > p.args.size() - 1)
+          throw out_of_range("numkeys");
+        size_t rest = p.args.size() - 1 - numkeys;
+        if (rest == 2 && p.args[numkeys + 1] == "LIMIT")
+          limit = stoll(p.args[numkeys + 2]);
+        else if (rest != 0)
+          throw invalid_argument("syntax");
+        if (limit < 0)
+          throw out_of_range("limit");
+      } catch (...) {
+        r.payload = ser_err(3, "ERR syntax error");
+        break;
+      }
+      vector<Set *> sets;
+      if (!lookup_sets(p.args.begin() + 1, p.args.begin() + 1 + numkeys, sets)) {
+        r.payload = ser_wrongtype();
+        break;
+      }
+      r.payload = ser_int(set_inter(sets, nullptr, limit));
+      break;
+    }
+
+    case SETBIT:
+    case GETBIT: {
+      uint64_t off;
+      if (!parse_bit_offset(p.arg1, off) ||
+          (p.type == SETBIT && strcmp(p.arg2, "0") && strcmp(p.arg2, "1"))) {
+        r.payload = ser_err(3, "ERR bit offset or value is not an integer or "
+                               "out of range");
+        break;
+      }
+      uint32_t klen = strlen(p.key);
+      HashEntry *e = dict->find_from(p.key, klen);
+      if (e && e->val->type != RobjType::OBJ_STRING) {
+        r.payload = ser_wrongtype();
+        break;
+      }
+      uint64_t byte = off >> 3;
+      int shift = 7 - (off & 7);
+      if (p.type == GETBIT) {
+        bool set = e && byte < e->val->len &&
+                   (((uint8_t *)e->val->ptr)[byte] >> shift) & 1;
+        r.payload = ser_int(set);
+        break;
+      }
+
+      if (!e) {
+        dict->insert_into(p.key, klen, "", 0);
+        e = dict->find_from(p.key, klen);
+      }
+      grow_string(e->val, byte + 1);
+      uint8_t *bp = (uint8_t *)e->val->ptr + byte;
+      int old = (*bp >> shift) & 1;
+      if (p.arg2[0] == '1')
+        *bp |= 1 << shift;
+      else
+        *bp &= ~(1 << shift);
+      aof_append("SETBIT " + string(p.key) + " " + p.arg1 + " " + p.arg2);
+      r.payload = ser_int(old);
+      break;
+    }
+
+    case BITCOUNT:
+    case BITPOS: {
+      // BITCOUNT key [start end] / BITPOS key bit [start [end]]
+      size_t first = p.type == BITPOS;
+      int bit = 1;
+      int64_t start = 0, end = -1;
+      try {
+        if (p.type == BITPOS) {
+          if (p.args[0] != "0" && p.args[0] != "1")
+            throw invalid_argument("bit");
+          bit = p.args[0][0] - '0';
+        }
+        if (p.args.size() > first)
+          start = stoll(p.args[first]);
+        if (p.args.size() > first + 1)
+          end = stoll(p.args[first + 1]);
+      } catch (...) {
+        r.payload = ser_err(3, "ERR value is not an integer or out of range");
+        break;
+      }
+      bool end_given = p.args.size() > first + 1;
+
+      HashEntry *e = dict->find_from(p.key, strlen(p.key));
+      if (e && e->val->type != RobjType::OBJ_STRING) {
+        r.payload = ser_wrongtype();
+        break;
+      }
+      if (!e) {
+        r.payload = ser_int(p.type == BITPOS && bit ? -1 : 0);
+        break;
+      }
+      int64_t len = e->val->len;
+
+      if (start < 0)
+        start = max<int64_t>(0, len + start);
+      if (end < 0)
+        end = len + end;
+      if (end >= len)
+        end = len - 1;
+      const uint8_t *base = (const uint8_t *)e->val->ptr;
+      if (start > end) {
+        r.payload = ser_int(p.type == BITCOUNT ? 0 : -1);
+      } else if (p.type == BITCOUNT) {
+        r.payload = ser_int(bit_count(base + start, end - start + 1));
+      } else {
+        int64_t pos = bit_pos(base + start, end - start + 1, bit);
+        if (pos >= 0)
+          pos += start * 8;
+        else if (bit == 0 && !end_given)
+          pos = (end + 1) * 8; // the string is implicitly 0-padded
+        r.payload = ser_int(pos);
+      }
+      break;
+    }
+
+    case BITOP: {
+      BitOp op;
+      string name = p.arg1;
+      if (name == "AND")
+        op = BITOP_AND;
+      else if (name == "OR")
+        op = BITOP_OR;
+      else if (name == "XOR")
+        op = BITOP_XOR;
+      else if (name == "NOT" && p.args.size() == 1)
+        op = BITOP_NOT;
+      else {
+        r.payload = ser_err(3, "ERR syntax error");
+        break;
+      }
+
+      static const uint8_t empty = 0;
+      vector<const uint8_t *> srcs;
+      vector<size_t> lens;
+      size_t maxlen = 0;
+      bool wrongtype = false;
+      for (auto &k : p.args) {
+        HashEntry *e = dict->find_from(k.data(), k.size());
+        if (e && e->val->type != RobjType::OBJ_STRING) {
+          wrongtype = true;
+          break;
+        }
+        srcs.push_back(e ? (const uint8_t *)e->val->ptr : &empty);
+        lens.push_back(e ? e->val->len : 0);
+        maxlen = max<size_t>(maxlen, lens.back());
+      }
+      if (wrongtype) {
+        r.payload = ser_wrongtype();
+        break;
+      }
+
+      vector<uint8_t> out(maxlen);
+      if (maxlen)
+        bit_op(op, out.data(), maxlen, srcs, lens);
+
+      uint32_t klen = strlen(p.key);
+      dict->erase_from(p.key, klen);
+      if (maxlen)
+        dict->insert_into(p.key, klen, (const char *)out.data(), maxlen);
+      aof_append(join_args("BITOP " + name + " " + p.key, p.args));
+      r.payload = ser_int(maxlen);
+      break;
+    }
+
+    case PFADD: {
+      uint32_t klen = strlen(p.key);
+      HashEntry *e = dict->find_from(p.key, klen);
+      if (e && !hll_valid(e->val)) {
+        r.payload = ser_hll_wrongtype();
+        break;
+      }
+      bool changed = false;
+      if (!e) {
+        string h = hll_create();
+        dict->insert_into(p.key, klen, h.data(), h.size());
+        e = dict->find_from(p.key, klen);
+        changed = true;
+      }
+      for (auto &el : p.args)
+        changed |= hll_add(e->val, el.data(), el.size());
+      if (changed)
+        aof_append(join_args("PFADD " + string(p.key), p.args));
+      r.payload = ser_int(changed);
+      break;
+    }
+
+    case PFCOUNT:
+    case PFMERGE: {
+      vector<Robj *> hlls;
+      bool valid = true;
+      for (auto &k : p.args) {
+        HashEntry *e = dict->find_from(k.data(), k.size());
+        if (e && !hll_valid(e->val))
+          valid = false;
+        else if (e)
+          hlls.push_back(e->val);
+      }
+      if (!valid) {
+        r.payload = ser_hll_wrongtype();
+        break;
+      }
+
+      if (p.type == PFCOUNT && p.args.size() == 1) {
+        r.payload = ser_int(hlls.empty() ? 0 : hll_count(hlls[0]));
+        break;
+      }
+
+      // Several keys: fold every register set into one, a vector at a time.
+      vector<uint8_t> raw(HLL_REGISTERS, 0);
+      for (Robj *o : hlls)
+        hll_merge_into(raw.data(), o);
+
+      if (p.type == PFCOUNT) {
+        r.payload = ser_int(hll_count_raw(raw.data()));
+        break;
+      }
+      // PFMERGE dest src...: dest (args[0]) is one of the inputs.
+      string v = hll_from_raw(raw.data());
+      dict->insert_into(p.args[0].data(), p.args[0].size(), v.data(), v.size());
+      aof_append(join_args("PFMERGE", p.args));
+      r.payload = ser_nil();
+      break;
+    }
+
+    case CLIENT_DURABLE: {
+      string mode = p.arg1;
+      if (mode != "ON" && mode != "OFF") {
+        r.payload = ser_err(3, "ERR syntax error");
+        break;
+      }
+      if (mode == "ON" && !aof.enabled()) {
+        r.payload = ser_err(3, "ERR CLIENT DURABLE requires appendonly");
+        break;
+      }
+      r.durable = mode == "ON";
+      r.payload = ser_nil();
+      break;
+    }
+
+    case CLIENT_TRACKING: {
+      // ON [BCAST] [PREFIX p ...] | OFF
+      string mode = p.arg1;
+      bool bcast = false, ok = mode == "ON" || mode == "OFF";
+      vector<string> prefixes;
+      for (size_t i = 0; ok && i < p.args.size(); i++) {
+        if (p.args[i] == "BCAST")
+          bcast = true;
+        else if (p.args[i] == "PREFIX" && i + 1 < p.args.size())
+          prefixes.push_back(p.args[++i]);
+        else
+          ok = false;
+      }
+      if (!ok || (mode == "OFF" && !p.args.empty()) ||
+          (!prefixes.empty() && !bcast)) {
+        r.payload = ser_err(3, "ERR syntax error");
+        break;
+      }
+      r.tracking = mode == "ON";
+      r.tracking_bcast = bcast;
+      // BCAST without a prefix covers every key.
+      r.tracking_prefixes = prefixes.empty() && bcast ? vector<string>{""}
+                                                      : prefixes;
+      string msg = "OK";
+      r.payload = ser_str(msg.data(), msg.size());
+      break;
+    }
+
+    case WAITAOF: {
+      if (!aof.enabled()) {
+        r.payload = ser_err(3, "ERR WAITAOF cannot be used when appendonly is "
+                               "disabled");
+        break;
+      }
+      r.wait_aof = true;
+      r.payload = ser_int(1);
+      break;
+    }
+
+    case BGREWRITEAOF: {
+      if (!aof.enabled()) {
+        r.payload = ser_err(3, "ERR appendonly is disabled");
+      } else if (aof.rewrite_in_progress()) {
+        r.payload = ser_err(3, "ERR Background append only file rewriting "
+                               "already in progress");
+      } else if (bgsave_pid > 0) {
+        aof_rewrite_scheduled = true;
+        string msg = "Background append only file rewriting scheduled";
+        r.payload = ser_str(msg.data(), msg.size());
+      } else if (!start_aof_rewrite()) {
+        r.payload = ser_err(3, "ERR could not start AOF rewrite");
+      } else {
+        string msg = "Background append only file rewriting started";
+        r.payload = ser_str(msg.data(), msg.size());
+      }
+      break;
+    }
+
+    case SAVE: {
+      if (bgsave_pid > 0) {
+        r.payload = ser_err(3, "ERR Background save already in progress");
+        break;
+      }
+      uint64_t t0 = now_ns();
+      last_save_ok = snapshot_save(dict, SNAPSHOT_FILE);
+      last_save_ms = (now_ns() - t0) / 1000000;
+      r.payload = last_save_ok ? ser_nil() : ser_err(3, "ERR snapshot failed");
+      break;
+    }
+
+    case BGSAVE: {
+      if (bgsave_pid > 0 || aof.rewrite_in_progress()) {
+        r.payload = ser_err(3, "ERR Background save already in progress");
+        break;
+      }
+      pid_t pid = fork();
+      if (pid < 0) {
+        r.payload = ser_err(3, "ERR could not fork");
+        break;
+      }
+      if (pid == 0)
+        _exit(snapshot_save(dict, SNAPSHOT_FILE) ? 0 : 1);
+      bgsave_pid = pid;
+      bgsave_start_ns = now_ns();
+      string msg = "Background saving started";
+      r.payload = ser_str(msg.data(), msg.size());
+      break;
+    }
+
+    case SETHEX: {
+      // An encoding for AOF rewrites and their replay, not a command:
+      // clients see it as unknown.
+      if (!aof_loading) {
+        r.payload = ser_err(1, "Unknown cmd");
+        break;
+      }
+      string v;
+      if (!hex_decode(p.arg1, v)) {
+        r.payload = ser_err(3, "ERR invalid hex string");
+        break;
+      }
+      dict->insert_into(p.key, strlen(p.key), v.data(), v.size());
+      r.payload = ser_nil();
+      break;
+    }
+
+    case PSYNC: {
+      uint64_t offset;
+      if (replica_mode) {
+        r.payload = ser_err(3, "ERR a follower cannot serve followers");
+      } else if (!parse_u64(p.arg2, offset)) {
+        r.payload = ser_err(3, "ERR invalid replication offset");
+      } else {
+        r.psync = true;
+        r.psync_id = p.arg1;
+        r.repl_offset = offset;
+      }
+      break;
+    }
+
+    case REPLCONF_ACK: {
+      if (!parse_u64(p.arg1, r.repl_offset)) {
+        r.payload = ser_err(3, "ERR invalid replication offset");
+        break;
+      }
+      r.repl_ack = true;
+      break;
+    }
+
+    case REPLICAOF: {
+      string host = p.arg1;
+      uint64_t port;
+      if (host == "NO" && string(p.arg2) == "ONE") {
+        replicaof("", 0);
+        r.payload = ser_nil();
+      } else if (!parse_u64(p.arg2, port) || port == 0 || port > 65535) {
+        r.payload = ser_err(3, "ERR invalid port");
+      } else {
+        replicaof(host, port);
+        r.payload = ser_nil();
+      }
+      break;
+    }
+
+    case SLOWLOG: {
+      string sub = p.arg1;
+      for (char &c : sub)
+        c = toupper((unsigned char)c);
+      uint64_t n = 10;
+      if (sub == "LEN" && !p.arg2) {
+        r.payload = ser_int(slowlog.len());
+      } else if (sub == "RESET" && !p.arg2) {
+        slowlog.reset();
+        r.payload = ser_str("OK", 2);
+      } else if (sub == "GET" && (!p.arg2 || parse_u64(p.arg2, n))) {
+        vector<string> entries;
+        for (const SlowLogEntry *e : slowlog.get(n))
+          entries.push_back(ser_arr_of({ser_int(e->id), ser_int(e->time),
+                                        ser_int(e->usec), ser_arr(e->argv),
+                                        ser_str(e->client.data(),
+                                                e->client.size())}));
+        r.payload = ser_arr_of(entries);
+      } else {
+        r.payload = ser_err(3, "ERR SLOWLOG GET [count] | LEN | RESET");
+      }
+      break;
+    }
+
+    case LATENCY: {
+      string sub = p.arg1;
+      for (char &c : sub)
+        c = toupper((unsigned char)c);
+      if (sub == "LATEST" && p.args.empty()) {
+        // event, time of the latest spike, its usec, all-time max usec
+        vector<string> events;
+        for (auto &ev : latency_monitor.all()) {
+          const LatencySample &s = ev.second.latest();
+          events.push_back(ser_arr_of(
+              {ser_str(ev.first.data(), ev.first.size()), ser_int(s.time),
+               ser_int(s.usec), ser_int(ev.second.max_usec)}));
+        }
+        r.payload = ser_arr_of(events);
+      } else if (sub == "HISTORY" && p.args.size() == 1) {
+        vector<LatencySample> samples;
+        latency_monitor.history(p.args[0], samples);
+        vector<string> out;
+        for (auto &s : samples)
+          out.push_back(ser_arr_of({ser_int(s.time), ser_int(s.usec)}));
+        r.payload = ser_arr_of(out);
+      } else if (sub == "RESET") {
+        r.payload = ser_int(latency_monitor.reset(p.args));
+      } else {
+        r.payload =
+            ser_err(3, "ERR LATENCY LATEST | HISTORY event | RESET [event ...]");
+      }
+      break;
+    }
+
+    case MEMORY: {
+      string sub = p.arg1;
+      for (char &c : sub)
+        c = toupper((unsigned char)c);
+      uint64_t elements = MEMORY_ELEMENT_SAMPLES;
+      uint64_t keys = MEMORY_KEY_SAMPLES;
+      if (sub == "USAGE" && p.key && parse_samples(p.args, elements)) {
+        HashEntry *e = dict->find_from(p.key, strlen(p.key));
+        if (!e) {
+          r.payload = ser_nil();
+          break;
+        }
+        size_t bytes = entry_memory(e, elements);
+        if (e->expires_at)
+          bytes += dict->expiry_item_bytes();
+        r.payload = ser_int(bytes);
+      } else if (sub == "STATS" && parse_samples(p.args, keys)) {
+        string info;
+        memory_stats(keys, info);
+        r.payload = "(info)\n" + info;
+      } else if (sub == "BIGKEYS" && parse_samples(p.args, keys)) {
+        // type, biggest key, its bytes and length, keys of the type sampled
+        map<string, TypeMemory> types;
+        sample_memory(keys, types);
+        vector<string> out;
+        for (auto &t : types)
+          out.push_back(ser_arr_of(
+              {ser_str(t.first.data(), t.first.size()),
+               ser_str(t.second.biggest.data(), t.second.biggest.size()),
+               ser_int(t.second.biggest_bytes),
+               ser_int(t.second.biggest_length), ser_int(t.second.keys)}));
+        r.payload = ser_arr_of(out);
+      } else {
+        r.payload = ser_err(3, "ERR MEMORY USAGE key [SAMPLES n] | STATS "
+                               "[SAMPLES n] | BIGKEYS [SAMPLES n]");
+      }
+      break;
+    }
+
+    case CLUSTER: {
+      string sub = p.arg1;
+      uint64_t slot, count;
+      if (!cluster.enabled()) {
+        r.payload = ser_err(3, "ERR This instance has cluster support disabled");
+      } else if (sub == "SLOTS" && p.args.empty()) {
+        vector<string> out;
+        const vector<ClusterNode> &nodes = cluster.all_nodes();
+        for (const ClusterNode &n : nodes) {
+          for (auto &rg : n.ranges)
+            out.push_back(to_string(rg.first) + " " + to_string(rg.second) +
+                          " " + n.host + " " + to_string(n.port));
+        }
+        r.payload = ser_arr(out);
+      } else if (sub == "KEYSLOT" && p.args.size() == 1) {
+        r.payload = ser_int(key_hash_slot(p.args[0].data(), p.args[0].size()));
+      } else if (sub == "COUNTKEYSINSLOT" && p.args.size() == 1) {
+        if (!parse_u64(p.args[0].c_str(), slot) || slot >= CLUSTER_SLOTS)
+          r.payload = ser_err(3, "ERR Invalid slot");
+        else
+          r.payload = ser_int(dict->count_keys_in_slot(slot));
+      } else if (sub == "GETKEYSINSLOT" && p.args.size() == 2) {
+        if (!parse_u64(p.args[0].c_str(), slot) || slot >= CLUSTER_SLOTS ||
+            !parse_u64(p.args[1].c_str(), count)) {
+          r.payload = ser_err(3, "ERR Invalid slot or number of keys");
+          break;
+        }
+        vector<string> keys;
+        dict->keys_in_slot(slot, count, keys);
+        r.payload = ser_arr(keys);
+      } else if (sub == "MIGRATE" && p.args.size() == 3) {
+        // CLUSTER MIGRATE slot host port: move slot's keys to that node.
+        uint64_t port;
+        string err;
+        int node = parse_u64(p.args[2].c_str(), port) && port <= 65535
+                       ? cluster.find_node(p.args[1], port)
+                       : -1;
+        if (!parse_u64(p.args[0].c_str(), slot) || slot >= CLUSTER_SLOTS)
+          r.payload = ser_err(3, "ERR Invalid slot");
+        else if (node < 0 || node == cluster.self_index())
+          r.payload = ser_err(3, "ERR target is not another cluster node");
+        else if (!start_slot_migration(slot, node, err))
+          r.payload = ser_err(3, err);
+        else
+          r.payload = ser_nil();
+      } else if (sub == "IMPORT" && p.args.size() == 1) {
+        // Sent by the source node of a migration.
+        if (!parse_u64(p.args[0].c_str(), slot) || slot >= CLUSTER_SLOTS ||
+            cluster.owns(slot)) {
+          r.payload = ser_err(3, "ERR cannot import this slot");
+        } else {
+          r.import_slot = slot;
+          string msg = "IMPORTING";
+          r.payload = ser_str(msg.data(), msg.size());
+        }
+      } else {
+        r.payload = ser_err(3, "ERR unknown CLUSTER subcommand");
+      }
+      break;
+    }
+
+    case ASKING:
+      r.asking = true;
+      r.payload = ser_nil();
+      break;
+
+    case WATCH: {
+      // The connection records the keys; MULTI, EXEC and the rest never
+      // get here, as they only mean something per connection.
+      r.watch_keys = p.args;
+      string msg = "OK";
+      r.payload = ser_str(msg.data(), msg.size());
+      break;
+    }
+
+    default:
+      r.payload = ser_err(1, "Unknown cmd");
+    }
+
+    if (keys_observed() && is_write_command(p.type)) {
+      vector<string> keys;
+      command_keys(p, keys);
+      for (const string &k : keys)
+        signal_modified_key(k);
+    }
+
+    g_total_commands++;
+
+    return r;
+  }
+
+  static void free_request(parsed_request &p) {
+    if (p.key)
+      free(p.key);
+    if (p.arg1)
+      free(p.arg1);
+    if (p.arg2)
+      free(p.arg2);
+  }
+
+  // Appends the keys p touches.
+  static void command_keys(const parsed_request &p, vector<string> &out) {
+    if (p.key)
+      out.push_back(p.key);
+    switch (p.type) {
+    case ZUNIONSTORE:
+    case ZINTERSTORE:
+    case ZDIFFSTORE:
+    case SINTERCARD: {
+      // numkeys key [key ...] ...
+      size_t n = strtoul(p.args[0].c_str(), nullptr, 10);
+      for (size_t i = 1; i <= n && i < p.args.size(); i++)
+        out.push_back(p.args[i]);
+      break;
+    }
+    case MSET:
+    case MSETNX:
+      // key value [key value ...]
+      for (size_t i = 0; i < p.args.size(); i += 2)
+        out.push_back(p.args[i]);
+      break;
+    case BLPOP:
+    case BRPOP:
+      // key [key ...] timeout
+      out.insert(out.end(), p.args.begin(), p.args.end() - 1);
+      break;
+    case DELETE:
+    case EXISTS:
+    case MGET:
+    case WATCH:
+    case SINTER:
+    case SUNION:
+    case SDIFF:
+    case PFCOUNT:
+    case PFMERGE:
+    case BITOP:
+      out.insert(out.end(), p.args.begin(), p.args.end());
+      break;
+    default:
+      break;
+    }
+  }
+
+  // False, with the error for payload, when p's keys are not all in one
+  // slot or that slot belongs to another node.
+  static bool cluster_route(const parsed_request &p, string &payload) {
+    vector<string> keys;
+    command_keys(p, keys);
+    if (keys.empty())
+      return true;
+
+    uint16_t slot = key_hash_slot(keys[0].data(), keys[0].size());
+    for (size_t i = 1; i < keys.size(); i++) {
+      if (key_hash_slot(keys[i].data(), keys[i].size()) != slot) {
+        payload = ser_err(3, "CROSSSLOT Keys in request don't hash to the "
+                             "same slot");
+        return false;
+      }
+    }
+    if (cluster.owns(slot)) {
+      if (slot == migrating_slot)
+        return route_migrating(p, keys, slot, payload);
+      return true;
+    }
+    if (p.asking && cluster.is_importing(slot))
+      return true;
+
+    int owner = cluster.slot_owner(slot);
+    if (owner < 0)
+      payload = ser_err(3, "CLUSTERDOWN Hash slot not served");
+    else
+      payload = ser_err(3, "MOVED " + to_string(slot) + " " +
+                               cluster.address(owner));
+    return false;
+  }
+
+  // Keys of a migrating slot are served here while they are here. A
+  // command whose keys have all left is sent to the target with ASK; one
+  // that finds only some of them, or writes a key the target may already
+  // hold, has to retry.
+  static bool route_migrating(const parsed_request &p,
+                              const vector<string> &keys, uint16_t slot,
+                              string &payload) {
+    size_t present = 0;
+    bool in_flight = false;
+    for (const string &k : keys) {
+      if (dict->find_from(k.data(), k.size()))
+        present++;
+      if (migrating_keys.count(k))
+        in_flight = true;
+    }
+    if (present == 0) {
+      payload = ser_err(3, "ASK " + to_string(slot) + " " +
+                               cluster.address(migrating_to));
+      return false;
+    }
+    if (present < keys.size() || (in_flight && is_write_command(p.type))) {
+      payload = ser_err(3, "TRYAGAIN Keys are being migrated");
+      return false;
+    }
+    return true;
+  }
+
+  // DELETE with several keys. The keys removed are logged as one record.
+  static long long delete_keys(const parsed_request &p) {
+    vector<string> keys{p.key};
+    keys.insert(keys.end(), p.args.begin(), p.args.end());
+    dict->prefetch_many(keys);
+
+    string cmd = "DELETE";
+    long long n = 0;
+    for (const string &k : keys) {
+      if (dict->erase_from(k.data(), k.size())) {
+        cmd += " " + k;
+        n++;
+      }
+    }
+    if (n)
+      aof_append(cmd);
+    return n;
+  }
+
+  // Commands a follower refuses from clients.
+  static bool is_write_command(RequestType t) {
+    switch (t) {
+    case SET:
+    case MSET:
+    case MSETNX:
+    case DELETE:
+    case ZADD:
+    case ZREM:
+    case EXPIRE:
+    case PERSIST:
+    case PEXPIREAT:
+    case ZUNIONSTORE:
+    case ZINTERSTORE:
+    case ZDIFFSTORE:
+    case HSET:
+    case HDEL:
+    case HINCRBY:
+    case LPUSH:
+    case RPUSH:
+    case LPOP:
+    case RPOP:
+    case LTRIM:
+    case BLPOP:
+    case BRPOP:
+    case SADD:
+    case SREM:
+    case SETBIT:
+    case BITOP:
+    case PFADD:
+    case PFMERGE:
+      return true;
+    default:
+      return false;
+    }
+  }
+
+  // numkeys key [key ...] [WEIGHTS w [w ...]] [AGGREGATE SUM|MIN|MAX]
+  // Checks the syntax only; the caller resolves the keys into inputs.
+  static bool parse_zsetop_args(const vector<string> &args, bool allow_weights,
+                                vector<ZSetOpInput> &inputs, ZAggregate &agg,
+                                string &err) {
+    long long numkeys;
+    try {
+      numkeys = stoll(args[0]);
+    } catch (...) {
+      err = "ERR numkeys is not an integer";
+      return false;
+    }
+    if (numkeys < 1 || (size_t)numkeys > args.size() - 1) {
+      err = "ERR numkeys out of range";
+      return false;
+    }
+
+    inputs.assign(numkeys, {nullptr, 1.0});
+
+    size_t i = numkeys + 1;
+    while (i < args.size()) {
+      if (allow_weights && args[i] == "WEIGHTS" &&
+          i + numkeys < args.size()) {
+        for (long long k = 0; k < numkeys; k++) {
+          const string &w = args[i + 1 + k];
+          char *end;
+          inputs[k].weight = strtod(w.c_str(), &end);
+          if (w.empty() || *end || isnan(inputs[k].weight)) {
+            err = "ERR weight value is not a float";
+            return false;
+          }
+        }
+        i += numkeys + 1;
+      } else if (allow_weights && args[i] == "AGGREGATE" &&
+                 i + 1 < args.size()) {
+        const string &a = args[i + 1];
+        if (a == "SUM")
+          agg = ZAggregate::SUM;
+        else if (a == "MIN")
+          agg = ZAggregate::MIN;
+        else if (a == "MAX")
+          agg = ZAggregate::MAX;
+        else {
+          err = "ERR syntax error";
+          return false;
+        }
+        i += 2;
+      } else {
+        err = "ERR syntax error";
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Returns the entry for key, creating it with make() when missing. The
+  // caller still has to check the type of an existing entry.
+  static HashEntry *find_or_create(const char *key, Robj *(*make)()) {
+    return find_or_create(key, strlen(key), make);
+  }
+
+  static HashEntry *find_or_create(const char *key, uint32_t len,
+                                   Robj *(*make)()) {
+    HashEntry *e = dict->find_from(key, len);
+    if (!e) {
+      Robj *o = make();
+      dict->insert_obj(key, len, o);
+      decr_refcount(o);
+      e = dict->find_from(key, len);
+    }
+    return e;
+  }
+
+  // Bit offsets are capped at 2^32 (a 512 MB value), as in Redis.
+  static bool parse_bit_offset(const char *s, uint64_t &out) {
+    if (!*s || !isdigit((unsigned char)*s))
+      return false;
+    char *end;
+    errno = 0;
+    out = strtoull(s, &end, 10);
+    return !*end && errno == 0 && out < (1ULL << 32);
+  }
+
+  // Zero-extends a string value to at least len bytes. The buffer grows
+  // geometrically and is reused while malloc_usable_size says it fits.
+  static void grow_string(Robj *o, uint64_t len) {
+    if (len <= o->len)
+      return;
+    if (len > malloc_usable_size(o->ptr)) {
+      size_t cap = max<uint64_t>(len, (uint64_t)o->len * 2);
+      o->ptr = realloc(o->ptr, cap);
+    }
+    memset((char *)o->ptr + o->len, 0, len - o->len);
+    o->len = len;
+  }
+
+  static bool parse_u64(const char *s, uint64_t &out) {
+    if (!*s || !isdigit((unsigned char)*s))
+      return false;
+    char *end;
+    errno = 0;
+    out = strtoull(s, &end, 10);
+    return !*end && errno == 0;
+  }
+
+  // Resolves keys to sets (null when missing); false on a non-set key.
+  static bool lookup_sets(vector<string>::const_iterator first,
+                          vector<string>::const_iterator last,
+                          vector<Set *> &out) {
+    for (; first != last; ++first) {
+      HashEntry *e = dict->find_from(first->data(), first->size());
+      if (e && e->val->type != RobjType::OBJ_SET)
+        return false;
+      out.push_back(e ? (Set *)e->val->ptr : nullptr);
+    }
+    return true;
+  }
+
+  // Pops one element, logs the pop and drops the key once the list is empty.
+  static void pop_logged(const string &key, List *l, bool left, string &out) {
+    if (left)
+      l->lpop(out);
+    else
+      l->rpop(out);
+    aof_append((left ? "LPOP " : "RPOP ") + key);
+    if (l->llen() == 0)
+      dict->erase_from(key.data(), key.size());
+    if (keys_observed())
+      signal_modified_key(key);
+  }
+
+  static string join_args(const string &head, const vector<string> &args) {
+    string line = head;
+    for (auto &a : args)
+      line += " " + a;
+    return line;
+  }
+
+  static string ser_err(int code, const string &msg) {
+    return "(err) " + to_string(code) + " " + msg;
+  }
+
+  static string ser_nil() { return "(nil)"; }
+
+  static string ser_str(const char *buf, uint32_t len) {
+    string out = "(str) ";
+    out.append(buf, len);
+    return out;
+  }
+
+  static string ser_wrongtype() {
+    return ser_err(2, "WRONGTYPE Operation against a key holding the wrong "
+                      "kind of value");
+  }
+
+  static string ser_hll_wrongtype() {
+    return ser_err(2, "WRONGTYPE Key is not a valid HyperLogLog string value");
+  }
+
+  static string ser_int(long long v) { return "(int) " + to_string(v); }
+
+  static string ser_arr(const vector<string> &elems) {
+    string out = "(arr) len=" + to_string(elems.size()) + "\n";
+    for (auto &e : elems) {
+      out += ser_str(e.data(), e.size()) + "\n";
+    }
+    out += "(arr) end";
+    return out;
+  }
+
+  // Array of already serialized elements, e.g. strings mixed with nils.
+  static string ser_arr_of(const vector<string> &serialized) {
+    string out = "(arr) len=" + to_string(serialized.size()) + "\n";
+    for (auto &e : serialized) {
+      out += e + "\n";
+    }
+    out += "(arr) end";
+    return out;
+  }
+
+  // Logs a write to the AOF and, once a follower has attached, to the
+  // replication stream. Both take the same encoded record.
+  static void aof_append(const string &raw_cmd) {
+    if (aof_loading)
+      return;
+    bool feed = repl_backlog.active();
+    if (!aof.enabled() && !feed)
+      return;
+    string rec;
+    aof_encode_command(rec, raw_cmd);
+    if (aof.enabled())
+      aof.append_records(rec.data(), rec.size(), 1);
+    if (feed) {
+      repl_buf += rec;
+      repl_buf_records++;
+    }
+  }
+
+  // The new file is a snapshot preamble, or plain commands without one.
+  static bool start_aof_rewrite() {
+    return aof.start_rewrite([](int fd) {
+      return aof_use_preamble ? snapshot_write(dict, fd)
+                              : aof_rewrite_dataset(dict, fd);
+    });
+  }
+
+  // Replays one binary record straight into the dataset. Only records
+  // without a dedicated opcode go through the command dispatcher.
+  static void apply_aof_record(const AofRecord &rec) {
+    const char *k = rec.key.p;
+    uint32_t klen = rec.key.len;
+    HashEntry *e;
+
+    switch (rec.op) {
+    case AOF_OP_SET:
+      dict->insert_into(k, klen, rec.args[0].p, rec.args[0].len);
+      return;
+    case AOF_OP_DEL:
+      dict->erase_from(k, klen);
+      return;
+    case AOF_OP_PEXPIREAT:
+      // As the live command does: a time already past is left to expiry.
+      dict->set_expiry(k, klen, rec.u64);
+      return;
+    case AOF_OP_ZADD:
+      e = find_or_create(k, klen, create_zset_obj);
+      if (e->val->type == RobjType::OBJ_ZSET)
+        ((ZSet *)e->val->ptr)->zadd(rec.args[0].p, rec.args[0].len, rec.f64);
+      return;
+    case AOF_OP_HSET:
+      e = find_or_create(k, klen, create_hash_obj);
+      if (e->val->type != RobjType::OBJ_HASH)
+        return;
+      for (size_t i = 0; i + 1 < rec.args.size(); i += 2)
+        ((Hash *)e->val->ptr)
+            ->hset(rec.args[i].p, rec.args[i].len, rec.args[i + 1].p,
+                   rec.args[i + 1].len);
+      return;
+    case AOF_OP_SADD:
+      e = find_or_create(k, klen, create_set_obj);
+      if (e->val->type != RobjType::OBJ_SET)
+        return;
+      for (const AofArg &a : rec.args)
+        ((Set *)e->val->ptr)->sadd(a.p, a.len);
+      return;
+    case AOF_OP_RPUSH:
+    case AOF_OP_LPUSH:
+      e = find_or_create(k, klen, create_list_obj);
+      if (e->val->type != RobjType::OBJ_LIST)
+        return;
+      for (const AofArg &a : rec.args) {
+        if (rec.op == AOF_OP_RPUSH)
+          ((List *)e->val->ptr)->rpush(a.p, a.len);
+        else
+          ((List *)e->val->ptr)->lpush(a.p, a.len);
+      }
+      return;
+    case AOF_OP_CMD: {
+      string line;
+      for (const AofArg &a : rec.args) {
+        if (!line.empty())
+          line += ' ';
+        line.append(a.p, a.len);
+      }
+      parsed_request p = parse_request(line);
+      if (p.type == UNKNOWN)
+        cerr << "[AOF] ignoring unknown command: " << line << "\n";
+      else
+        process_request(p);
+      return;
+    }
+    }
+  }
+
+  // Applies a decoded frame. Each record's bucket is fetched eight records
+  // ahead and its chain four ahead, so the lookups mostly hit cache.
+  static void apply_aof_records(const vector<AofRecord> &records) {
+    for (size_t i = 0; i < records.size(); i++) {
+      if (i + 8 < records.size() && records[i + 8].op != AOF_OP_CMD)
+        dict->prefetch(records[i + 8].key.p, records[i + 8].key.len, false);
+      if (i + 4 < records.size() && records[i + 4].op != AOF_OP_CMD)
+        dict->prefetch(records[i + 4].key.p, records[i + 4].key.len, true);
+      apply_aof_record(records[i]);
+      if (keys_observed() && records[i].op != AOF_OP_CMD)
+        signal_modified_key(string(records[i].key.p, records[i].key.len));
+    }
+  }
+
+  // Loads the AOF at path: a snapshot preamble, if the file starts with
+  // one, then the tail of records logged after it. A truncated or corrupt
+  // tail record either fails the load or, with truncate_bad, cuts the file
+  // back to the last good record. A corrupt preamble always fails.
+  static bool aof_replay(const string &path, bool truncate_bad) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0 && errno == ENOENT) {
+      cerr << "[AOF] no file found, skipping replay\n";
+      return true;
+    }
+    // Anything else would start us empty over a log we could not read.
+    struct stat sb;
+    if (fd < 0 || fstat(fd, &sb) != 0) {
+      perror(("[AOF] " + path).c_str());
+      if (fd >= 0)
+        close(fd);
+      return false;
+    }
+    size_t len = sb.st_size;
+    if (len == 0) {
+      close(fd);
+      return true;
+    }
+    const char *data =
+        (const char *)mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+      perror("[AOF] mmap");
+      return false;
+    }
+
+    uint64_t t0 = now_ns();
+    aof_loading = true;
+    size_t off = 0;
+    bool ok = true;
+
+    if (snapshot_is_snapshot(data, len)) {
+      if (!snapshot_load(dict, data, len, last_load, &off)) {
+        cerr << "[AOF] snapshot preamble is corrupt\n";
+        ok = false;
+      } else {
+        last_load_ms = (now_ns() - t0) / 1000000;
+        cerr << "[AOF] preamble: " << last_load.keys << " keys in "
+             << last_load_ms << " ms\n";
+      }
+    }
+
+    const char *bad = nullptr;
+    string cmd;
+    vector<AofRecord> records;
+    while (ok && off < len) {
+      if (aof_is_frame(data + off, len - off)) {
+        size_t frame_len;
+        AofFrameStatus st =
+            aof_decode_frame(data + off, len - off, &frame_len, records);
+        if (st != AOF_FRAME_OK) {
+          bad = st == AOF_FRAME_TRUNCATED ? "truncated frame" : "corrupt frame";
+          break;
+        }
+        apply_aof_records(records);
+        aof_load_records += records.size();
+        off += frame_len;
+        continue;
+      }
+
+      // Text record, from a plain-command rewrite or an older file.
+      const char *line = data + off;
+      const char *nl = (const char *)memchr(line, '\n', len - off);
+      if (!nl) {
+        bad = "truncated record";
+        break;
+      }
+      if (!aof_check_record(line, nl - line, cmd)) {
+        bad = "checksum mismatch";
+        break;
+      }
+      off = nl - data + 1;
+      if (cmd.empty())
+        continue;
+
+      parsed_request p = Server::parse_request(cmd);
+      if (p.type == UNKNOWN) {
+        cerr << "[AOF] ignoring unknown command: " << cmd << "\n";
+        continue;
+      }
+      Server::process_request(p);
+      aof_load_records++;
+    }
+    munmap((void *)data, len);
+    aof_loading = false;
+
+    if (bad) {
+      cerr << "[AOF] " << bad << " at offset " << off << " ("
+           << len - off << " bytes from the end)\n";
+      if (!truncate_bad) {
+        cerr << "[AOF] --aof-load-truncated=yes would cut it off\n";
+        return false;
+      }
+      if (truncate(path.c_str(), off) != 0) {
+        perror("[AOF] truncate");
+        return false;
+      }
+      aof_load_truncated = len - off;
+      cerr << "[AOF] truncated to the last good record\n";
+    }
+    if (ok)
+      cerr << "[AOF] replay finished: " << aof_load_records << " records in "
+           << (now_ns() - t0) / 1000000 << " ms\n";
+    return ok;
+  }
+
+  void shutdown() {
+    if (listen_fd != -1) {
+      close(listen_fd);
+      listen_fd = -1;
+    }
+    if (epoll_fd != -1) {
+      close(epoll_fd);
+      epoll_fd = -1;
+    }
+    cout << "[Server] Stopped listening." << endl;
+  }
+
+  int epollfd() const { return epoll_fd; }
+  int fd() const { return listen_fd; }
+  epoll_event *get_events() { return events; }
+};
+
+// Leader-side state of a follower's replication link.
+struct FollowerLink {
+  bool attached = false;
+  bool online = false;  // receiving the stream as it is logged
+  // The full-sync child whose snapshot this follower waits for (0: the next
+  // one to start), and the stream logged since that child forked.
+  uint64_t sync_gen = 0;
+  string pending;
+  // The snapshot file while it is being sent, the bytes still to read from
+  // it, and the stream offset the follower is at once it has all arrived.
+  int sync_fd = -1;
+  uint64_t sync_left = 0;
+  uint64_t sync_offset = 0;
+  uint64_t ack_offset = 0;
+  uint64_t ack_ns = 0;
+};
+
+class Connection {
+private:
+  int fd;
+  int epfd;
+  string read_buf;
+  string write_buf;
+  ConnectionState state = READING;
+
+  // Parked in BLPOP/BRPOP. Frames that arrive meanwhile stay in read_buf
+  // and run once the pop is answered, so replies keep their order.
+  bool blocked = false;
+  bool block_left = true;
+  vector<string> block_keys;
+  uint64_t block_deadline = 0;
+
+  // Durable connections get write replies only once the AOF offset their
+  // write ended at is synced. Held replies are (offset, payload) in order;
+  // anything behind a held reply waits with it.
+  bool durable;
+  deque<pair<uint64_t, string>> held;
+
+  // CLUSTER IMPORT: read_buf carries migration blocks for this slot.
+  int import_slot = -1;
+  bool asking = false;
+
+  // Requests taken out of read_buf by parse_ahead and not yet run.
+  deque<parsed_request> parsed_ahead;
+
+  // MULTI: requests queued for EXEC, and whether one was refused while
+  // queueing, which makes EXEC discard the lot.
+  bool in_multi = false;
+  bool multi_error = false;
+  vector<parsed_request> queued;
+
+  // WATCH: the watched keys with the expiry each had then, and whether
+  // one has been written since.
+  vector<pair<string, uint64_t>> watching;
+  bool watch_dirty = false;
+
+  // CLIENT TRACKING: the id tracking_table refers to this connection by,
+  // and the mode.
+  uint64_t id;
+  bool tracking = false;
+  bool tracking_bcast = false;
+
+  // I/O-thread mode: the epoll events to handle off the loop thread, and
+  // whether the connection is already in pending_writes.
+  int io_events = 0;
+  bool write_pending = false;
+
+  // Takes the next frame out of read_buf and parses it. False when no
+  // complete frame is buffered; an oversized one also closes the
+  // connection.
+  bool next_request(parsed_request &p, size_t &off) {
+    if (read_buf.size() - off < 4)
+      return false;
+
+    uint32_t len;
+    memcpy(&len, read_buf.data() + off, 4);
+
+    if (len > MAX_LEN) {
+      state = CLOSED;
+      return false;
+    }
+
+    if (read_buf.size() - off < 4 + len)
+      return false;
+
+    string payload = read_buf.substr(off + 4, len);
+    off += 4 + len;
+
+    p = Server::parse_request(payload);
+    return true;
+  }
+
+public:
+  FollowerLink repl;
+
+  Connection(int f, int ep)
+      : fd(f), epfd(ep),
+        durable(aof.enabled() && aof.fsync_policy() == FSYNC_ALWAYS),
+        id(next_client_id++) {}
+
+  ~Connection() {
+    if (blocked)
+      remove_from_blocking();
+    if (!held.empty())
+      held_clients.erase(this);
+    if (repl.attached)
+      replicas.erase(this);
+    if (repl.sync_fd >= 0)
+      close(repl.sync_fd);
+    if (import_slot >= 0)
+      cluster.set_importing(import_slot, false);
+    for (parsed_request &p : parsed_ahead)
+      Server::free_request(p);
+    for (parsed_request &p : queued)
+      Server::free_request(p);
+    unwatch();
+    stop_tracking();
+  }
+
+  // Reads whatever the socket holds. The frames run later in the
+  // iteration, through run_batch.
+  void on_read() {
+    char buf[4096];
+
+    while (true) {
+      ssize_t n = read(fd, buf, sizeof(buf));
+      if (n > 0) {
+        read_buf.append(buf, n);
+      } else if (n == 0) {
+        state = CLOSED;
+        return;
+      } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      } else {
+        state = CLOSED;
+        return;
+      }
+    }
+  }
+
+  bool has_input() const { return !read_buf.empty() || !parsed_ahead.empty(); }
+
+  // Parses every complete frame in read_buf ahead of running them, so
+  // run_batch can prefetch the keys of all ready connections together.
+  // Stops after a command that may change how the rest of the stream is
+  // read. Touches nothing outside the connection, so it may run on an I/O
+  // thread.
+  void parse_ahead() {
+    if (blocked || import_slot >= 0 || !parsed_ahead.empty())
+      return;
+
+    size_t off = 0;
+    parsed_request p;
+    while (state != CLOSED && next_request(p, off)) {
+      parsed_ahead.push_back(p);
+      if (p.type == CLUSTER || p.type == PSYNC)
+        break;
+    }
+    read_buf.erase(0, off);
+  }
+
+  void collect_keys(vector<const char *> &keys) const {
+    for (const parsed_request &p : parsed_ahead)
+      if (p.key)
+        keys.push_back(p.key);
+  }
+
+  // I/O-thread jobs: handle the events the loop saw, and write out
+  // replies queued since.
+  static void io_handle(void *arg) {
+    Connection *c = (Connection *)arg;
+    if (c->handle(c->io_events) == 0)
+      c->parse_ahead();
+  }
+
+  static void io_write(void *arg) { ((Connection *)arg)->write_pending_replies(); }
+
+  void set_io_events(int events) { io_events = events; }
+
+  void process_frames() {
+    while (!blocked && state != CLOSED) {
+      if (import_slot >= 0) {
+        if (!import_block())
+          break;
+        continue;
+      }
+
+      parsed_request p;
+      if (!parsed_ahead.empty()) {
+        p = parsed_ahead.front();
+        parsed_ahead.pop_front();
+      } else {
+        size_t off = 0;
+        bool got = next_request(p, off);
+        read_buf.erase(0, off);
+        if (!got)
+          break;
+      }
+
+      uint64_t before = aof.offset();
+      p.asking = asking;
+      asking = false;
+      Response response;
+      current_client_fd = fd;
+      if (in_multi || p.type == MULTI || p.type == EXEC || p.type == DISCARD ||
+          p.type == UNWATCH) {
+        // Queued commands are counted when EXEC runs them.
+        bool queues = in_multi && p.type != MULTI && p.type != EXEC &&
+                      p.type != DISCARD && p.type != UNWATCH;
+        uint64_t start = ticks_now();
+        response = transaction(p);
+        if (!queues)
+          Server::record_command(p, start, response);
+      } else {
+        track_reads(p);
+        response = Server::process_request(p);
+      }
+      current_client_fd = -1;
+      if (!response.watch_keys.empty())
+        watch(response.watch_keys);
+      if (response.tracking >= 0)
+        set_tracking(response);
+      if (!response.block_keys.empty()) {
+        block(response);
+        break;
+      }
+      if (response.psync) {
+        repl_attach(this, response.psync_id, response.repl_offset);
+        continue;
+      }
+      if (response.repl_ack) {
+        repl.ack_offset = response.repl_offset;
+        repl.ack_ns = now_ns();
+        continue;
+      }
+      if (response.asking)
+        asking = true;
+      if (response.import_slot >= 0) {
+        import_slot = response.import_slot;
+        cluster.set_importing(import_slot, true);
+      }
+
+      if (response.durable >= 0)
+        durable = response.durable;
+      uint64_t need = 0;
+      if (response.wait_aof || (durable && aof.offset() > before))
+        need = aof.offset();
+      reply_after(need, response.payload);
+    }
+  }
+
+  // MULTI, EXEC, DISCARD and UNWATCH, and every other request between
+  // MULTI and EXEC, which is queued rather than run.
+  Response transaction(parsed_request &p) {
+    Response r;
+    string ok = "OK";
+    switch (p.type) {
+    case MULTI:
+      if (in_multi) {
+        r.payload = Server::ser_err(3, "ERR MULTI calls can not be nested");
+      } else {
+        in_multi = true;
+        r.payload = Server::ser_str(ok.data(), ok.size());
+      }
+      break;
+    case EXEC:
+      if (!in_multi)
+        r.payload = Server::ser_err(3, "ERR EXEC without MULTI");
+      else
+        r = exec();
+      break;
+    case DISCARD:
+      if (!in_multi) {
+        r.payload = Server::ser_err(3, "ERR DISCARD without MULTI");
+      } else {
+        discard();
+        unwatch();
+        r.payload = Server::ser_str(ok.data(), ok.size());
+      }
+      break;
+    case UNWATCH:
+      unwatch();
+      r.payload = Server::ser_str(ok.data(), ok.size());
+      break;
+    case WATCH:
+      r.payload = Server::ser_err(3, "ERR WATCH inside MULTI is not allowed");
+      break;
+    case UNKNOWN:
+    case PSYNC:
+    case REPLCONF_ACK:
+    case CLUSTER:
+    case ASKING:
+    case CLIENT_TRACKING:
+      // Unknown, or changes what the connection is; the whole
+      // transaction is refused at EXEC.
+      multi_error = true;
+      r.payload = p.type == UNKNOWN
+                      ? Server::ser_err(1, "Unknown cmd")
+                      : Server::ser_err(3, "ERR command not allowed in MULTI");
+      break;
+    default: {
+      queued.push_back(p);
+      string msg = "QUEUED";
+      r.payload = Server::ser_str(msg.data(), msg.size());
+      return r;
+    }
+    }
+    Server::free_request(p);
+    return r;
+  }
+
+  // Runs the queued requests back to back. Nothing else runs in between,
+  // and everything they log lands in this iteration's AOF frame, which
+  // replay and followers apply whole or not at all.
+  Response exec() {
+    Response r;
+    vector<parsed_request> q;
+    q.swap(queued);
+    bool refused = multi_error;
+    bool stale = watch_dirty || watched_key_expired();
+    in_multi = multi_error = false;
+    unwatch();
+
+    if (refused || stale) {
+      for (parsed_request &p : q)
+        Server::free_request(p);
+      r.payload = refused ? Server::ser_err(3, "EXECABORT Transaction "
+                                               "discarded because of "
+                                               "previous errors.")
+                          : Server::ser_nil();
+      return r;
+    }
+
+    vector<string> replies;
+    for (parsed_request &p : q) {
+      track_reads(p);
+      Response one = Server::process_request(p);
+      // A blocking pop cannot wait here; it answers like an empty pop.
+      if (!one.block_keys.empty())
+        one.payload = Server::ser_nil();
+      r.wait_aof = r.wait_aof || one.wait_aof;
+      if (one.durable >= 0)
+        r.durable = one.durable;
+      replies.push_back(one.payload);
+    }
+    r.payload = Server::ser_arr_of(replies);
+    return r;
+  }
+
+  void discard() {
+    for (parsed_request &p : queued)
+      Server::free_request(p);
+    queued.clear();
+    in_multi = multi_error = false;
+  }
+
+  void watch(const vector<string> &keys) {
+    for (const string &k : keys) {
+      bool seen = false;
+      for (auto &w : watching)
+        seen = seen || w.first == k;
+      if (seen)
+        continue;
+      HashEntry *e = dict->find_from(k.data(), k.size());
+      watching.push_back({k, e ? e->expires_at : 0});
+      watched_keys[k].push_back(this);
+    }
+  }
+
+  void unwatch() {
+    for (auto &w : watching) {
+      auto it = watched_keys.find(w.first);
+      if (it == watched_keys.end())
+        continue;
+      vector<Connection *> &v = it->second;
+      v.erase(std::remove(v.begin(), v.end(), this), v.end());
+      if (v.empty())
+        watched_keys.erase(it);
+    }
+    watching.clear();
+    watch_dirty = false;
+  }
+
+  void set_tracking(const Response &r) {
+    stop_tracking();
+    if (!r.tracking)
+      return;
+    tracking = true;
+    tracking_bcast = r.tracking_bcast;
+    tracking_clients[id] = this;
+    for (const string &prefix : r.tracking_prefixes)
+      tracking_prefixes.push_back({prefix, id});
+  }
+
+  // Keys this connection read stay in tracking_table; entries of a
+  // connection that stopped tracking are dropped as they come up.
+  void stop_tracking() {
+    if (!tracking)
+      return;
+    tracking = tracking_bcast = false;
+    tracking_clients.erase(id);
+    tracking_prefixes.erase(
+        std::remove_if(tracking_prefixes.begin(), tracking_prefixes.end(),
+                       [&](const pair<string, uint64_t> &t) {
+                         return t.second == id;
+                       }),
+        tracking_prefixes.end());
+  }
+
+  // Remembers the keys of a read so a later change can invalidate them.
+  // A full table drops some other key, invalidating it early.
+  void track_reads(const parsed_request &p) {
+    if (!tracking || tracking_bcast || Server::is_write_command(p.type))
+      return;
+    vector<string> keys;
+    Server::command_keys(p, keys);
+    for (const string &k : keys) {
+      // Make room before inserting, so the key just read is never the one
+      // dropped.
+      while (tracking_table.size() >= tracking_max_keys &&
+             !tracking_table.count(k)) {
+        string victim = tracking_table.begin()->first;
+        tracking_invalidate(victim);
+      }
+      vector<uint64_t> &ids = tracking_table[k];
+      if (std::find(ids.begin(), ids.end(), id) == ids.end())
+        ids.push_back(id);
+    }
+  }
+
+  // Pushed outside the request / reply sequence; clients tell it apart by
+  // the "(push)" prefix. An empty key means every key.
+  void push_invalidate(const string &key) {
+    queue_reply(key.empty() ? "(push) invalidate-all"
+                            : "(push) invalidate " + key);
+    tracking_invalidations++;
+  }
+
+  // Expiring counts as a change, though it is not a write.
+  bool watched_key_expired() const {
+    uint64_t now = now_ns();
+    for (auto &w : watching)
+      if (w.second && w.second <= now)
+        return true;
+    return false;
+  }
+
+  // Applies one block from the migration source and acknowledges it. An
+  // empty block ends the migration: the slot is ours from here on. Imported
+  // keys are logged as commands, like an AOF rewrite would write them.
+  bool import_block() {
+    if (read_buf.size() < SNAPSHOT_BLOCK_HEADER)
+      return false;
+    uint32_t len, entries, crc;
+    memcpy(&len, read_buf.data(), 4);
+    memcpy(&entries, read_buf.data() + 4, 4);
+    memcpy(&crc, read_buf.data() + 8, 4);
+    if (read_buf.size() < SNAPSHOT_BLOCK_HEADER + len)
+      return false;
+
+    uint16_t slot = import_slot;
+    if (len == 0 && entries == 0) {
+      read_buf.erase(0, SNAPSHOT_BLOCK_HEADER);
+      import_slot = -1;
+      if (!cluster.set_owner(slot, cluster.self_index()))
+        cerr << "[CLUSTER] could not rewrite the cluster config\n";
+      cerr << "[CLUSTER] slot " << slot << " imported\n";
+      string msg = "OK";
+      queue_reply(Server::ser_str(msg.data(), msg.size()));
+      return true;
+    }
+
+    vector<string> keys;
+    bool ok = snapshot_load_block(dict, read_buf.data() + SNAPSHOT_BLOCK_HEADER,
+                                  len, entries, crc, keys);
+    read_buf.erase(0, SNAPSHOT_BLOCK_HEADER + len);
+    if (!ok) {
+      import_slot = -1;
+      cluster.set_importing(slot, false);
+      queue_reply(Server::ser_err(3, "ERR corrupt migration block"));
+      return true;
+    }
+    for (const string &k : keys) {
+      HashEntry *e = dict->find_from(k.data(), k.size());
+      if (e)
+        aof_entry_commands(e, Server::aof_append);
+      if (keys_observed())
+        signal_modified_key(k);
+    }
+    queue_reply(Server::ser_int(entries));
+    return true;
+  }
+
+  // Sends res once the AOF is synced up to offset (0: no wait).
+  void reply_after(uint64_t offset, const string &res) {
+    if (held.empty() && offset <= aof.synced_offset()) {
+      queue_reply(res);
+      return;
+    }
+    if (aof.fsync_error()) {
+      fail_held();
+      queue_reply(offset <= aof.synced_offset() ? res : not_durable_error());
+      return;
+    }
+    if (held.empty())
+      held_clients.insert(this);
+    else
+      offset = max(offset, held.back().first);
+    held.push_back({offset, res});
+  }
+
+  // Called whenever an fsync completes.
+  void release_held(uint64_t synced) {
+    while (!held.empty() && held.front().first <= synced) {
+      queue_reply(held.front().second);
+      held.pop_front();
+    }
+    if (held.empty())
+      held_clients.erase(this);
+  }
+
+  static string not_durable_error() {
+    return Server::ser_err(3, string("ERR AOF fsync failed: ") +
+                                  strerror(aof.fsync_error()) +
+                                  "; the write is not durable");
+  }
+
+  // After a failed fsync: the held writes past the last good one will
+  // never be known durable, so each gets an error in place of its reply.
+  void fail_held() {
+    release_held(aof.synced_offset());
+    for (size_t i = 0; i < held.size(); i++)
+      queue_reply(not_durable_error());
+    held.clear();
+    held_clients.erase(this);
+  }
+
+  void queue_reply(const string &res) {
+    uint32_t len = res.size();
+    write_buf.append((const char *)&len, 4);
+    queue_raw(res);
+  }
+
+  // Unframed bytes: the replication stream after a PSYNC reply.
+  void queue_raw(const string &bytes) {
+    write_buf.append(bytes);
+
+    if (io_threads.active()) {
+      if (!write_pending) {
+        write_pending = true;
+        pending_writes.push_back(fd);
+      }
+      return;
+    }
+
+    state = WRITING;
+
+    epoll_event ev{};
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    ev.data.fd = fd;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
+  }
+
+  // Starts sending the snapshot at fd (size bytes) to a follower; it goes
+  // online at offset once the last byte is queued.
+  void send_snapshot(int sync_fd, uint64_t size, uint64_t offset) {
+    repl.sync_fd = sync_fd;
+    repl.sync_left = size;
+    repl.sync_offset = offset;
+    queue_raw(string((const char *)&size, 8));
+  }
+
+  // Tops write_buf up from the snapshot being sent, a chunk at a time so
+  // the file never sits in memory whole. After the last chunk come the
+  // frames logged meanwhile. False when there is nothing to add.
+  bool refill_snapshot() {
+    if (repl.sync_fd < 0)
+      return false;
+    size_t old = write_buf.size();
+    write_buf.resize(old + min<uint64_t>(REPL_SYNC_CHUNK, repl.sync_left));
+    ssize_t n = read(repl.sync_fd, &write_buf[old], write_buf.size() - old);
+    write_buf.resize(old + max<ssize_t>(n, 0));
+    if (n <= 0) {
+      // The file is shorter than announced; the follower will resync.
+      state = CLOSED;
+      close(repl.sync_fd);
+      repl.sync_fd = -1;
+      return false;
+    }
+    repl.sync_left -= n;
+    if (repl.sync_left == 0) {
+      close(repl.sync_fd);
+      repl.sync_fd = -1;
+      write_buf += repl.pending;
+      string().swap(repl.pending);
+      repl.online = true;
+      repl.ack_offset = repl.sync_offset;
+      repl.ack_ns = now_ns();
+    }
+    return true;
+  }
+
+  void on_write() {
+    while (!write_buf.empty() || refill_snapshot()) {
+      ssize_t n = write(fd, write_buf.data(), write_buf.size());
+      if (n > 0) {
+        write_buf.erase(0, n);
+      } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return;
+      } else {
+        state = CLOSED;
+        return;
+      }
+    }
+    if (state == CLOSED)
+      return;
+
+    state = READING;
+
+    epoll_event ev{};
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.fd = fd;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
+  }
+
+  // Writes what queue_raw collected in I/O-thread mode. Only a full
+  // socket arms EPOLLOUT; until it fires, the data stays in write_buf.
+  void write_pending_replies() {
+    write_pending = false;
+    if (state != READING)
+      return;
+    while (!write_buf.empty() || refill_snapshot()) {
+      ssize_t n = write(fd, write_buf.data(), write_buf.size());
+      if (n > 0) {
+        write_buf.erase(0, n);
+      } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        state = WRITING;
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+        ev.data.fd = fd;
+        epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
+        return;
+      } else {
+        state = CLOSED;
+        return;
+      }
+    }
+  }
+
+  void block(const Response &r) {
+    blocked = true;
+    block_left = r.block_left;
+    block_keys = r.block_keys;
+    block_deadline = r.block_deadline;
+
+    for (auto &k : block_keys)
+      blocked_clients[k].push_back(this);
+    if (block_deadline)
+      block_deadlines.insert({block_deadline, this});
+  }
+
+  void remove_from_blocking() {
+    for (auto &k : block_keys) {
+      auto it = blocked_clients.find(k);
+      if (it == blocked_clients.end())
+        continue;
+      deque<Connection *> &q = it->second;
+      q.erase(std::remove(q.begin(), q.end(), this), q.end());
+      if (q.empty())
+        blocked_clients.erase(it);
+    }
+    if (block_deadline)
+      block_deadlines.erase({block_deadline, this});
+
+    blocked = false;
+    block_keys.clear();
+    block_deadline = 0;
+  }
+
+  // Answers the parked pop and resumes any pipelined frames behind it.
+  void unblock(const string &reply) {
+    remove_from_blocking();
+    reply_after(durable ? aof.offset() : 0, reply);
+    process_frames();
+  }
+
+  bool pops_left() const { return block_left; }
+  void mark_watch_dirty() { watch_dirty = true; }
+  bool closed() const { return state == CLOSED; }
+  int get_fd() const { return fd; }
+
+  int handle(int events) {
+    if (events & (EPOLLERR | EPOLLHUP)) {
+      state = CLOSED;
+      return -1;
+    }
+
+    if (events & EPOLLIN)
+      on_read();
+    if (events & EPOLLOUT)
+      on_write();
+
+    return state == CLOSED ? -1 : 0;
+  }
+
+  // Allocated bytes of the connection and what it buffers: socket data,
+  // held replies and a follower's pending stream.
+  size_t memory_usage() const {
+    size_t bytes = alloc_size(this) + read_buf.capacity() +
+                   write_buf.capacity() + repl.pending.capacity();
+    for (const auto &h : held)
+      bytes += h.second.capacity();
+    return bytes;
+  }
+
+  static void cleanup(int epfd, Connection *conn, int fd,
+                      unordered_map<int, Connection *> &mp) {
+    epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
+    close(fd);
+    delete conn;
+    mp.erase(fd);
+  }
+};
+
+unordered_map<int, Connection *> connection_map;
+
+size_t clients_memory() {
+  size_t bytes = 0;
+  for (auto &kv : connection_map)
+    bytes += kv.second->memory_usage();
+  return bytes;
+}
+
+// Runs the frames read in one epoll round as a batch. Every ready
+// connection's complete frames are parsed first and all their keys
+// prefetched together, so the table misses of different requests overlap;
+// then each connection runs its own requests in order. ready holds fds, as
+// a connection may have been dropped since its read.
+void run_batch(int epfd, vector<int> &ready) {
+  vector<Connection *> conns;
+  vector<const char *> keys;
+  for (int fd : ready) {
+    auto it = connection_map.find(fd);
+    if (it == connection_map.end())
+      continue;
+    conns.push_back(it->second);
+    it->second->parse_ahead();
+    it->second->collect_keys(keys);
+  }
+  if (keys.size() > 1)
+    dict->prefetch_many(keys);
+
+  for (Connection *c : conns) {
+    c->process_frames();
+    if (c->closed())
+      Connection::cleanup(epfd, c, c->get_fd(), connection_map);
+  }
+  ready.clear();
+}
+
+// I/O-thread mode: handles the client events of one epoll round on the
+// I/O threads (reads, parsing, writes on EPOLLOUT), then queues the
+// connections with requests for run_batch.
+void run_io_events(int epfd, vector<pair<int, int>> &events,
+                   vector<int> &ready) {
+  vector<void *> conns;
+  for (auto &ev : events) {
+    auto it = connection_map.find(ev.first);
+    if (it == connection_map.end())
+      continue;
+    it->second->set_io_events(ev.second);
+    conns.push_back(it->second);
+  }
+  io_threads.run(conns, Connection::io_handle);
+
+  for (void *p : conns) {
+    Connection *c = (Connection *)p;
+    if (c->closed())
+      Connection::cleanup(epfd, c, c->get_fd(), connection_map);
+    else if (c->has_input())
+      ready.push_back(c->get_fd());
+  }
+  events.clear();
+}
+
+// I/O-thread mode: writes every reply queued this iteration.
+void write_pending_replies(int epfd) {
+  vector<void *> conns;
+  for (int fd : pending_writes) {
+    auto it = connection_map.find(fd);
+    if (it != connection_map.end())
+      conns.push_back(it->second);
+  }
+  pending_writes.clear();
+  io_threads.run(conns, Connection::io_write);
+
+  for (void *p : conns) {
+    Connection *c = (Connection *)p;
+    if (c->closed())
+      Connection::cleanup(epfd, c, c->get_fd(), connection_map);
+  }
+}
+
+// Hands elements pushed onto watched lists to the clients parked on them,
+// oldest first. A served client may run pipelined commands that push to
+// more keys, hence the outer loop.
+void serve_blocked_clients(int epfd) {
+  while (!ready_keys.empty()) {
+    unordered_set<string> keys;
+    keys.swap(ready_keys);
+
+    for (const string &key : keys) {
+      while (true) {
+        auto it = blocked_clients.find(key);
+        if (it == blocked_clients.end())
+          break;
+        HashEntry *e = dict->find_from(key.data(), key.size());
+        if (!e || e->val->type != RobjType::OBJ_LIST)
+          break;
+
+        Connection *c = it->second.front();
+        string v;
+        Server::pop_logged(key, (List *)e->val->ptr, c->pops_left(), v);
+        c->unblock(Server::ser_arr({key, v}));
+        if (c->closed())
+          Connection::cleanup(epfd, c, c->get_fd(), connection_map);
+      }
+    }
+  }
+}
+
+// A change to key fails the next EXEC of every connection watching it and
+// invalidates it for tracking clients.
+void signal_modified_key(const string &key) {
+  auto it = watched_keys.find(key);
+  if (it != watched_keys.end()) {
+    for (Connection *c : it->second)
+      c->mark_watch_dirty();
+  }
+  if (!tracking_clients.empty())
+    tracking_invalidate(key);
+}
+
+// The whole dataset was replaced (a full resync).
+void signal_all_keys_modified() {
+  for (auto &w : watched_keys)
+    for (Connection *c : w.second)
+      c->mark_watch_dirty();
+  tracking_table.clear();
+  for (auto &t : tracking_clients)
+    t.second->push_invalidate("");
+}
+
+// Tells the connections that read key, or cover it with a BCAST prefix,
+// that their copy is stale. Readers have to read it again to be told
+// about the next change.
+void tracking_invalidate(const string &key) {
+  auto it = tracking_table.find(key);
+  if (it != tracking_table.end()) {
+    for (uint64_t id : it->second) {
+      auto c = tracking_clients.find(id);
+      if (c != tracking_clients.end())
+        c->second->push_invalidate(key);
+    }
+    tracking_table.erase(it);
+  }
+  for (auto &t : tracking_prefixes) {
+    if (key.compare(0, t.first.size(), t.first) == 0)
+      tracking_clients[t.second]->push_invalidate(key);
+  }
+}
+
+// Dict's expire hook: an expired key has changed as much as a deleted one.
+void on_key_expired(const char *key, uint32_t len) {
+  if (keys_observed())
+    signal_modified_key(string(key, len));
+}
+
+// Releases held replies covered by the latest fsync, or fails them all once
+// an fsync has failed.
+void release_durable_replies(int epfd) {
+  aof.drain_events();
+  uint64_t synced = aof.synced_offset();
+  vector<Connection *> ready(held_clients.begin(), held_clients.end());
+  for (Connection *c : ready) {
+    if (aof.fsync_error())
+      c->fail_held();
+    else
+      c->release_held(synced);
+    if (c->closed())
+      Connection::cleanup(epfd, c, c->get_fd(), connection_map);
+  }
+}
+
+void poll_bgsave() {
+  if (bgsave_pid <= 0)
+    return;
+  int status;
+  pid_t r = waitpid(bgsave_pid, &status, WNOHANG);
+  if (r == 0)
+    return;
+  bgsave_pid = -1;
+  last_save_ok = r > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+  last_save_ms = (now_ns() - bgsave_start_ns) / 1000000;
+  cerr << "[SNAPSHOT] background save " << (last_save_ok ? "done" : "failed")
+       << " in " << last_save_ms << " ms\n";
+}
+
+// Replication, leader side. Followers needing a full resync share one
+// forked child that writes the dataset to REPL_SYNC_FILE; the stream logged
+// after it forked waits in each follower's pending buffer.
+pid_t repl_sync_pid = -1;
+uint64_t repl_sync_gen = 0;    // full-sync children started so far
+uint64_t repl_sync_offset = 0; // stream offset the running child saw
+uint64_t repl_last_ping_ns = 0;
+uint64_t repl_last_keepalive_ns = 0;
+
+// Frames what was logged since the last call into the backlog and onto
+// every follower link; heartbeat sends an empty frame when nothing was.
+void repl_flush(bool heartbeat = false) {
+  if (!repl_buf_records && !heartbeat)
+    return;
+  string frame;
+  aof_encode_frame(frame, repl_buf, repl_buf_records);
+  repl_buf.clear();
+  repl_buf_records = 0;
+  repl_backlog.append(frame.data(), frame.size());
+  repl_last_ping_ns = now_ns();
+
+  for (Connection *c : replicas) {
+    if (c->repl.online)
+      c->queue_raw(frame);
+    else if (c->repl.sync_gen)
+      c->repl.pending += frame;
+  }
+}
+
+void repl_send_fullresync(Connection *c) {
+  string msg = "FULLRESYNC " + repl_id + " " + to_string(repl_sync_offset);
+  c->queue_reply(Server::ser_str(msg.data(), msg.size()));
+}
+
+// Forks the child for every follower waiting on a full resync.
+void repl_start_sync() {
+  repl_flush();
+  pid_t pid = fork();
+  if (pid < 0) {
+    perror("[REPL] fork");
+    return;
+  }
+  if (pid == 0) {
+    int f = open(REPL_SYNC_FILE, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+    _exit(f >= 0 && snapshot_write(dict, f) ? 0 : 1);
+  }
+
+  repl_sync_pid = pid;
+  repl_sync_gen++;
+  repl_sync_offset = repl_backlog.end_offset();
+  for (Connection *c : replicas) {
+    if (!c->repl.online && !c->repl.sync_gen) {
+      c->repl.sync_gen = repl_sync_gen;
+      repl_send_fullresync(c);
+    }
+  }
+  cerr << "[REPL] full sync started by pid " << pid << " at offset "
+       << repl_sync_offset << "\n";
+}
+
+// A follower's PSYNC. It resumes from the backlog when it asks for our
+// history at an offset still held there. Otherwise it joins the running
+// full-sync child if the backlog still covers what was logged since that
+// forked, or waits for the next one.
+void repl_attach(Connection *c, const string &id, uint64_t offset) {
+  if (!repl_backlog.active())
+    repl_backlog.create(repl_backlog_size, 0);
+  repl_flush();
 
-  void shutdown() {
-    if (listen_fd != -1) {
-      close(listen_fd);
-      listen_fd = -1;
+  c->repl.attached = true;
+  c->repl.ack_ns = now_ns();
+  replicas.insert(c);
+
+  string tail;
+  if (id == repl_id && repl_backlog.copy_from(offset, tail)) {
+    string msg = "CONTINUE " + repl_id;
+    c->queue_reply(Server::ser_str(msg.data(), msg.size()));
+    c->queue_raw(tail);
+    c->repl.online = true;
+    c->repl.ack_offset = offset;
+    cerr << "[REPL] follower resumed at offset " << offset << " ("
+         << tail.size() << " bytes from the backlog)\n";
+    return;
+  }
+
+  if (repl_sync_pid > 0) {
+    if (repl_backlog.copy_from(repl_sync_offset, tail)) {
+      c->repl.sync_gen = repl_sync_gen;
+      c->repl.pending = tail;
+      repl_send_fullresync(c);
     }
-    if (epoll_fd != -1) {
-      close(epoll_fd);
-      epoll_fd = -1;
+    return;
+  }
+  repl_start_sync();
+}
+
+// Reaps the full-sync child and sends its snapshot, then the pending
+// stream, to the followers that waited on it.
+void poll_repl_sync() {
+  if (repl_sync_pid <= 0)
+    return;
+  int status;
+  pid_t r = waitpid(repl_sync_pid, &status, WNOHANG);
+  if (r == 0)
+    return;
+  repl_sync_pid = -1;
+
+  bool ok = r > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+  struct stat sb;
+  ok = ok && stat(REPL_SYNC_FILE, &sb) == 0 && sb.st_size > 0;
+  if (!ok)
+    cerr << "[REPL] full sync failed\n";
+
+  bool waiting = false;
+  for (Connection *c : replicas) {
+    // Online, or still being sent an earlier snapshot.
+    if (c->repl.online || c->repl.sync_fd >= 0)
+      continue;
+    if (c->repl.sync_gen != repl_sync_gen) {
+      waiting = true;
+      continue;
     }
-    cout << "[Server] Stopped listening." << endl;
+    if (!ok) {
+      // The follower reconnects and asks again.
+      shutdown(c->get_fd(), SHUT_RDWR);
+      continue;
+    }
+    // Each follower reads the file at its own pace through its own
+    // descriptor, which keeps it alive after the unlink below.
+    int f = open(REPL_SYNC_FILE, O_RDONLY | O_CLOEXEC);
+    if (f < 0) {
+      shutdown(c->get_fd(), SHUT_RDWR);
+      continue;
+    }
+    c->send_snapshot(f, sb.st_size, repl_sync_offset);
   }
+  unlink(REPL_SYNC_FILE);
+  if (waiting)
+    repl_start_sync();
+}
 
-  int epollfd() const { return epoll_fd; }
-  int fd() const { return listen_fd; }
-  epoll_event *get_events() { return events; }
-};
+// Once per loop iteration: ships the stream, pings idle followers and
+// drops the ones that stopped acknowledging.
+void repl_cron() {
+  uint64_t now = now_ns();
+  repl_flush(!replicas.empty() && now - repl_last_ping_ns >= REPL_PING_NS);
+  poll_repl_sync();
 
-class Connection {
+  // Followers waiting for a snapshot get nothing else until it is written,
+  // however long that takes; see Replication.h.
+  if (now - repl_last_keepalive_ns >= REPL_PING_NS) {
+    repl_last_keepalive_ns = now;
+    uint64_t keepalive = REPL_SYNC_KEEPALIVE;
+    for (Connection *c : replicas) {
+      if (c->repl.online || c->repl.sync_fd >= 0)
+        continue;
+      if (c->repl.sync_gen)
+        c->queue_raw(string((const char *)&keepalive, 8));
+      else
+        c->queue_reply("");
+    }
+  }
+
+  for (Connection *c : replicas) {
+    if (c->repl.online && now - c->repl.ack_ns > REPL_TIMEOUT_NS) {
+      cerr << "[REPL] follower timed out\n";
+      shutdown(c->get_fd(), SHUT_RDWR);
+      c->repl.ack_ns = now;
+    }
+  }
+}
+
+// A follower's connection to its leader. While down it reconnects once a
+// second, asking to resume after the last frame it applied.
+class MasterLink {
 private:
-  int fd;
-  string read_buf;
-  string write_buf;
-  ConnectionState state = READING;
+  enum State { DOWN, CONNECTING, HANDSHAKE, SNAPSHOT, STREAMING };
 
-public:
-  explicit Connection(int f) : fd(f) {}
+  State state = DOWN;
+  int fd = -1;
+  int epfd = -1;
+  string host;
+  uint16_t port = 0;
+  string rbuf;
+  string wbuf;
 
-  void on_read(int epfd) {
-    char buf[4096];
+  // The leader's history and the offset just past the last applied frame.
+  string replid = "?";
+  uint64_t offset = 0;
 
-    while (true) {
-      ssize_t n = read(fd, buf, sizeof(buf));
+  uint64_t last_io_ns = 0;
+  uint64_t last_attempt_ns = 0;
+  uint64_t last_ack_ns = 0;
+  uint64_t down_since_ns = 0;
+  uint64_t full_syncs = 0;
+  uint64_t partial_syncs = 0;
+  vector<AofRecord> records;
+
+  // The snapshot being received into REPL_RECV_FILE, and its bytes still
+  // to come.
+  int snap_fd = -1;
+  uint64_t snap_left = 0;
+
+  void connect_link() {
+    last_attempt_ns = now_ns();
+
+    addrinfo hints{}, *res;
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host.c_str(), to_string(port).c_str(), &hints, &res) != 0) {
+      cerr << "[REPL] cannot resolve " << host << "\n";
+      return;
+    }
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    int rc = fd < 0 ? -1 : connect(fd, res->ai_addr, res->ai_addrlen);
+    freeaddrinfo(res);
+    if (rc < 0 && errno != EINPROGRESS) {
+      if (fd >= 0)
+        close(fd);
+      fd = -1;
+      return;
+    }
+
+    state = CONNECTING;
+    epoll_event ev{};
+    ev.events = EPOLLIN | EPOLLOUT;
+    ev.data.fd = fd;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+  }
+
+  void close_link() {
+    if (fd < 0)
+      return;
+    epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
+    close(fd);
+    fd = -1;
+    state = DOWN;
+    rbuf.clear();
+    wbuf.clear();
+    down_since_ns = now_ns();
+    if (snap_fd >= 0) {
+      close(snap_fd);
+      snap_fd = -1;
+      unlink(REPL_RECV_FILE);
+    }
+  }
+
+  void send_frame(const string &payload) {
+    uint32_t len = payload.size();
+    wbuf.append((const char *)&len, 4);
+    wbuf += payload;
+    flush_writes();
+  }
+
+  void flush_writes() {
+    while (!wbuf.empty()) {
+      ssize_t n = write(fd, wbuf.data(), wbuf.size());
       if (n > 0) {
-        read_buf.append(buf, n);
-      } else if (n == 0) {
-        state = CLOSED;
-        return;
+        wbuf.erase(0, n);
       } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
         break;
       } else {
-        state = CLOSED;
+        close_link();
         return;
       }
     }
+    epoll_event ev{};
+    ev.events = wbuf.empty() ? EPOLLIN : EPOLLIN | EPOLLOUT;
+    ev.data.fd = fd;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
+  }
 
-    while (true) {
-      if (read_buf.size() < 4)
+  bool on_handshake_reply(const string &reply) {
+    istringstream iss(reply);
+    string tag, word, id;
+    iss >> tag >> word >> id;
+    if (tag == "(str)" && word == "FULLRESYNC" && (iss >> offset)) {
+      replid = id;
+      state = SNAPSHOT;
+      return true;
+    }
+    if (tag == "(str)" && word == "CONTINUE" && id == replid) {
+      partial_syncs++;
+      state = STREAMING;
+      cerr << "[REPL] resumed at offset " << offset << "\n";
+      return true;
+    }
+    cerr << "[REPL] leader refused PSYNC: " << reply << "\n";
+    return false;
+  }
+
+  // Writes the snapshot to REPL_RECV_FILE as it arrives instead of
+  // holding it in rbuf, then loads it. False on a write error or a corrupt
+  // snapshot.
+  bool receive_snapshot() {
+    while (snap_fd < 0) {
+      uint64_t n;
+      if (rbuf.size() < 8)
+        return true;
+      memcpy(&n, rbuf.data(), 8);
+      rbuf.erase(0, 8);
+      if (n == REPL_SYNC_KEEPALIVE)
+        continue;
+      snap_fd = open(REPL_RECV_FILE, O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC,
+                     0644);
+      if (snap_fd < 0) {
+        perror("[REPL] open " REPL_RECV_FILE);
+        return false;
+      }
+      snap_left = n;
+    }
+
+    size_t take = min<uint64_t>(rbuf.size(), snap_left);
+    if (take && !write_all(snap_fd, rbuf.data(), take)) {
+      perror("[REPL] write " REPL_RECV_FILE);
+      return false;
+    }
+    rbuf.erase(0, take);
+    snap_left -= take;
+    if (snap_left)
+      return true;
+
+    bool synced = fdatasync(snap_fd) == 0;
+    close(snap_fd);
+    snap_fd = -1;
+    if (!synced || !load_snapshot()) {
+      cerr << "[REPL] snapshot from leader is corrupt\n";
+      unlink(REPL_RECV_FILE);
+      return false;
+    }
+    state = STREAMING;
+    return true;
+  }
+
+  // Replaces the dataset with the snapshot in REPL_RECV_FILE and, in the
+  // same step, makes that file our AOF: a snapshot is a valid log on its
+  // own. A crash then leaves either the old dataset with its log or the
+  // new one with the new log, never the old log before the new stream.
+  bool load_snapshot() {
+    uint64_t t0 = now_ns();
+    Dict *fresh = new Dict(128);
+    if (cluster.enabled())
+      fresh->enable_slot_index();
+    SnapshotLoadStats st;
+    if (!snapshot_load_file(fresh, REPL_RECV_FILE, st)) {
+      delete fresh;
+      return false;
+    }
+    delete dict;
+    dict = fresh;
+    dict->set_expire_hook(on_key_expired);
+    dict->set_latency_hook(on_dict_latency);
+    signal_all_keys_modified();
+    last_load = st;
+    last_load_ms = (now_ns() - t0) / 1000000;
+    full_syncs++;
+    cerr << "[REPL] full resync: " << st.keys << " keys at offset " << offset
+         << " in " << last_load_ms << " ms\n";
+
+    if (!aof.enabled()) {
+      unlink(REPL_RECV_FILE);
+    } else if (!aof.reset_to(REPL_RECV_FILE)) {
+      // The old log describes the old dataset; replace it the slow way.
+      unlink(REPL_RECV_FILE);
+      Server::start_aof_rewrite();
+    }
+    return true;
+  }
+
+  // Applies every complete frame in rbuf. The records also go to our own
+  // AOF as they are; aof_loading keeps commands replayed through the
+  // dispatcher from logging themselves a second time.
+  bool apply_frames() {
+    size_t off = 0;
+    bool ok = true;
+    aof_loading = true;
+    while (off < rbuf.size()) {
+      const char *f = rbuf.data() + off;
+      size_t frame_len;
+      AofFrameStatus st =
+          aof_is_frame(f, rbuf.size() - off)
+              ? aof_decode_frame(f, rbuf.size() - off, &frame_len, records)
+              : AOF_FRAME_CORRUPT;
+      if (st == AOF_FRAME_TRUNCATED)
         break;
+      if (st == AOF_FRAME_CORRUPT) {
+        cerr << "[REPL] corrupt frame at offset " << offset << "\n";
+        ok = false;
+        break;
+      }
+      Server::apply_aof_records(records);
+      if (aof.enabled() && !records.empty())
+        aof.append_records(f + AOF_FRAME_HEADER, frame_len - AOF_FRAME_HEADER,
+                           records.size());
+      offset += frame_len;
+      off += frame_len;
+    }
+    aof_loading = false;
+    rbuf.erase(0, off);
+    return ok;
+  }
 
-      uint32_t len;
-      memcpy(&len, read_buf.data(), 4);
+  bool process() {
+    while (true) {
+      if (state == HANDSHAKE) {
+        uint32_t len;
+        if (rbuf.size() < 4)
+          return true;
+        memcpy(&len, rbuf.data(), 4);
+        if (rbuf.size() < 4 + len)
+          return true;
+        string reply = rbuf.substr(4, len);
+        rbuf.erase(0, 4 + len);
+        // An empty reply only keeps the link alive while we wait.
+        if (len && !on_handshake_reply(reply))
+          return false;
+      } else if (state == SNAPSHOT) {
+        if (!receive_snapshot())
+          return false;
+        if (state == SNAPSHOT)
+          return true;
+      } else {
+        return state != STREAMING || apply_frames();
+      }
+    }
+  }
 
-      if (len > MAX_LEN) {
-        state = CLOSED;
+public:
+  void set_epoll(int ep) { epfd = ep; }
+  bool enabled() const { return !host.empty(); }
+  int get_fd() const { return fd; }
+
+  void start(const string &h, uint16_t p) {
+    stop();
+    host = h;
+    port = p;
+    replid = "?";
+    offset = 0;
+    down_since_ns = now_ns();
+    cerr << "[REPL] following " << host << ":" << port << "\n";
+    connect_link();
+  }
+
+  void stop() {
+    close_link();
+    host.clear();
+  }
+
+  void handle(int events) {
+    if (state == CONNECTING) {
+      int err = 0;
+      socklen_t len = sizeof(err);
+      getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len);
+      if (err || (events & (EPOLLERR | EPOLLHUP))) {
+        close_link();
         return;
       }
+      cerr << "[REPL] connected, sending PSYNC " << replid << " " << offset
+           << "\n";
+      state = HANDSHAKE;
+      last_io_ns = now_ns();
+      send_frame("PSYNC " + replid + " " + to_string(offset));
+      return;
+    }
+
+    if (events & EPOLLOUT)
+      flush_writes();
+    if (fd < 0 || !(events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+      return;
 
-      if (read_buf.size() < 4 + len)
+    char buf[65536];
+    while (true) {
+      ssize_t n = read(fd, buf, sizeof(buf));
+      if (n > 0) {
+        rbuf.append(buf, n);
+        last_io_ns = now_ns();
+      } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
         break;
+      } else {
+        // Apply what did arrive before giving up on the link.
+        process();
+        cerr << "[REPL] lost the leader\n";
+        close_link();
+        return;
+      }
+    }
+    if (!process())
+      close_link();
+  }
+
+  // Reconnects while down, acknowledges progress and notices a silent
+  // leader.
+  void cron() {
+    if (!enabled())
+      return;
+    uint64_t now = now_ns();
+    if (state == DOWN) {
+      if (now - last_attempt_ns >= REPL_PING_NS)
+        connect_link();
+      return;
+    }
+    if (state != CONNECTING && now - last_io_ns > REPL_TIMEOUT_NS) {
+      cerr << "[REPL] leader timed out\n";
+      close_link();
+      return;
+    }
+    if (state == STREAMING && now - last_ack_ns >= REPL_PING_NS) {
+      last_ack_ns = now;
+      send_frame("REPLCONF ACK " + to_string(offset));
+    }
+  }
+
+  void info(string &out) {
+    uint64_t now = now_ns();
+    out += "master_host:" + host + "\n";
+    out += "master_port:" + to_string(port) + "\n";
+    out += "master_link_status:" +
+           string(state == STREAMING ? "up" : "down") + "\n";
+    out += "master_last_io_seconds_ago:" +
+           to_string(last_io_ns ? (now - last_io_ns) / 1000000000ULL : 0) +
+           "\n";
+    out += "master_sync_in_progress:" + to_string(state == SNAPSHOT ? 1 : 0) +
+           "\n";
+    if (state != STREAMING)
+      out += "master_link_down_since_seconds:" +
+             to_string((now - down_since_ns) / 1000000000ULL) + "\n";
+    out += "master_replid:" + replid + "\n";
+    out += "slave_repl_offset:" + to_string(offset) + "\n";
+    out += "slave_read_only:1\n";
+    out += "repl_full_syncs:" + to_string(full_syncs) + "\n";
+    out += "repl_partial_syncs:" + to_string(partial_syncs) + "\n";
+  }
+};
+
+MasterLink master_link;
+
+// REPLICAOF host port, or an empty host for REPLICAOF NO ONE.
+void replicaof(const string &host, uint16_t port) {
+  if (host.empty()) {
+    if (!replica_mode)
+      return;
+    master_link.stop();
+    replica_mode = false;
+    // A new history: our followers start with a full resync.
+    repl_id = repl_new_id();
+    cerr << "[REPL] now leading as " << repl_id << "\n";
+    return;
+  }
+
+  // Our own followers go; the dataset is about to be replaced.
+  for (Connection *c : replicas)
+    shutdown(c->get_fd(), SHUT_RDWR);
+  if (repl_sync_pid > 0) {
+    kill(repl_sync_pid, SIGKILL);
+    waitpid(repl_sync_pid, nullptr, 0);
+    repl_sync_pid = -1;
+    unlink(REPL_SYNC_FILE);
+  }
+  repl_backlog.release();
+  repl_buf.clear();
+  repl_buf_records = 0;
+
+  replica_mode = true;
+  master_link.start(host, port);
+}
+
+void replication_info(string &out) {
+  out += "# Replication\n";
+  if (replica_mode) {
+    out += "role:slave\n";
+    master_link.info(out);
+    return;
+  }
 
-      string payload = read_buf.substr(4, len);
-      read_buf.erase(0, 4 + len);
+  uint64_t now = now_ns();
+  uint64_t end = repl_backlog.end_offset();
+  out += "role:master\n";
+  out += "master_replid:" + repl_id + "\n";
+  out += "master_repl_offset:" + to_string(end) + "\n";
+  out += "connected_slaves:" + to_string(replicas.size()) + "\n";
+  int i = 0;
+  for (Connection *c : replicas) {
+    sockaddr_in peer{};
+    socklen_t len = sizeof(peer);
+    getpeername(c->get_fd(), (sockaddr *)&peer, &len);
+    char ip[INET_ADDRSTRLEN] = "?";
+    inet_ntop(AF_INET, &peer.sin_addr, ip, sizeof(ip));
+    const FollowerLink &f = c->repl;
+    out += "slave" + to_string(i++) + ":ip=" + ip +
+           ",port=" + to_string(ntohs(peer.sin_port)) +
+           ",state=" + (f.online ? "online" : "wait_bgsave") +
+           ",offset=" + to_string(f.ack_offset) +
+           ",lag_bytes=" + to_string(f.online ? end - f.ack_offset : 0) +
+           ",lag_ms=" + to_string((now - f.ack_ns) / 1000000) + "\n";
+  }
+  out += "repl_sync_in_progress:" + to_string(repl_sync_pid > 0 ? 1 : 0) + "\n";
+  out += "repl_backlog_active:" + to_string(repl_backlog.active() ? 1 : 0) +
+         "\n";
+  out += "repl_backlog_size:" + to_string(repl_backlog.capacity()) + "\n";
+  out += "repl_backlog_first_byte_offset:" +
+         to_string(repl_backlog.start_offset()) + "\n";
+  out += "repl_backlog_histlen:" + to_string(repl_backlog.size()) + "\n";
+}
+
+// Slot migration pacing. A batch holds at most migrate_batch_keys keys and
+// shrinks while encoding and then deleting it keeps the loop busy longer
+// than migrate_budget_us, which bounds the latency migration adds to
+// commands queued behind it. migrate_max_bytes caps the bytes per second
+// put on the wire.
+uint32_t migrate_batch_keys = 512;
+uint64_t migrate_budget_us = 1000;
+uint64_t migrate_max_bytes = 32ULL << 20;
+
+// Source side of a slot migration. Keys go to the target in snapshot
+// blocks with one batch in flight; a key leaves this node only once the
+// target has acknowledged the batch holding it. An empty block ends the
+// migration, and the slot flips to the target when it confirms.
+class SlotMigration {
+private:
+  enum State { IDLE, CONNECTING, HANDSHAKE, SENDING, FINISHING };
+
+  State state = IDLE;
+  int fd = -1;
+  int epfd = -1;
+  uint16_t slot = 0;
+  int node = -1;
+  string rbuf;
+  string wbuf;
 
-      cout << "Client said: " << payload << endl;
+  bool waiting_ack = false;
+  uint32_t batch_keys = 0;
+  uint64_t build_ns = 0;
+  uint64_t next_send_ns = 0;
 
-      parsed_request p = Server::parse_request(payload);
-      Response response = Server::process_request(p);
-      string &res = response.payload;
-      len = res.size();
-      write_buf.resize(4 + len);
-      memcpy(&write_buf[0], &len, 4);
-      memcpy(&write_buf[4], res.data(), len);
+  uint64_t start_ns = 0;
+  uint64_t keys_moved = 0;
+  uint64_t bytes_sent = 0;
+  uint64_t batches = 0;
+  uint64_t last_batch_us = 0;
+  uint64_t max_batch_us = 0;
+  uint64_t last_ms = 0;
+  string last_status = "none";
+
+  bool connect_link() {
+    const ClusterNode &n = cluster.all_nodes()[node];
+    addrinfo hints{}, *res;
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(n.host.c_str(), to_string(n.port).c_str(), &hints, &res) !=
+        0)
+      return false;
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    int rc = fd < 0 ? -1 : connect(fd, res->ai_addr, res->ai_addrlen);
+    freeaddrinfo(res);
+    if (rc < 0 && errno != EINPROGRESS) {
+      if (fd >= 0)
+        close(fd);
+      fd = -1;
+      return false;
+    }
 
-      state = WRITING;
+    state = CONNECTING;
+    epoll_event ev{};
+    ev.events = EPOLLIN | EPOLLOUT;
+    ev.data.fd = fd;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+    return true;
+  }
 
-      epoll_event ev{};
-      ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
-      ev.data.fd = fd;
-      epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
+  void finish(bool ok, const string &why) {
+    if (fd >= 0) {
+      epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
+      close(fd);
+      fd = -1;
     }
+    state = IDLE;
+    rbuf.clear();
+    wbuf.clear();
+    waiting_ack = false;
+    // Unacknowledged keys stay here; a retry sends them again.
+    migrating_keys.clear();
+    migrating_slot = -1;
+    last_ms = (now_ns() - start_ns) / 1000000;
+    last_status = ok ? "ok" : why;
+    cerr << "[CLUSTER] migration of slot " << slot << " "
+         << (ok ? "finished" : "failed: " + why) << " (" << keys_moved
+         << " keys in " << last_ms << " ms)\n";
   }
 
-  void on_write(int epfd) {
-    while (!write_buf.empty()) {
-      ssize_t n = write(fd, write_buf.data(), write_buf.size());
+  void send(const string &bytes) {
+    wbuf += bytes;
+    while (!wbuf.empty()) {
+      ssize_t n = write(fd, wbuf.data(), wbuf.size());
       if (n > 0) {
-        write_buf.erase(0, n);
+        wbuf.erase(0, n);
       } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
-        return;
+        break;
       } else {
-        state = CLOSED;
+        finish(false, "write to target failed");
         return;
       }
     }
-
-    state = READING;
-
     epoll_event ev{};
-    ev.events = EPOLLIN | EPOLLET;
+    ev.events = wbuf.empty() ? EPOLLIN : EPOLLIN | EPOLLOUT;
     ev.data.fd = fd;
     epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
   }
 
-  int handle(int epfd, int events) {
-    if (events & (EPOLLERR | EPOLLHUP)) {
-      state = CLOSED;
-      return -1;
+  void send_batch() {
+    uint64_t t0 = now_ns();
+    vector<string> keys;
+    dict->keys_in_slot(slot, batch_keys, keys);
+    if (keys.empty()) {
+      string end(SNAPSHOT_BLOCK_HEADER, '\0');
+      state = FINISHING;
+      send(end);
+      return;
+    }
+
+    string payload;
+    uint32_t entries = 0;
+    for (const string &k : keys) {
+      // Expired keys are dropped here rather than shipped.
+      HashEntry *e = dict->find_from(k.data(), k.size());
+      if (!e)
+        continue;
+      snapshot_encode_entry(payload, e);
+      migrating_keys.insert(k);
+      entries++;
+    }
+    if (!entries)
+      return;
+
+    string block = snapshot_block(payload, entries);
+    build_ns = now_ns() - t0;
+    waiting_ack = true;
+    bytes_sent += block.size();
+    batches++;
+    next_send_ns = now_ns() + block.size() * 1000000000ULL / migrate_max_bytes;
+    send(block);
+  }
+
+  // The target holds the batch: drop it here and size the next one.
+  void on_ack() {
+    uint64_t t0 = now_ns();
+    for (const string &k : migrating_keys) {
+      if (dict->erase_from(k.data(), k.size())) {
+        Server::aof_append("DELETE " + k);
+        keys_moved++;
+        if (keys_observed())
+          signal_modified_key(k);
+      }
+    }
+    migrating_keys.clear();
+    waiting_ack = false;
+
+    last_batch_us = (build_ns + now_ns() - t0) / 1000;
+    max_batch_us = max(max_batch_us, last_batch_us);
+    if (last_batch_us > migrate_budget_us && batch_keys > 1)
+      batch_keys /= 2;
+    else if (last_batch_us * 2 < migrate_budget_us &&
+             batch_keys < migrate_batch_keys)
+      batch_keys = min(migrate_batch_keys, batch_keys * 2);
+  }
+
+  void on_reply(const string &reply) {
+    if (state == HANDSHAKE && reply == "(str) IMPORTING") {
+      state = SENDING;
+    } else if (state == SENDING && waiting_ack && reply.rfind("(int)", 0) == 0) {
+      on_ack();
+    } else if (state == FINISHING && reply == "(str) OK") {
+      if (!cluster.set_owner(slot, node))
+        cerr << "[CLUSTER] could not rewrite the cluster config\n";
+      finish(true, "");
+    } else {
+      finish(false, reply);
+    }
+  }
+
+public:
+  void set_epoll(int ep) { epfd = ep; }
+  int get_fd() const { return fd; }
+
+  bool start(uint16_t s, int n, string &err) {
+    if (state != IDLE) {
+      err = "ERR a slot migration is already running";
+      return false;
+    }
+    if (!cluster.owns(s)) {
+      err = "ERR slot is not served by this node";
+      return false;
+    }
+    slot = s;
+    node = n;
+    batch_keys = min<uint32_t>(migrate_batch_keys, 16);
+    next_send_ns = 0;
+    start_ns = now_ns();
+    keys_moved = bytes_sent = batches = last_batch_us = max_batch_us = 0;
+    last_status = "running";
+    if (!connect_link()) {
+      err = "ERR cannot connect to " + cluster.address(n);
+      last_status = err;
+      return false;
+    }
+    migrating_slot = s;
+    migrating_to = n;
+    cerr << "[CLUSTER] migrating slot " << s << " ("
+         << dict->count_keys_in_slot(s) << " keys) to " << cluster.address(n)
+         << "\n";
+    return true;
+  }
+
+  void handle(int events) {
+    if (state == CONNECTING) {
+      int err = 0;
+      socklen_t len = sizeof(err);
+      getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len);
+      if (err || (events & (EPOLLERR | EPOLLHUP))) {
+        finish(false, "cannot connect to target");
+        return;
+      }
+      state = HANDSHAKE;
+      string cmd = "CLUSTER IMPORT " + to_string(slot);
+      uint32_t n = cmd.size();
+      send(string((const char *)&n, 4) + cmd);
+      return;
     }
 
-    if (events & EPOLLIN)
-      on_read(epfd);
     if (events & EPOLLOUT)
-      on_write(epfd);
+      send("");
+    if (fd < 0 || !(events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+      return;
 
-    return state == CLOSED ? -1 : 0;
+    char buf[4096];
+    while (true) {
+      ssize_t n = read(fd, buf, sizeof(buf));
+      if (n > 0) {
+        rbuf.append(buf, n);
+      } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        break;
+      } else {
+        finish(false, "target closed the connection");
+        return;
+      }
+    }
+    while (fd >= 0 && rbuf.size() >= 4) {
+      uint32_t len;
+      memcpy(&len, rbuf.data(), 4);
+      if (rbuf.size() < 4 + len)
+        break;
+      string reply = rbuf.substr(4, len);
+      rbuf.erase(0, 4 + len);
+      on_reply(reply);
+    }
   }
 
-  static void cleanup(int epfd, Connection *conn, int fd,
-                      unordered_map<int, Connection *> &mp) {
-    epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
-    close(fd);
-    delete conn;
-    mp.erase(fd);
+  // Sends the next batch once the last one is acknowledged and the byte
+  // budget allows.
+  void cron() {
+    if (state == SENDING && !waiting_ack && now_ns() >= next_send_ns)
+      send_batch();
+  }
+
+  void info(string &out) {
+    out += "cluster_migrating_slot:" +
+           to_string(state == IDLE ? -1 : (int)slot) + "\n";
+    if (state != IDLE)
+      out += "cluster_migrating_keys_left:" +
+             to_string(dict->count_keys_in_slot(slot)) + "\n";
+    out += "cluster_migration_status:" + last_status + "\n";
+    out += "cluster_migration_keys_moved:" + to_string(keys_moved) + "\n";
+    out += "cluster_migration_batches:" + to_string(batches) + "\n";
+    out += "cluster_migration_bytes_sent:" + to_string(bytes_sent) + "\n";
+    out += "cluster_migration_batch_keys:" + to_string(batch_keys) + "\n";
+    out += "cluster_migration_last_batch_us:" + to_string(last_batch_us) + "\n";
+    out += "cluster_migration_max_batch_us:" + to_string(max_batch_us) + "\n";
+    out += "cluster_migration_last_ms:" + to_string(last_ms) + "\n";
   }
 };
 
-unordered_map<int, Connection *> connection_map;
+SlotMigration slot_migration;
+
+bool start_slot_migration(uint16_t slot, int node, string &err) {
+  return slot_migration.start(slot, node, err);
+}
+
+void migration_info(string &out) {
+  slot_migration.info(out);
+  uint32_t importing = 0;
+  for (uint32_t s = 0; s < CLUSTER_SLOTS; s++)
+    importing += cluster.is_importing(s);
+  out += "cluster_importing_slots:" + to_string(importing) + "\n";
+}
+
+void expire_blocked_clients(int epfd) {
+  uint64_t now = now_ns();
+  while (!block_deadlines.empty() && block_deadlines.begin()->first <= now) {
+    Connection *c = block_deadlines.begin()->second;
+    c->unblock(Server::ser_nil());
+    if (c->closed())
+      Connection::cleanup(epfd, c, c->get_fd(), connection_map);
+  }
+}
+
+// Parses the whole value of an integer --flag=value into out when it lies
+// in [lo, hi]; otherwise prints which values the flag takes.
+template <typename T>
+static bool int_flag(const string &a, long long lo, long long hi, T &out) {
+  size_t eq = a.find('=');
+  const char *v = a.c_str() + eq + 1;
+  char *end;
+  errno = 0;
+  long long n = strtoll(v, &end, 10);
+  if (!(isdigit((unsigned char)*v) || (*v == '-' && lo < 0)) || *end ||
+      errno || n < lo || n > hi) {
+    cerr << a.substr(0, eq) << " takes an integer from " << lo << " to " << hi
+         << "\n";
+    return false;
+  }
+  out = n;
+  return true;
+}
+
+int main(int argc, char **argv) {
+  bool appendonly = true;
+  FsyncPolicy fsync_policy = FSYNC_EVERYSEC;
+  uint32_t rewrite_pct = 100;
+  uint64_t rewrite_min_size = 64ULL << 20;
+  bool load_truncated = true;
+  uint16_t port = 1234;
+  string leader_host;
+  uint16_t leader_port = 0;
+  string cluster_config;
+  string cluster_host;
+  int io_thread_count = 1;
+  int64_t slowlog_threshold = 10000;
+  size_t slowlog_len = 128;
+  uint64_t latency_threshold = 1000;
+  for (int i = 1; i < argc; i++) {
+    string a = argv[i];
+    if (a.rfind("--port=", 0) == 0) {
+      if (!int_flag(a, 1, 65535, port))
+        return 1;
+    } else if (a.rfind("--cluster-config=", 0) == 0)
+      cluster_config = a.substr(17);
+    else if (a.rfind("--cluster-announce-host=", 0) == 0)
+      cluster_host = a.substr(24);
+    else if (a.rfind("--tracking-table-max-keys=", 0) == 0) {
+      if (!int_flag(a, 1, LLONG_MAX, tracking_max_keys))
+        return 1;
+    } else if (a.rfind("--io-threads=", 0) == 0) {
+      if (!int_flag(a, 1, 64, io_thread_count))
+        return 1;
+    } else if (a.rfind("--slowlog-log-slower-than=", 0) == 0) {
+      // Negative turns the slow log off.
+      if (!int_flag(a, -1, LLONG_MAX, slowlog_threshold))
+        return 1;
+    } else if (a.rfind("--slowlog-max-len=", 0) == 0) {
+      if (!int_flag(a, 0, LLONG_MAX, slowlog_len))
+        return 1;
+    } else if (a.rfind("--latency-monitor-threshold-us=", 0) == 0) {
+      if (!int_flag(a, 0, LLONG_MAX, latency_threshold))
+        return 1;
+    } else if (a.rfind("--migrate-batch-keys=", 0) == 0) {
+      if (!int_flag(a, 1, UINT32_MAX, migrate_batch_keys))
+        return 1;
+    } else if (a.rfind("--migrate-budget-us=", 0) == 0) {
+      if (!int_flag(a, 0, LLONG_MAX, migrate_budget_us))
+        return 1;
+    } else if (a.rfind("--migrate-max-bytes-per-sec=", 0) == 0) {
+      if (!int_flag(a, 1, LLONG_MAX, migrate_max_bytes))
+        return 1;
+    } else if (a.rfind("--repl-backlog-size=", 0) == 0) {
+      if (!int_flag(a, 16 * 1024, LLONG_MAX, repl_backlog_size))
+        return 1;
+    } else if (a.rfind("--replicaof=", 0) == 0) {
+      size_t colon = a.rfind(':');
+      if (colon == string::npos || colon < 12) {
+        cerr << "replicaof must be host:port\n";
+        return 1;
+      }
+      leader_host = a.substr(12, colon - 12);
+      if (!int_flag("--replicaof port=" + a.substr(colon + 1), 1, 65535,
+                    leader_port))
+        return 1;
+    } else if (a.rfind("--appendonly=", 0) == 0)
+      appendonly = a.substr(13) != "no";
+    else if (a.rfind("--auto-aof-rewrite-percentage=", 0) == 0) {
+      if (!int_flag(a, 0, UINT32_MAX, rewrite_pct))
+        return 1;
+    } else if (a.rfind("--auto-aof-rewrite-min-size=", 0) == 0) {
+      if (!int_flag(a, 0, LLONG_MAX, rewrite_min_size))
+        return 1;
+    } else if (a.rfind("--aof-use-snapshot-preamble=", 0) == 0)
+      aof_use_preamble = a.substr(28) != "no";
+    else if (a.rfind("--aof-load-truncated=", 0) == 0)
+      load_truncated = a.substr(21) != "no";
+    else if (a.rfind("--appendfsync=", 0) == 0 &&
+             !parse_fsync_policy(a.substr(14), fsync_policy)) {
+      cerr << "appendfsync must be always, everysec or no\n";
+      return 1;
+    }
+  }
 
-int main() {
   signal(SIGINT, signal_handler);
   signal(SIGTERM, signal_handler);
+  // A follower or client that went away shows up as EPIPE on write.
+  signal(SIGPIPE, SIG_IGN);
   Server server;
-  aof_fd = open("appendonly.aof", O_CREAT | O_WRONLY | O_APPEND, 0644);
-  if (aof_fd < 0) {
-    perror("open AOF");
-    return 1;
+  dict->set_expire_hook(on_key_expired);
+  dict->set_latency_hook(on_dict_latency);
+  if (!cluster_config.empty()) {
+    string err;
+    if (!cluster.load(cluster_config, cluster_host, port, err)) {
+      cerr << "[CLUSTER] " << err << "\n";
+      return 1;
+    }
+    dict->enable_slot_index();
+    cerr << "[CLUSTER] serving " << cluster.slots_owned() << " slots\n";
+  }
+  if (appendonly) {
+    if (!Server::aof_replay(AOF_FILE, load_truncated)) {
+      cerr << "[AOF] refusing to start\n";
+      return 1;
+    }
+    if (!aof.open(AOF_FILE, fsync_policy)) {
+      perror("open AOF");
+      return 1;
+    }
+    aof.set_auto_rewrite(rewrite_pct, rewrite_min_size);
+  } else {
+    // Without an AOF the snapshot is the only copy of the data.
+    uint64_t t0 = now_ns();
+    if (snapshot_load_file(dict, SNAPSHOT_FILE, last_load)) {
+      last_load_ms = (now_ns() - t0) / 1000000;
+      cerr << "[SNAPSHOT] loaded " << last_load.keys << " keys from "
+           << last_load.blocks << " blocks on " << last_load.threads
+           << " threads in " << last_load_ms << " ms\n";
+    } else if (access(SNAPSHOT_FILE, F_OK) == 0) {
+      cerr << "[SNAPSHOT] " << SNAPSHOT_FILE << " is corrupt, refusing to start\n";
+      return 1;
+    }
   }
 
-  Server::aof_replay();
-
-  if (server.init(1234) < 0)
+  if (server.init(port) < 0)
     return 1;
 
+  master_link.set_epoll(server.epollfd());
+  slot_migration.set_epoll(server.epollfd());
+  slowlog.configure(slowlog_threshold, slowlog_len);
+  latency_monitor.set_threshold(latency_threshold);
+  io_threads.start(io_thread_count);
+  if (io_threads.active())
+    cerr << "[Server] " << io_threads.count() << " I/O threads\n";
+  if (!leader_host.empty())
+    replicaof(leader_host, leader_port);
+
+  if (aof.enabled()) {
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.fd = aof.event_fd();
+    epoll_ctl(server.epollfd(), EPOLL_CTL_ADD, aof.event_fd(), &ev);
+  }
+
   while (g_running) {
+    uint64_t busy_start = ticks_now();
     dict->active_expire();
-
-    uint64_t now = now_ns();
-    if (aof_fd != -1 && (now - last_fsync) >= 1000000000ULL) {
-      fdatasync(aof_fd);
-      last_fsync = now;
-    }
+    latency_since("active-expire", busy_start);
 
     int timeout = -1;
     uint64_t next_expiry = dict->get_next_expiry();
+    if (!block_deadlines.empty() &&
+        (next_expiry == 0 || block_deadlines.begin()->first < next_expiry))
+      next_expiry = block_deadlines.begin()->first;
     if (next_expiry > 0) {
       uint64_t now = now_ns();
       if (next_expiry <= now)
@@ -655,8 +4796,12 @@ int main() {
 
     if (timeout == -1 || timeout > 100)
       timeout = 100;
+    uint64_t busy = ticks_now() - busy_start;
     int n =
         epoll_wait(server.epollfd(), server.get_events(), MAX_EVENTS, timeout);
+    busy_start = ticks_now();
+    vector<int> ready;
+    vector<pair<int, int>> io_events;
 
     if (n < 0 && errno == EINTR) {
       continue; // Check g_running loop condition
@@ -667,25 +4812,83 @@ int main() {
 
       if (fd == server.fd()) {
         server.acceptClient();
+      } else if (aof.enabled() && fd == aof.event_fd()) {
+        release_durable_replies(server.epollfd());
+      } else if (fd == master_link.get_fd()) {
+        master_link.handle(server.get_events()[i].events);
+      } else if (fd == slot_migration.get_fd()) {
+        slot_migration.handle(server.get_events()[i].events);
       } else {
         if (!connection_map.count(fd))
-          connection_map[fd] = new Connection(fd);
+          connection_map[fd] = new Connection(fd, server.epollfd());
 
         Connection *c = connection_map[fd];
-        if (c->handle(server.epollfd(), server.get_events()[i].events) < 0) {
+        if (io_threads.active()) {
+          io_events.push_back({fd, (int)server.get_events()[i].events});
+        } else if (c->handle(server.get_events()[i].events) < 0) {
           Connection::cleanup(server.epollfd(), c, fd, connection_map);
+        } else if (c->has_input()) {
+          ready.push_back(fd);
         }
       }
     }
+
+    if (!io_events.empty())
+      run_io_events(server.epollfd(), io_events, ready);
+    run_batch(server.epollfd(), ready);
+
+    serve_blocked_clients(server.epollfd());
+    expire_blocked_clients(server.epollfd());
+
+    // Everything this iteration logged goes out in one write; the fsync
+    // happens on the AOF thread, right away if replies are waiting on it.
+    uint64_t flush_start = ticks_now();
+    aof.flush(!held_clients.empty());
+    latency_since("aof-write", flush_start);
+    if (uint64_t spike = aof.take_fsync_spike_us())
+      latency_monitor.add_sample("aof-fsync", spike);
+
+    // Followers get the same records, also as one frame per iteration.
+    repl_cron();
+    master_link.cron();
+    slot_migration.cron();
+
+    if (!pending_writes.empty())
+      write_pending_replies(server.epollfd());
+
+    // Finishing a rewrite writes, syncs and renames on this thread;
+    // starting one forks.
+    uint64_t rewrite_start = ticks_now();
+    aof.poll_rewrite();
+    latency_since("aof-rewrite", rewrite_start);
+    poll_bgsave();
+    if (bgsave_pid < 0 && !aof.rewrite_in_progress() &&
+        (aof_rewrite_scheduled || aof.should_auto_rewrite())) {
+      aof_rewrite_scheduled = false;
+      rewrite_start = ticks_now();
+      Server::start_aof_rewrite();
+      latency_since("aof-rewrite", rewrite_start);
+    }
+
+    update_ops_per_sec();
+    uint64_t loop_ticks = busy + ticks_now() - busy_start;
+    loop_latency.record(loop_ticks);
+    latency_monitor.add_sample("event-loop", ticks_to_us(loop_ticks));
   }
 
   cout << "\n[Server] Shutting down gracefully..." << endl;
 
   server.shutdown();
+  io_threads.stop();
+  master_link.stop();
+  if (repl_sync_pid > 0) {
+    kill(repl_sync_pid, SIGKILL);
+    waitpid(repl_sync_pid, nullptr, 0);
+    unlink(REPL_SYNC_FILE);
+  }
 
-  if (aof_fd != -1) {
-    fdatasync(aof_fd);
-    close(aof_fd);
+  if (aof.enabled()) {
+    aof.close();
     cout << "[Server] AOF closed." << endl;
   }
 
@@ -1,142 +1,482 @@
 #include <bits/stdc++.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netinet/tcp.h>
+#include <sys/prctl.h>
 #include <sys/socket.h>
+#include "include/Latency.h"
 using namespace std;
 
+// Load generator. Each client thread owns one connection and keeps up to
+// --depth requests in flight. Closed loop (the default) sends the next
+// request as soon as a reply frees a slot. With --rate the load is open
+// loop: requests are scheduled at fixed intervals and their latency is
+// measured from the scheduled time, so a stalled server is charged for the
+// requests it kept the client from sending (no coordinated omission).
+
 static const int MAX_LEN = 4096;
+static const uint32_t MAX_VALUE = 4000;   // leaves room for the command
+// Open loop: the last stretch before a scheduled send is polled rather
+// than slept, as a wakeup can land this late even with 1 ns timer slack.
+static const uint64_t SPIN_NS = 50000;
+
+enum Op { OP_GET, OP_SET, OP_EXPIRE, OP_TTL, OP_ZADD, OP_ZRANK, OP_ZRANGE, NUM_OPS };
+static const char* op_names[NUM_OPS] = {"get", "set", "expire", "ttl", "zadd", "zrank", "zrange"};
+
+struct Config {
+    string host = "127.0.0.1";
+    uint16_t port = 1234;
+    int clients = 1;
+    size_t depth = 1;
+    long long ops = 100000;
+    double duration = 0;      // seconds; overrides ops
+    double warmup = 0;        // seconds run first and not recorded
+    double rate = 0;          // total ops/sec; 0 = closed loop
+    long long keyspace = 100000;
+    string dist = "uniform";  // uniform | zipf | hotspot
+    double zipf_s = 0.99;
+    double hot_keys = 0.2;    // hotspot: this fraction of the keys ...
+    double hot_ops = 0.8;     // ... gets this fraction of the operations
+    string value_size = "8";  // N | A-B | exp:MEAN
+    long long zset_keys = 100;
+    int zrange_len = 10;
+    int ttl_max = 10;
+    string mode = "mixed";
+    string mix;
+    bool json = false;
+};
+
+static uint64_t mono_ns(){
+    return chrono::duration_cast<chrono::nanoseconds>(
+               chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// "get:50,set:30,..." into weights; false on an unknown op.
+static bool parse_mix(const string& s, double* w){
+    fill(w, w + NUM_OPS, 0.0);
+    stringstream ss(s);
+    string item;
+    while (getline(ss, item, ',')) {
+        size_t c = item.find(':');
+        string name = item.substr(0, c);
+        double weight = c == string::npos ? 1 : stod(item.substr(c + 1));
+        int op = find(op_names, op_names + NUM_OPS, name) - op_names;
+        if (op == NUM_OPS) return false;
+        w[op] += weight;
+    }
+    return accumulate(w, w + NUM_OPS, 0.0) > 0;
+}
 
-struct Client {
-    int fd = -1;
-    bool connect_to(const char* ip, uint16_t port) {
-        fd = socket(AF_INET, SOCK_STREAM, 0);
-        if (fd < 0) return false;
-        sockaddr_in addr{};
-        addr.sin_family = AF_INET;
-        addr.sin_port = htons(port);
-        inet_pton(AF_INET, ip, &addr.sin_addr);
-        return ::connect(fd,(sockaddr*)&addr,sizeof(addr))==0;
-    }
-    bool write_full(const void* buf, size_t len) {
-        const char* p=(const char*)buf;
-        while(len>0){
-            ssize_t n=write(fd,p,len);
-            if(n<=0) return false;
-            p+=n; len-=n;
+static string mode_mix(const string& mode){
+    if (mode == "get") return "get";
+    if (mode == "set") return "set";
+    if (mode == "mixed") return "get:50,set:50";
+    if (mode == "ttl") return "get:40,set:30,expire:25,ttl:5";
+    if (mode == "zset") return "zadd:50,zrank:30,zrange:20";
+    return "";
+}
+
+// Picks key indexes in [0, n).
+class KeyChooser {
+private:
+    enum { UNIFORM, ZIPF, HOTSPOT } kind;
+    uint64_t n;
+    // Zipf, after YCSB's generator (Gray et al., "Quickly Generating
+    // Billion-Record Synthetic Databases"): one O(n) sum up front, then
+    // O(1) per key. Index 0 is the hottest.
+    double theta = 0, zetan = 0, alpha = 0, eta = 0, half_pow = 0;
+    uint64_t hot_n = 0;
+    double hot_ops = 0;
+
+public:
+    bool init(const Config& cfg){
+        n = max(1LL, cfg.keyspace);
+        if (cfg.dist == "uniform") {
+            kind = UNIFORM;
+        } else if (cfg.dist == "zipf") {
+            kind = ZIPF;
+            theta = cfg.zipf_s;
+            if (theta <= 0 || theta == 1) return false;
+            for (uint64_t i = 1; i <= n; i++) zetan += 1.0 / pow((double)i, theta);
+            double zeta2 = 1.0 + 1.0 / pow(2.0, theta);
+            alpha = 1.0 / (1.0 - theta);
+            eta = (1.0 - pow(2.0 / n, 1.0 - theta)) / (1.0 - zeta2 / zetan);
+            half_pow = 1.0 + pow(0.5, theta);
+        } else if (cfg.dist == "hotspot") {
+            kind = HOTSPOT;
+            hot_n = max<uint64_t>(1, (uint64_t)(n * cfg.hot_keys));
+            hot_ops = cfg.hot_ops;
+        } else {
+            return false;
         }
         return true;
     }
-    bool read_full(void* buf,size_t len){
-        char* p=(char*)buf;
-        while(len>0){
-            ssize_t n=read(fd,p,len);
-            if(n<=0) return false;
-            p+=n; len-=n;
+
+    uint64_t next(mt19937_64& rng) const{
+        uniform_real_distribution<double> u01(0.0, 1.0);
+        switch (kind) {
+        case ZIPF: {
+            double uz = u01(rng) * zetan;
+            if (uz < 1.0) return 0;
+            if (uz < half_pow) return 1;
+            uint64_t k = (uint64_t)(n * pow(eta * u01(rng) - eta + 1.0, alpha));
+            return min(k, n - 1);
+        }
+        case HOTSPOT:
+            if (hot_n >= n || u01(rng) < hot_ops) return rng() % hot_n;
+            return hot_n + rng() % (n - hot_n);
+        default:
+            return rng() % n;
         }
-        return true;
     }
-    bool send_cmd(const string& msg){
-        uint32_t len=msg.size();
-        char wbuf[4+MAX_LEN];
-        memcpy(wbuf,&len,4);
-        memcpy(wbuf+4,msg.data(),len);
-        if(!write_full(wbuf,4+len)) return false;
-        uint32_t rlen=0;
-        if(!read_full(&rlen,4)) return false;
-        if(rlen>MAX_LEN) return false;
-        static char rbuf[MAX_LEN];
-        if(!read_full(rbuf,rlen)) return false;
-        return true;
+};
+
+// Value lengths: fixed, uniform in a range, or exponential around a mean.
+class SizeChooser {
+private:
+    enum { FIXED, UNIFORM, EXP } kind;
+    uint32_t lo = 8, hi = 8;
+    double mean = 8;
+
+public:
+    bool init(const string& s){
+        if (s.rfind("exp:", 0) == 0) {
+            kind = EXP;
+            mean = stod(s.substr(4));
+            return mean >= 1;
+        }
+        size_t dash = s.find('-');
+        if (dash == string::npos) {
+            kind = FIXED;
+            lo = hi = stoul(s);
+        } else {
+            kind = UNIFORM;
+            lo = stoul(s.substr(0, dash));
+            hi = stoul(s.substr(dash + 1));
+        }
+        return lo >= 1 && lo <= hi && hi <= MAX_VALUE;
     }
+
+    uint32_t next(mt19937_64& rng) const{
+        switch (kind) {
+        case UNIFORM:
+            return lo + rng() % (hi - lo + 1);
+        case EXP: {
+            exponential_distribution<double> d(1.0 / mean);
+            return (uint32_t)min<double>(MAX_VALUE, 1.0 + d(rng));
+        }
+        default:
+            return lo;
+        }
+    }
+};
+
+struct Stats {
+    LatencyHistogram latency[NUM_OPS];
+    LatencyHistogram service;   // from the actual send, open loop only
+    LatencyHistogram send_lag;  // scheduled to actual send, open loop only
+    uint64_t errors = 0;
+    uint64_t first_ns = UINT64_MAX, last_ns = 0;
 };
 
-uint64_t now_us(){
-    auto t=chrono::high_resolution_clock::now();
-    return chrono::duration_cast<chrono::microseconds>(t.time_since_epoch()).count();
+struct Pending {
+    uint64_t intended;
+    uint64_t sent;
+    Op op;
+    bool measured;
+};
+
+struct Shared {
+    const Config* cfg;
+    const KeyChooser* keys;
+    const SizeChooser* sizes;
+    discrete_distribution<int> ops;
+    uint64_t start_ns;
+    uint64_t measure_ns;
+    uint64_t end_ns;            // 0 when ops bound the run
+    atomic<long long> claimed{0};
+    atomic<int> failed{0};
+};
+
+static int connect_to(const Config& cfg){
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(cfg.port);
+    inet_pton(AF_INET, cfg.host.c_str(), &addr.sin_addr);
+    if (::connect(fd, (sockaddr*)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    return fd;
 }
 
-int main(int argc,char** argv){
-    int clients=1;
-    long long ops=100000;
-    long long keyspace=100000;
-    string mode="mixed";
+static string build_cmd(Op op, Shared& sh, mt19937_64& rng, const string& filler){
+    const Config& cfg = *sh.cfg;
+    uint64_t k = sh.keys->next(rng);
+    string key = "k" + to_string(k);
+    switch (op) {
+    case OP_GET:
+        return "GET " + key;
+    case OP_SET: {
+        uint32_t len = sh.sizes->next(rng);
+        return "SET " + key + " " + filler.substr(rng() % (filler.size() - len), len);
+    }
+    case OP_EXPIRE:
+        return "EXPIRE " + key + " " + to_string(1 + rng() % cfg.ttl_max);
+    case OP_TTL:
+        return "TTL " + key;
+    default:
+        break;
+    }
+    string zkey = "z" + to_string(k % max(1LL, cfg.zset_keys));
+    if (op == OP_ZADD)
+        return "ZADD " + zkey + " " + to_string(rng() % 1000000) + " m" + to_string(k);
+    if (op == OP_ZRANK)
+        return "ZRANK " + zkey + " m" + to_string(k);
+    return "ZRANGE " + zkey + " 0 " + to_string(cfg.zrange_len - 1);
+}
 
-    for(int i=1;i<argc;i++){
-        string a=argv[i];
-        if(a.rfind("--clients=",0)==0) clients=stoi(a.substr(10));
-        if(a.rfind("--ops=",0)==0) ops=stoll(a.substr(6));
-        if(a.rfind("--keyspace=",0)==0) keyspace=stoll(a.substr(11));
-        if(a.rfind("--mode=",0)==0) mode=a.substr(7);
+static void worker(Shared& sh, int tid, Stats& st){
+    const Config& cfg = *sh.cfg;
+    int fd = connect_to(cfg);
+    if (fd < 0) {
+        sh.failed++;
+        return;
     }
 
-    vector<thread> th;
-    vector<vector<uint32_t>> samples(clients);
-    atomic<long long> done{0};
-    atomic<long long> errors{0};
-
-    auto worker=[&](int tid){
-        Client c;
-        if(!c.connect_to("127.0.0.1",1234)){
-            errors++;
-            return;
-        }
-        mt19937_64 rng(tid+123);
-        for(;;){
-            long long cur=done.fetch_add(1);
-            if(cur>=ops) break;
-
-            long long k = rng()%keyspace;
-            string key="k"+to_string(k);
-            string cmd;
-            if(mode=="get") cmd="GET "+key;
-            else if(mode=="set"){
-                string val="v"+to_string(rng()%1000000);
-                cmd="SET "+key+" "+val;
-            } else {
-                if(rng()%2){
-                    string val="v"+to_string(rng()%1000000);
-                    cmd="SET "+key+" "+val;
-                } else {
-                    cmd="GET "+key;
-                }
+    mt19937_64 rng(tid + 123);
+    // discrete_distribution::operator() is not const; one copy per thread.
+    discrete_distribution<int> ops = sh.ops;
+    string filler(2 * MAX_LEN, 'x');
+    for (char& c : filler) c = 'a' + rng() % 26;
+
+    uint64_t interval = cfg.rate > 0 ? (uint64_t)(cfg.clients * 1e9 / cfg.rate) : 0;
+    // Clients are staggered so an open-loop schedule is not bursty.
+    uint64_t next_intended = sh.start_ns + (interval ? interval * tid / cfg.clients : 0);
+    // The default 50 us slack would make every timed wakeup that late.
+    if (interval) prctl(PR_SET_TIMERSLACK, 1UL, 0, 0, 0);
+
+    deque<Pending> inflight;
+    string out, in;
+    size_t out_off = 0;
+    bool sending = true;
+    char buf[1 << 16];
+
+    while (sending || !inflight.empty()) {
+        uint64_t now = mono_ns();
+        while (sending && inflight.size() < cfg.depth) {
+            uint64_t intended = now;
+            if (interval) {
+                if (next_intended > now) break;
+                intended = next_intended;
+                next_intended += interval;
             }
+            bool measured = intended >= sh.measure_ns;
+            if (measured && ((sh.end_ns && intended >= sh.end_ns) ||
+                             (!sh.end_ns && sh.claimed.fetch_add(1) >= cfg.ops))) {
+                sending = false;
+                break;
+            }
+            Op op = (Op)ops(rng);
+            string cmd = build_cmd(op, sh, rng, filler);
+            uint32_t len = cmd.size();
+            out.append((const char*)&len, 4);
+            out += cmd;
+            inflight.push_back({intended, now, op, measured});
+            if (measured && interval) st.send_lag.record(now - intended);
+        }
+
+        while (out_off < out.size()) {
+            ssize_t n = write(fd, out.data() + out_off, out.size() - out_off);
+            if (n <= 0) break;
+            out_off += n;
+        }
+        if (out_off == out.size()) {
+            out.clear();
+            out_off = 0;
+        }
+
+        // Sleep until a reply, room to write, or the next scheduled send.
+        pollfd pfd{fd, POLLIN, 0};
+        if (!out.empty()) pfd.events |= POLLOUT;
+        timespec ts{}, *tsp = nullptr;
+        if (sending && interval && inflight.size() < cfg.depth) {
+            uint64_t wait = next_intended > now ? next_intended - now : 0;
+            wait = wait > SPIN_NS ? wait - SPIN_NS : 0;
+            ts.tv_sec = wait / 1000000000ULL;
+            ts.tv_nsec = wait % 1000000000ULL;
+            tsp = &ts;
+        }
+        if (!sending && inflight.empty()) break;
+        if (ppoll(&pfd, 1, tsp, nullptr) < 0 && errno != EINTR) break;
+        if (!(pfd.revents & (POLLIN | POLLHUP | POLLERR))) continue;
+
+        ssize_t n;
+        while ((n = read(fd, buf, sizeof(buf))) > 0) in.append(buf, n);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+            st.errors += inflight.size();
+            break;
+        }
 
-            uint64_t t0=now_us();
-            if(!c.send_cmd(cmd)){
-                errors++;
-                continue;
+        size_t off = 0;
+        uint64_t done = mono_ns();
+        while (in.size() - off >= 4 && !inflight.empty()) {
+            uint32_t len;
+            memcpy(&len, in.data() + off, 4);
+            if (in.size() - off - 4 < len) break;
+            Pending p = inflight.front();
+            inflight.pop_front();
+            if (p.measured) {
+                st.latency[p.op].record(done - p.intended);
+                if (interval) st.service.record(done - p.sent);
+                if (in.compare(off + 4, 5, "(err)") == 0) st.errors++;
+                st.first_ns = min(st.first_ns, p.intended);
+                st.last_ns = max(st.last_ns, done);
             }
-            uint64_t t1=now_us();
-            samples[tid].push_back(t1-t0);
-        }
-    };
-
-    auto tstart=now_us();
-    for(int i=0;i<clients;i++) th.emplace_back(worker,i);
-    for(auto &x:th) x.join();
-    auto tstop=now_us();
-
-    vector<uint32_t> all;
-    for(auto &v:samples) all.insert(all.end(),v.begin(),v.end());
-    sort(all.begin(),all.end());
-
-    double sec=(tstop-tstart)/1e6;
-    double thr=done.load()/sec;
-
-    auto pct=[&](double p){
-        if(all.empty()) return 0u;
-        size_t idx=p*all.size();
-        if(idx>=all.size()) idx=all.size()-1;
-        return all[idx];
-    };
-
-    cout<<"Total ops: "<<done.load()<<"\n";
-    cout<<"Errors: "<<errors.load()<<"\n";
-    cout<<"Time: "<<sec<<" sec\n";
-    cout<<"Throughput: "<<thr<<" ops/sec\n";
-    if(!all.empty()){
-        cout<<"p50: "<<pct(0.50)<<" us\n";
-        cout<<"p95: "<<pct(0.95)<<" us\n";
-        cout<<"p99: "<<pct(0.99)<<" us\n";
+            off += 4 + len;
+        }
+        in.erase(0, off);
+    }
+    close(fd);
+}
+
+static void print_row(const char* name, const LatencyHistogram& h){
+    printf("%-8s %10llu %9.1f %9.1f %9.1f %9.1f %9.1f\n", name,
+           (unsigned long long)h.count(), h.percentile(50) / 1e3, h.percentile(90) / 1e3,
+           h.percentile(99) / 1e3, h.percentile(99.9) / 1e3, h.max() / 1e3);
+}
+
+static string json_hist(const LatencyHistogram& h){
+    char b[256];
+    snprintf(b, sizeof(b),
+             "{\"count\":%llu,\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f}",
+             (unsigned long long)h.count(), h.percentile(50) / 1e3, h.percentile(90) / 1e3,
+             h.percentile(99) / 1e3, h.percentile(99.9) / 1e3, h.max() / 1e3);
+    return b;
+}
+
+int main(int argc, char** argv){
+    Config cfg;
+    for (int i = 1; i < argc; i++) {
+        string a = argv[i];
+        if (a.rfind("--host=", 0) == 0) cfg.host = a.substr(7);
+        else if (a.rfind("--port=", 0) == 0) cfg.port = stoi(a.substr(7));
+        else if (a.rfind("--clients=", 0) == 0) cfg.clients = max(1, stoi(a.substr(10)));
+        else if (a.rfind("--depth=", 0) == 0) cfg.depth = max(1, stoi(a.substr(8)));
+        else if (a.rfind("--ops=", 0) == 0) cfg.ops = stoll(a.substr(6));
+        else if (a.rfind("--duration=", 0) == 0) cfg.duration = stod(a.substr(11));
+        else if (a.rfind("--warmup=", 0) == 0) cfg.warmup = stod(a.substr(9));
+        else if (a.rfind("--rate=", 0) == 0) cfg.rate = stod(a.substr(7));
+        else if (a.rfind("--keyspace=", 0) == 0) cfg.keyspace = stoll(a.substr(11));
+        else if (a.rfind("--dist=", 0) == 0) cfg.dist = a.substr(7);
+        else if (a.rfind("--zipf-s=", 0) == 0) cfg.zipf_s = stod(a.substr(9));
+        else if (a.rfind("--hot-keys=", 0) == 0) cfg.hot_keys = stod(a.substr(11));
+        else if (a.rfind("--hot-ops=", 0) == 0) cfg.hot_ops = stod(a.substr(10));
+        else if (a.rfind("--value-size=", 0) == 0) cfg.value_size = a.substr(13);
+        else if (a.rfind("--zset-keys=", 0) == 0) cfg.zset_keys = stoll(a.substr(12));
+        else if (a.rfind("--zrange-len=", 0) == 0) cfg.zrange_len = max(1, stoi(a.substr(13)));
+        else if (a.rfind("--ttl-max=", 0) == 0) cfg.ttl_max = max(1, stoi(a.substr(10)));
+        else if (a.rfind("--mode=", 0) == 0) cfg.mode = a.substr(7);
+        else if (a.rfind("--mix=", 0) == 0) cfg.mix = a.substr(6);
+        else if (a == "--json") cfg.json = true;
+        else {
+            fprintf(stderr, "unknown option %s\n", a.c_str());
+            return 1;
+        }
+    }
+
+    string mix = cfg.mix.empty() ? mode_mix(cfg.mode) : cfg.mix;
+    double weights[NUM_OPS];
+    KeyChooser keys;
+    SizeChooser sizes;
+    if (mix.empty() || !parse_mix(mix, weights)) {
+        fprintf(stderr, "bad --mode / --mix\n");
+        return 1;
+    }
+    if (!keys.init(cfg)) {
+        fprintf(stderr, "bad --dist / --zipf-s\n");
+        return 1;
+    }
+    if (!sizes.init(cfg.value_size)) {
+        fprintf(stderr, "bad --value-size (N, A-B or exp:MEAN, at most %u)\n", MAX_VALUE);
+        return 1;
+    }
+
+    Shared sh;
+    sh.cfg = &cfg;
+    sh.keys = &keys;
+    sh.sizes = &sizes;
+    sh.ops = discrete_distribution<int>(weights, weights + NUM_OPS);
+    sh.start_ns = mono_ns();
+    sh.measure_ns = sh.start_ns + (uint64_t)(cfg.warmup * 1e9);
+    sh.end_ns = cfg.duration > 0 ? sh.measure_ns + (uint64_t)(cfg.duration * 1e9) : 0;
+
+    // Histograms are 5 KB each; keep them off the thread stacks.
+    vector<unique_ptr<Stats>> stats;
+    vector<thread> th;
+    for (int i = 0; i < cfg.clients; i++) stats.emplace_back(new Stats());
+    for (int i = 0; i < cfg.clients; i++) th.emplace_back(worker, ref(sh), i, ref(*stats[i]));
+    for (auto& t : th) t.join();
+
+    Stats total;
+    LatencyHistogram all;
+    for (auto& s : stats) {
+        for (int op = 0; op < NUM_OPS; op++) {
+            total.latency[op].merge(s->latency[op]);
+            all.merge(s->latency[op]);
+        }
+        total.service.merge(s->service);
+        total.send_lag.merge(s->send_lag);
+        total.errors += s->errors;
+        total.first_ns = min(total.first_ns, s->first_ns);
+        total.last_ns = max(total.last_ns, s->last_ns);
+    }
+    double sec = all.count() ? (total.last_ns - total.first_ns) / 1e9 : 0;
+    double thr = sec > 0 ? all.count() / sec : 0;
+
+    if (cfg.json) {
+        printf("{\"config\":{\"clients\":%d,\"depth\":%zu,\"rate\":%.0f,\"warmup\":%.1f,"
+               "\"keyspace\":%lld,\"dist\":\"%s\",\"value_size\":\"%s\",\"mix\":\"%s\"},",
+               cfg.clients, cfg.depth, cfg.rate, cfg.warmup, cfg.keyspace, cfg.dist.c_str(),
+               cfg.value_size.c_str(), mix.c_str());
+        printf("\"ops\":%llu,\"errors\":%llu,\"connect_failures\":%d,\"seconds\":%.3f,"
+               "\"throughput\":%.1f,\"latency_us\":{\"all\":%s",
+               (unsigned long long)all.count(), (unsigned long long)total.errors,
+               sh.failed.load(), sec, thr, json_hist(all).c_str());
+        for (int op = 0; op < NUM_OPS; op++)
+            if (total.latency[op].count())
+                printf(",\"%s\":%s", op_names[op], json_hist(total.latency[op]).c_str());
+        printf("}");
+        if (cfg.rate > 0) {
+            printf(",\"service_latency_us\":%s", json_hist(total.service).c_str());
+            printf(",\"send_lag_us\":%s", json_hist(total.send_lag).c_str());
+        }
+        printf("}\n");
+        return 0;
+    }
+
+    printf("Workload: clients=%d depth=%zu %s dist=%s value-size=%s mix=%s\n", cfg.clients,
+           cfg.depth, cfg.rate > 0 ? ("rate=" + to_string((long long)cfg.rate)).c_str() : "closed-loop",
+           cfg.dist.c_str(), cfg.value_size.c_str(), mix.c_str());
+    printf("Total ops: %llu\n", (unsigned long long)all.count());
+    printf("Errors: %llu\n", (unsigned long long)total.errors);
+    if (sh.failed) printf("Connect failures: %d\n", sh.failed.load());
+    printf("Time: %.3f sec\n", sec);
+    printf("Throughput: %.1f ops/sec\n", thr);
+    printf("%-8s %10s %9s %9s %9s %9s %9s  (us%s)\n", "op", "count", "p50", "p90", "p99",
+           "p99.9", "max", cfg.rate > 0 ? ", from scheduled start" : "");
+    for (int op = 0; op < NUM_OPS; op++)
+        if (total.latency[op].count()) print_row(op_names[op], total.latency[op]);
+    print_row("all", all);
+    if (cfg.rate > 0) {
+        print_row("service", total.service);
+        print_row("send-lag", total.send_lag);
     }
 }